@@ -0,0 +1,456 @@
+/* aes-crypt-bench.c
+ * Throughput and latency of aes-crypt against raw OpenSSL
+ *
+ * For every buffer size from the minimum to the maximum (powers of 4),
+ * both directions and every thread count asked for, it runs each case
+ * for a fixed time on every thread at once and prints one CSV line:
+ *
+ *   evp        EVP_CipherUpdate/Final on a context set up once, for each
+ *              cipher fusec's block format can use: the ceiling
+ *   crypt_ctx  aes-crypt's stream handle, key derived once (cached keys)
+ *   crypt_key  aes-crypt's small buffer call on a derived key, on the
+ *              CPU's AES instructions where it has them (named on stderr)
+ *   crypt_buf  aes-crypt's one shot call, key derived every call
+ *   do_crypt   do_crypt() between memory streams, key derived every call
+ *
+ * evp cases run once with the key schedule cached and once set up per
+ * call. Each line has the aggregate MB/s, the mean time per call, and
+ * the ratio to evp aes-256-cbc with cached keys (the cipher aes-crypt
+ * uses) at the same size, direction and thread count.
+ *
+ * With -r the MB/s of an earlier run's CSV are compared too; lines more
+ * than -R percent slower are reported on stderr, and the exit status is
+ * 2 if there were any.
+ *
+ */
+
+#ifdef linux
+/* For fmemopen() */
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aes-crypt.h"
+
+#define USAGE "[-t threads:threads:...] [-d ms] [-n min bytes] [-m max bytes] [-r ref.csv [-R pct]]"
+#define BENCH_KEY "aes-crypt-bench"
+/* MB/s is in 10^6 bytes */
+#define BENCH_MB 1e6
+
+enum { API_EVP, API_CRYPT_CTX, API_CRYPT_KEY, API_CRYPT_BUF, API_DO_CRYPT };
+
+static const char* api_names[] = { "evp", "crypt_ctx", "crypt_key", "crypt_buf", "do_crypt" };
+
+struct bench_case {
+    int api;
+    const char* cipher;		/* EVP name */
+    int cached;			/* key set up once, not per call */
+};
+
+static const struct bench_case cases[] = {
+    { API_EVP, "aes-256-cbc", 1 },	/* first: the others are compared to it */
+    { API_EVP, "aes-256-cbc", 0 },
+    { API_EVP, "aes-128-ctr", 1 },
+    { API_EVP, "aes-128-ctr", 0 },
+    { API_EVP, "chacha20", 1 },
+    { API_EVP, "chacha20", 0 },
+    { API_CRYPT_CTX, "aes-256-cbc", 1 },
+    { API_CRYPT_KEY, "aes-256-cbc", 1 },
+    { API_CRYPT_BUF, "aes-256-cbc", 0 },
+    { API_DO_CRYPT, "aes-256-cbc", 0 },
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+struct bench_thread {
+    pthread_t thread;
+    const struct bench_case* c;
+    int enc;
+    size_t size;		/* plaintext bytes per call */
+    const EVP_CIPHER* cipher;
+    unsigned char* in;		/* plaintext or ciphertext */
+    size_t inlen;
+    unsigned char* out;
+    size_t outsize;
+    uint64_t calls;
+    double seconds;
+    int failed;
+};
+
+struct bench_ref {
+    char* key;
+    double mbs;
+};
+
+static unsigned char key[64];
+static unsigned char iv[64];
+static volatile int stop;
+static pthread_barrier_t start;
+static struct bench_ref* refs;
+static size_t nrefs;
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One raw EVP call: (re)initialise, update, final */
+static int evp_once(EVP_CIPHER_CTX* ctx, struct bench_thread* t){
+    int len, last;
+
+    if(t->c->cached){
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, t->enc))
+	    return -1;
+    }
+    else if(!EVP_CipherInit_ex(ctx, t->cipher, NULL, key, iv, t->enc))
+	return -1;
+    if(!EVP_CipherUpdate(ctx, t->out, &len, t->in, t->inlen) ||
+       !EVP_CipherFinal_ex(ctx, t->out + len, &last))
+	return -1;
+    return 0;
+}
+
+/* One aes-crypt call of the case's kind */
+static int crypt_once(struct crypt_ctx* cc, struct crypt_key* ck, FILE* in, FILE* out,
+		      struct bench_thread* t){
+    size_t len, last;
+
+    switch(t->c->api){
+    case API_CRYPT_CTX:
+	if(!crypt_reinit(cc) || !crypt_update(cc, t->out, &len, t->in, t->inlen) ||
+	   !crypt_final(cc, t->out + len, &last))
+	    return -1;
+	return 0;
+    case API_CRYPT_KEY:
+	return crypt_key_buf(ck, t->in, t->inlen, t->out, t->outsize, &len,
+			     t->enc) ? 0 : -1;
+    case API_CRYPT_BUF:
+	return crypt_buf(t->in, t->inlen, t->out, t->outsize, &len, t->enc,
+			 BENCH_KEY) ? 0 : -1;
+    default:
+	rewind(in);
+	rewind(out);
+	return do_crypt(in, out, t->enc, BENCH_KEY) ? 0 : -1;
+    }
+}
+
+static void* bench_thread(void* arg){
+    struct bench_thread* t = arg;
+    struct crypt_ctx* cc = NULL;
+    struct crypt_key* ck = NULL;
+    EVP_CIPHER_CTX* ctx = NULL;
+    FILE* in = NULL;
+    FILE* out = NULL;
+    double t0;
+    int res = 0;
+
+    if(t->c->api == API_EVP){
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx || !EVP_CipherInit_ex(ctx, t->cipher, NULL, key, iv, t->enc))
+	    t->failed = 1;
+    }
+    else if(t->c->api == API_CRYPT_CTX){
+	cc = crypt_init(t->enc, BENCH_KEY);
+	t->failed = !cc;
+    }
+    else if(t->c->api == API_CRYPT_KEY){
+	ck = crypt_key_new(BENCH_KEY);
+	t->failed = !ck;
+    }
+    else if(t->c->api == API_DO_CRYPT){
+	in = fmemopen(t->in, t->inlen, "r");
+	out = fmemopen(t->out, t->outsize + 1, "w");
+	t->failed = !in || !out;
+    }
+    pthread_barrier_wait(&start);
+    t0 = now();
+    while(!t->failed && !res){
+	if(ctx)
+	    res = evp_once(ctx, t);
+	else
+	    res = crypt_once(cc, ck, in, out, t);
+	t->calls++;
+	if(stop)
+	    break;
+    }
+    t->seconds = now() - t0;
+    if(res)
+	t->failed = 1;
+    if(ctx)
+	EVP_CIPHER_CTX_free(ctx);
+    crypt_free(cc);
+    crypt_key_free(ck);
+    if(in)
+	fclose(in);
+    if(out)
+	fclose(out);
+    return NULL;
+}
+
+/* Input for a case: size bytes of plaintext, or their ciphertext made
+ * the way the case will decrypt it */
+static unsigned char* make_input(const struct bench_case* c, const EVP_CIPHER* cipher,
+				 int enc, size_t size, size_t* len){
+    unsigned char* plain;
+    unsigned char* ct;
+    EVP_CIPHER_CTX* ctx;
+    size_t i;
+    int n, last;
+
+    plain = malloc(CRYPT_OUTLEN(size));
+    if(!plain)
+	return NULL;
+    for(i = 0; i < size; i++)
+	plain[i] = (unsigned char)(i * 131 + (i >> 8));
+    *len = size;
+    if(enc)
+	return plain;
+    ct = malloc(CRYPT_OUTLEN(size));
+    if(!ct){
+	free(plain);
+	return NULL;
+    }
+    if(c->api != API_EVP){
+	if(!crypt_buf(plain, size, ct, CRYPT_OUTLEN(size), len, 1, BENCH_KEY)){
+	    free(ct);
+	    ct = NULL;
+	}
+	free(plain);
+	return ct;
+    }
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx || !EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, 1) ||
+       !EVP_CipherUpdate(ctx, ct, &n, plain, size) ||
+       !EVP_CipherFinal_ex(ctx, ct + n, &last)){
+	free(ct);
+	ct = NULL;
+    }
+    else
+	*len = (size_t)n + last;
+    if(ctx)
+	EVP_CIPHER_CTX_free(ctx);
+    free(plain);
+    return ct;
+}
+
+/* Runs a case on nthreads threads for ms; MB/s and us per call, or -1 */
+static int run_case(const struct bench_case* c, int enc, size_t size, unsigned int nthreads,
+		    unsigned int ms, double* mbs, double* us, uint64_t* calls){
+    struct bench_thread* t;
+    const EVP_CIPHER* cipher;
+    unsigned int i, started;
+    double secs = 0;
+    int res = 0;
+
+    cipher = EVP_get_cipherbyname(c->cipher);
+    if(!cipher)
+	return -1;
+    t = calloc(nthreads, sizeof(*t));
+    if(!t)
+	return -1;
+    for(i = 0; i < nthreads; i++){
+	t[i].c = c;
+	t[i].enc = enc;
+	t[i].size = size;
+	t[i].cipher = cipher;
+	t[i].in = make_input(c, cipher, enc, size, &t[i].inlen);
+	t[i].outsize = CRYPT_OUTLEN(size);
+	t[i].out = malloc(t[i].outsize + 1);
+	if(!t[i].in || !t[i].out)
+	    res = -1;
+    }
+    stop = 0;
+    started = 0;
+    if(res == 0){
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for(i = 0; i < nthreads; i++){
+	    if(pthread_create(&t[i].thread, NULL, bench_thread, &t[i])){
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	    }
+	    started++;
+	}
+	pthread_barrier_wait(&start);
+	usleep(ms * 1000);
+	stop = 1;
+	for(i = 0; i < started; i++)
+	    pthread_join(t[i].thread, NULL);
+	pthread_barrier_destroy(&start);
+    }
+    *mbs = 0;
+    *calls = 0;
+    for(i = 0; i < nthreads; i++){
+	if(t[i].failed)
+	    res = -1;
+	if(t[i].seconds > 0)
+	    *mbs += t[i].calls * (double)size / t[i].seconds / BENCH_MB;
+	*calls += t[i].calls;
+	secs += t[i].seconds;
+	free(t[i].in);
+	free(t[i].out);
+    }
+    /* each thread's calls take its whole time */
+    *us = *calls ? secs / *calls * 1e6 : 0;
+    free(t);
+    return res;
+}
+
+/* Loads the MB/s of each line of an earlier run */
+static int load_refs(const char* file){
+    char line[512];
+    char* comma;
+    void* grown;
+    FILE* fp;
+    int i;
+
+    fp = fopen(file, "r");
+    if(!fp){
+	perror(file);
+	return -1;
+    }
+    while(fgets(line, sizeof(line), fp)){
+	/* the key is the first six fields, MB/s the ninth */
+	for(i = 0, comma = line; i < 6 && comma; i++)
+	    comma = strchr(comma + 1, ',');
+	if(!comma || !strncmp(line, "api,", 4))
+	    continue;
+	*comma = '\0';
+	for(i = 0; i < 2 && comma; i++)
+	    comma = strchr(comma + 1, ',');
+	if(!comma)
+	    continue;
+	grown = realloc(refs, (nrefs + 1) * sizeof(*refs));
+	if(!grown)
+	    break;
+	refs = grown;
+	refs[nrefs].key = strdup(line);
+	refs[nrefs].mbs = atof(comma + 1);
+	if(refs[nrefs].key)
+	    nrefs++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static double ref_mbs(const char* key){
+    size_t i;
+
+    for(i = 0; i < nrefs; i++)
+	if(!strcmp(refs[i].key, key))
+	    return refs[i].mbs;
+    return 0;
+}
+
+/* "1:2:8" -> counts; returns how many */
+static int parse_threads(const char* s, unsigned int* out, int max){
+    char* end;
+    int n = 0;
+
+    while(n < max){
+	out[n] = strtoul(s, &end, 10);
+	if(end == s || out[n] == 0)
+	    return -1;
+	n++;
+	if(*end == '\0')
+	    return n;
+	if(*end != ':')
+	    return -1;
+	s = end + 1;
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]){
+    unsigned int threads[16] = { 1 };
+    int nthreads = 1;
+    unsigned int ms = 100;
+    size_t min = 16, max = 16 << 20, size;
+    double tolerance = 10;
+    const char* ref = NULL;
+    double mbs, us, ceiling = 0, base;
+    uint64_t calls;
+    char rkey[128];
+    int slower = 0;
+    int opt, ti, enc;
+    size_t ci;
+
+    while((opt = getopt(argc, argv, "t:d:n:m:r:R:")) != -1){
+	switch(opt){
+	case 't':
+	    nthreads = parse_threads(optarg, threads, 16);
+	    break;
+	case 'd':
+	    ms = atoi(optarg);
+	    break;
+	case 'n':
+	    min = strtoull(optarg, NULL, 0);
+	    break;
+	case 'm':
+	    max = strtoull(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    ref = optarg;
+	    break;
+	case 'R':
+	    tolerance = atof(optarg);
+	    break;
+	default:
+	    nthreads = -1;
+	}
+    }
+    if(nthreads < 0 || optind != argc || ms == 0 || min == 0 || min > max){
+	fprintf(stderr, "Usage: %s %s\n", argv[0], USAGE);
+	fprintf(stderr, "  -t N:N:..  thread counts (default 1)\n");
+	fprintf(stderr, "  -d MS      time per line (default 100)\n");
+	fprintf(stderr, "  -n, -m     smallest and largest buffer (default 16 and 16M)\n");
+	fprintf(stderr, "  -r FILE    compare with an earlier run's output\n");
+	fprintf(stderr, "  -R PCT     how much slower counts as a regression (default 10)\n");
+	exit(EXIT_FAILURE);
+    }
+    if(ref && load_refs(ref) < 0)
+	exit(EXIT_FAILURE);
+    fprintf(stderr, "crypt_key kernel: %s\n", crypt_kernel());
+    memset(key, 0x5a, sizeof(key));
+    memset(iv, 0xa5, sizeof(iv));
+
+    printf("api,cipher,keys,op,bytes,threads,calls,us_per_call,mb_per_s,vs_evp,vs_ref\n");
+    for(ti = 0; ti < nthreads; ti++)
+	for(size = min; size <= max; size *= 4)
+	    for(enc = 1; enc >= 0; enc--)
+		for(ci = 0; ci < NCASES; ci++){
+		    if(run_case(&cases[ci], enc, size, threads[ti], ms, &mbs, &us, &calls) < 0){
+			fprintf(stderr, "%s %s: failed\n", api_names[cases[ci].api],
+				cases[ci].cipher);
+			continue;
+		    }
+		    if(ci == 0)
+			ceiling = mbs;
+		    snprintf(rkey, sizeof(rkey), "%s,%s,%s,%s,%zu,%u",
+			     api_names[cases[ci].api], cases[ci].cipher,
+			     cases[ci].cached ? "cached" : "per-call",
+			     enc ? "encrypt" : "decrypt", size, threads[ti]);
+		    printf("%s,%llu,%.3f,%.1f,%.3f,", rkey, (unsigned long long)calls,
+			   us, mbs, ceiling > 0 ? mbs / ceiling : 0);
+		    base = ref ? ref_mbs(rkey) : 0;
+		    if(base > 0){
+			printf("%.3f", mbs / base);
+			if(mbs < base * (1 - tolerance / 100)){
+			    fprintf(stderr, "slower: %s %.1f MB/s, was %.1f\n", rkey, mbs, base);
+			    slower++;
+			}
+		    }
+		    printf("\n");
+		    fflush(stdout);
+		}
+    if(slower)
+	fprintf(stderr, "%d lines more than %.0f%% slower than %s\n", slower, tolerance, ref);
+    return slower ? 2 : EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 /* aes-crypt.c
  * High level function interface for performing AES encryption on FILE pointers
+ * and in memory
  * Uses OpenSSL libcrypto EVP API
  *
  * By Andy Sayler (www.andysayler.com)
@@ -15,51 +16,1231 @@
  *
  */
 
+#ifdef linux
+/* For copy_file_range() and splice() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef linux
+#include <sys/sendfile.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_AESNI
+#ifndef bit_VAES
+#define bit_VAES (1 << 9)
+#endif
+#endif
+
+#include <openssl/crypto.h>
+
 #include "aes-crypt.h"
 
 #define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+/* most bytes handed to the cipher in one call (it takes an int) */
+#define CRYPT_CHUNK (1 << 30)
+/* bounce buffers of the iovec functions */
+#define CRYPT_BOUNCE (16 * 1024)
+/* regular files shorter than this skip crypt_fd()'s threads */
+#define CRYPT_PIPE_MIN (4 * CRYPT_PIPE_BUF)
+/* most bytes asked of the kernel in one copy call */
+#define CRYPT_COPY_MAX (1 << 30)
+
+/* copy_file_range() came with glibc 2.27 */
+#if defined(linux) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+/* AES-256: 14 rounds, 15 round keys */
+#define AES_ROUNDS 14
+
+/* functions built for the instructions they use, whatever the flags */
+#define TARGET_AESNI __attribute__((target("aes,sse2")))
+#define TARGET_VAES __attribute__((target("vaes,avx2,aes")))
+
+/* what crypt_key_buf() runs on, best first checked */
+enum { KERNEL_EVP, KERNEL_AESNI, KERNEL_VAES };
+
+static const char* kernel_names[] = { "evp", "aes-ni", "vaes" };
+static int kernel = KERNEL_EVP;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+struct crypt_key {
+    unsigned char key[32];
+    unsigned char iv[32];
+    /* round keys of the kernels: encrypt, then decrypt (unused by EVP) */
+    unsigned char rk[2][AES_ROUNDS + 1][AES_BLOCK_SIZE];
+};
+
+struct crypt_ctx {
+    int action;
+    EVP_CIPHER_CTX* ctx;	/* NULL for pass-through */
+    unsigned char key[32];
+    unsigned char iv[32];
+};
+
+/* a crypt_fd() buffer; the one holding the end of the input is last */
+struct pipe_slot {
+    unsigned char* buf;
+    size_t len;
+    int full;
+    int last;
+};
+
+/* crypt_fd() state: the reader fills in[], the cipher empties in[] into
+ * out[], the writer empties out[], each going round its ring in order */
+struct crypt_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;	/* a slot filled or emptied, or failed */
+    struct pipe_slot in[CRYPT_PIPE_SLOTS];
+    struct pipe_slot out[CRYPT_PIPE_SLOTS];
+    int infd;
+    int outfd;
+    int failed;
+};
+
+/* a position in an iovec array */
+struct iov_cur {
+    const struct iovec* iov;
+    int cnt;
+    size_t off;			/* into iov[0] */
+};
+
+/* Key and IV from a pass phrase, as do_crypt() always has; FAILURE on
+ * error */
+static int derive_key(const char* key_str, unsigned char* key, unsigned char* iv){
+    int nrounds = 5;
+    int i;
+
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    /* Build Key from String */
+    i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+		       (const unsigned char*)key_str, strlen(key_str), nrounds,
+		       key, iv);
+    if(i != 32){
+	/* Error */
+	fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+struct crypt_ctx* crypt_init(int action, const char* key_str){
+    struct crypt_ctx* c;
+
+    c = calloc(1, sizeof(*c));
+    if(!c){
+	perror("calloc error");
+	return NULL;
+    }
+    c->action = action;
+    if(action < 0){
+	return c;
+    }
+    if(!derive_key(key_str, c->key, c->iv)){
+	crypt_free(c);
+	return NULL;
+    }
+    /* Init Engine */
+    c->ctx = EVP_CIPHER_CTX_new();
+    if(!c->ctx ||
+       !EVP_CipherInit_ex(c->ctx, EVP_aes_256_cbc(), NULL, c->key, c->iv, action)){
+	crypt_free(c);
+	return NULL;
+    }
+    return c;
+}
+
+int crypt_reinit(struct crypt_ctx* c){
+    if(c->action < 0){
+	return SUCCESS;
+    }
+    /* same cipher and key schedule, fresh IV and no buffered input */
+    if(!EVP_CipherInit_ex(c->ctx, NULL, NULL, NULL, c->iv, c->action)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+int crypt_update(struct crypt_ctx* c, unsigned char* out, size_t* outlen,
+		 const unsigned char* in, size_t inlen){
+    int n, len;
+
+    *outlen = 0;
+    while(inlen > 0){
+	n = inlen > CRYPT_CHUNK ? CRYPT_CHUNK : (int)inlen;
+	/* If in pass-through mode, copy as is */
+	if(c->action < 0){
+	    memcpy(out, in, n);
+	    len = n;
+	}
+	else if(!EVP_CipherUpdate(c->ctx, out, &len, in, n)){
+	    return FAILURE;
+	}
+	in += n;
+	inlen -= n;
+	out += len;
+	*outlen += len;
+    }
+    return SUCCESS;
+}
+
+int crypt_final(struct crypt_ctx* c, unsigned char* out, size_t* outlen){
+    int len = 0;
+
+    if(c->action >= 0 && !EVP_CipherFinal_ex(c->ctx, out, &len)){
+	*outlen = 0;
+	return FAILURE;
+    }
+    *outlen = len;
+    return SUCCESS;
+}
+
+void crypt_free(struct crypt_ctx* c){
+    if(!c){
+	return;
+    }
+    if(c->ctx){
+	EVP_CIPHER_CTX_free(c->ctx);
+    }
+    OPENSSL_cleanse(c, sizeof(*c));
+    free(c);
+}
+
+/* Output size of inlen bytes */
+static size_t out_size(int action, size_t inlen){
+    if(action > 0){
+	return inlen / AES_BLOCK_SIZE * AES_BLOCK_SIZE + AES_BLOCK_SIZE;
+    }
+    return inlen;
+}
+
+#ifdef HAVE_AESNI
+/* One step of the AES-256 key schedule (Intel's AES-NI white paper):
+ * t1 is two round keys back, t3 one back; assist has been through
+ * aeskeygenassist */
+TARGET_AESNI static inline __m128i expand_a(__m128i t1, __m128i assist){
+    __m128i t4;
+
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    t4 = _mm_slli_si128(t1, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    return _mm_xor_si128(t1, assist);
+}
+
+TARGET_AESNI static inline __m128i expand_b(__m128i t1, __m128i t3){
+    __m128i t2, t4;
+
+    t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0x00), 0xaa);
+    t4 = _mm_slli_si128(t3, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    return _mm_xor_si128(t3, t2);
+}
+
+/* the round constant must be an immediate */
+#define EXPAND(i, rcon) \
+    do{ \
+	t1 = expand_a(t1, _mm_aeskeygenassist_si128(t3, rcon)); \
+	rk[i] = t1; \
+	if(i < AES_ROUNDS){ \
+	    t3 = expand_b(t1, t3); \
+	    rk[i + 1] = t3; \
+	} \
+    }while(0)
+
+/* Fills in k's round keys from its key */
+TARGET_AESNI static void expand_key(struct crypt_key* k){
+    __m128i rk[AES_ROUNDS + 1];
+    __m128i t1, t3;
+    int i;
+
+    t1 = _mm_loadu_si128((const __m128i*)k->key);
+    t3 = _mm_loadu_si128((const __m128i*)(k->key + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+    EXPAND(2, 0x01);
+    EXPAND(4, 0x02);
+    EXPAND(6, 0x04);
+    EXPAND(8, 0x08);
+    EXPAND(10, 0x10);
+    EXPAND(12, 0x20);
+    EXPAND(14, 0x40);
+    for(i = 0; i <= AES_ROUNDS; i++){
+	_mm_storeu_si128((__m128i*)k->rk[0][i], rk[i]);
+	/* the equivalent inverse cipher's keys: reversed, mixed */
+	if(i == 0 || i == AES_ROUNDS){
+	    _mm_storeu_si128((__m128i*)k->rk[1][AES_ROUNDS - i], rk[i]);
+	}
+	else{
+	    _mm_storeu_si128((__m128i*)k->rk[1][AES_ROUNDS - i], _mm_aesimc_si128(rk[i]));
+	}
+    }
+    OPENSSL_cleanse(rk, sizeof(rk));
+}
+
+/* CBC encrypts n blocks, chaining from and back into iv. Each block
+ * needs the one before, so this goes a block at a time on any CPU. */
+TARGET_AESNI static void cbc_encrypt_aesni(const struct crypt_key* k, unsigned char* iv,
+					   const unsigned char* in, unsigned char* out,
+					   size_t n){
+    __m128i rk[AES_ROUNDS + 1];
+    __m128i b;
+    int r;
+
+    for(r = 0; r <= AES_ROUNDS; r++){
+	rk[r] = _mm_loadu_si128((const __m128i*)k->rk[0][r]);
+    }
+    b = _mm_loadu_si128((const __m128i*)iv);
+    for(; n > 0; n--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE){
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i*)in));
+	b = _mm_xor_si128(b, rk[0]);
+	for(r = 1; r < AES_ROUNDS; r++){
+	    b = _mm_aesenc_si128(b, rk[r]);
+	}
+	b = _mm_aesenclast_si128(b, rk[AES_ROUNDS]);
+	_mm_storeu_si128((__m128i*)out, b);
+    }
+    _mm_storeu_si128((__m128i*)iv, b);
+}
+
+/* f(b, k) on each of b0 to b7 */
+#define ROUND8(f, k) \
+    do{ \
+	b0 = f(b0, k); b1 = f(b1, k); b2 = f(b2, k); b3 = f(b3, k); \
+	b4 = f(b4, k); b5 = f(b5, k); b6 = f(b6, k); b7 = f(b7, k); \
+    }while(0)
+
+/* CBC decrypts n blocks, eight at a time to keep the AES unit busy.
+ * Every block is loaded before any is stored, so out may be in. */
+TARGET_AESNI static void cbc_decrypt_aesni(const struct crypt_key* k, unsigned char* iv,
+					   const unsigned char* in, unsigned char* out,
+					   size_t n){
+    const __m128i* rk = (const __m128i*)k->rk[1];
+    const __m128i* src;
+    __m128i* dst;
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    __m128i prev, r0;
+    int r;
+
+    prev = _mm_loadu_si128((const __m128i*)iv);
+    r0 = _mm_loadu_si128(rk);
+    for(; n >= 8; n -= 8, in += 8 * AES_BLOCK_SIZE, out += 8 * AES_BLOCK_SIZE){
+	src = (const __m128i*)in;
+	dst = (__m128i*)out;
+	b0 = _mm_xor_si128(_mm_loadu_si128(src), r0);
+	b1 = _mm_xor_si128(_mm_loadu_si128(src + 1), r0);
+	b2 = _mm_xor_si128(_mm_loadu_si128(src + 2), r0);
+	b3 = _mm_xor_si128(_mm_loadu_si128(src + 3), r0);
+	b4 = _mm_xor_si128(_mm_loadu_si128(src + 4), r0);
+	b5 = _mm_xor_si128(_mm_loadu_si128(src + 5), r0);
+	b6 = _mm_xor_si128(_mm_loadu_si128(src + 6), r0);
+	b7 = _mm_xor_si128(_mm_loadu_si128(src + 7), r0);
+	for(r = 1; r < AES_ROUNDS; r++){
+	    ROUND8(_mm_aesdec_si128, _mm_loadu_si128(rk + r));
+	}
+	ROUND8(_mm_aesdeclast_si128, _mm_loadu_si128(rk + AES_ROUNDS));
+	b0 = _mm_xor_si128(b0, prev);
+	b1 = _mm_xor_si128(b1, _mm_loadu_si128(src));
+	b2 = _mm_xor_si128(b2, _mm_loadu_si128(src + 1));
+	b3 = _mm_xor_si128(b3, _mm_loadu_si128(src + 2));
+	b4 = _mm_xor_si128(b4, _mm_loadu_si128(src + 3));
+	b5 = _mm_xor_si128(b5, _mm_loadu_si128(src + 4));
+	b6 = _mm_xor_si128(b6, _mm_loadu_si128(src + 5));
+	b7 = _mm_xor_si128(b7, _mm_loadu_si128(src + 6));
+	prev = _mm_loadu_si128(src + 7);
+	_mm_storeu_si128(dst, b0);
+	_mm_storeu_si128(dst + 1, b1);
+	_mm_storeu_si128(dst + 2, b2);
+	_mm_storeu_si128(dst + 3, b3);
+	_mm_storeu_si128(dst + 4, b4);
+	_mm_storeu_si128(dst + 5, b5);
+	_mm_storeu_si128(dst + 6, b6);
+	_mm_storeu_si128(dst + 7, b7);
+    }
+    for(; n > 0; n--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE){
+	b1 = _mm_loadu_si128((const __m128i*)in);
+	b0 = _mm_xor_si128(b1, r0);
+	for(r = 1; r < AES_ROUNDS; r++){
+	    b0 = _mm_aesdec_si128(b0, _mm_loadu_si128(rk + r));
+	}
+	b0 = _mm_aesdeclast_si128(b0, _mm_loadu_si128(rk + AES_ROUNDS));
+	_mm_storeu_si128((__m128i*)out, _mm_xor_si128(b0, prev));
+	prev = b1;
+    }
+    _mm_storeu_si128((__m128i*)iv, prev);
+}
+
+/* cbc_decrypt_aesni() two blocks to a register, sixteen at a time; n
+ * must be a multiple of 16. The rest is left to AES-NI by the caller, so
+ * that the 128 bit code never runs with the 256 bit registers dirty. */
+TARGET_VAES static void cbc_decrypt_vaes(const struct crypt_key* k, unsigned char* iv,
+					 const unsigned char* in, unsigned char* out,
+					 size_t n){
+    __m256i rk[AES_ROUNDS + 1];
+    const __m256i* src;
+    __m256i* dst;
+    __m256i b0, b1, b2, b3, b4, b5, b6, b7;
+    __m128i prev;
+    int r;
+
+    for(r = 0; r <= AES_ROUNDS; r++){
+	rk[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)k->rk[1][r]));
+    }
+    prev = _mm_loadu_si128((const __m128i*)iv);
+    for(; n >= 16; n -= 16, in += 16 * AES_BLOCK_SIZE, out += 16 * AES_BLOCK_SIZE){
+	src = (const __m256i*)in;
+	dst = (__m256i*)out;
+	b0 = _mm256_xor_si256(_mm256_loadu_si256(src), rk[0]);
+	b1 = _mm256_xor_si256(_mm256_loadu_si256(src + 1), rk[0]);
+	b2 = _mm256_xor_si256(_mm256_loadu_si256(src + 2), rk[0]);
+	b3 = _mm256_xor_si256(_mm256_loadu_si256(src + 3), rk[0]);
+	b4 = _mm256_xor_si256(_mm256_loadu_si256(src + 4), rk[0]);
+	b5 = _mm256_xor_si256(_mm256_loadu_si256(src + 5), rk[0]);
+	b6 = _mm256_xor_si256(_mm256_loadu_si256(src + 6), rk[0]);
+	b7 = _mm256_xor_si256(_mm256_loadu_si256(src + 7), rk[0]);
+	for(r = 1; r < AES_ROUNDS; r++){
+	    ROUND8(_mm256_aesdec_epi128, rk[r]);
+	}
+	ROUND8(_mm256_aesdeclast_epi128, rk[AES_ROUNDS]);
+	/* each pair's previous blocks: the one before it, and its first */
+	b0 = _mm256_xor_si256(b0, _mm256_inserti128_si256(
+				  _mm256_castsi128_si256(prev),
+				  _mm_loadu_si128((const __m128i*)in), 1));
+	b1 = _mm256_xor_si256(b1, _mm256_loadu_si256((const __m256i*)(in + 16)));
+	b2 = _mm256_xor_si256(b2, _mm256_loadu_si256((const __m256i*)(in + 48)));
+	b3 = _mm256_xor_si256(b3, _mm256_loadu_si256((const __m256i*)(in + 80)));
+	b4 = _mm256_xor_si256(b4, _mm256_loadu_si256((const __m256i*)(in + 112)));
+	b5 = _mm256_xor_si256(b5, _mm256_loadu_si256((const __m256i*)(in + 144)));
+	b6 = _mm256_xor_si256(b6, _mm256_loadu_si256((const __m256i*)(in + 176)));
+	b7 = _mm256_xor_si256(b7, _mm256_loadu_si256((const __m256i*)(in + 208)));
+	prev = _mm_loadu_si128((const __m128i*)(in + 240));
+	_mm256_storeu_si256(dst, b0);
+	_mm256_storeu_si256(dst + 1, b1);
+	_mm256_storeu_si256(dst + 2, b2);
+	_mm256_storeu_si256(dst + 3, b3);
+	_mm256_storeu_si256(dst + 4, b4);
+	_mm256_storeu_si256(dst + 5, b5);
+	_mm256_storeu_si256(dst + 6, b6);
+	_mm256_storeu_si256(dst + 7, b7);
+    }
+    _mm_storeu_si128((__m128i*)iv, prev);
+}
+#endif
+
+/* Picks the best kernel this CPU and OS can run */
+static int kernel_cpu(void){
+#ifdef HAVE_AESNI
+    unsigned int a, b, c, d;
+    unsigned int lo, hi;
+
+    if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_AES) || !(d & bit_SSE2)){
+	return KERNEL_EVP;
+    }
+    /* 256 bit registers need the OS to save them as well */
+    if(!(c & bit_AVX) || !(c & bit_OSXSAVE)){
+	return KERNEL_AESNI;
+    }
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    if((lo & 6) != 6 || !__get_cpuid_count(7, 0, &a, &b, &c, &d) ||
+       !(b & bit_AVX2) || !(c & bit_VAES)){
+	return KERNEL_AESNI;
+    }
+    return KERNEL_VAES;
+#else
+    return KERNEL_EVP;
+#endif
+}
+
+/* One shot AES-256-CBC through EVP with k's key; in may be out */
+static int evp_key_buf(const struct crypt_key* k, const unsigned char* in, size_t inlen,
+		       unsigned char* out, size_t* outlen, int action){
+    EVP_CIPHER_CTX* ctx;
+    int n, last;
+    int res;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+	return FAILURE;
+    }
+    res = EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, k->key, k->iv, action) &&
+	EVP_CipherUpdate(ctx, out, &n, in, (int)inlen) &&
+	EVP_CipherFinal_ex(ctx, out + n, &last);
+    EVP_CIPHER_CTX_free(ctx);
+    if(res){
+	*outlen = (size_t)n + last;
+    }
+    return res ? SUCCESS : FAILURE;
+}
+
+#ifdef HAVE_AESNI
+/* CBC on n whole blocks with kern, chaining from and back into iv; out
+ * may be in */
+static void kernel_cbc(int kern, const struct crypt_key* k, unsigned char* iv,
+		       const unsigned char* in, unsigned char* out, size_t n, int action){
+    size_t i;
+
+    if(action > 0){
+	cbc_encrypt_aesni(k, iv, in, out, n);
+	return;
+    }
+    i = kern == KERNEL_VAES ? n / 16 * 16 : 0;
+    if(i > 0){
+	cbc_decrypt_vaes(k, iv, in, out, i);
+    }
+    cbc_decrypt_aesni(k, iv, in + i * AES_BLOCK_SIZE, out + i * AES_BLOCK_SIZE, n - i);
+}
+
+/* evp_key_buf() on a kernel: same padding, same errors */
+static int kernel_buf(int kern, const struct crypt_key* k, const unsigned char* in,
+		      size_t inlen, unsigned char* out, size_t* outlen, int action){
+    unsigned char iv[AES_BLOCK_SIZE];
+    unsigned char last[AES_BLOCK_SIZE];
+    size_t n = inlen / AES_BLOCK_SIZE;
+    size_t pad, i;
+
+    memcpy(iv, k->iv, AES_BLOCK_SIZE);
+    if(action > 0){
+	/* 1 to 16 bytes of padding, each holding the count; the tail is
+	 * copied out before out (maybe in) is written */
+	pad = AES_BLOCK_SIZE - inlen % AES_BLOCK_SIZE;
+	memcpy(last, in + n * AES_BLOCK_SIZE, AES_BLOCK_SIZE - pad);
+	memset(last + AES_BLOCK_SIZE - pad, (int)pad, pad);
+	cbc_encrypt_aesni(k, iv, in, out, n);
+	cbc_encrypt_aesni(k, iv, last, out + n * AES_BLOCK_SIZE, 1);
+	*outlen = (n + 1) * AES_BLOCK_SIZE;
+	return SUCCESS;
+    }
+    if(inlen == 0 || inlen % AES_BLOCK_SIZE){
+	return FAILURE;
+    }
+    kernel_cbc(kern, k, iv, in, out, n, 0);
+    pad = out[inlen - 1];
+    if(pad == 0 || pad > AES_BLOCK_SIZE){
+	return FAILURE;
+    }
+    for(i = 2; i <= pad; i++){
+	if(out[inlen - i] != pad){
+	    return FAILURE;
+	}
+    }
+    *outlen = inlen - pad;
+    return SUCCESS;
+}
+
+/* Whether kern gives OpenSSL's output, both ways and in place, for
+ * lengths around the block and unroll sizes */
+static int kernel_check(int kern){
+    static const size_t lens[] = { 0, 1, 15, 16, 17, 127, 128, 129, 255, 256, 257, 300 };
+    unsigned char plain[300];
+    unsigned char want[CRYPT_OUTLEN(300)];
+    unsigned char got[CRYPT_OUTLEN(300)];
+    struct crypt_key k;
+    size_t wantlen, gotlen;
+    size_t i;
+    int res = SUCCESS;
+
+    if(!derive_key("aes-crypt kernel check", k.key, k.iv)){
+	return FAILURE;
+    }
+    expand_key(&k);
+    for(i = 0; i < sizeof(plain); i++){
+	plain[i] = (unsigned char)(i * 167 + 13);
+    }
+    for(i = 0; i < sizeof(lens) / sizeof(lens[0]) && res; i++){
+	res = evp_key_buf(&k, plain, lens[i], want, &wantlen, 1) &&
+	    kernel_buf(kern, &k, plain, lens[i], got, &gotlen, 1) &&
+	    gotlen == wantlen && !memcmp(got, want, wantlen) &&
+	    kernel_buf(kern, &k, got, gotlen, got, &gotlen, 0) &&
+	    gotlen == lens[i] && !memcmp(got, plain, gotlen);
+    }
+    OPENSSL_cleanse(&k, sizeof(k));
+    return res;
+}
+#endif
+
+/* Quietly falls back on a kernel that disagrees with OpenSSL: this runs
+ * inside whatever first needs a key, a file system request included;
+ * crypt_kernel() tells which one won */
+static void kernel_pick(void){
+    int kern = kernel_cpu();
+
+#ifdef HAVE_AESNI
+    while(kern != KERNEL_EVP && !kernel_check(kern)){
+	kern--;
+    }
+#endif
+    kernel = kern;
+}
+
+/* Derives k from key_str and, if a kernel will use them, its round keys */
+static int key_setup(struct crypt_key* k, const char* key_str){
+    pthread_once(&kernel_once, kernel_pick);
+    if(!derive_key(key_str, k->key, k->iv)){
+	return FAILURE;
+    }
+#ifdef HAVE_AESNI
+    if(kernel != KERNEL_EVP){
+	expand_key(k);
+    }
+#endif
+    return SUCCESS;
+}
+
+/* crypt_key_buf() without the checks */
+static int key_buf(const struct crypt_key* k, const unsigned char* in, size_t inlen,
+		   unsigned char* out, size_t* outlen, int action){
+#ifdef HAVE_AESNI
+    if(kernel != KERNEL_EVP){
+	return kernel_buf(kernel, k, in, inlen, out, outlen, action);
+    }
+#endif
+    return evp_key_buf(k, in, inlen, out, outlen, action);
+}
+
+struct crypt_key* crypt_key_new(const char* key_str){
+    struct crypt_key* k;
+
+    k = calloc(1, sizeof(*k));
+    if(!k){
+	perror("calloc error");
+	return NULL;
+    }
+    if(!key_setup(k, key_str)){
+	crypt_key_free(k);
+	return NULL;
+    }
+    return k;
+}
+
+int crypt_key_buf(const struct crypt_key* k, const unsigned char* in, size_t inlen,
+		  unsigned char* out, size_t outsize, size_t* outlen, int action){
+    *outlen = 0;
+    if(inlen > CRYPT_CHUNK || outsize < out_size(action, inlen)){
+	fprintf(stderr, "Buffer too large or too small\n");
+	return FAILURE;
+    }
+    if(action < 0){
+	memmove(out, in, inlen);
+	*outlen = inlen;
+	return SUCCESS;
+    }
+    return key_buf(k, in, inlen, out, outlen, action);
+}
+
+void crypt_key_free(struct crypt_key* k){
+    if(!k){
+	return;
+    }
+    OPENSSL_cleanse(k, sizeof(*k));
+    free(k);
+}
+
+int crypt_cbc(const unsigned char* key, const unsigned char* iv, const unsigned char* in,
+	      size_t len, unsigned char* out, int action){
+    EVP_CIPHER_CTX* ctx;
+    int n;
+    int res;
+
+    if(len % AES_BLOCK_SIZE || len > CRYPT_CHUNK || action < 0){
+	return FAILURE;
+    }
+    pthread_once(&kernel_once, kernel_pick);
+#ifdef HAVE_AESNI
+    if(kernel != KERNEL_EVP){
+	struct crypt_key k;
+	unsigned char chain[AES_BLOCK_SIZE];
+
+	memcpy(k.key, key, sizeof(k.key));
+	expand_key(&k);
+	memcpy(chain, iv, AES_BLOCK_SIZE);
+	kernel_cbc(kernel, &k, chain, in, out, len / AES_BLOCK_SIZE, action);
+	OPENSSL_cleanse(&k, sizeof(k));
+	return SUCCESS;
+    }
+#endif
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx){
+	return FAILURE;
+    }
+    res = EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action) &&
+	EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+	EVP_CipherUpdate(ctx, out, &n, in, (int)len) && (size_t)n == len;
+    EVP_CIPHER_CTX_free(ctx);
+    return res ? SUCCESS : FAILURE;
+}
+
+const char* crypt_kernel(void){
+    pthread_once(&kernel_once, kernel_pick);
+    return kernel_names[kernel];
+}
+
+int crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+	      size_t outsize, size_t* outlen, int action, char* key_str){
+    struct crypt_ctx* c;
+    struct crypt_key k;
+    size_t len, last;
+    int res;
+
+    *outlen = 0;
+    if(outsize < out_size(action, inlen)){
+	fprintf(stderr, "Output buffer too small\n");
+	return FAILURE;
+    }
+    if(action >= 0 && inlen <= CRYPT_CHUNK){
+	/* all of it in one go, on a kernel if there is one */
+	res = key_setup(&k, key_str) && key_buf(&k, in, inlen, out, outlen, action);
+	OPENSSL_cleanse(&k, sizeof(k));
+	return res ? SUCCESS : FAILURE;
+    }
+    c = crypt_init(action, key_str);
+    if(!c){
+	return FAILURE;
+    }
+    res = crypt_update(c, out, &len, in, inlen) &&
+	crypt_final(c, out + len, &last);
+    crypt_free(c);
+    if(res){
+	*outlen = len + last;
+    }
+    return res ? SUCCESS : FAILURE;
+}
+
+int crypt_buf_inplace(unsigned char* buf, size_t len, size_t size,
+		      size_t* outlen, int action, char* key_str){
+    struct crypt_key k;
+    int res;
+
+    *outlen = 0;
+    /* one cipher call: later ones would write behind their input */
+    if(len > CRYPT_CHUNK || size < out_size(action, len)){
+	fprintf(stderr, "Buffer too large or too small\n");
+	return FAILURE;
+    }
+    if(action < 0){
+	*outlen = len;
+	return SUCCESS;
+    }
+    res = key_setup(&k, key_str) && key_buf(&k, buf, len, buf, outlen, action);
+    OPENSSL_cleanse(&k, sizeof(k));
+    return res ? SUCCESS : FAILURE;
+}
+
+/* Copies up to len bytes from cur into buf; returns how many there were */
+static size_t gather(struct iov_cur* cur, unsigned char* buf, size_t len){
+    size_t done = 0;
+    size_t n;
+
+    while(done < len && cur->cnt > 0){
+	n = cur->iov->iov_len - cur->off;
+	if(n > len - done){
+	    n = len - done;
+	}
+	memcpy(buf + done, (char*)cur->iov->iov_base + cur->off, n);
+	done += n;
+	cur->off += n;
+	if(cur->off == cur->iov->iov_len){
+	    cur->iov++;
+	    cur->cnt--;
+	    cur->off = 0;
+	}
+    }
+    return done;
+}
+
+/* Copies len bytes from buf to cur; FAILURE if they don't fit */
+static int scatter(struct iov_cur* cur, const unsigned char* buf, size_t len){
+    size_t n;
+
+    while(len > 0){
+	if(cur->cnt == 0){
+	    fprintf(stderr, "Output vector too small\n");
+	    return FAILURE;
+	}
+	n = cur->iov->iov_len - cur->off;
+	if(n > len){
+	    n = len;
+	}
+	memcpy((char*)cur->iov->iov_base + cur->off, buf, n);
+	buf += n;
+	len -= n;
+	cur->off += n;
+	if(cur->off == cur->iov->iov_len){
+	    cur->iov++;
+	    cur->cnt--;
+	    cur->off = 0;
+	}
+    }
+    return SUCCESS;
+}
+
+/* Runs len bytes of src through c into dst. Input is gathered into a
+ * bounce buffer before the output of it is scattered, and the cipher's
+ * output never gets ahead of its input, so dst may be src. */
+static int run_iov(struct crypt_ctx* c, struct iov_cur* src, size_t len,
+		   struct iov_cur* dst, size_t* outlen){
+    unsigned char inbuf[CRYPT_BOUNCE];
+    unsigned char outbuf[CRYPT_BOUNCE + EVP_MAX_BLOCK_LENGTH];
+    size_t n, got;
+
+    *outlen = 0;
+    for(;;){
+	n = gather(src, inbuf, len < CRYPT_BOUNCE ? len : CRYPT_BOUNCE);
+	len -= n;
+	if(n == 0){
+	    break;
+	}
+	if(!crypt_update(c, outbuf, &got, inbuf, n) ||
+	   !scatter(dst, outbuf, got)){
+	    return FAILURE;
+	}
+	*outlen += got;
+    }
+    /* Handle remaining cipher block + padding */
+    if(!crypt_final(c, outbuf, &got) || !scatter(dst, outbuf, got)){
+	return FAILURE;
+    }
+    *outlen += got;
+    return SUCCESS;
+}
+
+int crypt_iov(const struct iovec* in, int incnt, const struct iovec* out,
+	      int outcnt, size_t* outlen, int action, char* key_str){
+    struct iov_cur src = { in, incnt, 0 };
+    struct iov_cur dst = { out, outcnt, 0 };
+    struct crypt_ctx* c;
+    int res;
+
+    *outlen = 0;
+    c = crypt_init(action, key_str);
+    if(!c){
+	return FAILURE;
+    }
+    res = run_iov(c, &src, (size_t)-1, &dst, outlen);
+    crypt_free(c);
+    return res;
+}
+
+int crypt_iov_inplace(const struct iovec* iov, int cnt, size_t len,
+		      size_t* outlen, int action, char* key_str){
+    struct iov_cur src = { iov, cnt, 0 };
+    struct iov_cur dst = { iov, cnt, 0 };
+    struct crypt_ctx* c;
+    int res;
+
+    *outlen = 0;
+    c = crypt_init(action, key_str);
+    if(!c){
+	return FAILURE;
+    }
+    res = run_iov(c, &src, len, &dst, outlen);
+    crypt_free(c);
+    return res;
+}
+
+/* Reads into buf until it is full or the input ends; -1 on error */
+static ssize_t read_full(int fd, unsigned char* buf, size_t size, int* eof){
+    size_t done = 0;
+    ssize_t n;
+
+    *eof = 0;
+    while(done < size){
+	n = read(fd, buf + done, size - done);
+	if(n < 0 && errno == EINTR){
+	    continue;
+	}
+	if(n < 0){
+	    perror("read error");
+	    return -1;
+	}
+	if(n == 0){
+	    *eof = 1;
+	    break;
+	}
+	done += n;
+    }
+    return done;
+}
+
+/* Writes all of buf; FAILURE on error */
+static int write_full(int fd, const unsigned char* buf, size_t len){
+    ssize_t n;
+
+    while(len > 0){
+	n = write(fd, buf, len);
+	if(n < 0 && errno == EINTR){
+	    continue;
+	}
+	if(n < 0){
+	    perror("write error");
+	    return FAILURE;
+	}
+	buf += n;
+	len -= n;
+    }
+    return SUCCESS;
+}
+
+/* crypt_fd() on the calling thread alone */
+static int crypt_fd_serial(int infd, int outfd, struct crypt_ctx* c){
+    unsigned char inbuf[CRYPT_BOUNCE];
+    unsigned char outbuf[CRYPT_BOUNCE + EVP_MAX_BLOCK_LENGTH];
+    size_t outlen, last;
+    ssize_t inlen;
+    int eof;
+
+    do{
+	inlen = read_full(infd, inbuf, sizeof(inbuf), &eof);
+	if(inlen < 0 || !crypt_update(c, outbuf, &outlen, inbuf, inlen)){
+	    return FAILURE;
+	}
+	if(eof){
+	    if(!crypt_final(c, outbuf + outlen, &last)){
+		return FAILURE;
+	    }
+	    outlen += last;
+	}
+	if(!write_full(outfd, outbuf, outlen)){
+	    return FAILURE;
+	}
+    }while(!eof);
+    return SUCCESS;
+}
+
+/* Whether a kernel copy failing with err means it can't copy between
+ * these fds at all (rather than that the copy itself went wrong) */
+static int copy_unsupported(int err){
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+	err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Copies everything left to read on infd to outfd, keeping the data in
+ * the kernel where it can: copy_file_range() between regular files (which
+ * may share extents or copy on the device), sendfile() from a regular
+ * file, splice() from a pipe. Anything else, or a kernel that won't,
+ * goes through a large buffer. Each fd's own position is used. */
+static int copy_fd(int infd, int outfd){
+    struct stat ist, ost;
+    unsigned char* buf;
+    ssize_t n;
+    int eof;
+
+    if(fstat(infd, &ist) < 0 || fstat(outfd, &ost) < 0){
+	perror("stat error");
+	return FAILURE;
+    }
+#ifdef HAVE_COPY_FILE_RANGE
+    /* some special files claim to be regular and empty: only trust it
+     * between real ones */
+    if(S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode) && ist.st_size > 0){
+	while((n = copy_file_range(infd, NULL, outfd, NULL,
+				   CRYPT_COPY_MAX, 0)) != 0){
+	    if(n > 0 || errno == EINTR){
+		continue;
+	    }
+	    if(copy_unsupported(errno)){
+		break;
+	    }
+	    perror("copy error");
+	    return FAILURE;
+	}
+	if(n == 0){
+	    return SUCCESS;
+	}
+    }
+#endif
+#ifdef linux
+    if(S_ISREG(ist.st_mode) && ist.st_size > 0){
+	while((n = sendfile(outfd, infd, NULL, CRYPT_COPY_MAX)) != 0){
+	    if(n > 0 || errno == EINTR){
+		continue;
+	    }
+	    if(copy_unsupported(errno)){
+		break;
+	    }
+	    perror("copy error");
+	    return FAILURE;
+	}
+	if(n == 0){
+	    return SUCCESS;
+	}
+    }
+    else if(S_ISFIFO(ist.st_mode)){
+	while((n = splice(infd, NULL, outfd, NULL, CRYPT_COPY_MAX,
+			  SPLICE_F_MOVE)) != 0){
+	    if(n > 0 || errno == EINTR){
+		continue;
+	    }
+	    if(copy_unsupported(errno)){
+		break;
+	    }
+	    perror("copy error");
+	    return FAILURE;
+	}
+	if(n == 0){
+	    return SUCCESS;
+	}
+    }
+#endif
+
+    /* the kernel can't: copy through user space, a big buffer at a time */
+    buf = malloc(CRYPT_PIPE_BUF);
+    if(!buf){
+	perror("malloc error");
+	return FAILURE;
+    }
+    do{
+	n = read_full(infd, buf, CRYPT_PIPE_BUF, &eof);
+	if(n < 0 || !write_full(outfd, buf, n)){
+	    free(buf);
+	    return FAILURE;
+	}
+    }while(!eof);
+    free(buf);
+    return SUCCESS;
+}
+
+/* Waits for s to be full (or empty); FAILURE if the pipe failed */
+static int slot_wait(struct crypt_pipe* p, struct pipe_slot* s, int full){
+    int res;
+
+    pthread_mutex_lock(&p->lock);
+    while(s->full != full && !p->failed){
+	pthread_cond_wait(&p->cond, &p->lock);
+    }
+    res = !p->failed;
+    pthread_mutex_unlock(&p->lock);
+    return res ? SUCCESS : FAILURE;
+}
+
+/* Marks s full (or empty) for the next stage */
+static void slot_pass(struct crypt_pipe* p, struct pipe_slot* s, int full){
+    pthread_mutex_lock(&p->lock);
+    s->full = full;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Stops every stage */
+static void pipe_fail(struct crypt_pipe* p){
+    pthread_mutex_lock(&p->lock);
+    p->failed = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void* pipe_reader(void* arg){
+    struct crypt_pipe* p = arg;
+    struct pipe_slot* s;
+    ssize_t n;
+    int i = 0;
+    int eof;
+
+    do{
+	s = &p->in[i];
+	if(!slot_wait(p, s, 0)){
+	    return NULL;
+	}
+	n = read_full(p->infd, s->buf, CRYPT_PIPE_BUF, &eof);
+	if(n < 0){
+	    pipe_fail(p);
+	    return NULL;
+	}
+	s->len = n;
+	s->last = eof;
+	slot_pass(p, s, 1);
+	i = (i + 1) % CRYPT_PIPE_SLOTS;
+    }while(!eof);
+    return NULL;
+}
+
+static void* pipe_writer(void* arg){
+    struct crypt_pipe* p = arg;
+    struct pipe_slot* s;
+    int i = 0;
+    int last;
+
+    do{
+	s = &p->out[i];
+	if(!slot_wait(p, s, 1)){
+	    return NULL;
+	}
+	if(!write_full(p->outfd, s->buf, s->len)){
+	    pipe_fail(p);
+	    return NULL;
+	}
+	last = s->last;
+	slot_pass(p, s, 0);
+	i = (i + 1) % CRYPT_PIPE_SLOTS;
+    }while(!last);
+    return NULL;
+}
+
+/* The cipher stage, on the calling thread */
+static void pipe_cipher(struct crypt_pipe* p, struct crypt_ctx* c){
+    struct pipe_slot* in;
+    struct pipe_slot* out;
+    size_t last;
+    int i = 0;
+
+    do{
+	in = &p->in[i];
+	out = &p->out[i];
+	if(!slot_wait(p, in, 1) || !slot_wait(p, out, 0)){
+	    return;
+	}
+	if(!crypt_update(c, out->buf, &out->len, in->buf, in->len) ||
+	   (in->last && !crypt_final(c, out->buf + out->len, &last))){
+	    pipe_fail(p);
+	    return;
+	}
+	if(in->last){
+	    out->len += last;
+	}
+	out->last = in->last;
+	slot_pass(p, in, 0);
+	slot_pass(p, out, 1);
+	i = (i + 1) % CRYPT_PIPE_SLOTS;
+    }while(!out->last);
+}
+
+int crypt_fd(int infd, int outfd, int action, char* key_str){
+    struct crypt_pipe p;
+    struct crypt_ctx* c;
+    pthread_t reader, writer;
+    struct stat st;
+    off_t pos;
+    int res = FAILURE;
+    int i;
+
+    /* nothing to cipher: leave the copy to the kernel */
+    if(action < 0){
+	return copy_fd(infd, outfd);
+    }
+    c = crypt_init(action, key_str);
+    if(!c){
+	return FAILURE;
+    }
+    /* not worth the threads for a short file */
+    pos = lseek(infd, 0, SEEK_CUR);
+    if(fstat(infd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0 &&
+       st.st_size - pos < CRYPT_PIPE_MIN){
+	res = crypt_fd_serial(infd, outfd, c);
+	crypt_free(c);
+	return res;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.infd = infd;
+    p.outfd = outfd;
+    for(i = 0; i < CRYPT_PIPE_SLOTS; i++){
+	if(posix_memalign((void**)&p.in[i].buf, 4096, CRYPT_PIPE_BUF) ||
+	   posix_memalign((void**)&p.out[i].buf, 4096, CRYPT_OUTLEN(CRYPT_PIPE_BUF))){
+	    break;
+	}
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if(i < CRYPT_PIPE_SLOTS ||
+       pthread_create(&reader, NULL, pipe_reader, &p) != 0){
+	/* no buffers or no threads: one thing at a time, then */
+	res = crypt_fd_serial(infd, outfd, c);
+    }
+    else{
+	if(pthread_create(&writer, NULL, pipe_writer, &p) != 0){
+	    pipe_fail(&p);
+	}
+	else{
+	    pipe_cipher(&p, c);
+	    pthread_join(writer, NULL);
+	}
+	pthread_join(reader, NULL);
+	res = p.failed ? FAILURE : SUCCESS;
+    }
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    for(i = 0; i < CRYPT_PIPE_SLOTS; i++){
+	free(p.in[i].buf);
+	free(p.out[i].buf);
+    }
+    crypt_free(c);
+    return res;
+}
+
+/* Hands the rest of a large file on in over to crypt_fd() (any file for
+ * a pass-through copy), after lining the fds up with the streams'
+ * positions and before lining the streams up with the fds'. -1 if in
+ * isn't such a file or out has no fd. */
+static int do_crypt_fd(FILE* in, FILE* out, int action, char* key_str){
+    struct stat st;
+    off_t pos;
+    int res;
+
+    if(fileno(in) < 0 || fileno(out) < 0 ||
+       fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode)){
+	return -1;
+    }
+    pos = ftello(in);
+    if(pos < 0 || (action >= 0 && st.st_size - pos < CRYPT_PIPE_MIN) ||
+       fflush(out) != 0 ||
+       lseek(fileno(in), pos, SEEK_SET) < 0){
+	return -1;
+    }
+    res = crypt_fd(fileno(in), fileno(out), action, key_str);
+    fseeko(in, 0, SEEK_END);
+    /* fails harmlessly on a pipe */
+    fseeko(out, 0, SEEK_CUR);
+    return res;
+}
+
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* Local Vars */
 
     /* Buffers */
     unsigned char inbuf[BLOCKSIZE];
-    int inlen;
+    size_t inlen;
     /* Allow enough space in output buffer for additional cipher block */
     unsigned char outbuf[BLOCKSIZE + EVP_MAX_BLOCK_LENGTH];
-    int outlen;
-    int writelen;
+    size_t outlen;
+    size_t writelen;
 
-    /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
+    /* Cipher stream (or pass-through) */
+    struct crypt_ctx* c;
+    int res;
+
+    /* Large files are read, ciphered and written all at once; copies of
+     * any file are left to the kernel */
+    res = do_crypt_fd(in, out, action, key_str);
+    if(res >= 0){
+	return res;
+    }
 
     /* Setup Encryption Key and Cipher Engine if in cipher mode */
-    if(action >= 0){
-	if(!key_str){
-	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
-	    return 0;
-	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
-	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
-	    return 0;
-	}
-	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
-    }    
+    c = crypt_init(action, key_str);
+    if(!c){
+	return FAILURE;
+    }
 
     /* Loop through Input File*/
     for(;;){
@@ -69,20 +1250,12 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    /* EOF -> Break Loop */
 	    break;
 	}
-	
-	/* If in cipher mode, perform cipher transform on block */
-	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
-		{
-		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
-		}
-	}
-	/* If in pass-through mode. copy block as is */
-	else{
-	    memcpy(outbuf, inbuf, inlen);
-	    outlen = inlen;
+
+	/* Perform cipher transform on block (or copy it as is) */
+	if(!crypt_update(c, outbuf, &outlen, inbuf, inlen)){
+	    /* Error */
+	    crypt_free(c);
+	    return FAILURE;
 	}
 
 	/* Write Block */
@@ -90,25 +1263,21 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
-	    return 0;
-	}
-    }
-    
-    /* If in cipher mode, handle necessary padding */
-    if(action >= 0){
-	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
-	    {
-		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
-	    }
-	/* Write remainign cipher block + padding*/
-	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	    crypt_free(c);
+	    return FAILURE;
+	}
+    }
+
+    /* Handle remaining cipher block + padding (nothing in pass-through) */
+    if(!crypt_final(c, outbuf, &outlen)){
+	/* Error */
+	crypt_free(c);
+	return FAILURE;
     }
-    
+    /* Write remainign cipher block + padding*/
+    fwrite(outbuf, sizeof(*outbuf), outlen, out);
+    crypt_free(c);
+
     /* Success */
-    return 1;
+    return SUCCESS;
 }
@@ -1,5 +1,6 @@
 /* aes-crypt.h
  * High level function interface for performing AES encryption on FILE pointers
+ * and in memory
  * Uses OpenSSL libcrypto EVP API
  *
  * By Andy Sayler (www.andysayler.com)
@@ -13,6 +14,31 @@
  * http://saju.net.in/blog/?p=36
  * http://saju.net.in/code/misc/openssl_aes.c.txt
  *
+ * Besides do_crypt() on FILE pointers, the same cipher (AES-256-CBC with
+ * PKCS padding, key and IV derived from the pass phrase) can be run on
+ * memory: one shot on a buffer or an iovec array, in place or not, or as
+ * a stream through a crypt_ctx handle, which also saves deriving the key
+ * again for every buffer. Encrypting adds 1 to CRYPT_PAD bytes of
+ * padding, so output buffers need room for CRYPT_OUTLEN(input) bytes;
+ * decrypting takes it off again.
+ *
+ * Whole files are best run through crypt_fd(), which reads, ciphers and
+ * writes at the same time, each on its own thread, so a file goes about
+ * as fast as the slower of the disk and the cipher rather than at the
+ * sum of their times. do_crypt() hands large files to it. Pass-through
+ * copies never leave the kernel when the fds allow it (copy_file_range(),
+ * sendfile() or splice()); do_crypt() hands it any file to copy.
+ *
+ * For the small buffers of file system requests, a crypt_key holds the
+ * key already expanded for the CPU's AES instructions (AES-NI, and VAES
+ * for decrypting where there is AVX2), so crypt_key_buf() is a few
+ * hundred instructions with no EVP context, lookups or allocation. The
+ * instructions are found at run time and checked against OpenSSL's
+ * output before use; without them (or if they disagree) it is EVP.
+ * crypt_buf() and crypt_buf_inplace() go the same way after deriving the
+ * key, and so does crypt_cbc(), unpadded on a raw key and an IV of the
+ * caller's, for data that brings its own IV (fusec's blocks).
+ *
  */
 
 #ifndef AES_CRYPT_H
@@ -21,6 +47,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
@@ -29,6 +56,17 @@
 #define FAILURE 0
 #define SUCCESS 1
 
+/* most bytes encrypting adds */
+#define CRYPT_PAD EVP_MAX_BLOCK_LENGTH
+/* room the output of n input bytes may need */
+#define CRYPT_OUTLEN(n) ((n) + CRYPT_PAD)
+/* crypt_fd() buffers: this many of this size (page aligned) per stage */
+#define CRYPT_PIPE_SLOTS 3
+#define CRYPT_PIPE_BUF (1 << 20)
+
+struct crypt_ctx;
+struct crypt_key;
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
@@ -39,4 +77,174 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* int crypt_fd(int infd, int outfd, int action, char* key_str)
+ * Purpose: Perform cipher on everything left to read on infd and write the
+ *          result to outfd. A reader and a writer thread keep
+ *          CRYPT_PIPE_SLOTS buffers each on either side of the cipher, so
+ *          all three run at once; short inputs are done on the calling
+ *          thread alone. A pass-through copy is done by the kernel if
+ *          it can, otherwise through one large buffer.
+ * Args: int infd     : Input file descriptor (any kind, read to EOF)
+ *       int outfd    : Output file descriptor
+ *       int action   : Cipher action (as do_crypt)
+ *       char* key_str : Pass phrase
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_fd(int infd, int outfd, int action, char* key_str);
+
+/* struct crypt_ctx* crypt_init(int action, const char* key_str)
+ * Purpose: Derive the key from key_str and start a stream
+ * Args: int action          : Cipher action (as do_crypt)
+ *       const char* key_str : Pass phrase (unused for pass-through)
+ * Return: New handle, NULL on error
+ */
+extern struct crypt_ctx* crypt_init(int action, const char* key_str);
+
+/* int crypt_reinit(struct crypt_ctx* c)
+ * Purpose: Start a new stream with the handle's key, dropping whatever
+ *          was left of the last one (much cheaper than crypt_init())
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_reinit(struct crypt_ctx* c);
+
+/* int crypt_update(struct crypt_ctx* c, unsigned char* out, size_t* outlen,
+ *                  const unsigned char* in, size_t inlen)
+ * Purpose: Run the next inlen bytes of the stream through the cipher
+ * Args: struct crypt_ctx* c     : Handle
+ *       unsigned char* out      : Output, room for CRYPT_OUTLEN(inlen)
+ *                                 bytes; must not overlap in
+ *       size_t* outlen          : Set to the bytes written to out
+ *       const unsigned char* in : Input
+ *       size_t inlen            : Input length
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_update(struct crypt_ctx* c, unsigned char* out, size_t* outlen,
+			const unsigned char* in, size_t inlen);
+
+/* int crypt_final(struct crypt_ctx* c, unsigned char* out, size_t* outlen)
+ * Purpose: End the stream: write the last block (and padding)
+ * Args: struct crypt_ctx* c : Handle
+ *       unsigned char* out  : Output, room for CRYPT_PAD bytes
+ *       size_t* outlen      : Set to the bytes written to out
+ * Return: FAILURE on error (including bad padding when decrypting),
+ *         SUCCESS on success
+ */
+extern int crypt_final(struct crypt_ctx* c, unsigned char* out, size_t* outlen);
+
+/* void crypt_free(struct crypt_ctx* c)
+ * Purpose: Free a handle and wipe its key
+ */
+extern void crypt_free(struct crypt_ctx* c);
+
+/* int crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+ *               size_t outsize, size_t* outlen, int action, char* key_str)
+ * Purpose: Perform cipher on a whole buffer
+ * Args: const unsigned char* in : Input
+ *       size_t inlen            : Input length
+ *       unsigned char* out      : Output, must not overlap in (see
+ *                                 crypt_buf_inplace())
+ *       size_t outsize          : Room in out: CRYPT_OUTLEN(inlen) to be safe
+ *       size_t* outlen          : Set to the output length
+ *       int action              : Cipher action (as do_crypt)
+ *       char* key_str           : Pass phrase
+ * Return: FAILURE on error (including too little room), SUCCESS on success
+ */
+extern int crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+		     size_t outsize, size_t* outlen, int action, char* key_str);
+
+/* int crypt_buf_inplace(unsigned char* buf, size_t len, size_t size,
+ *                       size_t* outlen, int action, char* key_str)
+ * Purpose: Perform cipher on the first len bytes of buf, in place
+ * Args: size_t size : Room in buf for the output (CRYPT_OUTLEN(len) to
+ *                     encrypt, len to decrypt); at most 1 GB
+ *       otherwise as crypt_buf()
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_buf_inplace(unsigned char* buf, size_t len, size_t size,
+			     size_t* outlen, int action, char* key_str);
+
+/* int crypt_iov(const struct iovec* in, int incnt, const struct iovec* out,
+ *               int outcnt, size_t* outlen, int action, char* key_str)
+ * Purpose: Perform cipher on the bytes of in[0..incnt), scattering the
+ *          result over out[0..outcnt)
+ * Args: const struct iovec* in  : Input
+ *       int incnt               : Input vector length
+ *       const struct iovec* out : Output, must not overlap in (see
+ *                                 crypt_iov_inplace())
+ *       int outcnt              : Output vector length
+ *       size_t* outlen          : Set to the output length
+ *       int action              : Cipher action (as do_crypt)
+ *       char* key_str           : Pass phrase
+ * Return: FAILURE on error (including too little room), SUCCESS on success
+ */
+extern int crypt_iov(const struct iovec* in, int incnt, const struct iovec* out,
+		     int outcnt, size_t* outlen, int action, char* key_str);
+
+/* int crypt_iov_inplace(const struct iovec* iov, int cnt, size_t len,
+ *                       size_t* outlen, int action, char* key_str)
+ * Purpose: Perform cipher on the first len bytes of iov[0..cnt), in place;
+ *          the output may use all of the vector
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_iov_inplace(const struct iovec* iov, int cnt, size_t len,
+			     size_t* outlen, int action, char* key_str);
+
+/* struct crypt_key* crypt_key_new(const char* key_str)
+ * Purpose: Derive the key from key_str, ready for crypt_key_buf()
+ * Args: const char* key_str : Pass phrase
+ * Return: New key, NULL on error
+ */
+extern struct crypt_key* crypt_key_new(const char* key_str);
+
+/* int crypt_key_buf(const struct crypt_key* k, const unsigned char* in,
+ *                   size_t inlen, unsigned char* out, size_t outsize,
+ *                   size_t* outlen, int action)
+ * Purpose: Perform cipher on a whole buffer with a derived key; the
+ *          cheapest way to do a small one. Safe to share k between
+ *          threads.
+ * Args: const struct crypt_key* k : Key (unused for pass-through)
+ *       const unsigned char* in   : Input, at most 1 GB
+ *       size_t inlen              : Input length
+ *       unsigned char* out        : Output; may be in, otherwise must not
+ *                                   overlap it
+ *       size_t outsize            : Room in out: CRYPT_OUTLEN(inlen) to be safe
+ *       size_t* outlen            : Set to the output length
+ *       int action                : Cipher action (as do_crypt)
+ * Return: FAILURE on error (including too little room and bad padding),
+ *         SUCCESS on success
+ */
+extern int crypt_key_buf(const struct crypt_key* k, const unsigned char* in,
+			 size_t inlen, unsigned char* out, size_t outsize,
+			 size_t* outlen, int action);
+
+/* void crypt_key_free(struct crypt_key* k)
+ * Purpose: Free a key and wipe it
+ */
+extern void crypt_key_free(struct crypt_key* k);
+
+/* int crypt_cbc(const unsigned char* key, const unsigned char* iv,
+ *               const unsigned char* in, size_t len, unsigned char* out,
+ *               int action)
+ * Purpose: AES-256-CBC without padding on a raw key and IV. The key is
+ *          expanded on every call, which costs about one AES block; on
+ *          EVP (crypt_kernel()) each call sets up a context of its own.
+ * Args: const unsigned char* key : 32 key bytes
+ *       const unsigned char* iv  : 16 IV bytes
+ *       const unsigned char* in  : Input, a multiple of 16 bytes, at most 1 GB
+ *       size_t len               : Input length
+ *       unsigned char* out       : Output, len bytes; may be in, otherwise
+ *                                  must not overlap it
+ *       int action               : 1 to encrypt, 0 to decrypt
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_cbc(const unsigned char* key, const unsigned char* iv,
+		     const unsigned char* in, size_t len, unsigned char* out,
+		     int action);
+
+/* const char* crypt_kernel(void)
+ * Purpose: Name what crypt_key_buf() and crypt_cbc() run on here
+ * Return: "vaes", "aes-ni" or "evp"
+ */
+extern const char* crypt_kernel(void);
+
 #endif
@@ -0,0 +1,238 @@
+/* bblog.c
+ * Leveled logging for fusec that stays off the request path
+ *
+ * See bblog.h for details
+ *
+ * Every thread that logs gets a single-producer/single-consumer ring: the
+ * thread only advances tail, the drain thread only advances head, so
+ * neither side takes a lock. The global list of rings is locked, but only
+ * when a thread logs for the first time and when the drain thread walks
+ * it. A ring whose thread has exited is freed once it has been drained.
+ *
+ */
+
+#ifdef linux
+/* For syscall() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "bblog.h"
+
+/* entries per thread (a power of two) */
+#define BBLOG_RING 64
+/* longest message kept, the rest is cut off */
+#define BBLOG_MSG 240
+/* how often the drain thread looks at the rings */
+#define BBLOG_DRAIN_MS 100
+
+struct bblog_ent {
+    struct timespec ts;
+    int level;
+    char msg[BBLOG_MSG];
+};
+
+struct bblog_ring {
+    unsigned int head;		/* next entry to drain (drain thread) */
+    unsigned int tail;		/* next entry to fill (owner thread) */
+    unsigned long dropped;	/* messages lost to a full ring */
+    int dead;			/* owner has exited */
+    long tid;
+    struct bblog_ring* next;
+    struct bblog_ent ent[BBLOG_RING];
+};
+
+int bblog_level = BBLOG_WARN;
+
+static const char* const level_names[] = { "ERR", "WARN", "INFO", "DEBUG" };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static struct bblog_ring* rings;
+static pthread_t drainer;
+static int running;
+static int stop;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static __thread struct bblog_ring* my_ring;
+
+static void ring_exit(void* p){
+    struct bblog_ring* r = p;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void){
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+static struct bblog_ring* get_ring(void){
+    struct bblog_ring* r = my_ring;
+
+    if(r)
+	return r;
+    pthread_once(&ring_once, ring_key_init);
+    r = calloc(1, sizeof(*r));
+    if(!r)
+	return NULL;
+    r->tid = syscall(SYS_gettid);
+    if(pthread_setspecific(ring_key, r)){
+	free(r);
+	return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&lock);
+    my_ring = r;
+    return r;
+}
+
+static void print_ent(long tid, const struct bblog_ent* e){
+    struct tm tm;
+
+    localtime_r(&e->ts.tv_sec, &tm);
+    fprintf(stderr, "%02d:%02d:%02d.%03ld fusec[%ld] %s: %s\n",
+	    tm.tm_hour, tm.tm_min, tm.tm_sec, e->ts.tv_nsec / 1000000,
+	    tid, level_names[e->level], e->msg);
+}
+
+/* Called with lock held; frees rings of exited threads once empty */
+static void drain_all(void){
+    struct bblog_ring** pp = &rings;
+    struct bblog_ring* r;
+    unsigned int head, tail;
+    unsigned long dropped;
+    int dead;
+
+    while((r = *pp)){
+	dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	for(; head != tail; head++)
+	    print_ent(r->tid, &r->ent[head % BBLOG_RING]);
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+	if(dropped)
+	    fprintf(stderr, "fusec[%ld] WARN: %lu log messages dropped\n",
+		    r->tid, dropped);
+	if(dead){
+	    *pp = r->next;
+	    free(r);
+	}
+	else
+	    pp = &r->next;
+    }
+    fflush(stderr);
+}
+
+static void* drain_thread(void* arg){
+    struct timespec ts;
+
+    (void) arg;
+    pthread_mutex_lock(&lock);
+    while(!stop){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += BBLOG_DRAIN_MS * 1000000L;
+	if(ts.tv_nsec >= 1000000000L){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&wake, &lock, &ts);
+	drain_all();
+    }
+    drain_all();
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void bblog_write(int level, const char* fmt, ...){
+    struct bblog_ring* r = NULL;
+    struct bblog_ent* e;
+    struct bblog_ent direct;
+    unsigned int tail;
+    va_list ap;
+
+    if(level < BBLOG_ERR)
+	level = BBLOG_ERR;
+    if(level > BBLOG_DEBUG)
+	level = BBLOG_DEBUG;
+    if(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+	r = get_ring();
+    if(r){
+	tail = r->tail;
+	if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= BBLOG_RING){
+	    __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+	    return;
+	}
+	e = &r->ent[tail % BBLOG_RING];
+    }
+    else
+	e = &direct;
+
+    clock_gettime(CLOCK_REALTIME, &e->ts);
+    e->level = level;
+    va_start(ap, fmt);
+    vsnprintf(e->msg, sizeof(e->msg), fmt, ap);
+    va_end(ap);
+
+    if(!r){
+	print_ent(syscall(SYS_gettid), e);
+	return;
+    }
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    /* errors should not sit in the ring; a lost wakeup only delays them */
+    if(level <= BBLOG_WARN)
+	pthread_cond_signal(&wake);
+}
+
+static void level_signal(int sig){
+    int lvl = __atomic_load_n(&bblog_level, __ATOMIC_RELAXED);
+
+    if(sig == SIGUSR1 && lvl < BBLOG_DEBUG)
+	lvl++;
+    else if(sig == SIGUSR2 && lvl > BBLOG_ERR)
+	lvl--;
+    __atomic_store_n(&bblog_level, lvl, __ATOMIC_RELAXED);
+}
+
+int bblog_start(void){
+    struct sigaction sa;
+    int ret;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = level_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGUSR1, &sa, NULL) < 0 || sigaction(SIGUSR2, &sa, NULL) < 0)
+	return -errno;
+
+    stop = 0;
+    ret = pthread_create(&drainer, NULL, drain_thread, NULL);
+    if(ret)
+	return -ret;
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void bblog_stop(void){
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+	return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&lock);
+    stop = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(drainer, NULL);
+}
@@ -0,0 +1,60 @@
+/* bblog.h
+ * Leveled logging for fusec that stays off the request path
+ *
+ * bblog() checks the level before doing anything else, so a disabled
+ * message costs one load; messages above BBLOG_MAX_LEVEL are compiled
+ * out altogether. An enabled message is formatted into a ring buffer
+ * owned by the calling thread (no locks, no stdio) and written to stderr
+ * by a background thread. A full ring drops messages rather than wait;
+ * the drops are counted and reported.
+ *
+ * Before bblog_start() (and after bblog_stop()) messages go straight to
+ * stderr.
+ *
+ * The level can be changed at runtime: SIGUSR1 raises it by one,
+ * SIGUSR2 lowers it.
+ *
+ */
+
+#ifndef BBLOG_H
+#define BBLOG_H
+
+#define BBLOG_ERR 0
+#define BBLOG_WARN 1
+#define BBLOG_INFO 2
+#define BBLOG_DEBUG 3
+
+/* most verbose level compiled in (-DBBLOG_MAX_LEVEL=3 for debug messages) */
+#ifndef BBLOG_MAX_LEVEL
+#define BBLOG_MAX_LEVEL BBLOG_INFO
+#endif
+
+/* current level; messages above it are skipped */
+extern int bblog_level;
+
+#define bblog(lvl, ...)							\
+    do {								\
+	if((lvl) <= BBLOG_MAX_LEVEL &&					\
+	   (lvl) <= __atomic_load_n(&bblog_level, __ATOMIC_RELAXED))	\
+	    bblog_write((lvl), __VA_ARGS__);				\
+    } while(0)
+
+/* void bblog_write(int level, const char* fmt, ...)
+ * Purpose: Log a message unconditionally (use bblog())
+ */
+extern void bblog_write(int level, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* int bblog_start(void)
+ * Purpose: Start the drain thread and install the SIGUSR1/SIGUSR2
+ *          handlers. Call after daemonizing.
+ * Return: 0 on success, -errno on error (logging stays synchronous)
+ */
+extern int bblog_start(void);
+
+/* void bblog_stop(void)
+ * Purpose: Write out everything logged so far and stop the drain thread
+ */
+extern void bblog_stop(void);
+
+#endif
@@ -0,0 +1,1063 @@
+/* dedup.c
+ * Content-addressed, deduplicated block store for fusec
+ *
+ * See dedup.h for the on-disk layout
+ *
+ * The index is a hash table from id to slot and reference count, under
+ * one mutex. A block that is new to the store is entered before its slot
+ * has been written (so two writers of the same block share it), but is
+ * not ready until then: anyone else who wants it waits.
+ *
+ * Readers take no file lock. A block can be dropped and its slot reused
+ * while a reader is between the map and the store, which is why every
+ * read is checked against its id and retried on a mismatch.
+ *
+ * A map update is pending in the write-back state until the journal is
+ * synced (writeback_commit()), but the blocks it adds to the store are
+ * written to their slots right away, ahead of their journal records. That
+ * is safe as long as a free slot is one that nothing left after a crash
+ * can refer to, so the references an update drops are only released once
+ * its map record is durable (struct dd_drop).
+ *
+ * Index file (host byte order):
+ *   0  "FCDDIDX1"   8  u32 clean   12 u32 unused
+ *  16  u64 slots   24  u64 entries
+ *  32  entries of id, u64 slot, u64 references
+ *
+ */
+
+#ifdef linux
+/* For pread() and fdopendir() */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "bblog.h"
+#include "dedup.h"
+
+#define DEDUP_STORE ".fusec-dedup-store"
+#define DEDUP_INDEX ".fusec-dedup-index"
+#define DEDUP_INDEX_TMP ".fusec-dedup-index.tmp"
+#define DEDUP_HDRLEN 32
+#define DEDUP_ENTLEN (DEDUP_IDLEN + 16)
+/* journal records hold at most this many extents */
+#define DEDUP_TXN_EXT 8
+/* a read that keeps racing with slot reuse gives up after this */
+#define DEDUP_RETRIES 8
+
+static const char DEDUP_MAGIC[8] = { 'F', 'C', 'D', 'D', 'I', 'D', 'X', '1' };
+
+struct dd_ent {
+    unsigned char id[DEDUP_IDLEN];
+    uint64_t slot;
+    uint64_t refs;
+    int ready;			/* slot written */
+    const void* owner;		/* update writing it, while not ready */
+    struct dd_ent* next;
+};
+
+/* Blocks an update no longer refers to, released once the journal is
+   durable up to its map record */
+struct dd_drop {
+    uint64_t seq;
+    size_t n;
+    struct dd_drop* next;
+    unsigned char ids[];
+};
+
+struct dedup {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct dd_ent** tab;
+    size_t nbuckets;
+    size_t nent;
+    uint64_t nslots;
+    uint64_t* free;		/* stack of unused slots below nslots */
+    size_t nfree, freecap;
+    int rootfd;
+    int storefd;
+    int dirty;			/* the index may not match the maps */
+    struct dd_drop* drops;	/* oldest first */
+    struct dd_drop* lastdrop;
+    struct journal* j;
+    unsigned char kid[32];
+    unsigned char kenc[32];
+    char* flag;
+    char* value;
+};
+
+static const unsigned char zero_id[DEDUP_IDLEN];
+
+/* map entries are what the write-back state keeps pending */
+static const struct wb_format dd_format = { DEDUP_IDLEN, NULL, NULL };
+
+static int all_zero(const unsigned char* p, size_t len){
+    size_t i;
+    for(i = 0; i < len; i++)
+	if(p[i])
+	    return 0;
+    return 1;
+}
+
+static uint64_t nblocks(uint64_t size){
+    return (size + ENCBLK_SIZE - 1) / ENCBLK_SIZE;
+}
+
+static off_t map_off(uint64_t idx){
+    return ENCBLK_HDRLEN + (off_t)idx * DEDUP_IDLEN;
+}
+
+/* ids are keyed hashes already: their first bytes are as good as any */
+static size_t bucket(const struct dedup* dd, const unsigned char* id){
+    size_t h;
+
+    memcpy(&h, id, sizeof(h));
+    return h & (dd->nbuckets - 1);
+}
+
+static struct dd_ent* find(struct dedup* dd, const unsigned char* id){
+    struct dd_ent* e;
+
+    for(e = dd->tab[bucket(dd, id)]; e; e = e->next)
+	if(!memcmp(e->id, id, DEDUP_IDLEN))
+	    return e;
+    return NULL;
+}
+
+static void insert(struct dedup* dd, struct dd_ent* e){
+    struct dd_ent **tab, *n, *next;
+    size_t i, old = dd->nbuckets;
+
+    if(dd->nent >= 2 * dd->nbuckets){
+	tab = calloc(2 * old, sizeof(*tab));
+	/* without memory the chains just get longer */
+	if(tab){
+	    dd->nbuckets = 2 * old;
+	    for(i = 0; i < old; i++)
+		for(n = dd->tab[i]; n; n = next){
+		    next = n->next;
+		    n->next = tab[bucket(dd, n->id)];
+		    tab[bucket(dd, n->id)] = n;
+		}
+	    free(dd->tab);
+	    dd->tab = tab;
+	}
+    }
+    e->next = dd->tab[bucket(dd, e->id)];
+    dd->tab[bucket(dd, e->id)] = e;
+    dd->nent++;
+}
+
+static void remove_ent(struct dedup* dd, struct dd_ent* e){
+    struct dd_ent** pp = &dd->tab[bucket(dd, e->id)];
+
+    while(*pp != e)
+	pp = &(*pp)->next;
+    *pp = e->next;
+    dd->nent--;
+}
+
+static uint64_t slot_alloc(struct dedup* dd){
+    if(dd->nfree)
+	return dd->free[--dd->nfree];
+    return dd->nslots++;
+}
+
+static void slot_free(struct dedup* dd, uint64_t slot){
+    uint64_t* tmp;
+
+    if(dd->nfree == dd->freecap){
+	tmp = realloc(dd->free, (dd->freecap ? 2 * dd->freecap : 64) * sizeof(*tmp));
+	/* leaked until the next rebuild */
+	if(!tmp){
+	    dd->dirty = 1;
+	    return;
+	}
+	dd->free = tmp;
+	dd->freecap = dd->freecap ? 2 * dd->freecap : 64;
+    }
+    dd->free[dd->nfree++] = slot;
+}
+
+/* Called with lock held */
+static void unref_locked(struct dedup* dd, const unsigned char* id){
+    struct dd_ent* e;
+
+    if(!memcmp(id, zero_id, DEDUP_IDLEN))
+	return;
+    e = find(dd, id);
+    if(!e){
+	bblog(BBLOG_ERR, "dedup: dropping a block that is not in the store");
+	dd->dirty = 1;
+	return;
+    }
+    if(--e->refs)
+	return;
+    remove_ent(dd, e);
+    slot_free(dd, e->slot);
+    free(e);
+}
+
+static int make_id(const struct dedup* dd, const unsigned char* plain,
+		   unsigned char id[DEDUP_IDLEN]){
+    unsigned int len = DEDUP_IDLEN;
+
+    if(!HMAC(EVP_sha256(), dd->kid, sizeof(dd->kid), plain, ENCBLK_SIZE, id, &len) ||
+       len != DEDUP_IDLEN)
+	return -EIO;
+    return 0;
+}
+
+/* slot image: IV (start of the id), then AES-256-CTR ciphertext; the
+   same transform both ways */
+static int ctr(EVP_CIPHER_CTX* ctx, const struct dedup* dd, const unsigned char* iv,
+	       const unsigned char* in, unsigned char* out){
+    int outlen;
+
+    if(!EVP_CipherInit_ex(ctx, EVP_aes_256_ctr(), NULL, dd->kenc, iv, 1))
+	return -EIO;
+    if(!EVP_CipherUpdate(ctx, out, &outlen, in, ENCBLK_SIZE) || outlen != ENCBLK_SIZE)
+	return -EIO;
+    return 0;
+}
+
+static int seal(EVP_CIPHER_CTX* ctx, const struct dedup* dd, const unsigned char* id,
+		const unsigned char* plain, unsigned char* disk){
+    memcpy(disk, id, ENCBLK_IVLEN);
+    return ctr(ctx, dd, disk, plain, disk + ENCBLK_IVLEN);
+}
+
+/* Decrypt a slot image and check that it is block id; -EAGAIN if not */
+static int unseal(EVP_CIPHER_CTX* ctx, const struct dedup* dd, const unsigned char* id,
+		  const unsigned char* disk, unsigned char* plain){
+    unsigned char check[DEDUP_IDLEN];
+    int res;
+
+    if(memcmp(disk, id, ENCBLK_IVLEN))
+	return -EAGAIN;
+    res = ctr(ctx, dd, disk, disk + ENCBLK_IVLEN, plain);
+    if(res == 0)
+	res = make_id(dd, plain, check);
+    if(res == 0 && memcmp(check, id, DEDUP_IDLEN))
+	res = -EAGAIN;
+    return res;
+}
+
+/* Fetch block id from the store; -EAGAIN if it is not (or no longer)
+   there */
+static int get_block(struct dedup* dd, EVP_CIPHER_CTX* ctx, const unsigned char* id,
+		     unsigned char* plain){
+    unsigned char disk[ENCBLK_DISK];
+    struct dd_ent* e;
+    uint64_t slot = 0;
+    int found = 0;
+    ssize_t n;
+
+    if(!memcmp(id, zero_id, DEDUP_IDLEN)){
+	memset(plain, 0, ENCBLK_SIZE);
+	return 0;
+    }
+    pthread_mutex_lock(&dd->lock);
+    e = find(dd, id);
+    if(e && e->ready){
+	slot = e->slot;
+	found = 1;
+    }
+    pthread_mutex_unlock(&dd->lock);
+    if(!found)
+	return -EAGAIN;
+    n = pread(dd->storefd, disk, ENCBLK_DISK, (off_t)slot * ENCBLK_DISK);
+    if(n < 0)
+	return -errno;
+    if(n != ENCBLK_DISK)
+	return -EAGAIN;
+    return unseal(ctx, dd, id, disk, plain);
+}
+
+/* Read n map entries from first on, pending ones from ov; past the end of
+   the map reads as holes */
+static int read_ids(int fd, const struct encblk_overlay* ov, uint64_t first, size_t n,
+		    unsigned char* ids){
+    size_t len = n * DEDUP_IDLEN, done = 0, i;
+    ssize_t r;
+
+    while(done < len){
+	r = pread(fd, ids + done, len - done, map_off(first) + done);
+	if(r < 0){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if(r == 0)
+	    break;
+	done += r;
+    }
+    memset(ids + done, 0, len - done);
+    if(ov)
+	for(i = 0; i < n; i++)
+	    ov->lookup(ov->arg, first + i, ids + i * DEDUP_IDLEN);
+    return 0;
+}
+
+/* Read block idx of the file, following the map again if the store
+   changed under it */
+static int load_block(struct dedup* dd, EVP_CIPHER_CTX* ctx, int fd,
+		      const struct encblk_overlay* ov, uint64_t idx,
+		      unsigned char* id, unsigned char* plain){
+    int res, tries;
+
+    for(tries = 0; tries < DEDUP_RETRIES; tries++){
+	if(tries){
+	    res = read_ids(fd, ov, idx, 1, id);
+	    if(res < 0)
+		return res;
+	}
+	res = get_block(dd, ctx, id, plain);
+	if(res != -EAGAIN)
+	    return res;
+    }
+    bblog(BBLOG_ERR, "dedup: block %llu does not match its id",
+	  (unsigned long long)idx);
+    return -EIO;
+}
+
+extern ssize_t dedup_read(struct dedup* dd, int fd, const struct encblk_overlay* ov,
+			  const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset){
+    unsigned char plain[ENCBLK_SIZE];
+    unsigned char* ids;
+    EVP_CIPHER_CTX* ctx;
+    uint64_t first, idx, n;
+    size_t done = 0, boff, len;
+    int res;
+
+    if(offset < 0)
+	return -EINVAL;
+    if((uint64_t)offset >= hdr->size || size == 0)
+	return 0;
+    if(size > hdr->size - offset)
+	size = hdr->size - offset;
+
+    first = offset / ENCBLK_SIZE;
+    n = nblocks(offset + size) - first;
+    ids = malloc(n * DEDUP_IDLEN);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ids || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    res = read_ids(fd, ov, first, n, ids);
+    if(res < 0)
+	goto out;
+    for(idx = first; done < size; idx++){
+	boff = (offset + done) % ENCBLK_SIZE;
+	len = ENCBLK_SIZE - boff;
+	if(len > size - done)
+	    len = size - done;
+	res = load_block(dd, ctx, fd, ov, idx, ids + (idx - first) * DEDUP_IDLEN, plain);
+	if(res < 0)
+	    goto out;
+	memcpy(buf + done, plain + boff, len);
+	done += len;
+    }
+    res = 0;
+ out:
+    EVP_CIPHER_CTX_free(ctx);
+    free(ids);
+    return res < 0 ? res : (ssize_t)done;
+}
+
+/* Take a reference on block id for the update owner. *slot is set, and
+   *isnew if the update has to write the slot. */
+static void ref(struct dedup* dd, const void* owner, const unsigned char* id,
+		struct dd_ent* fresh, uint64_t* slot, int* isnew){
+    struct dd_ent* e;
+
+    pthread_mutex_lock(&dd->lock);
+    while((e = find(dd, id)) && !e->ready && e->owner != owner)
+	pthread_cond_wait(&dd->ready, &dd->lock);
+    if(e){
+	e->refs++;
+	*slot = e->slot;
+	*isnew = 0;
+    }
+    else{
+	memcpy(fresh->id, id, DEDUP_IDLEN);
+	fresh->slot = slot_alloc(dd);
+	fresh->refs = 1;
+	fresh->ready = 0;
+	fresh->owner = owner;
+	insert(dd, fresh);
+	*slot = fresh->slot;
+	*isnew = 1;
+    }
+    pthread_mutex_unlock(&dd->lock);
+}
+
+/* Mark the blocks owner entered as written (or given up on) */
+static void publish(struct dedup* dd, const void* owner, const unsigned char* ids, size_t n){
+    struct dd_ent* e;
+    size_t i;
+
+    pthread_mutex_lock(&dd->lock);
+    for(i = 0; i < n; i++){
+	e = find(dd, ids + i * DEDUP_IDLEN);
+	if(e && e->owner == owner){
+	    e->ready = 1;
+	    e->owner = NULL;
+	}
+    }
+    pthread_cond_broadcast(&dd->ready);
+    pthread_mutex_unlock(&dd->lock);
+}
+
+static void unref(struct dedup* dd, const unsigned char* ids, size_t n){
+    size_t i;
+
+    pthread_mutex_lock(&dd->lock);
+    for(i = 0; i < n; i++)
+	unref_locked(dd, ids + i * DEDUP_IDLEN);
+    pthread_cond_broadcast(&dd->ready);
+    pthread_mutex_unlock(&dd->lock);
+}
+
+/* Release the blocks of updates whose map records are durable by now */
+static void reap(struct dedup* dd){
+    uint64_t synced = journal_synced_seq(dd->j);
+    struct dd_drop* dr;
+    size_t i;
+
+    pthread_mutex_lock(&dd->lock);
+    while((dr = dd->drops) && dr->seq <= synced){
+	dd->drops = dr->next;
+	for(i = 0; i < dr->n; i++)
+	    unref_locked(dd, dr->ids + i * DEDUP_IDLEN);
+	free(dr);
+    }
+    if(!dd->drops)
+	dd->lastdrop = NULL;
+    pthread_mutex_unlock(&dd->lock);
+}
+
+/* Log an update of a dedup file and keep it pending: new header hdr (the
+ * old size was oldsize) and the n plaintext blocks from first on.
+ * Everything beyond the new size is dropped. */
+static int commit(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+		  const char* path, const struct encblk_hdr* hdr, uint64_t oldsize,
+		  uint64_t first, size_t n, const unsigned char* plain){
+    const struct encblk_overlay* ov = writeback_overlay(f);
+    unsigned char hbuf[ENCBLK_HDRLEN];
+    struct journal_ext mext[2], *sext = NULL;
+    struct journal_txn* txn = NULL;
+    struct stat fst;
+    unsigned char *ids = NULL, *disk = NULL;
+    struct dd_drop* drop = NULL;
+    struct dd_ent** fresh = NULL;
+    EVP_CIPHER_CTX* ctx = NULL;
+    uint64_t newblk = nblocks(hdr->size), oldblk = nblocks(oldsize);
+    uint64_t cut = 0, seq, slot;
+    size_t i, k = 0, nsext = 0, ntxn = 0, taken = 0, nold;
+    int isnew, res;
+    char owner;
+
+    /* slots whose blocks were let go of by now can be reused */
+    reap(dd);
+
+    /* old ids: the blocks rewritten, then the ones cut off */
+    if(newblk < oldblk)
+	cut = oldblk - newblk;
+    nold = n + cut;
+    ids = malloc(n * DEDUP_IDLEN + 1);
+    drop = malloc(sizeof(*drop) + nold * DEDUP_IDLEN);
+    disk = malloc(n * ENCBLK_DISK + 1);
+    sext = malloc(n * sizeof(*sext) + 1);
+    txn = malloc((n / DEDUP_TXN_EXT + 2) * sizeof(*txn));
+    fresh = calloc(n + 1, sizeof(*fresh));
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ids || !drop || !disk || !sext || !txn || !fresh || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    for(i = 0; i < n; i++){
+	fresh[i] = malloc(sizeof(**fresh));
+	if(!fresh[i]){
+	    res = -ENOMEM;
+	    goto out;
+	}
+    }
+    /* a file whose names are gone is not replayed (writeback_forget()) */
+    if(fstat(fd, &fst) == -1){
+	res = -errno;
+	goto out;
+    }
+    drop->n = nold;
+    res = read_ids(fd, ov, first, n, drop->ids);
+    if(res == 0 && cut)
+	res = read_ids(fd, ov, newblk, cut, drop->ids + n * DEDUP_IDLEN);
+    if(res < 0)
+	goto out;
+    for(i = 0; i < n; i++)
+	if(first + i >= oldblk)
+	    memset(drop->ids + i * DEDUP_IDLEN, 0, DEDUP_IDLEN);
+
+    /* hash, and encrypt what the store does not have yet */
+    for(i = 0; i < n; i++){
+	unsigned char* id = ids + i * DEDUP_IDLEN;
+	const unsigned char* p = plain + i * ENCBLK_SIZE;
+
+	if(all_zero(p, ENCBLK_SIZE)){
+	    memset(id, 0, DEDUP_IDLEN);
+	    continue;
+	}
+	res = make_id(dd, p, id);
+	if(res < 0)
+	    goto undo;
+	ref(dd, &owner, id, fresh[i], &slot, &isnew);
+	taken = i + 1;
+	if(!isnew)
+	    continue;
+	fresh[i] = NULL;
+	res = seal(ctx, dd, id, p, disk + k * ENCBLK_DISK);
+	if(res < 0)
+	    goto undo;
+	/* new slots are mostly appended: merge neighbours */
+	if(nsext && sext[nsext - 1].off + sext[nsext - 1].len == slot * ENCBLK_DISK &&
+	   (const unsigned char*)sext[nsext - 1].data + sext[nsext - 1].len ==
+	   disk + k * ENCBLK_DISK)
+	    sext[nsext - 1].len += ENCBLK_DISK;
+	else{
+	    sext[nsext].off = slot * ENCBLK_DISK;
+	    sext[nsext].len = ENCBLK_DISK;
+	    sext[nsext].data = disk + k * ENCBLK_DISK;
+	    nsext++;
+	}
+	k++;
+    }
+
+    /* the store first, so replay never finds a map entry without its block */
+    for(i = 0; i < nsext; i += txn[ntxn].next, ntxn++){
+	txn[ntxn].path = DEDUP_STORE;
+	txn[ntxn].ino = 0;
+	txn[ntxn].disklen = -1;
+	txn[ntxn].xattr_name = NULL;
+	txn[ntxn].xattr_value = NULL;
+	txn[ntxn].ext = sext + i;
+	txn[ntxn].next = nsext - i < DEDUP_TXN_EXT ? nsext - i : DEDUP_TXN_EXT;
+    }
+    encblk_hdr_encode(hdr, hbuf);
+    txn[ntxn].next = 0;
+    if(n){
+	mext[txn[ntxn].next].off = map_off(first);
+	mext[txn[ntxn].next].len = n * DEDUP_IDLEN;
+	mext[txn[ntxn].next].data = ids;
+	txn[ntxn].next++;
+    }
+    mext[txn[ntxn].next].off = 0;
+    mext[txn[ntxn].next].len = ENCBLK_HDRLEN;
+    mext[txn[ntxn].next].data = hbuf;
+    txn[ntxn].next++;
+    txn[ntxn].ext = mext;
+    while(*path == '/')
+	path++;
+    txn[ntxn].path = fst.st_nlink ? path : "";
+    txn[ntxn].ino = fst.st_nlink ? fst.st_ino : 0;
+    txn[ntxn].disklen = map_off(newblk);
+    txn[ntxn].xattr_name = NULL;
+    txn[ntxn].xattr_value = NULL;
+    ntxn++;
+    res = writeback_commit(wb, f, fd, &dd_format, txn, ntxn, hdr, first, n, ids, &seq);
+    if(res < 0){
+	/* the store records alone are harmless: nothing points at them */
+	goto undo;
+    }
+
+    /* logged: from here on the update stands, whatever fails. New blocks
+       go to their free slots without waiting for the journal. */
+    for(i = 0; res == 0 && i + 1 < ntxn; i++)
+	res = journal_apply(dd->storefd, &txn[i]);
+    publish(dd, &owner, ids, n);
+    pthread_mutex_lock(&dd->lock);
+    if(res < 0){
+	/* replayed at the next mount; the counts are rebuilt then */
+	dd->dirty = 1;
+    }
+    if(nold){
+	drop->seq = seq;
+	drop->next = NULL;
+	if(dd->lastdrop)
+	    dd->lastdrop->next = drop;
+	else
+	    dd->drops = drop;
+	dd->lastdrop = drop;
+	drop = NULL;
+    }
+    pthread_mutex_unlock(&dd->lock);
+    goto out;
+
+ undo:
+    publish(dd, &owner, ids, taken);
+    unref(dd, ids, taken);
+ out:
+    if(fresh){
+	for(i = 0; i < n; i++)
+	    free(fresh[i]);
+	free(fresh);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    free(txn);
+    free(sext);
+    free(disk);
+    free(drop);
+    free(ids);
+    return res;
+}
+
+extern int dedup_write(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+		       const char* path, const char* buf, size_t size, off_t offset){
+    const struct encblk_overlay* ov = writeback_overlay(f);
+    struct encblk_hdr hdr;
+    unsigned char *plain = NULL, *ids = NULL;
+    EVP_CIPHER_CTX* ctx = NULL;
+    uint64_t oldsize, first, n, idx;
+    int res;
+
+    if(offset < 0)
+	return -EINVAL;
+    if(size == 0)
+	return 0;
+    res = writeback_hdr(f, fd, &hdr);
+    if(res < 0)
+	return res;
+    oldsize = hdr.size;
+    first = offset / ENCBLK_SIZE;
+    n = nblocks(offset + size) - first;
+    plain = malloc(n * ENCBLK_SIZE);
+    ids = malloc(n * DEDUP_IDLEN);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!plain || !ids || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    res = read_ids(fd, ov, first, n, ids);
+    if(res < 0)
+	goto out;
+    /* only the partly covered end blocks have old contents to keep */
+    memset(plain, 0, n * ENCBLK_SIZE);
+    if(offset % ENCBLK_SIZE)
+	res = load_block(dd, ctx, fd, ov, first, ids, plain);
+    idx = first + n - 1;
+    if(res == 0 && (offset + size) % ENCBLK_SIZE && (idx != first || !(offset % ENCBLK_SIZE)))
+	res = load_block(dd, ctx, fd, ov, idx, ids + (n - 1) * DEDUP_IDLEN,
+			 plain + (n - 1) * ENCBLK_SIZE);
+    if(res < 0)
+	goto out;
+    memcpy(plain + offset % ENCBLK_SIZE, buf, size);
+    if((uint64_t)offset + size > hdr.size)
+	hdr.size = offset + size;
+    res = commit(dd, wb, f, fd, path, &hdr, oldsize, first, n, plain);
+ out:
+    EVP_CIPHER_CTX_free(ctx);
+    free(ids);
+    free(plain);
+    return res;
+}
+
+extern int dedup_truncate(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+			  const char* path, uint64_t size){
+    const struct encblk_overlay* ov = writeback_overlay(f);
+    struct encblk_hdr hdr;
+    unsigned char plain[ENCBLK_SIZE];
+    unsigned char id[DEDUP_IDLEN];
+    EVP_CIPHER_CTX* ctx;
+    uint64_t oldsize, last;
+    int res;
+
+    res = writeback_hdr(f, fd, &hdr);
+    if(res < 0)
+	return res;
+    oldsize = hdr.size;
+    hdr.size = size;
+    /* growing only adds holes; shrinking into a block zeroes its tail */
+    if(size >= oldsize || size % ENCBLK_SIZE == 0)
+	return commit(dd, wb, f, fd, path, &hdr, oldsize, 0, 0, NULL);
+
+    last = size / ENCBLK_SIZE;
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx)
+	return -ENOMEM;
+    res = read_ids(fd, ov, last, 1, id);
+    if(res == 0)
+	res = load_block(dd, ctx, fd, ov, last, id, plain);
+    EVP_CIPHER_CTX_free(ctx);
+    if(res < 0)
+	return res;
+    memset(plain + size % ENCBLK_SIZE, 0, ENCBLK_SIZE - size % ENCBLK_SIZE);
+    return commit(dd, wb, f, fd, path, &hdr, oldsize, last, 1, plain);
+}
+
+extern void dedup_forget(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+			 const char* path){
+    struct encblk_hdr hdr;
+    uint64_t oldsize;
+
+    /* emptied like any truncate, its blocks go once that is durable */
+    if((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY && writeback_hdr(f, fd, &hdr) == 0){
+	oldsize = hdr.size;
+	hdr.size = 0;
+	if(commit(dd, wb, f, fd, path, &hdr, oldsize, 0, 0, NULL) == 0)
+	    return;
+    }
+
+    /* the blocks stay referenced until the next rebuild */
+    pthread_mutex_lock(&dd->lock);
+    dd->dirty = 1;
+    pthread_mutex_unlock(&dd->lock);
+}
+
+/* Rebuild: count the references in the map of the file open on fd */
+static void count_file(struct dedup* dd, int fd){
+    struct encblk_hdr hdr;
+    unsigned char ids[64 * DEDUP_IDLEN];
+    struct dd_ent* e;
+    uint64_t n, i, chunk, k;
+
+    if(encblk_read_hdr(fd, &hdr) < 0)
+	return;
+    n = nblocks(hdr.size);
+    for(i = 0; i < n; i += chunk){
+	chunk = n - i < 64 ? n - i : 64;
+	if(read_ids(fd, NULL, i, chunk, ids) < 0)
+	    return;
+	for(k = 0; k < chunk; k++){
+	    if(!memcmp(ids + k * DEDUP_IDLEN, zero_id, DEDUP_IDLEN))
+		continue;
+	    e = find(dd, ids + k * DEDUP_IDLEN);
+	    if(e)
+		e->refs++;
+	    else
+		bblog(BBLOG_ERR, "dedup: block %llu of a file is missing from the store",
+		      (unsigned long long)(i + k));
+	}
+    }
+}
+
+/* Rebuild: find every dedup file below the directory open on dirfd
+   (closed here) */
+static void count_dir(struct dedup* dd, int dirfd){
+    char val[16];
+    struct dirent* de;
+    struct stat st;
+    ssize_t len;
+    DIR* dir;
+    int fd;
+
+    dir = fdopendir(dirfd);
+    if(!dir){
+	close(dirfd);
+	return;
+    }
+    while((de = readdir(dir))){
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	if(fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+	    continue;
+	if(S_ISDIR(st.st_mode)){
+	    fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	    if(fd != -1)
+		count_dir(dd, fd);
+	}
+	else if(S_ISREG(st.st_mode)){
+	    fd = openat(dirfd, de->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	    if(fd == -1)
+		continue;
+	    len = fgetxattr(fd, dd->flag, val, sizeof(val) - 1);
+	    if(len > 0){
+		val[len] = '\0';
+		if(!strcmp(val, dd->value))
+		    count_file(dd, fd);
+	    }
+	    close(fd);
+	}
+    }
+    closedir(dir);
+}
+
+/* Rebuild the index from the store and every map */
+static int rebuild(struct dedup* dd){
+    unsigned char disk[ENCBLK_DISK], plain[ENCBLK_SIZE], id[DEDUP_IDLEN];
+    EVP_CIPHER_CTX* ctx;
+    struct dd_ent *e, *next;
+    struct stat st;
+    uint64_t slot;
+    size_t i;
+    int fd;
+
+    if(fstat(dd->storefd, &st) == -1)
+	return -errno;
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx)
+	return -ENOMEM;
+    dd->nslots = (st.st_size + ENCBLK_DISK - 1) / ENCBLK_DISK;
+    for(slot = 0; slot < dd->nslots; slot++){
+	if(pread(dd->storefd, disk, ENCBLK_DISK, (off_t)slot * ENCBLK_DISK) != ENCBLK_DISK ||
+	   all_zero(disk, ENCBLK_DISK) ||
+	   ctr(ctx, dd, disk, disk + ENCBLK_IVLEN, plain) < 0 ||
+	   make_id(dd, plain, id) < 0 ||
+	   memcmp(id, disk, ENCBLK_IVLEN) || find(dd, id)){
+	    slot_free(dd, slot);
+	    continue;
+	}
+	e = calloc(1, sizeof(*e));
+	if(!e){
+	    EVP_CIPHER_CTX_free(ctx);
+	    return -ENOMEM;
+	}
+	memcpy(e->id, id, DEDUP_IDLEN);
+	e->slot = slot;
+	e->ready = 1;
+	insert(dd, e);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    /* not dup(): that would share (and move) rootfd's directory offset */
+    fd = openat(dd->rootfd, ".", O_RDONLY | O_DIRECTORY);
+    if(fd == -1)
+	return -errno;
+    count_dir(dd, fd);
+
+    for(i = 0; i < dd->nbuckets; i++)
+	for(e = dd->tab[i]; e; e = next){
+	    next = e->next;
+	    if(e->refs == 0){
+		remove_ent(dd, e);
+		slot_free(dd, e->slot);
+		free(e);
+	    }
+	}
+    return 0;
+}
+
+static uint64_t get64(const unsigned char* p){ uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t get32(const unsigned char* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static void put64(unsigned char* p, uint64_t v){ memcpy(p, &v, 8); }
+static void put32(unsigned char* p, uint32_t v){ memcpy(p, &v, 4); }
+
+/* Load a cleanly saved index; -EAGAIN if there is none to trust */
+static int load_index(struct dedup* dd){
+    unsigned char hdr[DEDUP_HDRLEN], ent[DEDUP_ENTLEN];
+    unsigned char* used = NULL;
+    struct dd_ent* e;
+    uint64_t nent, i, slot;
+    FILE* fp;
+    int fd, res = -EAGAIN;
+
+    fd = openat(dd->rootfd, DEDUP_INDEX, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1)
+	return -EAGAIN;
+    fp = fdopen(fd, "r+");
+    if(!fp){
+	close(fd);
+	return -EAGAIN;
+    }
+    if(fread(hdr, DEDUP_HDRLEN, 1, fp) != 1 || memcmp(hdr, DEDUP_MAGIC, 8) ||
+       get32(hdr + 8) != 1)
+	goto out;
+    dd->nslots = get64(hdr + 16);
+    nent = get64(hdr + 24);
+    used = calloc(dd->nslots / 8 + 1, 1);
+    if(!used){
+	res = -ENOMEM;
+	goto out;
+    }
+    for(i = 0; i < nent; i++){
+	if(fread(ent, DEDUP_ENTLEN, 1, fp) != 1)
+	    goto out;
+	slot = get64(ent + DEDUP_IDLEN);
+	if(slot >= dd->nslots || used[slot / 8] & (1 << slot % 8))
+	    goto out;
+	used[slot / 8] |= 1 << slot % 8;
+	e = calloc(1, sizeof(*e));
+	if(!e){
+	    res = -ENOMEM;
+	    goto out;
+	}
+	memcpy(e->id, ent, DEDUP_IDLEN);
+	e->slot = slot;
+	e->refs = get64(ent + DEDUP_IDLEN + 8);
+	e->ready = 1;
+	insert(dd, e);
+    }
+    for(slot = 0; slot < dd->nslots; slot++)
+	if(!(used[slot / 8] & (1 << slot % 8)))
+	    slot_free(dd, slot);
+
+    /* from now on only a clean unmount makes it valid again */
+    put32(hdr + 8, 0);
+    if(fseek(fp, 0, SEEK_SET) || fwrite(hdr, DEDUP_HDRLEN, 1, fp) != 1 ||
+       fflush(fp) || fdatasync(fd) == -1)
+	res = -EIO;
+    else
+	res = 0;
+ out:
+    free(used);
+    fclose(fp);
+    return res;
+}
+
+static int save_index(struct dedup* dd){
+    unsigned char hdr[DEDUP_HDRLEN], ent[DEDUP_ENTLEN];
+    struct dd_ent* e;
+    FILE* fp;
+    size_t i;
+    int fd, ok;
+
+    fd = openat(dd->rootfd, DEDUP_INDEX_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+    if(fd == -1)
+	return -errno;
+    fp = fdopen(fd, "w");
+    if(!fp){
+	close(fd);
+	return -ENOMEM;
+    }
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, DEDUP_MAGIC, 8);
+    put32(hdr + 8, 1);
+    put64(hdr + 16, dd->nslots);
+    put64(hdr + 24, dd->nent);
+    ok = fwrite(hdr, DEDUP_HDRLEN, 1, fp) == 1;
+    for(i = 0; ok && i < dd->nbuckets; i++)
+	for(e = dd->tab[i]; ok && e; e = e->next){
+	    memcpy(ent, e->id, DEDUP_IDLEN);
+	    put64(ent + DEDUP_IDLEN, e->slot);
+	    put64(ent + DEDUP_IDLEN + 8, e->refs);
+	    ok = fwrite(ent, DEDUP_ENTLEN, 1, fp) == 1;
+	}
+    ok = ok && fflush(fp) == 0 && fsync(fd) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    /* the store has to be on disk before an index pointing into it */
+    ok = ok && fsync(dd->storefd) == 0;
+    if(!ok || renameat(dd->rootfd, DEDUP_INDEX_TMP, dd->rootfd, DEDUP_INDEX) == -1){
+	unlinkat(dd->rootfd, DEDUP_INDEX_TMP, 0);
+	return -EIO;
+    }
+    fsync(dd->rootfd);
+    return 0;
+}
+
+static void free_index(struct dedup* dd){
+    struct dd_ent *e, *next;
+    size_t i;
+
+    for(i = 0; i < dd->nbuckets; i++)
+	for(e = dd->tab[i]; e; e = next){
+	    next = e->next;
+	    free(e);
+	}
+    memset(dd->tab, 0, dd->nbuckets * sizeof(*dd->tab));
+    dd->nent = 0;
+    dd->nfree = 0;
+    dd->nslots = 0;
+}
+
+extern struct dedup* dedup_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+				const char* flag, const char* value, int create){
+    struct dedup* dd;
+    struct stat st;
+    unsigned int len;
+    int res;
+
+    dd = calloc(1, sizeof(*dd));
+    if(!dd)
+	return NULL;
+    dd->nbuckets = 1024;
+    dd->tab = calloc(dd->nbuckets, sizeof(*dd->tab));
+    dd->flag = strdup(flag);
+    dd->value = strdup(value);
+    if(!dd->tab || !dd->flag || !dd->value){
+	res = -ENOMEM;
+	goto fail;
+    }
+    dd->rootfd = rootfd;
+    dd->j = j;
+    len = sizeof(dd->kid);
+    if(!HMAC(EVP_sha256(), keys->k[ENCBLK_AES256CBC], ENCBLK_KEYLEN,
+	     (const unsigned char*)"fusec dedup id", 14, dd->kid, &len)){
+	res = -EIO;
+	goto fail;
+    }
+    len = sizeof(dd->kenc);
+    if(!HMAC(EVP_sha256(), keys->k[ENCBLK_AES256CBC], ENCBLK_KEYLEN,
+	     (const unsigned char*)"fusec dedup enc", 15, dd->kenc, &len)){
+	res = -EIO;
+	goto fail;
+    }
+    dd->storefd = openat(rootfd, DEDUP_STORE,
+			 O_RDWR | O_NOFOLLOW | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if(dd->storefd == -1){
+	res = -errno;
+	goto fail;
+    }
+    pthread_mutex_init(&dd->lock, NULL);
+    pthread_cond_init(&dd->ready, NULL);
+
+    res = load_index(dd);
+    if(res < 0){
+	free_index(dd);
+	if(fstat(dd->storefd, &st) == 0 && st.st_size)
+	    bblog(BBLOG_WARN, "dedup: index not saved cleanly, rebuilding");
+	res = rebuild(dd);
+	if(res < 0){
+	    close(dd->storefd);
+	    goto fail;
+	}
+	bblog(BBLOG_INFO, "dedup: %zu blocks in %llu slots", dd->nent,
+	      (unsigned long long)dd->nslots);
+    }
+    return dd;
+
+ fail:
+    free(dd->value);
+    free(dd->flag);
+    free(dd->tab);
+    free(dd);
+    errno = -res;
+    return NULL;
+}
+
+extern void dedup_close(struct dedup* dd){
+    struct dd_drop* dr;
+
+    if(!dd)
+	return;
+    /* anything still held back was not made durable */
+    reap(dd);
+    while((dr = dd->drops)){
+	dd->drops = dr->next;
+	free(dr);
+	dd->dirty = 1;
+    }
+    if(!dd->dirty && save_index(dd) < 0)
+	bblog(BBLOG_ERR, "dedup: could not save the index, it is rebuilt at the next mount");
+    free_index(dd);
+    close(dd->storefd);
+    pthread_mutex_destroy(&dd->lock);
+    pthread_cond_destroy(&dd->ready);
+    free(dd->free);
+    free(dd->value);
+    free(dd->flag);
+    free(dd->tab);
+    free(dd);
+}
@@ -0,0 +1,124 @@
+/* dedup.h
+ * Content-addressed, deduplicated block store for fusec
+ *
+ * Files in the dedup format keep no data of their own. After the usual
+ * encblk header they hold a block map: one DEDUP_IDLEN byte id per
+ * ENCBLK_SIZE plaintext block (all zeros for a hole). The id is a keyed
+ * hash (HMAC-SHA256) of the block's plaintext, and names the block in a
+ * store shared by the whole mount, where each distinct block is kept
+ * once:
+ *
+ *   .fusec-dedup-store  slot i at i * ENCBLK_DISK: the first ENCBLK_IVLEN
+ *                       bytes of the id, then the block encrypted with
+ *                       AES-256-CTR using them as IV
+ *
+ * The IV comes from the content (convergent encryption), so equal blocks
+ * encrypt to the same slot no matter which file they are written from;
+ * since the hash is keyed, nobody without the key phrase can tell which
+ * blocks are equal. A read decrypts the slot and checks the hash, which
+ * also catches a slot that was reused under it.
+ *
+ * The mapping from id to slot and each block's reference count are kept
+ * in memory, and saved to .fusec-dedup-index on a clean unmount. After a
+ * crash (or a failed update) they are rebuilt at mount from the store
+ * and the maps of every dedup file.
+ *
+ * Map and store updates go through the journal like block updates. Map
+ * entries stay pending in the write-back state, like a block file's
+ * blocks, until the journal has been synced past them; blocks new to the
+ * store are written to their slots at once. Slots whose last reference
+ * goes away are reused once that is durable; the store file does not
+ * shrink.
+ *
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encblk.h"
+#include "journal.h"
+#include "writeback.h"
+
+#define DEDUP_IDLEN 32
+
+struct dedup;
+
+/* struct dedup* dedup_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+ *                          const char* flag, const char* value, int create)
+ * Purpose: Open the block store. Call after journal_replay(), before
+ *          serving requests.
+ * Args: int rootfd                    : Backing root directory fd
+ *       struct journal* j             : Journal updates are logged in
+ *       const struct encblk_keys* keys : Mount keys the store keys are derived from
+ *       const char* flag, value       : xattr marking dedup files (to find
+ *                                       them for a rebuild)
+ *       int create                    : Create the store if there is none
+ * Return: Store on success, NULL on error (errno set; ENOENT if there is
+ *         no store and create is 0)
+ */
+extern struct dedup* dedup_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+				const char* flag, const char* value, int create);
+
+/* ssize_t dedup_read(struct dedup* dd, int fd, const struct encblk_overlay* ov,
+ *                    const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset)
+ * Purpose: Read a plaintext range of a dedup file
+ * Args: struct dedup* dd                 : Store
+ *       int fd                           : Backing file (the map)
+ *       const struct encblk_overlay* ov  : Pending map entries
+ *                                          (writeback_overlay()), or NULL
+ *       const struct encblk_hdr* hdr     : Its header (writeback_hdr())
+ *       char* buf, size_t size           : Output buffer
+ *       off_t offset                     : Plaintext offset
+ * Return: Number of bytes read (short at EOF), -errno on error
+ */
+extern ssize_t dedup_read(struct dedup* dd, int fd, const struct encblk_overlay* ov,
+			  const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset);
+
+/* int dedup_write(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+ *                 const char* path, const char* buf, size_t size, off_t offset)
+ * Purpose: Write to a dedup file, locked for writing with writeback_lock()
+ *          and writeback_exclude() (readers must not hold on to map
+ *          entries whose blocks this lets go of)
+ * Args: struct dedup* dd      : Store
+ *       struct writeback* wb  : Write-back state the map update is kept in
+ *       struct wb_file* f     : The locked file
+ *       int fd                : Backing file, open for reading and writing
+ *       const char* path      : Path of the file relative to the backing root
+ *       const char* buf, size_t size, off_t offset : The write
+ * Return: 0 on success, -errno on error
+ */
+extern int dedup_write(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+		       const char* path, const char* buf, size_t size, off_t offset);
+
+/* int dedup_truncate(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+ *                    const char* path, uint64_t size)
+ * Purpose: Truncate a dedup file (locked as for dedup_write())
+ * Return: 0 on success, -errno on error
+ */
+extern int dedup_truncate(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+			  const char* path, uint64_t size);
+
+/* void dedup_forget(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+ *                   const char* path)
+ * Purpose: Drop the references of a dedup file whose last link has just
+ *          been removed (locked as for dedup_write())
+ * Args: struct dedup* dd : Store
+ *       struct writeback* wb, struct wb_file* f : As for dedup_write()
+ *       int fd           : The file, open for reading and writing; it is
+ *                          truncated to nothing
+ *       const char* path : The path it had
+ */
+extern void dedup_forget(struct dedup* dd, struct writeback* wb, struct wb_file* f, int fd,
+			 const char* path);
+
+/* void dedup_close(struct dedup* dd)
+ * Purpose: Save the index (unless it may be out of date) and free the
+ *          store. Call once the write-back state is flushed.
+ */
+extern void dedup_close(struct dedup* dd);
+
+#endif
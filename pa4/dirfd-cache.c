@@ -0,0 +1,188 @@
+/* dirfd-cache.c
+ * Small cache of open directory file descriptors for fusec
+ *
+ * See dirfd-cache.h for details
+ *
+ * The cache is direct mapped: each path hashes to exactly one slot and a
+ * miss simply replaces whatever idle entry lives there. A slot that is
+ * still referenced is never replaced; the caller then gets a private,
+ * uncached fd instead.
+ *
+ */
+
+#ifdef linux
+/* For O_PATH */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dirfd-cache.h"
+
+struct dirfd_slot {
+    char* path;
+    size_t len;
+    unsigned long hash;
+    int fd;
+    unsigned int refs;
+    int stale;
+};
+
+struct dirfd_cache {
+    int rootfd;
+    unsigned int nslots;
+    pthread_mutex_t lock;
+    struct dirfd_slot* slots;
+};
+
+/* FNV-1a */
+static unsigned long path_hash(const char* s, size_t len){
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	h ^= (unsigned char)s[i];
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+/* Close a slot's fd and mark it empty. Caller holds the lock. */
+static void slot_clear(struct dirfd_slot* s){
+    if(s->fd >= 0)
+	close(s->fd);
+    free(s->path);
+    s->path = NULL;
+    s->len = 0;
+    s->fd = -1;
+    s->refs = 0;
+    s->stale = 0;
+}
+
+static int open_dir(int rootfd, const char* dir, size_t len){
+    char* tmp;
+    int fd;
+
+    tmp = strndup(dir, len);
+    if(!tmp)
+	return -ENOMEM;
+    fd = openat(rootfd, tmp, O_PATH | O_DIRECTORY);
+    free(tmp);
+    if(fd == -1)
+	return -errno;
+    return fd;
+}
+
+extern struct dirfd_cache* dirfd_cache_new(int rootfd, unsigned int nslots){
+    struct dirfd_cache* c;
+    unsigned int i;
+
+    if(nslots == 0){
+	errno = EINVAL;
+	return NULL;
+    }
+    c = malloc(sizeof(*c));
+    if(!c)
+	return NULL;
+    c->slots = calloc(nslots, sizeof(*c->slots));
+    if(!c->slots){
+	free(c);
+	return NULL;
+    }
+    for(i = 0; i < nslots; i++)
+	c->slots[i].fd = -1;
+    c->rootfd = rootfd;
+    c->nslots = nslots;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+extern int dirfd_cache_get(struct dirfd_cache* c, const char* dir, size_t len,
+			   struct dirfd_slot** slot){
+    unsigned long h = path_hash(dir, len);
+    struct dirfd_slot* s = &c->slots[h % c->nslots];
+    char* path;
+    int fd;
+
+    *slot = NULL;
+
+    /* Hit */
+    pthread_mutex_lock(&c->lock);
+    if(s->path && !s->stale && s->hash == h && s->len == len &&
+       !memcmp(s->path, dir, len)){
+	s->refs++;
+	*slot = s;
+	fd = s->fd;
+	pthread_mutex_unlock(&c->lock);
+	return fd;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* Miss: open outside the lock so misses do not serialize */
+    fd = open_dir(c->rootfd, dir, len);
+    if(fd < 0)
+	return fd;
+    path = strndup(dir, len);
+    if(!path)
+	return fd;
+
+    pthread_mutex_lock(&c->lock);
+    if(s->refs == 0){
+	slot_clear(s);
+	s->path = path;
+	s->len = len;
+	s->hash = h;
+	s->fd = fd;
+	s->refs = 1;
+	*slot = s;
+	path = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* Slot busy: caller gets an uncached fd and closes it on put */
+    free(path);
+    return fd;
+}
+
+extern void dirfd_cache_put(struct dirfd_cache* c, struct dirfd_slot* slot, int fd){
+    if(!slot){
+	close(fd);
+	return;
+    }
+    pthread_mutex_lock(&c->lock);
+    if(--slot->refs == 0 && slot->stale)
+	slot_clear(slot);
+    pthread_mutex_unlock(&c->lock);
+}
+
+extern void dirfd_cache_flush(struct dirfd_cache* c){
+    unsigned int i;
+
+    pthread_mutex_lock(&c->lock);
+    for(i = 0; i < c->nslots; i++){
+	if(!c->slots[i].path)
+	    continue;
+	if(c->slots[i].refs == 0)
+	    slot_clear(&c->slots[i]);
+	else
+	    c->slots[i].stale = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+extern void dirfd_cache_free(struct dirfd_cache* c){
+    unsigned int i;
+
+    if(!c)
+	return;
+    for(i = 0; i < c->nslots; i++)
+	slot_clear(&c->slots[i]);
+    pthread_mutex_destroy(&c->lock);
+    free(c->slots);
+    free(c);
+}
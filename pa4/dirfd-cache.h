@@ -0,0 +1,72 @@
+/* dirfd-cache.h
+ * Small cache of open directory file descriptors for fusec
+ *
+ * Maps backing-store directory paths (relative to the mount root) to
+ * O_PATH directory descriptors so that hot parent directories do not have
+ * to be re-walked by the kernel on every *at() call.
+ *
+ * Entries are reference counted: a descriptor handed out by
+ * dirfd_cache_get() stays valid until the matching dirfd_cache_put(), even
+ * if the cache is flushed in between.
+ *
+ * Note: cached descriptors follow the directory, not the path. If a cached
+ *       directory is renamed or removed the cache must be flushed. fusec
+ *       does this for its own rename()/rmdir(), but changes made directly
+ *       to the backing store behind the mount are not seen, which is why
+ *       the cache is off unless asked for.
+ *
+ */
+
+#ifndef DIRFD_CACHE_H
+#define DIRFD_CACHE_H
+
+#include <stddef.h>
+
+struct dirfd_cache;
+struct dirfd_slot;
+
+/* struct dirfd_cache* dirfd_cache_new(int rootfd, unsigned int nslots)
+ * Purpose: Create a directory descriptor cache rooted at rootfd
+ * Args: int rootfd           : Directory fd all cached paths are relative to
+ *       unsigned int nslots  : Number of cache slots
+ * Return: New cache on success, NULL on error (errno set)
+ */
+extern struct dirfd_cache* dirfd_cache_new(int rootfd, unsigned int nslots);
+
+/* int dirfd_cache_get(struct dirfd_cache* c, const char* dir, size_t len,
+ *                     struct dirfd_slot** slot)
+ * Purpose: Get a directory fd for the first len bytes of dir
+ * Args: struct dirfd_cache* c    : Cache
+ *       const char* dir          : Directory path relative to the root
+ *       size_t len               : Length of the path in dir
+ *       struct dirfd_slot** slot : Set to the slot holding the reference,
+ *                                  or NULL if the fd is not cached
+ * Return: Directory fd on success, -errno on error
+ */
+extern int dirfd_cache_get(struct dirfd_cache* c, const char* dir, size_t len,
+			   struct dirfd_slot** slot);
+
+/* void dirfd_cache_put(struct dirfd_cache* c, struct dirfd_slot* slot, int fd)
+ * Purpose: Release a directory fd obtained from dirfd_cache_get()
+ * Args: struct dirfd_cache* c   : Cache
+ *       struct dirfd_slot* slot : Slot returned by dirfd_cache_get()
+ *       int fd                  : Fd returned by dirfd_cache_get()
+ * Return: Nothing
+ */
+extern void dirfd_cache_put(struct dirfd_cache* c, struct dirfd_slot* slot, int fd);
+
+/* void dirfd_cache_flush(struct dirfd_cache* c)
+ * Purpose: Drop all cached entries (in-use fds are closed on their last put)
+ * Args: struct dirfd_cache* c : Cache
+ * Return: Nothing
+ */
+extern void dirfd_cache_flush(struct dirfd_cache* c);
+
+/* void dirfd_cache_free(struct dirfd_cache* c)
+ * Purpose: Close all cached fds and free the cache
+ * Args: struct dirfd_cache* c : Cache (no references may be outstanding)
+ * Return: Nothing
+ */
+extern void dirfd_cache_free(struct dirfd_cache* c);
+
+#endif
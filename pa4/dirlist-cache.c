@@ -0,0 +1,454 @@
+/* dirlist-cache.c
+ * In-memory cache of directory listings for fusec readdir()
+ *
+ * See dirlist-cache.h for details
+ *
+ * Watches are IN_ONESHOT: the first change to a directory drops its
+ * listing and the kernel removes the watch by itself, so an idle cache of
+ * a busy tree does not keep generating events.
+ *
+ * A listing is only inserted if no event (or explicit invalidation) that
+ * could affect it was seen between placing the watch and finishing the
+ * scan. Recent events are kept in a small ring for that check; if the ring
+ * has wrapped since the scan started the listing is simply not cached.
+ *
+ */
+
+#ifdef linux
+/* For pipe2() */
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "bblog.h"
+#include "dirlist-cache.h"
+
+#define DIRLIST_HASH_SIZE 1024
+#define DIRLIST_MAX_BYTES (64 * 1024 * 1024)
+#define DIRLIST_RING 64
+/* pseudo watch descriptor recorded for path based invalidations */
+#define DIRLIST_WD_ANY -1
+#define DIRLIST_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_ONESHOT)
+
+struct dirlist {
+    char* path;
+    size_t len;
+    unsigned long hash;
+    int wd;
+    unsigned int refs;
+    int cached;
+    size_t n;
+    struct dirlist_ent* ents;
+    char* names;
+    size_t bytes;
+    struct dirlist* hnext;
+    struct dirlist* prev;
+    struct dirlist* next;
+};
+
+struct dirlist_cache {
+    pthread_mutex_t lock;
+    unsigned int maxdirs;
+    unsigned int ndirs;
+    size_t bytes;
+    struct dirlist* hash[DIRLIST_HASH_SIZE];
+    /* LRU list, most recently used first */
+    struct dirlist* head;
+    struct dirlist* tail;
+    /* recently seen invalidations, for racing loads */
+    unsigned long seq;
+    int ring[DIRLIST_RING];
+    int ifd;
+    int stopfd[2];
+    pthread_t thread;
+    int running;
+};
+
+/* FNV-1a */
+static unsigned long path_hash(const char* s, size_t len){
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	h ^= (unsigned char)s[i];
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+static void dirlist_free(struct dirlist* l){
+    free(l->path);
+    free(l->ents);
+    free(l->names);
+    free(l);
+}
+
+/* Record an invalidation in the ring. Caller holds the lock. */
+static void note_event(struct dirlist_cache* c, int wd){
+    c->ring[c->seq % DIRLIST_RING] = wd;
+    c->seq++;
+}
+
+/* Was there an invalidation that could affect wd since seq0? Caller holds the lock. */
+static int seen_event(struct dirlist_cache* c, unsigned long seq0, int wd){
+    unsigned long s;
+
+    if(c->seq - seq0 > DIRLIST_RING)
+	return 1;
+    for(s = seq0; s != c->seq; s++){
+	int ewd = c->ring[s % DIRLIST_RING];
+	if(ewd == wd || ewd == DIRLIST_WD_ANY)
+	    return 1;
+    }
+    return 0;
+}
+
+static int wd_in_use(struct dirlist_cache* c, int wd){
+    struct dirlist* l;
+
+    for(l = c->head; l; l = l->next)
+	if(l->wd == wd)
+	    return 1;
+    return 0;
+}
+
+/* Take a listing out of the cache. Caller holds the lock. */
+static void unlink_entry(struct dirlist_cache* c, struct dirlist* l, int rmwatch){
+    struct dirlist** pp = &c->hash[l->hash % DIRLIST_HASH_SIZE];
+
+    while(*pp != l)
+	pp = &(*pp)->hnext;
+    *pp = l->hnext;
+    if(l->prev)
+	l->prev->next = l->next;
+    else
+	c->head = l->next;
+    if(l->next)
+	l->next->prev = l->prev;
+    else
+	c->tail = l->prev;
+    l->cached = 0;
+    c->ndirs--;
+    c->bytes -= l->bytes;
+
+    /* A racing load may have been handed the same wd; note_event() makes
+       sure it does not cache on a watch we are about to remove */
+    if(rmwatch && !wd_in_use(c, l->wd)){
+	note_event(c, l->wd);
+	inotify_rm_watch(c->ifd, l->wd);
+    }
+    if(l->refs == 0)
+	dirlist_free(l);
+}
+
+static void invalidate_wd(struct dirlist_cache* c, int wd){
+    struct dirlist* l;
+    struct dirlist* next;
+
+    note_event(c, wd);
+    for(l = c->head; l; l = next){
+	next = l->next;
+	if(l->wd == wd)
+	    unlink_entry(c, l, 0);
+    }
+}
+
+static void invalidate_all(struct dirlist_cache* c){
+    note_event(c, DIRLIST_WD_ANY);
+    while(c->head)
+	unlink_entry(c, c->head, 1);
+}
+
+static void* watch_thread(void* arg){
+    struct dirlist_cache* c = arg;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd[2];
+    const struct inotify_event* ev;
+    ssize_t len;
+    char* p;
+
+    pfd[0].fd = c->ifd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = c->stopfd[0];
+    pfd[1].events = POLLIN;
+
+    for(;;){
+	if(poll(pfd, 2, -1) == -1){
+	    if(errno == EINTR)
+		continue;
+	    bblog(BBLOG_ERR, "dirlist_cache: poll: %s, watcher stopped", strerror(errno));
+	    break;
+	}
+	if(pfd[1].revents)
+	    break;
+	len = read(c->ifd, buf, sizeof(buf));
+	if(len <= 0)
+	    continue;
+
+	pthread_mutex_lock(&c->lock);
+	for(p = buf; p < buf + len; p += sizeof(*ev) + ev->len){
+	    ev = (const struct inotify_event*)p;
+	    if(ev->mask & IN_Q_OVERFLOW)
+		invalidate_all(c);
+	    else if(ev->wd >= 0)
+		invalidate_wd(c, ev->wd);
+	}
+	pthread_mutex_unlock(&c->lock);
+    }
+    return NULL;
+}
+
+extern struct dirlist_cache* dirlist_cache_new(unsigned int maxdirs){
+    struct dirlist_cache* c;
+
+    c = calloc(1, sizeof(*c));
+    if(!c)
+	return NULL;
+    c->maxdirs = maxdirs;
+    c->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(c->ifd == -1){
+	free(c);
+	return NULL;
+    }
+    if(pipe2(c->stopfd, O_CLOEXEC) == -1){
+	close(c->ifd);
+	free(c);
+	return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+extern int dirlist_cache_start(struct dirlist_cache* c){
+    int res;
+
+    res = pthread_create(&c->thread, NULL, watch_thread, c);
+    if(res)
+	return -res;
+    c->running = 1;
+    return 0;
+}
+
+extern struct dirlist* dirlist_cache_lookup(struct dirlist_cache* c, const char* path){
+    size_t len = strlen(path);
+    unsigned long h = path_hash(path, len);
+    struct dirlist* l;
+
+    pthread_mutex_lock(&c->lock);
+    for(l = c->hash[h % DIRLIST_HASH_SIZE]; l; l = l->hnext){
+	if(l->hash == h && l->len == len && !memcmp(l->path, path, len))
+	    break;
+    }
+    if(l){
+	l->refs++;
+	/* move to the front of the LRU list */
+	if(l->prev){
+	    l->prev->next = l->next;
+	    if(l->next)
+		l->next->prev = l->prev;
+	    else
+		c->tail = l->prev;
+	    l->prev = NULL;
+	    l->next = c->head;
+	    c->head->prev = l;
+	    c->head = l;
+	}
+    }
+    pthread_mutex_unlock(&c->lock);
+    return l;
+}
+
+/* Read all entries of fd into l. Consumes fd. */
+static int read_dir(struct dirlist* l, int fd){
+    DIR* dp;
+    struct dirent* de;
+    size_t cap = 0;
+    size_t ncap = 0;
+    size_t nlen = 0;
+    size_t namelen;
+    size_t i;
+    void* tmp;
+
+    dp = fdopendir(fd);
+    if(dp == NULL){
+	close(fd);
+	return -errno;
+    }
+    while((de = readdir(dp)) != NULL){
+	if(l->n == cap){
+	    cap = cap ? cap * 2 : 64;
+	    tmp = realloc(l->ents, cap * sizeof(*l->ents));
+	    if(!tmp)
+		goto nomem;
+	    l->ents = tmp;
+	}
+	namelen = strlen(de->d_name) + 1;
+	if(nlen + namelen > ncap){
+	    ncap = ncap ? ncap * 2 : 1024;
+	    while(nlen + namelen > ncap)
+		ncap *= 2;
+	    tmp = realloc(l->names, ncap);
+	    if(!tmp)
+		goto nomem;
+	    l->names = tmp;
+	}
+	memcpy(l->names + nlen, de->d_name, namelen);
+	/* names may still move; store the offset for now */
+	l->ents[l->n].name = (const char*)nlen;
+	l->ents[l->n].ino = de->d_ino;
+	l->ents[l->n].type = de->d_type;
+	l->n++;
+	nlen += namelen;
+    }
+    closedir(dp);
+
+    for(i = 0; i < l->n; i++)
+	l->ents[i].name = l->names + (size_t)l->ents[i].name;
+    l->bytes = sizeof(*l) + l->len + cap * sizeof(*l->ents) + ncap;
+    return 0;
+
+ nomem:
+    closedir(dp);
+    return -ENOMEM;
+}
+
+extern struct dirlist* dirlist_cache_load(struct dirlist_cache* c, const char* path, int fd){
+    char procpath[64];
+    struct dirlist* l;
+    struct dirlist* old;
+    unsigned long seq0;
+    int res;
+
+    l = calloc(1, sizeof(*l));
+    if(!l){
+	close(fd);
+	return NULL;
+    }
+    l->len = strlen(path);
+    l->path = strndup(path, l->len);
+    if(!l->path){
+	free(l);
+	close(fd);
+	return NULL;
+    }
+    l->hash = path_hash(path, l->len);
+    l->refs = 1;
+
+    /* Watch before scanning so nothing can slip in between. There is no
+       inotify_add_watch_at(), but the fd's /proc link resolves without
+       walking the path again. */
+    pthread_mutex_lock(&c->lock);
+    seq0 = c->seq;
+    pthread_mutex_unlock(&c->lock);
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+    l->wd = inotify_add_watch(c->ifd, procpath, DIRLIST_EVENTS);
+
+    res = read_dir(l, fd);
+    if(res < 0){
+	dirlist_free(l);
+	errno = -res;
+	return NULL;
+    }
+    if(l->wd < 0 || !c->running)
+	return l;
+
+    pthread_mutex_lock(&c->lock);
+    if(seen_event(c, seq0, l->wd) || l->bytes > DIRLIST_MAX_BYTES){
+	pthread_mutex_unlock(&c->lock);
+	return l;
+    }
+    /* replace any listing of the same path another load beat us to */
+    for(old = c->hash[l->hash % DIRLIST_HASH_SIZE]; old; old = old->hnext){
+	if(old->hash == l->hash && old->len == l->len &&
+	   !memcmp(old->path, l->path, l->len)){
+	    unlink_entry(c, old, 0);
+	    break;
+	}
+    }
+    /* make room */
+    while(c->tail && (c->ndirs >= c->maxdirs ||
+		      c->bytes + l->bytes > DIRLIST_MAX_BYTES))
+	unlink_entry(c, c->tail, 1);
+
+    l->cached = 1;
+    l->refs++;
+    l->hnext = c->hash[l->hash % DIRLIST_HASH_SIZE];
+    c->hash[l->hash % DIRLIST_HASH_SIZE] = l;
+    l->next = c->head;
+    if(c->head)
+	c->head->prev = l;
+    else
+	c->tail = l;
+    c->head = l;
+    c->ndirs++;
+    c->bytes += l->bytes;
+    pthread_mutex_unlock(&c->lock);
+    return l;
+}
+
+extern size_t dirlist_entries(struct dirlist* l, const struct dirlist_ent** ents){
+    *ents = l->ents;
+    return l->n;
+}
+
+extern void dirlist_put(struct dirlist_cache* c, struct dirlist* l){
+    int dofree;
+
+    pthread_mutex_lock(&c->lock);
+    dofree = (--l->refs == 0 && !l->cached);
+    pthread_mutex_unlock(&c->lock);
+    if(dofree)
+	dirlist_free(l);
+}
+
+extern void dirlist_cache_invalidate(struct dirlist_cache* c, const char* path,
+				     size_t len, int subtree){
+    struct dirlist* l;
+    struct dirlist* next;
+
+    /* "/" is the prefix of everything */
+    if(subtree && len == 1 && path[0] == '/')
+	len = 0;
+
+    pthread_mutex_lock(&c->lock);
+    note_event(c, DIRLIST_WD_ANY);
+    for(l = c->head; l; l = next){
+	next = l->next;
+	if(l->len == len || (subtree && l->len > len)){
+	    if(memcmp(l->path, path, len))
+		continue;
+	    if(l->len > len && l->path[len] != '/')
+		continue;
+	    unlink_entry(c, l, 1);
+	}
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+extern void dirlist_cache_free(struct dirlist_cache* c){
+    if(!c)
+	return;
+    if(c->running){
+	if(write(c->stopfd[1], "", 1) == 1)
+	    pthread_join(c->thread, NULL);
+    }
+    pthread_mutex_lock(&c->lock);
+    invalidate_all(c);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_destroy(&c->lock);
+    close(c->stopfd[0]);
+    close(c->stopfd[1]);
+    close(c->ifd);
+    free(c);
+}
@@ -0,0 +1,102 @@
+/* dirlist-cache.h
+ * In-memory cache of directory listings for fusec readdir()
+ *
+ * Listings are read from the backing store once and served from memory
+ * until the directory changes. Changes are noticed two ways:
+ *   - an inotify watch on every cached directory, drained by a background
+ *     thread (catches changes made directly to the backing store)
+ *   - explicit dirlist_cache_invalidate() calls from fusec's own mutating
+ *     handlers (inotify is asynchronous, so without these a readdir right
+ *     after a mkdir could still see the old listing)
+ *
+ * Listings are reference counted; a listing handed out stays valid until
+ * dirlist_put() even if it is invalidated in the meantime.
+ *
+ */
+
+#ifndef DIRLIST_CACHE_H
+#define DIRLIST_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct dirlist_cache;
+struct dirlist;
+
+/* One directory entry, as readdir(3) reported it */
+struct dirlist_ent {
+    const char* name;
+    ino_t ino;
+    unsigned char type;
+};
+
+/* struct dirlist_cache* dirlist_cache_new(unsigned int maxdirs)
+ * Purpose: Create a listing cache and its inotify instance
+ * Args: unsigned int maxdirs : Maximum number of cached directories
+ * Return: New cache on success, NULL on error (errno set)
+ */
+extern struct dirlist_cache* dirlist_cache_new(unsigned int maxdirs);
+
+/* int dirlist_cache_start(struct dirlist_cache* c)
+ * Purpose: Start the inotify watcher thread (call after daemonizing)
+ * Args: struct dirlist_cache* c : Cache
+ * Return: 0 on success, -errno on error
+ */
+extern int dirlist_cache_start(struct dirlist_cache* c);
+
+/* struct dirlist* dirlist_cache_lookup(struct dirlist_cache* c,
+ *                                      const char* path)
+ * Purpose: Look up a cached listing
+ * Args: struct dirlist_cache* c : Cache
+ *       const char* path        : Directory path as seen in the mount
+ * Return: Referenced listing on a hit, NULL on a miss
+ */
+extern struct dirlist* dirlist_cache_lookup(struct dirlist_cache* c, const char* path);
+
+/* struct dirlist* dirlist_cache_load(struct dirlist_cache* c,
+ *                                    const char* path, int fd)
+ * Purpose: Read a directory and cache its listing
+ * Args: struct dirlist_cache* c : Cache
+ *       const char* path        : Directory path as seen in the mount
+ *       int fd                  : Open directory fd (consumed)
+ * Return: Referenced listing on success (possibly uncached, e.g. when no
+ *         watch could be placed), NULL on error (errno set)
+ */
+extern struct dirlist* dirlist_cache_load(struct dirlist_cache* c, const char* path, int fd);
+
+/* size_t dirlist_entries(struct dirlist* l, const struct dirlist_ent** ents)
+ * Purpose: Get the entries of a listing
+ * Args: struct dirlist* l               : Listing
+ *       const struct dirlist_ent** ents : Set to the entry array
+ * Return: Number of entries
+ */
+extern size_t dirlist_entries(struct dirlist* l, const struct dirlist_ent** ents);
+
+/* void dirlist_put(struct dirlist_cache* c, struct dirlist* l)
+ * Purpose: Release a listing from dirlist_cache_lookup()/dirlist_cache_load()
+ * Args: struct dirlist_cache* c : Cache
+ *       struct dirlist* l       : Listing
+ * Return: Nothing
+ */
+extern void dirlist_put(struct dirlist_cache* c, struct dirlist* l);
+
+/* void dirlist_cache_invalidate(struct dirlist_cache* c, const char* path,
+ *                               size_t len, int subtree)
+ * Purpose: Drop the listing of a directory (and optionally everything below it)
+ * Args: struct dirlist_cache* c : Cache
+ *       const char* path        : Directory path as seen in the mount
+ *       size_t len              : Length of the path in path
+ *       int subtree             : Also drop listings of all subdirectories
+ * Return: Nothing
+ */
+extern void dirlist_cache_invalidate(struct dirlist_cache* c, const char* path,
+				     size_t len, int subtree);
+
+/* void dirlist_cache_free(struct dirlist_cache* c)
+ * Purpose: Stop the watcher thread and free the cache
+ * Args: struct dirlist_cache* c : Cache (no listings may be outstanding)
+ * Return: Nothing
+ */
+extern void dirlist_cache_free(struct dirlist_cache* c);
+
+#endif
@@ -0,0 +1,447 @@
+/* encblk.c
+ * Block structured encrypted file format for fusec
+ *
+ * See encblk.h for the on-disk layout
+ *
+ * Uses the OpenSSL libcrypto EVP API, like aes-crypt.c, but with keys
+ * derived once per mount instead of once per call. AES-256-CBC blocks
+ * go through aes-crypt's crypt_cbc() instead where it runs on the CPU's
+ * AES instructions, saving EVP's per-block setup.
+ *
+ */
+
+#ifdef linux
+/* For pread() and clock_gettime() */
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+
+#include "aes-crypt.h"
+#include "encblk.h"
+
+static const char ENCBLK_MAGIC[8] = { 'F', 'U', 'S', 'E', 'C', 'B', 'L', 'K' };
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+#define HAVE_CHACHA20
+#endif
+
+/* indexed by cipher id */
+static const struct {
+    const char* name;
+    const EVP_CIPHER* (*evp)(void);
+} ciphers[ENCBLK_NCIPHERS] = {
+    { "aes-256-cbc", EVP_aes_256_cbc },
+    { "aes-128-ctr", EVP_aes_128_ctr },
+#ifdef HAVE_CHACHA20
+    { "chacha20", EVP_chacha20 },
+#else
+    { "chacha20", NULL },
+#endif
+};
+
+static void put_le32(unsigned char* p, uint32_t v){
+    int i;
+    for(i = 0; i < 4; i++)
+	p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char* p, uint64_t v){
+    int i;
+    for(i = 0; i < 8; i++)
+	p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char* p){
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char* p){
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int all_zero(const unsigned char* p, size_t len){
+    size_t i;
+    for(i = 0; i < len; i++)
+	if(p[i])
+	    return 0;
+    return 1;
+}
+
+/* Encrypt one plaintext block into its on-disk image under a fresh IV */
+static int seal_block(EVP_CIPHER_CTX* ctx, const struct encblk_keys* keys, uint32_t cipher,
+		      const unsigned char* plain, unsigned char* disk){
+    int outlen;
+
+    if(!encblk_cipher_ok(cipher))
+	return -EIO;
+    if(RAND_bytes(disk, ENCBLK_IVLEN) != 1)
+	return -EIO;
+    if(cipher == ENCBLK_AES256CBC && keys->cbc_kernel)
+	return crypt_cbc(keys->k[cipher], disk, plain, ENCBLK_SIZE, disk + ENCBLK_IVLEN, 1) ?
+	    0 : -EIO;
+    if(!EVP_CipherInit_ex(ctx, ciphers[cipher].evp(), NULL, keys->k[cipher], disk, 1))
+	return -EIO;
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if(!EVP_CipherUpdate(ctx, disk + ENCBLK_IVLEN, &outlen, plain, ENCBLK_SIZE) ||
+       outlen != ENCBLK_SIZE)
+	return -EIO;
+    return 0;
+}
+
+/* Decrypt one on-disk block image */
+static int open_block(EVP_CIPHER_CTX* ctx, const struct encblk_keys* keys, uint32_t cipher,
+		      const unsigned char* disk, unsigned char* plain){
+    int outlen;
+
+    if(all_zero(disk, ENCBLK_DISK)){
+	memset(plain, 0, ENCBLK_SIZE);
+	return 0;
+    }
+    if(!encblk_cipher_ok(cipher))
+	return -EIO;
+    if(cipher == ENCBLK_AES256CBC && keys->cbc_kernel)
+	return crypt_cbc(keys->k[cipher], disk, disk + ENCBLK_IVLEN, ENCBLK_SIZE, plain, 0) ?
+	    0 : -EIO;
+    if(!EVP_CipherInit_ex(ctx, ciphers[cipher].evp(), NULL, keys->k[cipher], disk, 0))
+	return -EIO;
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    if(!EVP_CipherUpdate(ctx, plain, &outlen, disk + ENCBLK_IVLEN, ENCBLK_SIZE) ||
+       outlen != ENCBLK_SIZE)
+	return -EIO;
+    return 0;
+}
+
+static off_t block_off(uint64_t idx){
+    return ENCBLK_HDRLEN + (off_t)idx * ENCBLK_DISK;
+}
+
+/* Read and decrypt block idx; blocks past EOF read as zeros */
+static int load_block(int fd, const struct encblk_overlay* ov, EVP_CIPHER_CTX* ctx,
+		      const struct encblk_keys* keys, uint32_t cipher,
+		      uint64_t idx, unsigned char* plain){
+    unsigned char disk[ENCBLK_DISK];
+    ssize_t res;
+
+    if(ov && ov->lookup(ov->arg, idx, disk))
+	return open_block(ctx, keys, cipher, disk, plain);
+    res = pread(fd, disk, ENCBLK_DISK, block_off(idx));
+    if(res < 0)
+	return -errno;
+    memset(disk + res, 0, ENCBLK_DISK - res);
+    return open_block(ctx, keys, cipher, disk, plain);
+}
+
+extern int encblk_derive_keys(const char* key_str, struct encblk_keys* keys){
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    unsigned char salt[8] = { 'F', 'U', 'S', 'E', 'C', 'K', 'E', 'Y' };
+    int nrounds = 5;
+    uint32_t i;
+
+    if(!key_str)
+	return -EINVAL;
+    /* AES-256-CBC unsalted, as do_crypt, so existing files keep their key */
+    for(i = 0; i < ENCBLK_NCIPHERS; i++){
+	salt[7] = (unsigned char)('0' + i);
+	if(EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), i ? salt : NULL,
+			  (const unsigned char*)key_str, strlen(key_str), nrounds,
+			  keys->k[i], iv) != ENCBLK_KEYLEN)
+	    return -EINVAL;
+    }
+    /* EVP with a context of its own per call would be slower than ours */
+    keys->cbc_kernel = strcmp(crypt_kernel(), "evp") != 0;
+    return 0;
+}
+
+extern int encblk_cipher_id(const char* name){
+    int i;
+
+    for(i = 0; i < ENCBLK_NCIPHERS; i++)
+	if(!strcmp(name, ciphers[i].name))
+	    return i;
+    return -1;
+}
+
+extern const char* encblk_cipher_name(uint32_t cipher){
+    return cipher < ENCBLK_NCIPHERS ? ciphers[cipher].name : "?";
+}
+
+extern int encblk_cipher_ok(uint32_t cipher){
+    return cipher < ENCBLK_NCIPHERS && ciphers[cipher].evp != NULL;
+}
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern double encblk_bench(const struct encblk_keys* keys, uint32_t cipher, size_t bytes){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char plain[ENCBLK_SIZE];
+    unsigned char disk[ENCBLK_DISK];
+    size_t i, nblk = bytes / ENCBLK_SIZE;
+    double start, secs;
+    int res = 0;
+
+    if(!encblk_cipher_ok(cipher))
+	return -1;
+    if(nblk == 0)
+	nblk = 1;
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx)
+	return -1;
+    memset(plain, 0x5a, sizeof(plain));
+    /* one round first so lazy setup inside libcrypto is not timed */
+    res = seal_block(ctx, keys, cipher, plain, disk);
+    start = now();
+    for(i = 0; i < nblk && res == 0; i++){
+	res = seal_block(ctx, keys, cipher, plain, disk);
+	if(res == 0)
+	    res = open_block(ctx, keys, cipher, disk, plain);
+    }
+    secs = now() - start;
+    EVP_CIPHER_CTX_free(ctx);
+    if(res < 0)
+	return -1;
+    if(secs <= 0)
+	secs = 1e-9;
+    return nblk * (double)ENCBLK_SIZE / secs / (1 << 20);
+}
+
+extern void encblk_hdr_init(struct encblk_hdr* hdr, uint32_t cipher){
+    hdr->version = ENCBLK_VERSION;
+    hdr->cipher = cipher;
+    hdr->blocksize = ENCBLK_SIZE;
+    hdr->size = 0;
+}
+
+extern void encblk_hdr_encode(const struct encblk_hdr* hdr, unsigned char buf[ENCBLK_HDRLEN]){
+    memset(buf, 0, ENCBLK_HDRLEN);
+    memcpy(buf, ENCBLK_MAGIC, sizeof(ENCBLK_MAGIC));
+    put_le32(buf + 8, hdr->version);
+    put_le32(buf + 12, hdr->cipher);
+    put_le32(buf + 16, hdr->blocksize);
+    put_le64(buf + 24, hdr->size);
+}
+
+extern int encblk_read_hdr(int fd, struct encblk_hdr* hdr){
+    unsigned char buf[ENCBLK_HDRLEN];
+    ssize_t res;
+
+    res = pread(fd, buf, ENCBLK_HDRLEN, 0);
+    if(res < 0)
+	return -errno;
+    /* created but header not written yet */
+    if(res == 0){
+	encblk_hdr_init(hdr, ENCBLK_AES256CBC);
+	return 0;
+    }
+    if(res != ENCBLK_HDRLEN || memcmp(buf, ENCBLK_MAGIC, sizeof(ENCBLK_MAGIC)))
+	return -EIO;
+    hdr->version = get_le32(buf + 8);
+    hdr->cipher = get_le32(buf + 12);
+    hdr->blocksize = get_le32(buf + 16);
+    hdr->size = get_le64(buf + 24);
+    if(hdr->version != ENCBLK_VERSION || hdr->cipher >= ENCBLK_NCIPHERS ||
+       hdr->blocksize != ENCBLK_SIZE)
+	return -EIO;
+    return 0;
+}
+
+extern off_t encblk_disklen(uint64_t size){
+    return block_off((size + ENCBLK_SIZE - 1) / ENCBLK_SIZE);
+}
+
+extern ssize_t encblk_decrypt(const struct encblk_keys* keys, const struct encblk_hdr* hdr,
+			      const unsigned char* disk, char* buf, size_t size, off_t offset){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char plain[ENCBLK_SIZE];
+    uint64_t first, last, i;
+    size_t done = 0;
+    ssize_t res = 0;
+
+    if(offset < 0)
+	return -EINVAL;
+    if((uint64_t)offset >= hdr->size || size == 0)
+	return 0;
+    if(size > hdr->size - offset)
+	size = hdr->size - offset;
+
+    first = offset / ENCBLK_SIZE;
+    last = (offset + size - 1) / ENCBLK_SIZE;
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx)
+	return -ENOMEM;
+    for(i = first; i <= last; i++){
+	size_t boff = (i == first) ? offset % ENCBLK_SIZE : 0;
+	size_t blen = ENCBLK_SIZE - boff;
+
+	if(blen > size - done)
+	    blen = size - done;
+	res = open_block(ctx, keys, hdr->cipher, disk + (i - first) * ENCBLK_DISK, plain);
+	if(res < 0)
+	    break;
+	memcpy(buf + done, plain + boff, blen);
+	done += blen;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return res < 0 ? res : (ssize_t)done;
+}
+
+extern ssize_t encblk_read(int fd, const struct encblk_overlay* ov, const struct encblk_keys* keys,
+			   const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset){
+    unsigned char* disk;
+    uint64_t first, last, i;
+    size_t nblk;
+    ssize_t res;
+
+    if(offset < 0)
+	return -EINVAL;
+    if((uint64_t)offset >= hdr->size || size == 0)
+	return 0;
+    if(size > hdr->size - offset)
+	size = hdr->size - offset;
+
+    first = offset / ENCBLK_SIZE;
+    last = (offset + size - 1) / ENCBLK_SIZE;
+    nblk = last - first + 1;
+
+    disk = malloc(nblk * ENCBLK_DISK);
+    if(!disk)
+	return -ENOMEM;
+    /* one read for the whole run of blocks */
+    res = pread(fd, disk, nblk * ENCBLK_DISK, block_off(first));
+    if(res < 0){
+	res = -errno;
+	goto out;
+    }
+    memset(disk + res, 0, nblk * ENCBLK_DISK - res);
+    if(ov)
+	for(i = first; i <= last; i++)
+	    ov->lookup(ov->arg, i, disk + (i - first) * ENCBLK_DISK);
+    res = encblk_decrypt(keys, hdr, disk, buf, size, offset);
+
+ out:
+    free(disk);
+    return res;
+}
+
+extern int encblk_build_write(int fd, const struct encblk_overlay* ov,
+			      const struct encblk_keys* keys, struct encblk_hdr* hdr,
+			      const char* buf, size_t size, off_t offset,
+			      struct encblk_run* run){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char plain[ENCBLK_SIZE];
+    uint64_t first, last, i;
+    size_t nblk, done = 0;
+    int res = 0;
+
+    run->off = 0;
+    run->len = 0;
+    run->data = NULL;
+    if(offset < 0)
+	return -EINVAL;
+    if(size == 0)
+	return 0;
+
+    first = offset / ENCBLK_SIZE;
+    last = (offset + size - 1) / ENCBLK_SIZE;
+    nblk = last - first + 1;
+
+    run->data = malloc(nblk * ENCBLK_DISK);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!run->data || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    run->off = block_off(first);
+    run->len = nblk * ENCBLK_DISK;
+
+    for(i = first; i <= last; i++){
+	size_t boff = (i == first) ? offset % ENCBLK_SIZE : 0;
+	size_t blen = ENCBLK_SIZE - boff;
+
+	if(blen > size - done)
+	    blen = size - done;
+	/* partially covered blocks that already exist need their old contents */
+	if(blen < ENCBLK_SIZE && i * ENCBLK_SIZE < hdr->size && fd >= 0){
+	    res = load_block(fd, ov, ctx, keys, hdr->cipher, i, plain);
+	    if(res < 0)
+		goto out;
+	}
+	else if(blen < ENCBLK_SIZE)
+	    memset(plain, 0, ENCBLK_SIZE);
+	memcpy(plain + boff, buf + done, blen);
+	res = seal_block(ctx, keys, hdr->cipher, plain, run->data + (i - first) * ENCBLK_DISK);
+	if(res < 0)
+	    goto out;
+	done += blen;
+    }
+    if((uint64_t)offset + size > hdr->size)
+	hdr->size = offset + size;
+
+ out:
+    EVP_CIPHER_CTX_free(ctx);
+    if(res < 0){
+	free(run->data);
+	run->data = NULL;
+	run->len = 0;
+    }
+    return res;
+}
+
+extern int encblk_build_truncate(int fd, const struct encblk_overlay* ov,
+				 const struct encblk_keys* keys, struct encblk_hdr* hdr,
+				 uint64_t size, struct encblk_run* run){
+    EVP_CIPHER_CTX* ctx;
+    unsigned char plain[ENCBLK_SIZE];
+    uint64_t idx = size / ENCBLK_SIZE;
+    size_t keep = size % ENCBLK_SIZE;
+    int res;
+
+    run->off = 0;
+    run->len = 0;
+    run->data = NULL;
+
+    /* growing: the old last block's tail is already zero */
+    if(size >= hdr->size || keep == 0){
+	hdr->size = size;
+	return 0;
+    }
+
+    run->data = malloc(ENCBLK_DISK);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!run->data || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    res = load_block(fd, ov, ctx, keys, hdr->cipher, idx, plain);
+    if(res < 0)
+	goto out;
+    memset(plain + keep, 0, ENCBLK_SIZE - keep);
+    res = seal_block(ctx, keys, hdr->cipher, plain, run->data);
+    if(res < 0)
+	goto out;
+    run->off = block_off(idx);
+    run->len = ENCBLK_DISK;
+    hdr->size = size;
+
+ out:
+    EVP_CIPHER_CTX_free(ctx);
+    if(res < 0){
+	free(run->data);
+	run->data = NULL;
+    }
+    return res;
+}
@@ -0,0 +1,199 @@
+/* encblk.h
+ * Block structured encrypted file format for fusec
+ *
+ * The original fusec format encrypts a whole file as one AES-256-CBC
+ * stream, so changing a single byte means decrypting and re-encrypting
+ * everything after it. Files in this format are instead split into
+ * fixed size plaintext blocks that are encrypted independently, so a
+ * write only has to rewrite the blocks it touches.
+ *
+ * On-disk layout:
+ *   header   ENCBLK_HDRLEN bytes (magic, version, cipher, block size,
+ *            logical plaintext size)
+ *   block 0  ENCBLK_DISK bytes: random IV followed by the ciphertext of
+ *            ENCBLK_SIZE plaintext bytes (no padding)
+ *   block 1  ...
+ *
+ * The last block is always stored whole with its tail zero filled; the
+ * logical size lives in the header. A block whose on-disk bytes are all
+ * zero (a hole left by extending the file) reads back as zeros.
+ *
+ * The cipher is chosen per file when it is created and recorded in the
+ * header, so files written under different mount settings stay readable.
+ * All ciphers use the same block layout: AES-256-CBC (the original),
+ * AES-128-CTR, and ChaCha20 where libcrypto has it; the CTR and ChaCha20
+ * IV is a random counter block/nonce.
+ *
+ */
+
+#ifndef ENCBLK_H
+#define ENCBLK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ENCBLK_VERSION 1
+#define ENCBLK_HDRLEN 64
+#define ENCBLK_SIZE 4096
+#define ENCBLK_IVLEN 16
+#define ENCBLK_DISK (ENCBLK_IVLEN + ENCBLK_SIZE)
+#define ENCBLK_KEYLEN 32
+
+/* cipher ids, as stored in the header */
+#define ENCBLK_AES256CBC 0
+#define ENCBLK_AES128CTR 1
+#define ENCBLK_CHACHA20 2
+#define ENCBLK_NCIPHERS 3
+
+/* Keys for every cipher, derived once per mount from the key phrase */
+struct encblk_keys {
+    unsigned char k[ENCBLK_NCIPHERS][ENCBLK_KEYLEN];
+    int cbc_kernel;		/* AES-256-CBC through crypt_cbc() */
+};
+
+struct encblk_hdr {
+    uint32_t version;
+    uint32_t cipher;
+    uint32_t blocksize;
+    uint64_t size;
+};
+
+/* A contiguous run of on-disk bytes to be written */
+struct encblk_run {
+    uint64_t off;
+    size_t len;
+    unsigned char* data;
+};
+
+/* Block images that are newer than what the backing file holds (updates
+ * not written back yet). lookup() copies block idx's image into disk and
+ * returns 1, or returns 0 if the file's copy is current. */
+struct encblk_overlay {
+    int (*lookup)(void* arg, uint64_t idx, unsigned char* disk);
+    void* arg;
+};
+
+/* int encblk_derive_keys(const char* key_str, struct encblk_keys* keys)
+ * Purpose: Derive the block keys from a passphrase. The AES-256-CBC key is
+ *          derived the same way as do_crypt's; the others use their own salt.
+ * Args: const char* key_str       : Passphrase
+ *       struct encblk_keys* keys  : Output keys
+ * Return: 0 on success, -errno on error
+ */
+extern int encblk_derive_keys(const char* key_str, struct encblk_keys* keys);
+
+/* int encblk_cipher_id(const char* name)
+ * Purpose: Look up a cipher by name ("aes-256-cbc", "aes-128-ctr", "chacha20")
+ * Return: Cipher id, -1 if unknown
+ */
+extern int encblk_cipher_id(const char* name);
+
+/* const char* encblk_cipher_name(uint32_t cipher)
+ * Purpose: Name of a cipher id ("?" if unknown)
+ */
+extern const char* encblk_cipher_name(uint32_t cipher);
+
+/* int encblk_cipher_ok(uint32_t cipher)
+ * Purpose: Is this cipher known and provided by the linked libcrypto?
+ */
+extern int encblk_cipher_ok(uint32_t cipher);
+
+/* double encblk_bench(const struct encblk_keys* keys, uint32_t cipher, size_t bytes)
+ * Purpose: Time encrypting and decrypting bytes worth of blocks
+ * Args: const struct encblk_keys* keys : Keys
+ *       uint32_t cipher                : Cipher to time
+ *       size_t bytes                   : Amount of data (at least one block)
+ * Return: Throughput in MB/s, negative on error
+ */
+extern double encblk_bench(const struct encblk_keys* keys, uint32_t cipher, size_t bytes);
+
+/* void encblk_hdr_init(struct encblk_hdr* hdr, uint32_t cipher)
+ * Purpose: Initialize the header of a new, empty file
+ */
+extern void encblk_hdr_init(struct encblk_hdr* hdr, uint32_t cipher);
+
+/* void encblk_hdr_encode(const struct encblk_hdr* hdr, unsigned char buf[ENCBLK_HDRLEN])
+ * Purpose: Serialize a header into its on-disk form
+ */
+extern void encblk_hdr_encode(const struct encblk_hdr* hdr, unsigned char buf[ENCBLK_HDRLEN]);
+
+/* int encblk_read_hdr(int fd, struct encblk_hdr* hdr)
+ * Purpose: Read and check the header of an open file
+ * Args: int fd                 : Backing file
+ *       struct encblk_hdr* hdr : Output header
+ * Return: 0 on success, -errno on error (-EIO for a bad header).
+ *         An empty file reads as an empty AES-256-CBC header.
+ */
+extern int encblk_read_hdr(int fd, struct encblk_hdr* hdr);
+
+/* off_t encblk_disklen(uint64_t size)
+ * Purpose: On-disk length of a file with the given logical size
+ */
+extern off_t encblk_disklen(uint64_t size);
+
+/* ssize_t encblk_read(int fd, const struct encblk_overlay* ov, const struct encblk_keys* keys,
+ *                     const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset)
+ * Purpose: Read and decrypt a plaintext range
+ * Args: int fd                       : Backing file
+ *       const struct encblk_overlay* ov : Pending block images, or NULL
+ *       const struct encblk_keys* keys : Block keys
+ *       const struct encblk_hdr* hdr : Current header
+ *       char* buf, size_t size       : Output buffer
+ *       off_t offset                 : Plaintext offset
+ * Return: Number of bytes read (short at EOF), -errno on error
+ */
+extern ssize_t encblk_read(int fd, const struct encblk_overlay* ov, const struct encblk_keys* keys,
+			   const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset);
+
+/* ssize_t encblk_decrypt(const struct encblk_keys* keys, const struct encblk_hdr* hdr,
+ *                        const unsigned char* disk, char* buf, size_t size, off_t offset)
+ * Purpose: Decrypt a plaintext range from block images already read
+ * Args: const struct encblk_keys* keys : Block keys
+ *       const struct encblk_hdr* hdr : Current header
+ *       const unsigned char* disk    : Images of the blocks the range
+ *                                      touches, from block offset / ENCBLK_SIZE on
+ *       char* buf, size_t size       : Output buffer
+ *       off_t offset                 : Plaintext offset
+ * Return: Number of bytes decrypted (short at EOF), -errno on error
+ */
+extern ssize_t encblk_decrypt(const struct encblk_keys* keys, const struct encblk_hdr* hdr,
+			      const unsigned char* disk, char* buf, size_t size, off_t offset);
+
+/* int encblk_build_write(int fd, const struct encblk_overlay* ov,
+ *                        const struct encblk_keys* keys, struct encblk_hdr* hdr,
+ *                        const char* buf, size_t size, off_t offset,
+ *                        struct encblk_run* run)
+ * Purpose: Encrypt the blocks a write touches, without writing them
+ * Args: int fd                 : Backing file (partially covered blocks are
+ *                                read from it; -1 if there is nothing to read)
+ *       const struct encblk_overlay* ov : Pending block images, or NULL
+ *       const struct encblk_keys* keys : Block keys
+ *       struct encblk_hdr* hdr : Header; size is updated for the write
+ *       const char* buf, size_t size, off_t offset : The write
+ *       struct encblk_run* run : Output run of block images (free run->data)
+ * Return: 0 on success, -errno on error
+ */
+extern int encblk_build_write(int fd, const struct encblk_overlay* ov,
+			      const struct encblk_keys* keys, struct encblk_hdr* hdr,
+			      const char* buf, size_t size, off_t offset,
+			      struct encblk_run* run);
+
+/* int encblk_build_truncate(int fd, const struct encblk_overlay* ov,
+ *                           const struct encblk_keys* keys, struct encblk_hdr* hdr,
+ *                           uint64_t size, struct encblk_run* run)
+ * Purpose: Prepare a truncate; re-encrypts the new last block with its tail
+ *          zeroed when shrinking into the middle of a block
+ * Args: int fd                   : Backing file
+ *       const struct encblk_overlay* ov : Pending block images, or NULL
+ *       const struct encblk_keys* keys : Block keys
+ *       struct encblk_hdr* hdr   : Header; size is updated
+ *       uint64_t size            : New logical size
+ *       struct encblk_run* run   : Output run (len 0 if no block changes)
+ * Return: 0 on success, -errno on error
+ */
+extern int encblk_build_truncate(int fd, const struct encblk_overlay* ov,
+				 const struct encblk_keys* keys, struct encblk_hdr* hdr,
+				 uint64_t size, struct encblk_run* run);
+
+#endif
@@ -0,0 +1,231 @@
+/* fairq.c
+ * Weighted fair admission of data operations for fusec
+ *
+ * See fairq.h for details
+ *
+ * Waiters sit on a list sorted by tag, each on its own condition
+ * variable, so a freed slot goes straight to the one it belongs to
+ * instead of waking everybody. The slot is handed over rather than
+ * released, so a thread arriving meanwhile can't take it first.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "fairq.h"
+#include "bblog.h"
+
+/* cost of an operation on top of its bytes, so small ones aren't free */
+#define FAIRQ_OP_COST 4096
+/* heaviest weight accepted */
+#define FAIRQ_WEIGHT_MAX 1000
+/* flows kept before idle ones are forgotten */
+#define FAIRQ_FLOWS 1024
+#define FAIRQ_BUCKETS 64
+
+struct fairq_flow {
+    uint32_t id;
+    unsigned int weight;
+    double finish;		/* tag of its last request */
+    unsigned int waiting;
+    struct fairq_flow* next;
+};
+
+struct fairq_wait {
+    double tag;
+    int granted;
+    pthread_cond_t cond;
+    struct fairq_flow* flow;
+    struct fairq_wait* next;
+};
+
+struct fairq_weight {
+    uint32_t id;
+    unsigned int weight;
+};
+
+struct fairq {
+    pthread_mutex_t lock;
+    unsigned int slots;
+    unsigned int busy;
+    double vtime;
+    struct fairq_wait* waiters;	/* by tag, then arrival */
+    struct fairq_flow* flows[FAIRQ_BUCKETS];
+    unsigned int nflows;
+    struct fairq_weight* weights;
+    unsigned int nweights;
+};
+
+static int parse_weights(struct fairq* s, const char* spec){
+    const char* p;
+    char* end;
+    unsigned long id, w;
+    unsigned int n = 1;
+
+    for(p = spec; *p; p++)
+	if(*p == ':')
+	    n++;
+    s->weights = calloc(n, sizeof(*s->weights));
+    if(!s->weights)
+	return -ENOMEM;
+    for(p = spec; *p; p = end + (*end == ':')){
+	errno = 0;
+	id = strtoul(p, &end, 10);
+	if(errno || end == p || *end != '=' || id > UINT32_MAX)
+	    return -EINVAL;
+	p = end + 1;
+	w = strtoul(p, &end, 10);
+	if(errno || end == p || (*end && *end != ':') ||
+	   w < 1 || w > FAIRQ_WEIGHT_MAX)
+	    return -EINVAL;
+	s->weights[s->nweights].id = id;
+	s->weights[s->nweights].weight = w;
+	s->nweights++;
+    }
+    return 0;
+}
+
+struct fairq* fairq_new(unsigned int slots, const char* weights){
+    struct fairq* s;
+    int ret;
+
+    if(!slots){
+	errno = EINVAL;
+	return NULL;
+    }
+    s = calloc(1, sizeof(*s));
+    if(!s)
+	return NULL;
+    s->slots = slots;
+    if(weights && (ret = parse_weights(s, weights)) < 0){
+	free(s->weights);
+	free(s);
+	errno = -ret;
+	return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+/* Forget flows with nothing queued that are no longer ahead of virtual
+ * time; they would start from it anyway. Called with lock held. */
+static void prune_flows(struct fairq* s){
+    struct fairq_flow** pp;
+    struct fairq_flow* f;
+    unsigned int i;
+
+    for(i = 0; i < FAIRQ_BUCKETS; i++){
+	pp = &s->flows[i];
+	while((f = *pp)){
+	    if(!f->waiting && f->finish <= s->vtime){
+		*pp = f->next;
+		free(f);
+		s->nflows--;
+	    }
+	    else
+		pp = &f->next;
+	}
+    }
+}
+
+/* Called with lock held */
+static struct fairq_flow* get_flow(struct fairq* s, uint32_t id){
+    struct fairq_flow* f;
+    unsigned int b = id % FAIRQ_BUCKETS;
+    unsigned int i;
+
+    for(f = s->flows[b]; f; f = f->next)
+	if(f->id == id)
+	    return f;
+    if(s->nflows >= FAIRQ_FLOWS)
+	prune_flows(s);
+    f = calloc(1, sizeof(*f));
+    if(!f)
+	return NULL;
+    f->id = id;
+    f->weight = 1;
+    for(i = 0; i < s->nweights; i++)
+	if(s->weights[i].id == id)
+	    f->weight = s->weights[i].weight;
+    f->finish = s->vtime;
+    f->next = s->flows[b];
+    s->flows[b] = f;
+    s->nflows++;
+    return f;
+}
+
+void fairq_enter(struct fairq* s, uint32_t flow, size_t bytes){
+    struct fairq_wait w;
+    struct fairq_wait** pp;
+    struct fairq_flow* f;
+    unsigned int weight;
+    double start;
+
+    pthread_mutex_lock(&s->lock);
+    f = get_flow(s, flow);
+    weight = f ? f->weight : 1;
+    start = f && f->finish > s->vtime ? f->finish : s->vtime;
+    w.tag = start + (double) (bytes + FAIRQ_OP_COST) / weight;
+    if(f)
+	f->finish = w.tag;
+
+    if(s->busy < s->slots && !s->waiters){
+	s->busy++;
+	s->vtime = w.tag;
+	pthread_mutex_unlock(&s->lock);
+	return;
+    }
+
+    w.granted = 0;
+    w.flow = f;
+    pthread_cond_init(&w.cond, NULL);
+    for(pp = &s->waiters; *pp; pp = &(*pp)->next)
+	if((*pp)->tag > w.tag)
+	    break;
+    w.next = *pp;
+    *pp = &w;
+    if(f)
+	f->waiting++;
+    bblog(BBLOG_DEBUG, "fairq: flow %u waits, tag %.0f, vtime %.0f",
+	  flow, w.tag, s->vtime);
+    while(!w.granted)
+	pthread_cond_wait(&w.cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    pthread_cond_destroy(&w.cond);
+}
+
+void fairq_leave(struct fairq* s){
+    struct fairq_wait* w;
+
+    pthread_mutex_lock(&s->lock);
+    w = s->waiters;
+    if(w){
+	s->waiters = w->next;
+	if(w->flow)
+	    w->flow->waiting--;
+	s->vtime = w->tag;
+	w->granted = 1;
+	pthread_cond_signal(&w->cond);
+    }
+    else
+	s->busy--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void fairq_free(struct fairq* s){
+    struct fairq_flow* f;
+    unsigned int i;
+
+    if(!s)
+	return;
+    for(i = 0; i < FAIRQ_BUCKETS; i++)
+	while((f = s->flows[i])){
+	    s->flows[i] = f->next;
+	    free(f);
+	}
+    free(s->weights);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
@@ -0,0 +1,61 @@
+/* fairq.h
+ * Weighted fair admission of data operations for fusec
+ *
+ * Every request fusec serves runs on a FUSE worker thread as soon as it
+ * arrives, so one process streaming a large file keeps the crypto (and
+ * the backing disk) busy with as many requests as the kernel lets it
+ * have in flight, and a small read from anyone else waits behind them.
+ *
+ * With a scheduler, reads and writes first have to get one of a few
+ * slots. While all are taken, waiting requests get them in weighted
+ * fair queuing order between flows (the callers, by uid or pid): each
+ * request is tagged with the virtual time at which its flow would have
+ * finished it, at its flow's weight, and the smallest tag goes next
+ * (self-clocked: virtual time is the tag of the last request admitted).
+ * A flow that has been idle starts at the current virtual time, so it
+ * gets in ahead of a flow with a long backlog; a backlogged flow can't
+ * bank credit for later.
+ *
+ * Metadata operations don't go through the scheduler at all, so they
+ * never wait behind data.
+ *
+ */
+
+#ifndef FAIRQ_H
+#define FAIRQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fairq;
+
+/* struct fairq* fairq_new(unsigned int slots, const char* weights)
+ * Purpose: Create a scheduler
+ * Args: unsigned int slots   : Operations admitted at once
+ *       const char* weights  : Flow weights, "ID=W:ID=W:..." (NULL: all 1;
+ *                              flows not listed have weight 1)
+ * Return: Scheduler on success, NULL on error (errno set; EINVAL for a
+ *         bad weight list)
+ */
+extern struct fairq* fairq_new(unsigned int slots, const char* weights);
+
+/* void fairq_enter(struct fairq* s, uint32_t flow, size_t bytes)
+ * Purpose: Wait for a slot. Every fairq_enter() is paired with a
+ *          fairq_leave() once the operation is done.
+ * Args: struct fairq* s : Scheduler
+ *       uint32_t flow   : Whose operation it is
+ *       size_t bytes    : How much data it moves (its cost)
+ */
+extern void fairq_enter(struct fairq* s, uint32_t flow, size_t bytes);
+
+/* void fairq_leave(struct fairq* s)
+ * Purpose: Give a slot back
+ */
+extern void fairq_leave(struct fairq* s);
+
+/* void fairq_free(struct fairq* s)
+ * Purpose: Free a scheduler nobody is waiting in
+ */
+extern void fairq_free(struct fairq* s);
+
+#endif
@@ -0,0 +1,492 @@
+/* fusec-replay.c
+ * Replays a fusec operation trace (-o trace=FILE) against a mount
+ *
+ * Every thread in the trace gets a thread here, which issues that
+ * thread's operations in order through the normal system calls, at the
+ * times they were originally issued (divided by the speedup), or back to
+ * back with -s 0. The data written is a fixed pattern; traces do not
+ * record file contents.
+ *
+ * Afterwards it prints, per operation, the latency fusec had when the
+ * trace was recorded next to the latency seen now (which includes the
+ * kernel round trip), and the overall throughput of both runs.
+ *
+ * Replay against a copy of the tree the trace was recorded on, or the
+ * operations will mostly fail; failures that did not happen in the
+ * original are counted.
+ *
+ */
+
+#ifdef linux
+/* For utimensat() */
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "optrace.h"
+
+#define USAGE "[-s speedup] <trace file> <mountpoint>"
+/* xattr names are not traced; this one stands in for all of them */
+#define REPLAY_XATTR "user.fusec-replay"
+/* open files each replay thread keeps */
+#define REPLAY_FDS 16
+
+struct replay_fd {
+    uint32_t path;
+    int fd;
+    int writable;
+};
+
+struct replay_thread {
+    pthread_t thread;
+    uint32_t tid;
+    size_t* recs;		/* indices into the trace, in order */
+    size_t nrecs, cap;
+    struct replay_fd fds[REPLAY_FDS];
+    unsigned int nextfd;
+    char* buf;
+    size_t buflen;
+};
+
+static struct optrace_rec* recs;
+static size_t nrecs;
+static uint64_t* latency;	/* replay latency of each record, ns */
+static int* result;		/* replay result of each record */
+static char** paths;
+static size_t npaths;
+static const char* mnt;
+static double speedup = 1;
+static struct timespec t0;
+
+static uint64_t ts_ns(const struct timespec* ts){
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+static int full_path(uint32_t id, char out[PATH_MAX]){
+    if(id == OPTRACE_NOPATH || id >= npaths || !paths[id])
+	return -1;
+    if(snprintf(out, PATH_MAX, "%s%s", mnt, paths[id]) >= PATH_MAX)
+	return -1;
+    return 0;
+}
+
+static int load(const char* file){
+    unsigned char hdr[OPTRACE_HDRLEN], rec[OPTRACE_RECLEN];
+    size_t reccap = 0;
+    uint32_t id, len;
+    FILE* fp;
+    void* tmp;
+
+    fp = fopen(file, "r");
+    if(!fp){
+	perror(file);
+	return -1;
+    }
+    if(fread(hdr, OPTRACE_HDRLEN, 1, fp) != 1 || memcmp(hdr, OPTRACE_MAGIC, 8)){
+	fprintf(stderr, "%s: not a fusec trace\n", file);
+	fclose(fp);
+	return -1;
+    }
+    while(fread(rec, 1, 1, fp) == 1){
+	if(rec[0] == OPTRACE_PATH){
+	    if(fread(rec + 1, OPTRACE_PATHLEN - 1, 1, fp) != 1)
+		break;
+	    memcpy(&id, rec + 4, 4);
+	    memcpy(&len, rec + 8, 4);
+	    if(id >= npaths){
+		tmp = realloc(paths, (id + 1) * 2 * sizeof(*paths));
+		if(!tmp)
+		    goto nomem;
+		paths = tmp;
+		memset(paths + npaths, 0, ((id + 1) * 2 - npaths) * sizeof(*paths));
+		npaths = (id + 1) * 2;
+	    }
+	    free(paths[id]);
+	    paths[id] = malloc(len + 1);
+	    if(!paths[id])
+		goto nomem;
+	    if(len && fread(paths[id], len, 1, fp) != 1)
+		break;
+	    paths[id][len] = '\0';
+	}
+	else if(rec[0] == OPTRACE_OP){
+	    if(fread(rec + 1, OPTRACE_RECLEN - 1, 1, fp) != 1)
+		break;
+	    if(nrecs == reccap){
+		reccap = reccap ? 2 * reccap : 4096;
+		tmp = realloc(recs, reccap * sizeof(*recs));
+		if(!tmp)
+		    goto nomem;
+		recs = tmp;
+	    }
+	    optrace_decode(rec, &recs[nrecs++]);
+	}
+	else{
+	    fprintf(stderr, "%s: bad record, stopping there\n", file);
+	    break;
+	}
+    }
+    fclose(fp);
+    return 0;
+
+ nomem:
+    fprintf(stderr, "out of memory\n");
+    fclose(fp);
+    return -1;
+}
+
+static char* get_buf(struct replay_thread* t, size_t len){
+    char* tmp;
+
+    if(len > t->buflen){
+	tmp = realloc(t->buf, len);
+	if(!tmp)
+	    return NULL;
+	memset(tmp, 'r', len);
+	t->buf = tmp;
+	t->buflen = len;
+    }
+    return t->buf;
+}
+
+/* An fd for path, kept open for later operations on it */
+static int get_fd(struct replay_thread* t, uint32_t id, int write){
+    char p[PATH_MAX];
+    struct replay_fd* f;
+    unsigned int i;
+    int fd, writable = 1;
+
+    for(i = 0; i < REPLAY_FDS; i++){
+	f = &t->fds[i];
+	if(f->fd > 0 && f->path == id && (f->writable || !write))
+	    return f->fd;
+    }
+    if(full_path(id, p) < 0)
+	return -1;
+    fd = open(p, O_RDWR);
+    if(fd == -1 && !write){
+	fd = open(p, O_RDONLY);
+	writable = 0;
+    }
+    if(fd == -1)
+	return -1;
+    f = &t->fds[t->nextfd++ % REPLAY_FDS];
+    if(f->fd > 0)
+	close(f->fd);
+    f->path = id;
+    f->fd = fd;
+    f->writable = writable;
+    return fd;
+}
+
+/* Names changed: nothing kept open may be found by its old name */
+static void drop_fds(struct replay_thread* t){
+    unsigned int i;
+
+    for(i = 0; i < REPLAY_FDS; i++)
+	if(t->fds[i].fd > 0){
+	    close(t->fds[i].fd);
+	    t->fds[i].fd = 0;
+	}
+}
+
+static long issue(struct replay_thread* t, const struct optrace_rec* r){
+    char p[PATH_MAX], p2[PATH_MAX];
+    struct statvfs sv;
+    struct stat st;
+    struct dirent* de;
+    DIR* dir;
+    char* buf;
+    long res;
+    int fd;
+
+    if(r->op == OPT_STATFS)
+	return statvfs(mnt, &sv);
+    if(full_path(r->path, p) < 0)
+	return -1;
+    switch(r->op){
+    case OPT_GETATTR:
+	return lstat(p, &st);
+    case OPT_ACCESS:
+	return access(p, r->size);
+    case OPT_READLINK:
+	buf = get_buf(t, r->size + 1);
+	return buf ? readlink(p, buf, r->size) : -1;
+    case OPT_READDIR:
+	dir = opendir(p);
+	if(!dir)
+	    return -1;
+	while((de = readdir(dir)))
+	    ;
+	closedir(dir);
+	return 0;
+    case OPT_MKNOD:
+	return mknod(p, r->size, r->off);
+    case OPT_MKDIR:
+	return mkdir(p, r->size);
+    case OPT_SYMLINK:
+	if(r->path2 >= npaths || !paths[r->path2])
+	    return -1;
+	return symlink(paths[r->path2], p);
+    case OPT_UNLINK:
+	drop_fds(t);
+	return unlink(p);
+    case OPT_RMDIR:
+	drop_fds(t);
+	return rmdir(p);
+    case OPT_RENAME:
+	drop_fds(t);
+	return full_path(r->path2, p2) < 0 ? -1 : rename(p, p2);
+    case OPT_LINK:
+	return full_path(r->path2, p2) < 0 ? -1 : link(p, p2);
+    case OPT_CHMOD:
+	return chmod(p, r->size);
+    case OPT_CHOWN:
+	return lchown(p, r->off, r->size);
+    case OPT_TRUNCATE:
+	return truncate(p, r->off);
+    case OPT_UTIMENS:
+	return utimensat(AT_FDCWD, p, NULL, AT_SYMLINK_NOFOLLOW);
+    case OPT_OPEN:
+	fd = open(p, r->size & (O_ACCMODE | O_TRUNC | O_APPEND));
+	return fd == -1 ? -1 : close(fd);
+    case OPT_CREATE:
+	fd = open(p, O_CREAT | O_WRONLY | O_TRUNC, r->size & 07777);
+	return fd == -1 ? -1 : close(fd);
+    case OPT_READ:
+	buf = get_buf(t, r->size);
+	fd = get_fd(t, r->path, 0);
+	return (!buf || fd < 0) ? -1 : pread(fd, buf, r->size, r->off);
+    case OPT_WRITE:
+	buf = get_buf(t, r->size);
+	fd = get_fd(t, r->path, 1);
+	return (!buf || fd < 0) ? -1 : pwrite(fd, buf, r->size, r->off);
+    case OPT_FSYNC:
+	fd = get_fd(t, r->path, 0);
+	if(fd < 0)
+	    return -1;
+	return r->size ? fdatasync(fd) : fsync(fd);
+    case OPT_SETXATTR:
+	buf = get_buf(t, r->size);
+	return buf ? lsetxattr(p, REPLAY_XATTR, buf, r->size, 0) : -1;
+    case OPT_GETXATTR:
+	buf = get_buf(t, r->size);
+	return buf ? lgetxattr(p, REPLAY_XATTR, buf, r->size) : -1;
+    case OPT_LISTXATTR:
+	buf = get_buf(t, r->size);
+	return buf ? llistxattr(p, buf, r->size) : -1;
+    case OPT_REMOVEXATTR:
+	return lremovexattr(p, REPLAY_XATTR);
+    default:
+	/* release: the kernel sends it for the closes above */
+	res = 0;
+    }
+    return res;
+}
+
+static void* replay_thread(void* arg){
+    struct replay_thread* t = arg;
+    const struct optrace_rec* r;
+    struct timespec at;
+    uint64_t when, start;
+    size_t i;
+    long res;
+
+    for(i = 0; i < t->nrecs; i++){
+	r = &recs[t->recs[i]];
+	if(speedup > 0){
+	    when = ts_ns(&t0) + (uint64_t)(r->start / speedup);
+	    at.tv_sec = when / 1000000000;
+	    at.tv_nsec = when % 1000000000;
+	    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+		;
+	}
+	start = now_ns();
+	res = issue(t, r);
+	latency[t->recs[i]] = now_ns() - start;
+	result[t->recs[i]] = res < 0 ? -errno : 0;
+    }
+    drop_fds(t);
+    free(t->buf);
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* mean and 99th percentile of v (sorted in place), in us */
+static void stats(uint64_t* v, size_t n, double* mean, double* p99){
+    double sum = 0;
+    size_t i;
+
+    qsort(v, n, sizeof(*v), cmp_u64);
+    for(i = 0; i < n; i++)
+	sum += v[i];
+    *mean = sum / n / 1000;
+    *p99 = v[n * 99 / 100] / 1000.0;
+}
+
+static void report(uint64_t wall){
+    uint64_t *orig, *now;
+    uint64_t span = 0, rbytes = 0, wbytes = 0;
+    double om, op, nm, np;
+    size_t i, n, errs;
+    unsigned int op_;
+
+    orig = malloc(nrecs * sizeof(*orig));
+    now = malloc(nrecs * sizeof(*now));
+    if(!orig || !now){
+	fprintf(stderr, "out of memory\n");
+	return;
+    }
+    printf("%-16s %8s %8s %12s %12s %12s %12s\n", "op", "count", "new errs",
+	   "orig mean us", "orig p99 us", "now mean us", "now p99 us");
+    for(op_ = 1; op_ < OPT_NOPS; op_++){
+	for(i = n = errs = 0; i < nrecs; i++){
+	    if(recs[i].op != op_)
+		continue;
+	    orig[n] = recs[i].dur;
+	    now[n] = latency[i];
+	    if(result[i] < 0 && recs[i].res >= 0)
+		errs++;
+	    n++;
+	}
+	if(!n)
+	    continue;
+	stats(orig, n, &om, &op);
+	stats(now, n, &nm, &np);
+	printf("%-16s %8zu %8zu %12.1f %12.1f %12.1f %12.1f\n",
+	       optrace_op_name(op_), n, errs, om, op, nm, np);
+    }
+    for(i = 0; i < nrecs; i++){
+	if(recs[i].start + recs[i].dur > span)
+	    span = recs[i].start + recs[i].dur;
+	if(recs[i].op == OPT_READ && recs[i].res > 0)
+	    rbytes += recs[i].res;
+	if(recs[i].op == OPT_WRITE && recs[i].res > 0)
+	    wbytes += recs[i].res;
+    }
+    if(nrecs)
+	span -= recs[0].start;
+    printf("\n%-16s %12s %12s %12s %12s\n", "", "seconds", "ops/s", "read MB/s", "write MB/s");
+    printf("%-16s %12.3f %12.0f %12.1f %12.1f\n", "original", span / 1e9,
+	   span ? nrecs / (span / 1e9) : 0, span ? rbytes / (span / 1e3) : 0,
+	   span ? wbytes / (span / 1e3) : 0);
+    printf("%-16s %12.3f %12.0f %12.1f %12.1f\n", "replay", wall / 1e9,
+	   wall ? nrecs / (wall / 1e9) : 0, wall ? rbytes / (wall / 1e3) : 0,
+	   wall ? wbytes / (wall / 1e3) : 0);
+    free(orig);
+    free(now);
+}
+
+int main(int argc, char* argv[]){
+    struct replay_thread* threads = NULL;
+    size_t nthreads = 0, i, k;
+    size_t* tmp;
+    void* grown;
+    uint64_t wall;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:")) != -1){
+	if(opt == 's')
+	    speedup = atof(optarg);
+	else{
+	    fprintf(stderr, "Usage: %s %s\n", argv[0], USAGE);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if(argc - optind != 2 || speedup < 0){
+	fprintf(stderr, "Usage: %s %s\n", argv[0], USAGE);
+	fprintf(stderr, "  -s N  N times the original speed (default 1, 0: no waiting)\n");
+	exit(EXIT_FAILURE);
+    }
+    mnt = argv[optind + 1];
+    if(load(argv[optind]) < 0)
+	exit(EXIT_FAILURE);
+    latency = calloc(nrecs + 1, sizeof(*latency));
+    result = calloc(nrecs + 1, sizeof(*result));
+    if(!latency || !result){
+	fprintf(stderr, "out of memory\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* one replay thread per traced thread, each in trace order */
+    for(i = 0; i < nrecs; i++){
+	for(k = 0; k < nthreads && threads[k].tid != recs[i].tid; k++)
+	    ;
+	if(k == nthreads){
+	    grown = realloc(threads, (nthreads + 1) * sizeof(*threads));
+	    if(!grown){
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	    }
+	    threads = grown;
+	    memset(&threads[k], 0, sizeof(*threads));
+	    threads[k].tid = recs[i].tid;
+	    nthreads++;
+	}
+	if(threads[k].nrecs == threads[k].cap){
+	    threads[k].cap = threads[k].cap ? 2 * threads[k].cap : 256;
+	    tmp = realloc(threads[k].recs, threads[k].cap * sizeof(*tmp));
+	    if(!tmp){
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	    }
+	    threads[k].recs = tmp;
+	}
+	threads[k].recs[threads[k].nrecs++] = i;
+    }
+    printf("%zu operations on %zu threads\n", nrecs, nthreads);
+
+    /* the first operation goes out right away */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if(nrecs && speedup > 0){
+	wall = ts_ns(&t0) - (uint64_t)(recs[0].start / speedup);
+	t0.tv_sec = wall / 1000000000;
+	t0.tv_nsec = wall % 1000000000;
+    }
+    wall = now_ns();
+    for(k = 0; k < nthreads; k++)
+	if(pthread_create(&threads[k].thread, NULL, replay_thread, &threads[k])){
+	    perror("pthread_create");
+	    exit(EXIT_FAILURE);
+	}
+    for(k = 0; k < nthreads; k++)
+	pthread_join(threads[k].thread, NULL);
+    wall = now_ns() - wall;
+
+    report(wall);
+    for(k = 0; k < nthreads; k++)
+	free(threads[k].recs);
+    free(threads);
+    for(i = 0; i < npaths; i++)
+	free(paths[i]);
+    free(paths);
+    free(recs);
+    free(latency);
+    free(result);
+    return EXIT_SUCCESS;
+}
@@ -28,16 +28,23 @@
 #define HAVE_SETXATTR
 /* name for encryption attribute */
 static const char FLAG[] = "user.pa4-encfs.encrypted";
+/* FLAG values: whole-file CBC (original format) and block format (encblk.h) */
+static const char FLAG_LEGACY[] = "true";
+static const char FLAG_BLOCKS[] = "blocks";
+/* and a block map into the shared dedup store (dedup.h) */
+static const char FLAG_DEDUP[] = "dedup";
+/* and blocks striped across several backing directories (stripe.h) */
+static const char FLAG_STRIPED[] = "striped";
+/* per-file override of the direct_io policy: "1" always, "0" never */
+static const char FLAG_DIRECT_IO[] = "user.pa4-encfs.direct_io";
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
-/* For open_memstream() */
-#define _POSIX_C_SOURCE 200809L
+/* For pread()/pwrite(), openat() & co and O_PATH */
+#define _GNU_SOURCE
 /* Linux is missing ENOATTR error, using ENODATA instead */
 #define ENOATTR ENODATA
 #endif
@@ -52,7 +59,24 @@ static const char FLAG[] = "user.pa4-encfs.encrypted";
 #include <sys/time.h>
 #include <stdlib.h> 	
 #include <linux/limits.h>
+#include <stddef.h>
+#include <fnmatch.h>
 #include "aes-crypt.h"
+#include "dirfd-cache.h"
+#include "dirlist-cache.h"
+#include "encblk.h"
+#include "journal.h"
+#include "writeback.h"
+#include "staging.h"
+#include "bblog.h"
+#include "dedup.h"
+#include "optrace.h"
+#include "pack.h"
+#include "fairq.h"
+#include "keepcache.h"
+#include "stripe.h"
+#include "tier.h"
+#include "fuseloop.h"
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
@@ -61,199 +85,828 @@ static const char FLAG[] = "user.pa4-encfs.encrypted";
 #define DECRYPT 0
 #define PASS_THROUGH -1
 
+/* isenc() results */
+#define ENC_NONE 0
+#define ENC_LEGACY 1
+#define ENC_BLOCKS 2
+#define ENC_DEDUP 3
+#define ENC_STRIPED 4
+
+/* ciphertext of a legacy file decrypted at a time */
+#define BB_LEGACY_CHUNK (16 * 1024)
+
+/* how much -o cipher=auto encrypts per cipher to time it */
+#define BB_BENCH_BYTES (4 << 20)
+
+/* fusec's own files in the backing store; hidden from the mount */
+#define BB_INTERNAL_PREFIX ".fusec-"
+#define JOURNAL_NAME ".fusec-journal"
+
 // maintain encfs state in here
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #define XMP_DATA ((struct BB_DATA *) fuse_get_context()->private_data)
 
 struct BB_DATA {
 	char* rootdir;
 	char* key;
+	/* backing root, opened once at mount; everything is *at() relative to it */
+	int rootfd;
+	/* optional cache of parent directory fds (-o dirfd_cache=N) */
+	unsigned int dircache_slots;
+	struct dirfd_cache* dircache;
+	/* inotify backed readdir cache (-o dirlist_cache=N, 0 = off) */
+	unsigned int dirlist_slots;
+	struct dirlist_cache* dirlist;
+	/* block format keys, derived once from the key phrase */
+	struct encblk_keys blkkeys;
+	/* cipher for new files: -o cipher=NAME|auto, where auto picks
+	   the fastest of -o ciphers=A:B:... */
+	char* cipher_name;
+	char* cipher_allow;
+	uint32_t cipher;
+	/* write-ahead journal for in-place block updates (-o journal_mb=N) */
+	unsigned int journal_mb;
+	struct journal* journal;
+	/* journaled updates not written back yet (-o dirty_mb=N), committed
+	   at least every -o commit_ms=N */
+	unsigned int dirty_mb;
+	unsigned int commit_ms;
+	struct writeback* wb;
+	/* writes staged in memory and encrypted in the background
+	   (-o stage_workers=N, 0 = off; at most -o stage_mb=N staged) */
+	unsigned int stage_workers;
+	unsigned int stage_mb;
+	struct staging* stage;
+	/* -o log_level=N, see bblog.h; changed at runtime by SIGUSR1/SIGUSR2 */
+	unsigned int log_level;
+	/* files opened with direct_io (no FUSE page cache): at least
+	   -o direct_io_mb=N MB (0 = no size limit), or matching one of
+	   -o direct_io_paths=GLOB:GLOB:..., unless FLAG_DIRECT_IO says otherwise */
+	unsigned int direct_io_mb;
+	char* direct_io_paths;
+	/* new files are block maps into a deduplicated store (-o dedup);
+	   the store is opened whenever it exists */
+	int dedup;
+	struct dedup* dd;
+	/* every operation served is recorded in -o trace=FILE (optrace.h) */
+	char* trace_file;
+	struct optrace* trace;
+	/* small files kept in per-directory containers (pack.h): new files
+	   start out packed with -o pack, and stay so up to -o pack_max=N
+	   bytes; the containers are opened whenever there are any */
+	int pack;
+	unsigned int pack_max;
+	struct pack* pk;
+	/* reads and writes admitted -o sched_slots=N at a time (0 = off)
+	   in weighted fair order between uids (pids with -o sched_by=pid),
+	   weighted by -o sched_weights=ID=W:ID=W:... */
+	unsigned int sched_slots;
+	char* sched_by;
+	char* sched_weights;
+	int sched_pid;
+	struct fairq* sched;
+	/* files opened unchanged since their last open keep the kernel's
+	   page cache (keepcache.h); -o keep_cache=N files remembered, 0 = off
+	   (the default) */
+	unsigned int keep_slots;
+	struct keepcache* kc;
+	/* new files striped over the root and -o stripe_dirs=DIR:DIR:...
+	   in -o stripe_kb=N units (stripe.h), unless they are dedup files;
+	   the layout is opened whenever the root has one */
+	char* stripe_dirs;
+	unsigned int stripe_kb;
+	struct stripe* stripe;
+	/* copies of the most read block files in -o tier_dir=DIR (tier.h),
+	   at most -o tier_mb=N MB, made once a file's heat is -o tier_hot=N */
+	char* tier_dir;
+	unsigned int tier_mb;
+	unsigned int tier_hot;
+	struct tier* tier;
+	/* fusec's own session loop (fuseloop.h) with at most -o workers=N
+	   data and -o meta_workers=N metadata workers (0 = libfuse's loop,
+	   resp. one shared pool), pinned to -o worker_cpus= and -o
+	   meta_cpus=, exiting after -o worker_idle_ms=N idle (0 = never) */
+	unsigned int workers;
+	unsigned int meta_workers;
+	char* worker_cpus;
+	char* meta_cpus;
+	unsigned int worker_idle_ms;
+};
+
+/* is name one of fusec's own files (journal, ...)? */
+static int bb_internal_name(const char *name)
+{
+	return !strncmp(name, BB_INTERNAL_PREFIX, sizeof(BB_INTERNAL_PREFIX) - 1);
+}
+
+/* A backing-store location: a directory fd and a name relative to it */
+struct bb_at {
+	int dirfd;
+	const char *name;
+	struct dirfd_slot *slot;
 };
 
+/* Resolves a mount path to a (dirfd, name) pair. Without the dirfd cache
+ * this is just the root fd and the path minus its leading '/'; with it the
+ * parent directory comes out of the cache so the kernel only has to look
+ * up the last component. Must be paired with bb_at_put(). */
+static int bb_at_get(const char *path, struct bb_at *at)
+{
+	struct BB_DATA *data = XMP_DATA;
+	const char *slash;
+	int fd;
+
+	while (*path == '/')
+		path++;
+	slash = strrchr(path, '/');
+	if (bb_internal_name(slash ? slash + 1 : path))
+		return -ENOENT;
+	at->dirfd = data->rootfd;
+	at->name = *path ? path : ".";
+	at->slot = NULL;
+
+	if (data->dircache == NULL)
+		return 0;
+	if (slash == NULL)
+		return 0;
+
+	fd = dirfd_cache_get(data->dircache, path, slash - path, &at->slot);
+	if (fd < 0)
+		return fd;
+	at->dirfd = fd;
+	at->name = slash + 1;
+	return 0;
+}
+
+static void bb_at_put(struct bb_at *at)
+{
+	if (at->dirfd != XMP_DATA->rootfd)
+		dirfd_cache_put(XMP_DATA->dircache, at->slot, at->dirfd);
+}
+
+/* Drops cached listings that a change to path makes stale: always the
+ * parent's, and with subtree set also path's own and everything below it
+ * (for directories that were removed or moved) */
+static void bb_dirlist_changed(const char *path, int subtree)
+{
+	struct dirlist_cache *c = XMP_DATA->dirlist;
+	const char *slash;
+
+	if (c == NULL)
+		return;
+	slash = strrchr(path, '/');
+	dirlist_cache_invalidate(c, path, slash > path ? (size_t)(slash - path) : 1, 0);
+	if (subtree)
+		dirlist_cache_invalidate(c, path, strlen(path), 1);
+}
+
+/* Opens a file relative to the backing root */
+static int bb_openat(const char *path, int flags, mode_t mode)
+{
+	struct bb_at at;
+	int res;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = openat(at.dirfd, at.name, flags, mode);
+	if (res == -1)
+		res = -errno;
+	bb_at_put(&at);
+	return res;
+}
+
+/* Is path a packed file (see pack.h)? Asked once the backing store has
+ * said ENOENT: a name is never both. */
+static int bb_packed(const char *path, struct pack_attr *a)
+{
+	if (XMP_DATA->pk == NULL)
+		return 0;
+	return pack_getattr(XMP_DATA->pk, path, a) == 0;
+}
+
+/* access() for a packed file, checked the way the kernel checks the
+ * backing files: against fusec's own credentials */
+static int bb_pack_access(const struct pack_attr *a, int mask)
+{
+	mode_t mode = a->mode;
+
+	if (mask == F_OK)
+		return 0;
+	if (geteuid() == 0)
+		return (mask & X_OK) && !(mode & 0111) ? -EACCES : 0;
+	if (geteuid() == a->uid)
+		mode >>= 6;
+	else if (getegid() == a->gid)
+		mode >>= 3;
+	return (mode & mask & 07) == (unsigned int)(mask & 07) ? 0 : -EACCES;
+}
+
+static void bb_pack_stat(const struct pack_attr *a, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode = a->mode;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = a->uid;
+	stbuf->st_gid = a->gid;
+	stbuf->st_size = a->size;
+	stbuf->st_blksize = ENCBLK_SIZE;
+	stbuf->st_blocks = (a->size + 511) / 512;
+	stbuf->st_atim = a->atime;
+	stbuf->st_mtim = a->mtime;
+	stbuf->st_ctim = a->ctime;
+}
+
+/* chmod() and co. on a packed file, once the backing store said res */
+static int bb_pack_setattr(const char *path, int what, const struct pack_attr *a,
+			   int res)
+{
+	int pres;
+
+	if (res != -ENOENT || XMP_DATA->pk == NULL)
+		return res;
+	pres = pack_setattr(XMP_DATA->pk, path, what, a);
+	return pres == -ENOENT ? res : pres;
+}
 
+/* Path of a backing location for calls without an *at() variant
+ * (l___xattr()): its directory fd through /proc, so only the last
+ * component is looked up again and nothing has to be opened */
+static int bb_procpath(char fpath[PATH_MAX], const struct bb_at *at)
+{
+	if (snprintf(fpath, PATH_MAX, "/proc/self/fd/%d/%s", at->dirfd, at->name) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	return 0;
+}
 
-static void bb_fullpath(char fpath[PATH_MAX], const char *path)
+static ssize_t bb_getflag(int fd, const char *fpath, char *value, size_t size)
 {
-    strcpy(fpath, XMP_DATA->rootdir);
-    strncat(fpath, path, PATH_MAX);
+	if (fpath)
+		return lgetxattr(fpath, FLAG, value, size);
+	return fgetxattr(fd, FLAG, value, size);
 }
 
 /*Checks for flags to see if the file is encrypted
- * Returns 1 if the file is encrypted and 0 if it is
- * not. The attribute manipulation is taken straight 
- * out of xattr-util.c!*/
-static int isenc(const char *path){
+ * Returns ENC_LEGACY, ENC_BLOCKS, ENC_DEDUP or ENC_STRIPED if the file
+ * is encrypted
+ * and ENC_NONE if it is not. The attribute manipulation is taken straight 
+ * out of xattr-util.c! Reads the attribute off the open fd, or without one
+ * off fpath (see isenc_at()); path is only for messages.
+ * Runs on nearly every operation, so it only logs at debug level
+ * unless something is actually wrong.*/
+static int isenc_get(int fd, const char *fpath, const char *path){
 	ssize_t valsize;
 	char *tmpval;
+	int enc, res;
 
 	/* get the size of the value */
-	valsize = getxattr(path, FLAG, NULL, 0);
+	valsize = bb_getflag(fd, fpath, NULL, 0);
 	if(valsize < 0){
 	    if(errno == ENOATTR){
-		fprintf(stderr, "No %s attribute set on %s\n", FLAG, path);
+		bblog(BBLOG_DEBUG, "No %s attribute set on %s", FLAG, path);
 		return 0;
 	    }
 	    else{
-		perror("getxattr error");
-		fprintf(stderr, "path  = %s\n", path);
-		fprintf(stderr, "name  = %s\n", FLAG);
-		fprintf(stderr, "value = %s\n", "NULL");
-		fprintf(stderr, "size  = %zd\n", valsize);
-		return -errno;
+		res = -errno;
+		bblog(BBLOG_ERR, "getxattr %s on %s: %s", FLAG, path, strerror(-res));
+		return res;
 	    }
 	}
 	/* Malloc Value Space */
 	tmpval = malloc(sizeof(*tmpval)*(valsize+1));
 	if(!tmpval){
-	    perror("malloc of 'tmpval' error");
-	    return -errno;
+	    bblog(BBLOG_ERR, "getxattr %s on %s: out of memory", FLAG, path);
+	    return -ENOMEM;
 	}
 	/* Get attribute value */
-	valsize = getxattr(path, FLAG, tmpval, valsize);
+	valsize = bb_getflag(fd, fpath, tmpval, valsize);
 	if(valsize < 0){
 	    if(errno == ENOATTR){
-		fprintf(stdout, "No %s attribute set on %s\n", FLAG, path);
+		bblog(BBLOG_DEBUG, "No %s attribute set on %s", FLAG, path);
+		free(tmpval);
 		return 0;
 	    }
 	    else{
-		perror("getxattr error");
-		fprintf(stderr, "path  = %s\n", path);
-		fprintf(stderr, "name  = %s\n", FLAG);
-		fprintf(stderr, "value = %s\n", tmpval);
-		fprintf(stderr, "size  = %zd\n", valsize);
-		return -errno;
+		res = -errno;
+		bblog(BBLOG_ERR, "getxattr %s on %s: %s", FLAG, path, strerror(-res));
+		free(tmpval);
+		return res;
 	    }
 	}
 
 	/* place NULL terminator at valsize for comparison */
 	tmpval[valsize] = '\0';
 
-	/* if value is "true", it is encrypted. Otherwise, consider it unencrypted */
-	if(!strcmp(tmpval, "true")){
-		return 1;
-	}
+	/* if value is "true", it is encrypted (whole file), "blocks" means the
+	   block format. Otherwise, consider it unencrypted */
+	if(!strcmp(tmpval, FLAG_LEGACY))
+		enc = ENC_LEGACY;
+	else if(!strcmp(tmpval, FLAG_BLOCKS))
+		enc = ENC_BLOCKS;
+	else if(!strcmp(tmpval, FLAG_DEDUP))
+		enc = ENC_DEDUP;
+	else if(!strcmp(tmpval, FLAG_STRIPED))
+		enc = ENC_STRIPED;
 	else
-		return 0;
+		enc = ENC_NONE;
+	free(tmpval);
+	return enc;
+}
+
+static int isenc(int fd, const char *path){
+	return isenc_get(fd, NULL, path);
+}
+
+/* isenc() of a file that isn't open, without opening it */
+static int isenc_at(const struct bb_at *at, const char *path){
+	char fpath[PATH_MAX];
+	int res;
+
+	res = bb_procpath(fpath, at);
+	if (res < 0)
+		return res;
+	return isenc_get(-1, fpath, path);
+}
+
+/* Decrypts a whole-file (legacy) encrypted file open on fd from the
+ * start, straight into buf for the plaintext range [offset, offset +
+ * size), and stops after it. Returns the bytes copied, or -errno. With
+ * buf NULL it decrypts the whole file and returns the plaintext size. */
+static long bb_legacy_pread(int fd, char *buf, size_t size, off_t offset)
+{
+	unsigned char in[BB_LEGACY_CHUNK];
+	unsigned char out[CRYPT_OUTLEN(BB_LEGACY_CHUNK)];
+	struct crypt_ctx *c;
+	off_t pos = 0;
+	off_t at = 0;
+	size_t done = 0;
+	size_t len, skip, n;
+	ssize_t got;
+	long res = 0;
+	int ok;
+
+	c = crypt_init(DECRYPT, XMP_DATA->key);
+	if (c == NULL)
+		return -ENOMEM;
+	for (;;) {
+		got = pread(fd, in, sizeof(in), pos);
+		if (got < 0) {
+			res = -errno;
+			break;
+		}
+		pos += got;
+		if (got > 0)
+			ok = crypt_update(c, out, &len, in, got);
+		else
+			ok = crypt_final(c, out, &len);
+		/* a bad last block (another key) ends the plaintext early,
+		   as it always has with do_crypt */
+		if (!ok)
+			len = 0;
+		if (buf && at + (off_t)len > offset && done < size) {
+			skip = offset > at ? offset - at : 0;
+			n = len - skip;
+			if (n > size - done)
+				n = size - done;
+			memcpy(buf + done, out + skip, n);
+			done += n;
+		}
+		at += len;
+		if (got == 0 || !ok || (buf && done == size))
+			break;
+	}
+	crypt_free(c);
+	if (res < 0)
+		return res;
+	return buf ? (long)done : (long)at;
 }
 
-/* gets us the full path*/
-static void xmp_fullpath(char fpath[PATH_MAX], const char *path)
+/* get size of encrypted file open on fd */
+static long getsize(int fd){
+	return bb_legacy_pread(fd, NULL, 0, 0);
+}
+
+/* Drops a file's fast tier copy before its blocks change; takes data
+ * for the staging workers */
+static void bb_tier_changed(struct BB_DATA *data, int fd)
 {
-	strcpy(fpath, XMP_DATA->rootdir);
-	strncat(fpath, path, PATH_MAX);
+	struct stat st;
+
+	if (data->tier && fstat(fd, &st) == 0)
+		tier_changed(data->tier, &st);
 }
 
-/* get size of encrypted file*/
-static long getsize(char *path){
-	FILE *fp, *temp;
-	long size;
+/* decrypts a whole-file (legacy) encrypted file into memory */
+static int bb_legacy_load(int fd, char **plain, size_t *len)
+{
+	struct iovec iov;
+	struct stat st;
+	size_t n = 0;
+	ssize_t got;
+
+	*plain = NULL;
+	*len = 0;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	iov.iov_len = st.st_size;
+	iov.iov_base = malloc(iov.iov_len + 1);
+	if (iov.iov_base == NULL)
+		return -ENOMEM;
+	while (n < iov.iov_len) {
+		got = pread(fd, (char *)iov.iov_base + n, iov.iov_len - n, n);
+		if (got <= 0)
+			break;
+		n += got;
+	}
+	/* decrypted where it was read: the plaintext is never longer */
+	if (!crypt_iov_inplace(&iov, 1, n, len, DECRYPT, XMP_DATA->key)) {
+		free(iov.iov_base);
+		return -EIO;
+	}
+	*plain = iov.iov_base;
+	return 0;
+}
 
-	fp = fopen(path, "r");
-	if (fp == NULL)
-			return -errno;
+/* Rewrites a legacy file in the block format, in place. The whole new
+ * image goes through the journal, so a crash leaves either the old file
+ * or the converted one. It is written back right away: until the flag
+ * changes on disk the file still reads as legacy. */
+static int bb_legacy_store(int fd, const char *path, struct wb_file *f,
+			   const char *plain, size_t len)
+{
+	struct encblk_hdr hdr;
+	struct encblk_run run;
+	int res;
+
+	encblk_hdr_init(&hdr, XMP_DATA->cipher);
+	res = encblk_build_write(-1, NULL, &XMP_DATA->blkkeys, &hdr, plain, len, 0, &run);
+	if (res < 0)
+		return res;
+	bb_tier_changed(XMP_DATA, fd);
+	res = writeback_update(XMP_DATA->wb, f, fd, path, &hdr, &run,
+			       FLAG, FLAG_BLOCKS, 1);
+	free(run.data);
+	return res;
+}
 
-	/* double check  */
-	if(isenc(path)){
-		/* create temp file and encrypt into it. */
-		temp = tmpfile();
-		if (temp == NULL)
+/* truncate for a file open (read/write) on fd, whatever its format */
+static int bb_truncate_fd(int fd, const char *path, off_t size)
+{
+	struct encblk_hdr hdr;
+	struct encblk_run run;
+	struct wb_file f;
+	char *plain, *tmp;
+	size_t len;
+	int res;
+
+	switch (isenc(fd, path)) {
+	case ENC_BLOCKS:
+		if (XMP_DATA->stage) {
+			res = staging_drain_fd(XMP_DATA->stage, fd);
+			if (res < 0)
+				return res;
+		}
+		res = writeback_lock(XMP_DATA->wb, fd, 1, &f);
+		if (res < 0)
+			return res;
+		res = writeback_hdr(&f, fd, &hdr);
+		if (res == 0)
+			res = encblk_build_truncate(fd, writeback_overlay(&f),
+						    &XMP_DATA->blkkeys, &hdr, size, &run);
+		if (res == 0) {
+			bb_tier_changed(XMP_DATA, fd);
+			res = writeback_update(XMP_DATA->wb, &f, fd, path, &hdr,
+					       &run, NULL, NULL, 0);
+			free(run.data);
+		}
+		writeback_unlock(XMP_DATA->wb, &f);
+		return res;
+	case ENC_DEDUP:
+		if (XMP_DATA->dd == NULL)
+			return -EIO;
+		res = writeback_lock(XMP_DATA->wb, fd, 1, &f);
+		if (res < 0)
+			return res;
+		writeback_exclude(XMP_DATA->wb, &f);
+		res = dedup_truncate(XMP_DATA->dd, XMP_DATA->wb, &f, fd, path, size);
+		writeback_unlock(XMP_DATA->wb, &f);
+		return res;
+	case ENC_STRIPED:
+		if (XMP_DATA->stripe == NULL)
+			return -EIO;
+		res = writeback_lock(XMP_DATA->wb, fd, 1, &f);
+		if (res < 0)
+			return res;
+		res = stripe_truncate(XMP_DATA->stripe, XMP_DATA->wb, &f, fd, path, size);
+		writeback_unlock(XMP_DATA->wb, &f);
+		return res;
+	case ENC_LEGACY:
+		/* converted to the block format on the way */
+		res = writeback_lock(XMP_DATA->wb, fd, 1, &f);
+		if (res < 0)
+			return res;
+		res = bb_legacy_load(fd, &plain, &len);
+		if (res == 0 && (size_t)size > len) {
+			tmp = realloc(plain, size);
+			if (tmp == NULL)
+				res = -ENOMEM;
+			else {
+				memset(tmp + len, 0, size - len);
+				plain = tmp;
+			}
+		}
+		if (res == 0)
+			res = bb_legacy_store(fd, path, &f, plain, size);
+		free(plain);
+		writeback_unlock(XMP_DATA->wb, &f);
+		return res;
+	default:
+		if (ftruncate(fd, size) == -1)
 			return -errno;
-		do_crypt(fp, temp, DECRYPT, XMP_DATA->key);
-		/* get real size */
-		fseek(temp, 0, SEEK_END);
-		size = ftell(temp);
-		fclose(fp);
-	}
-	else{
-		fprintf(stderr, "LIES");
-		return -errno;
+		return 0;
 	}
-	
-	return size;
+}
+
+static int bb_write_blocks(void *arg, int fd, const char *path,
+			   const char *buf, size_t size, off_t offset);
+static int bb_unlink_at(int dirfd, const char *name, const char *path);
+
+/* pack_unpack() callback: recreates a packed file as a backing file in
+ * the format new files get, with its contents synced (see pack.h) */
+static int bb_unpack_make(void *arg, const char *path, const char *data,
+			  const struct pack_attr *a)
+{
+	struct BB_DATA *bd = arg;
+	struct encblk_hdr hdr;
+	unsigned char hbuf[ENCBLK_HDRLEN];
+	const char *format = FLAG_BLOCKS;
+	struct timespec ts[2];
+	struct wb_file f;
+	struct bb_at at;
+	int fd, res = 0;
+
+	fd = bb_openat(path, O_CREAT | O_EXCL | O_RDWR, a->mode & 07777);
+	if (fd < 0)
+		return fd;
+	if (bd->dedup && bd->dd)
+		format = FLAG_DEDUP;
+	else if (bd->stripe_dirs && bd->stripe) {
+		format = FLAG_STRIPED;
+		res = stripe_init_file(bd->stripe, fd);
+	}
+	if (res == 0 && fsetxattr(fd, FLAG, format, strlen(format), 0) == -1)
+		res = -errno;
+	encblk_hdr_init(&hdr, bd->cipher);
+	encblk_hdr_encode(&hdr, hbuf);
+	if (res == 0 && pwrite(fd, hbuf, ENCBLK_HDRLEN, 0) != ENCBLK_HDRLEN)
+		res = -EIO;
+	if (res == 0 && a->size && format != FLAG_BLOCKS) {
+		res = writeback_lock(bd->wb, fd, 1, &f);
+		if (res == 0) {
+			if (format == FLAG_DEDUP)
+				res = dedup_write(bd->dd, bd->wb, &f, fd, path,
+						  data, a->size, 0);
+			else
+				res = stripe_write(bd->stripe, bd->wb, &f, fd, path,
+						   data, a->size, 0);
+			writeback_unlock(bd->wb, &f);
+		}
+	}
+	else if (res == 0 && a->size)
+		res = bb_write_blocks(bd, fd, path, data, a->size, 0);
+	if (res == 0 && a->size)
+		res = writeback_fsync(bd->wb, fd, 1);
+	if (res == 0) {
+		/* as far as fusec's own credentials allow */
+		if (fchown(fd, a->uid, a->gid) == -1)
+			bblog(BBLOG_DEBUG, "unpack %s: chown: %s", path, strerror(errno));
+		ts[0] = a->atime;
+		ts[1] = a->mtime;
+		futimens(fd, ts);
+	}
+	close(fd);
+	if (res < 0 && bb_at_get(path, &at) == 0) {
+		bb_unlink_at(at.dirfd, at.name, path);
+		bb_at_put(&at);
+	}
+	return res;
+}
+
+/* Moves a packed file out of its container, for what only backing files
+ * can do (grow past -o pack_max, links, xattrs). -ENOENT if it is not
+ * packed (any more). */
+static int bb_unpack(const char *path)
+{
+	if (XMP_DATA->pk == NULL)
+		return -ENOENT;
+	return pack_unpack(XMP_DATA->pk, path, bb_unpack_make, XMP_DATA);
 }
 
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+	int fd;
+	int enc;
 	long unecrsize;
-
-	res = lstat(fpath, stbuf);
-	if (res == -1)
-		return -errno;
+	struct encblk_hdr hdr;
+	struct wb_file f;
+	struct stg_file *sf;
+	uint64_t end;
+	struct bb_at at;
+	struct pack_attr pa;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = fstatat(at.dirfd, at.name, stbuf, AT_SYMLINK_NOFOLLOW);
+	if (res == -1) {
+		res = -errno;
+		bb_at_put(&at);
+		if (res == -ENOENT && bb_packed(path, &pa)) {
+			bb_pack_stat(&pa, stbuf);
+			return 0;
+		}
+		return res;
+	}
 	/* if the file is encrypted, we'll need to replace the size,
 	since size(unecrypted) != size(encrypted), which is important
 	for some text editors */
 	if(S_ISREG(stbuf->st_mode)){
-		if(isenc(fpath)){
-			unecrsize = getsize(fpath);
-			stbuf->st_size = unecrsize;
+		/* the flag comes off the path: plain files aren't opened */
+		enc = isenc_at(&at, path);
+		if (enc > 0) {
+			fd = openat(at.dirfd, at.name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+			if (fd == -1) {
+				/* its size is in there; the backing one is wrong */
+				res = -errno;
+				bblog(BBLOG_WARN, "getattr %s: can't read size: %s",
+				      path, strerror(-res));
+				bb_at_put(&at);
+				return res;
+			}
+			switch(enc){
+			case ENC_BLOCKS:
+				/* the block format keeps the size in its header
+				   (which may have updates pending) */
+				if (writeback_lock(XMP_DATA->wb, fd, 0, &f) < 0)
+					break;
+				if (writeback_hdr(&f, fd, &hdr) == 0)
+					stbuf->st_size = hdr.size;
+				writeback_unlock(XMP_DATA->wb, &f);
+				/* staged writes may extend it */
+				if (XMP_DATA->stage &&
+				    (sf = staging_pin(XMP_DATA->stage, fd, &end))) {
+					if ((uint64_t)stbuf->st_size < end)
+						stbuf->st_size = end;
+					staging_unpin(XMP_DATA->stage, sf);
+				}
+				break;
+			case ENC_DEDUP:
+			case ENC_STRIPED:
+				/* so do the dedup and striped formats, their
+				   updates pending too */
+				if (writeback_lock(XMP_DATA->wb, fd, 0, &f) < 0)
+					break;
+				if (writeback_hdr(&f, fd, &hdr) == 0)
+					stbuf->st_size = hdr.size;
+				writeback_unlock(XMP_DATA->wb, &f);
+				break;
+			case ENC_LEGACY:
+				unecrsize = getsize(fd);
+				if (unecrsize >= 0)
+					stbuf->st_size = unecrsize;
+				break;
+			}
+			close(fd);
 		}
 	}
+	bb_at_put(&at);
 
 	return 0;
 }
 
 
-/* left untouched except adding 
- * char fpath[PATH_MAX];
- * bb_fullpath(fpath, path);
- * and changing l___attr(path....)
- * to l___attr(fpath...) because fpath is the full path and
- * not the relative one that we feed into our program!
- * (bb_fullpath(fpath,path) hint from 
- * "Writing a FUSE Filesystem: a Tutorial")*/
+/* left untouched except resolving the path with
+ * bb_at_get(path, &at) and switching each call to its
+ * *at() variant (access -> faccessat, etc.), so the kernel
+ * walks the path relative to the backing root fd instead
+ * of from / every time. (bb_fullpath(fpath,path) hint from 
+ * "Writing a FUSE Filesystem: a Tutorial" is what this replaced)*/
 
 static int xmp_access(const char *path, int mask)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
+	struct bb_at at;
+	struct pack_attr pa;
 
-	bb_fullpath(fpath, path);
-	res = access(fpath, mask);
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = faccessat(at.dirfd, at.name, mask, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == -ENOENT && bb_packed(path, &pa))
+		res = bb_pack_access(&pa, mask);
 
-	return 0;
+	return res;
 }
 
 
 static int xmp_readlink(const char *path, char *buf, size_t size)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
+	struct bb_at at;
 
-	bb_fullpath(fpath, path);
-	res = readlink(fpath, buf, size - 1);
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = readlinkat(at.dirfd, at.name, buf, size - 1);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res < 0)
+		return res;
 
 	buf[res] = '\0';
 	return 0;
 }
 
 
+/* pack_list() callback: packed files are listed after the backing entries */
+struct bb_fill {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int bb_pack_fill(void *arg, const char *name, const struct pack_attr *a)
+{
+	struct bb_fill *fill = arg;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = a->mode;
+	return fill->filler(fill->buf, name, &st, 0);
+}
+
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
 	DIR *dp;
 	struct dirent *de;
+	int fd;
+	struct dirlist_cache *c = XMP_DATA->dirlist;
+	struct dirlist *l;
+	const struct dirlist_ent *ents;
+	size_t i, n;
+	struct bb_fill fill = { buf, filler };
 	
 	(void) offset;
 	(void) fi;
+
+	/* serve repeat listings from memory */
+	if (c != NULL && (l = dirlist_cache_lookup(c, path)) == NULL) {
+		fd = bb_openat(path, O_RDONLY | O_DIRECTORY, 0);
+		if (fd < 0)
+			return fd;
+		l = dirlist_cache_load(c, path, fd);
+		if (l == NULL)
+			return -errno;
+	}
+	if (c != NULL) {
+		n = dirlist_entries(l, &ents);
+		for (i = 0; i < n; i++) {
+			struct stat st;
+			if (bb_internal_name(ents[i].name))
+				continue;
+			memset(&st, 0, sizeof(st));
+			st.st_ino = ents[i].ino;
+			st.st_mode = ents[i].type << 12;
+			if (filler(buf, ents[i].name, &st, 0))
+				break;
+		}
+		dirlist_put(c, l);
+		if (XMP_DATA->pk)
+			return pack_list(XMP_DATA->pk, path, bb_pack_fill, &fill);
+		return 0;
+	}
 	
-	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	
-	dp = opendir(fpath);
-	if (dp == NULL)
+	fd = bb_openat(path, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0)
+		return fd;
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
 		return -errno;
+	}
 
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
+		if (bb_internal_name(de->d_name))
+			continue;
 		memset(&st, 0, sizeof(st));
 		st.st_ino = de->d_ino;
 		st.st_mode = de->d_type << 12;
@@ -262,6 +915,8 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	}
 
 	closedir(dp);
+	if (XMP_DATA->pk)
+		return pack_list(XMP_DATA->pk, path, bb_pack_fill, &fill);
 	return 0;
 }
 
@@ -269,240 +924,796 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
-
-	bb_fullpath(fpath, path);
+	struct bb_at at;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	if (bb_packed(path, NULL)) {
+		bb_at_put(&at);
+		return -EEXIST;
+	}
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
-		res = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(at.dirfd, at.name, O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(fpath, mode);
+		res = mkfifoat(at.dirfd, at.name, mode);
 	else
-		res = mknod(fpath, mode, rdev);
+		res = mknodat(at.dirfd, at.name, mode, rdev);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == 0)
+		bb_dirlist_changed(path, 0);
 
-	return 0;
+	return res;
 }
 
 static int xmp_mkdir(const char *path, mode_t mode)
 {
 	int res = 0;
-	
-	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	
-	res = mkdir(fpath, mode);
+	struct bb_at at;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	if (bb_packed(path, NULL)) {
+		bb_at_put(&at);
+		return -EEXIST;
+	}
+	res = mkdirat(at.dirfd, at.name, mode);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == 0)
+		bb_dirlist_changed(path, 0);
 
-	return 0;
+	return res;
+}
+
+
+/* A dedup or striped file whose last link is about to go, open (or -1):
+ * its blocks are released with bb_forget() once it is gone. Only called
+ * with it locked by bb_names_lock(). */
+static int bb_victim(int dirfd, const char *name, const char *path)
+{
+	struct stat st;
+	int fd;
+	int enc;
+
+	if (XMP_DATA->dd == NULL && XMP_DATA->stripe == NULL)
+		return -1;
+	fd = openat(dirfd, name, O_RDWR | O_NOFOLLOW | O_NONBLOCK);
+	/* without write access the map can't be emptied: the blocks are
+	   only released by the next rebuild */
+	if (fd == -1)
+		fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+	    ((enc = isenc(fd, path)) != ENC_DEDUP && enc != ENC_STRIPED) ||
+	    (enc == ENC_DEDUP && XMP_DATA->dd == NULL) ||
+	    (enc == ENC_STRIPED && XMP_DATA->stripe == NULL)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Release the blocks of a victim that is gone, and close it. f is the
+ * lock bb_names_lock() took on it. */
+static void bb_forget(int fd, const char *path, struct wb_file *f)
+{
+	if (isenc(fd, path) == ENC_DEDUP) {
+		writeback_exclude(XMP_DATA->wb, f);
+		dedup_forget(XMP_DATA->dd, XMP_DATA->wb, f, fd, path);
+	} else
+		stripe_forget(XMP_DATA->stripe, fd);
+	close(fd);
+}
+
+/* Locks the file at (dirfd, name) for writing, like a write does: its
+ * names are added and removed under this lock, so writers know whether
+ * it has any left (see writeback_forget()). Returns an O_PATH fd for
+ * bb_names_unlock(), -1 if there is nothing there. */
+static int bb_names_lock(int dirfd, const char *name, struct wb_file *f)
+{
+	int fd;
+
+	fd = openat(dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (writeback_lock(XMP_DATA->wb, fd, 1, f) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void bb_names_unlock(int fd, struct wb_file *f)
+{
+	if (fd == -1)
+		return;
+	writeback_unlock(XMP_DATA->wb, f);
+	close(fd);
 }
 
+/* unlinkat() of a file. The journal is told first if this is its last
+ * name, so its records aren't replayed into a file that gets its inode
+ * number later; a dedup or striped file's blocks go with it. */
+static int bb_unlink_at(int dirfd, const char *name, const char *path)
+{
+	struct wb_file f;
+	int lk, victim;
+	int res = 0;
+
+	lk = bb_names_lock(dirfd, name, &f);
+	victim = lk != -1 ? bb_victim(dirfd, name, path) : -1;
+	if (lk != -1)
+		res = writeback_forget(XMP_DATA->wb, &f, lk);
+	if (res == 0 && unlinkat(dirfd, name, 0) == -1) {
+		res = -errno;
+		if (lk != -1)
+			writeback_unforget(XMP_DATA->wb, &f);
+	}
+	if (victim != -1) {
+		if (res == 0)
+			bb_forget(victim, path, &f);
+		else
+			close(victim);
+	}
+	bb_names_unlock(lk, &f);
+	return res;
+}
 
 static int xmp_unlink(const char *path)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
+	struct bb_at at;
 
-	bb_fullpath(fpath, path);
-	res = unlink(fpath);
-	if (res == -1)
-		return -errno;
+	/* packed files only have a record to drop */
+	if (XMP_DATA->pk) {
+		res = pack_remove(XMP_DATA->pk, path);
+		if (res != -ENOENT)
+			return res;
+	}
+	/* staged writes name the file by path */
+	if (XMP_DATA->stage) {
+		res = staging_drain_path(XMP_DATA->stage, path, 0);
+		if (res < 0)
+			return res;
+	}
+	res = bb_at_get(path, &at);
+	if (res == 0) {
+		res = bb_unlink_at(at.dirfd, at.name, path);
+		bb_at_put(&at);
+	}
+	if (res == 0)
+		bb_dirlist_changed(path, 0);
 
-	return 0;
+	return res;
 }
 
 
 static int xmp_rmdir(const char *path)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
+	struct bb_at at;
 
-	bb_fullpath(fpath, path);
-	res = rmdir(fpath);
-	if (res == -1)
-		return -errno;
+	/* packed files count as entries; an empty container goes */
+	if (XMP_DATA->pk) {
+		res = pack_rmdir(XMP_DATA->pk, path);
+		if (res < 0)
+			return res;
+	}
+	res = bb_at_get(path, &at);
+	if (res == 0) {
+		res = unlinkat(at.dirfd, at.name, AT_REMOVEDIR);
+		if (res == -1)
+			res = -errno;
+		bb_at_put(&at);
+	}
+	if (res == 0)
+		bb_dirlist_changed(path, 1);
+	/* a cached fd for it (or below it) would now point at a dead dir */
+	if (res == 0 && XMP_DATA->dircache)
+		dirfd_cache_flush(XMP_DATA->dircache);
 
-	return 0;
+	return res;
 }
 /*end unchanged functions!*/
 
-/*Similar to the previous changes with 
- * char fpath[PATH_MAX];
- * bb_fullpath(fpath, path);
- * but, going with the passed parameters 
- * of *from and *to gets the full paths
- * for the to and from files!*/
+/*Similar to the previous changes, but
+ * going with the passed parameters 
+ * of *from and *to resolves both the to
+ * and from files!*/
 
 static int xmp_symlink(const char *from, const char *to)
 {
 	int res = 0;
-	char fullto[PATH_MAX];
-
-	bb_fullpath(fullto, to);
-	res = symlink(from, fullto);
+	struct bb_at atto;
+
+	res = bb_at_get(to, &atto);
+	if (res < 0)
+		return res;
+	if (bb_packed(to, NULL)) {
+		bb_at_put(&atto);
+		return -EEXIST;
+	}
+	res = symlinkat(from, atto.dirfd, atto.name);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&atto);
+	if (res == 0)
+		bb_dirlist_changed(to, 0);
 
-	return 0;
+	return res;
 }
 
 
+/* rename() where packed files are involved, 1 if none are. A backing
+ * entry at to is removed before a packed file takes its place, and a
+ * packed file at to before a backing entry does: not atomic, unlike the
+ * rename of two backing entries. */
+static int bb_pack_rename(const char *from, const char *to)
+{
+	struct pack *pk = XMP_DATA->pk;
+	struct bb_at at;
+	struct stat st;
+	int res;
+
+	if (pack_getattr(pk, from, NULL) == 0) {
+		res = bb_at_get(to, &at);
+		if (res < 0)
+			return res;
+		res = fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW);
+		bb_at_put(&at);
+		if (res == 0) {
+			if (S_ISDIR(st.st_mode))
+				return -EISDIR;
+			res = xmp_unlink(to);
+			if (res < 0)
+				return res;
+		}
+		return pack_rename(pk, from, to);
+	}
+	if (pack_getattr(pk, to, NULL) == 0) {
+		res = bb_at_get(from, &at);
+		if (res < 0)
+			return res;
+		res = fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			res = -errno;
+		bb_at_put(&at);
+		if (res < 0)
+			return res;
+		if (S_ISDIR(st.st_mode))
+			return -ENOTDIR;
+		res = pack_remove(pk, to);
+		if (res < 0 && res != -ENOENT)
+			return res;
+	}
+	return 1;
+}
+
 static int xmp_rename(const char *from, const char *to)
 {
 	int res = 0;
-	char fullfrom[PATH_MAX];
-	char fullto[PATH_MAX];
-
-	bb_fullpath(fullfrom, from);
-	bb_fullpath(fullto, to);
-	res = rename(fullfrom, fullto);
-	if (res == -1)
-		return -errno;
+	int isdir = 0;
+	int victim = -1;
+	int lk;
+	struct bb_at atfrom, atto;
+	struct stat st, stto;
+	struct wb_file f;
+
+	if (XMP_DATA->pk) {
+		res = bb_pack_rename(from, to);
+		if (res != 1)
+			return res;
+	}
+	/* staged writes name the file by path */
+	if (XMP_DATA->stage) {
+		res = staging_drain_path(XMP_DATA->stage, from, 1);
+		if (res == 0)
+			res = staging_drain_path(XMP_DATA->stage, to, 1);
+		if (res < 0)
+			return res;
+	}
+	res = bb_at_get(from, &atfrom);
+	if (res < 0)
+		return res;
+	res = bb_at_get(to, &atto);
+	if (res < 0) {
+		bb_at_put(&atfrom);
+		return res;
+	}
+	/* a file replaced by the rename loses a name, maybe its last */
+	lk = bb_names_lock(atto.dirfd, atto.name, &f);
+	if (lk != -1)
+		res = writeback_forget(XMP_DATA->wb, &f, lk);
+	if (res < 0) {
+		bb_names_unlock(lk, &f);
+		bb_at_put(&atto);
+		bb_at_put(&atfrom);
+		return res;
+	}
+	if ((XMP_DATA->dircache || XMP_DATA->dd || XMP_DATA->stripe) &&
+	    fstatat(atfrom.dirfd, atfrom.name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		isdir = S_ISDIR(st.st_mode);
+		/* a dedup or striped file replaced by the rename loses its blocks */
+		if ((XMP_DATA->dd || XMP_DATA->stripe) && lk != -1 &&
+		    fstatat(atto.dirfd, atto.name, &stto, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    (st.st_dev != stto.st_dev || st.st_ino != stto.st_ino))
+			victim = bb_victim(atto.dirfd, atto.name, to);
+	}
+	res = renameat(atfrom.dirfd, atfrom.name, atto.dirfd, atto.name);
+	if (res == -1) {
+		res = -errno;
+		if (lk != -1)
+			writeback_unforget(XMP_DATA->wb, &f);
+	}
+	if (victim != -1) {
+		if (res == 0)
+			bb_forget(victim, to, &f);
+		else
+			close(victim);
+	}
+	bb_names_unlock(lk, &f);
+	bb_at_put(&atto);
+	bb_at_put(&atfrom);
+	/* cached fds follow the directory, not the name */
+	if (res == 0 && isdir && XMP_DATA->dircache)
+		dirfd_cache_flush(XMP_DATA->dircache);
+	if (res == 0) {
+		bb_dirlist_changed(from, 1);
+		bb_dirlist_changed(to, 1);
+	}
 
-	return 0;
+	return res;
 }
 
 
 static int xmp_link(const char *from, const char *to)
 {
 	int res = 0;
-	char fullfrom[PATH_MAX];
-	char fullto[PATH_MAX];
-
-	bb_fullpath(fullfrom, from);
-	bb_fullpath(fullto, to);
-	res = link(fullfrom, fullto);
+	int lk;
+	struct bb_at atfrom, atto;
+	struct wb_file f;
+
+	/* a record can't have two names: the file moves out first */
+	if (XMP_DATA->pk) {
+		if (bb_packed(to, NULL))
+			return -EEXIST;
+		res = bb_unpack(from);
+		if (res < 0 && res != -ENOENT)
+			return res;
+	}
+	res = bb_at_get(from, &atfrom);
+	if (res < 0)
+		return res;
+	res = bb_at_get(to, &atto);
+	if (res < 0) {
+		bb_at_put(&atfrom);
+		return res;
+	}
+	/* not while a name of it is being removed (bb_unlink_at()) */
+	lk = bb_names_lock(atfrom.dirfd, atfrom.name, &f);
+	res = linkat(atfrom.dirfd, atfrom.name, atto.dirfd, atto.name, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_names_unlock(lk, &f);
+	bb_at_put(&atto);
+	bb_at_put(&atfrom);
+	if (res == 0)
+		bb_dirlist_changed(to, 0);
 
-	return 0;
+	return res;
 }
 /*END to&fro functions*/
 
-/* left untouched except adding 
- * char fpath[PATH_MAX];
- * bb_fullpath(fpath, path);
- * and changing l___attr(path....)
- * to l___attr(fpath...) because fpath is the full path and
- * not the relative one that we feed into our program!
- * (bb_fullpath(fpath,path) hint from 
- * "Writing a FUSE Filesystem: a Tutorial")*/
+/* left untouched except resolving the path with
+ * bb_at_get(path, &at) and switching to the *at()
+ * variant of each call, same as above */
 
 static int xmp_chmod(const char *path, mode_t mode)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
+	struct bb_at at;
+	struct pack_attr pa;
 
-	bb_fullpath(fpath, path);
-	res = chmod(fpath, mode);
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = fchmodat(at.dirfd, at.name, mode, 0);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	pa.mode = mode;
 
-	return 0;
+	return bb_pack_setattr(path, PACK_SET_MODE, &pa, res);
 }
 
 
 static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
-
-	bb_fullpath(fpath, path);
-	res = lchown(fpath, uid, gid);
+	int what = 0;
+	struct bb_at at;
+	struct pack_attr pa;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = fchownat(at.dirfd, at.name, uid, gid, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
-		return -errno;
-
-	return 0;
+		res = -errno;
+	bb_at_put(&at);
+	if (res != -ENOENT || !bb_packed(path, &pa))
+		return res;
+	/* only root gives files away, as for the backing files */
+	if (uid != (uid_t)-1 && uid != pa.uid && geteuid() != 0)
+		return -EPERM;
+	if (uid != (uid_t)-1)
+		what |= PACK_SET_UID;
+	if (gid != (gid_t)-1)
+		what |= PACK_SET_GID;
+	pa.uid = uid;
+	pa.gid = gid;
+
+	return bb_pack_setattr(path, what, &pa, res);
 }
 
 static int xmp_truncate(const char *path, off_t size)
 {
 	int res = 0;
-	char fpath[PATH_MAX];
-
-	bb_fullpath(fpath, path);
-	res = truncate(fpath, size);
-	if (res == -1)
-		return -errno;
+	int fd;
+
+	/* there is no truncateat(), so open and truncate through the fd */
+	fd = bb_openat(path, O_RDWR, 0);
+	if (fd == -ENOENT && XMP_DATA->pk) {
+		/* packed files are truncated in their container, unless
+		   they outgrow it */
+		res = pack_truncate(XMP_DATA->pk, path, size);
+		if (res != -EFBIG)
+			return res;
+		res = bb_unpack(path);
+		if (res < 0 && res != -ENOENT)
+			return res;
+		fd = bb_openat(path, O_RDWR, 0);
+	}
+	if (fd == -EACCES)
+		fd = bb_openat(path, O_WRONLY, 0);
+	if (fd < 0)
+		return fd;
+	res = bb_truncate_fd(fd, path, size);
+	close(fd);
 
-	return 0;
+	return res;
 }
 
 static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
 	int res = 0;
-	struct timeval tv[2];
-	char fpath[PATH_MAX];
+	int what = 0;
+	struct bb_at at;
+	struct pack_attr pa;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = utimensat(at.dirfd, at.name, ts, 0);
+	if (res == -1)
+		res = -errno;
+	bb_at_put(&at);
+	if (res != -ENOENT || XMP_DATA->pk == NULL)
+		return res;
+	clock_gettime(CLOCK_REALTIME, &pa.atime);
+	pa.mtime = pa.atime;
+	if (ts[0].tv_nsec != UTIME_OMIT) {
+		what |= PACK_SET_ATIME;
+		if (ts[0].tv_nsec != UTIME_NOW)
+			pa.atime = ts[0];
+	}
+	if (ts[1].tv_nsec != UTIME_OMIT) {
+		what |= PACK_SET_MTIME;
+		if (ts[1].tv_nsec != UTIME_NOW)
+			pa.mtime = ts[1];
+	}
 
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	return bb_pack_setattr(path, what, &pa, res);
+}
 
-	bb_fullpath(fpath, path);
-	res = utimes(fpath, tv);
-	if (res == -1)
-		return -errno;
+/* The plaintext size -o direct_io_mb goes by. For plain and block
+ * format files the backing size stands in for it, differing only by the
+ * block headers; a dedup file's backing file is just its block map and a
+ * striped one's holds only the first device's blocks, so theirs comes
+ * from the header, with updates pending. */
+static uint64_t bb_direct_io_size(int fd, const char *path, const struct stat *st)
+{
+	struct encblk_hdr hdr;
+	struct wb_file f;
+	uint64_t size = st->st_size;
+	int enc, rfd;
+
+	enc = isenc(fd, path);
+	if (enc != ENC_DEDUP && enc != ENC_STRIPED)
+		return size;
+	/* fd may be write only */
+	rfd = bb_openat(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0);
+	if (rfd < 0)
+		return size;
+	if (writeback_lock(XMP_DATA->wb, rfd, 0, &f) == 0) {
+		if (writeback_hdr(&f, rfd, &hdr) == 0)
+			size = hdr.size;
+		writeback_unlock(XMP_DATA->wb, &f);
+	}
+	close(rfd);
+	return size;
+}
 
+/* Should the file open on fd bypass the kernel page cache? Streaming
+ * files are otherwise cached twice, decrypted above the mount and
+ * encrypted in the backing store, and push hot files out of both. */
+static int bb_direct_io(int fd, const char *path)
+{
+	struct BB_DATA *data = XMP_DATA;
+	char val[2];
+	struct stat st;
+	const char *p, *end;
+	char pat[PATH_MAX];
+	size_t len;
+
+	if (fgetxattr(fd, FLAG_DIRECT_IO, val, sizeof(val)) == 1)
+		return val[0] == '1';
+	if (data->direct_io_mb && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    bb_direct_io_size(fd, path, &st) >= (uint64_t)data->direct_io_mb << 20)
+		return 1;
+	for (p = data->direct_io_paths; p && *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p;
+		if (len == 0 || len >= sizeof(pat))
+			continue;
+		memcpy(pat, p, len);
+		pat[len] = '\0';
+		if (fnmatch(pat, path, 0) == 0)
+			return 1;
+	}
 	return 0;
 }
 
-
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+/* Lets the kernel keep its cache of a file that hasn't changed since it
+ * was last opened (keepcache.h). Called once fi->direct_io is decided. */
+static void bb_keep_open(int fd, struct fuse_file_info *fi)
 {
-	int res = 0;
-	char fpath[PATH_MAX];
+	struct keepcache *kc = XMP_DATA->kc;
+	struct stg_file *sf;
+	struct wb_file f;
+	struct stat st;
+	uint64_t gen, end;
+	int staged = 0;
+
+	if (kc == NULL || fi->direct_io || fstat(fd, &st) == -1 ||
+	    !S_ISREG(st.st_mode))
+		return;
+	/* pending writes haven't changed the backing file yet */
+	if (writeback_lock(XMP_DATA->wb, fd, 0, &f) < 0)
+		return;
+	gen = writeback_gen(&f);
+	writeback_unlock(XMP_DATA->wb, &f);
+	/* staged ones have no version to go by */
+	if (XMP_DATA->stage && (sf = staging_pin(XMP_DATA->stage, fd, &end))) {
+		staged = 1;
+		staging_unpin(XMP_DATA->stage, sf);
+	}
+	if (keepcache_open(kc, &st, gen) && !staged && !(fi->flags & O_TRUNC))
+		fi->keep_cache = 1;
+}
 
-	bb_fullpath(fpath, path);
-	res = open(fpath, fi->flags);
-	if (res == -1)
-		return -errno;
+/* open() of a packed file: checks access, truncates if asked to */
+static int bb_pack_open(const char *path, struct fuse_file_info *fi)
+{
+	struct pack_attr pa;
+	int mask, res;
+
+	if (!bb_packed(path, &pa))
+		return -ENOENT;
+	switch (fi->flags & O_ACCMODE) {
+	case O_RDONLY:
+		mask = R_OK;
+		break;
+	case O_WRONLY:
+		mask = W_OK;
+		break;
+	default:
+		mask = R_OK | W_OK;
+	}
+	res = bb_pack_access(&pa, mask);
+	if (res == 0 && (fi->flags & O_TRUNC) && pa.size)
+		res = pack_truncate(XMP_DATA->pk, path, 0);
+	return res;
+}
 
-	close(res);
-	return 0;
+static int xmp_open(const char *path, struct fuse_file_info *fi)
+{
+	int res = 0;
+	int fd;
+
+	if (fi->flags & O_TRUNC) {
+		/* O_TRUNC would cut off an encrypted file's header; truncate
+		   through bb_truncate_fd() instead, which needs to read */
+		fd = bb_openat(path, (fi->flags & ~(O_TRUNC | O_ACCMODE)) | O_RDWR, 0);
+		if (fd >= 0)
+			res = bb_truncate_fd(fd, path, 0);
+		else if (fd == -EACCES)
+			fd = bb_openat(path, fi->flags, 0);
+	}
+	else
+		fd = bb_openat(path, fi->flags, 0);
+	if (fd == -ENOENT && XMP_DATA->pk)
+		return bb_pack_open(path, fi);
+	if (fd < 0)
+		return fd;
+
+	fi->direct_io = bb_direct_io(fd, path);
+	if (res == 0)
+		bb_keep_open(fd, fi);
+	close(fd);
+	return res;
 }
 /*end unchanged functions!*/
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+/* With -o sched_slots=N reads and writes wait for one of N slots, handed
+ * out in weighted fair order between callers (fairq.h); metadata
+ * operations never wait behind them. */
+static void bb_sched_enter(size_t size)
 {
-	FILE *fp, *temp;
-	int res;
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+	struct fuse_context *ctx = fuse_get_context();
+	struct BB_DATA *data = ctx->private_data;
+	uint32_t who;
 
-	(void) fi;
+	if (data->sched) {
+		who = data->sched_pid ? (uint32_t)ctx->pid : (uint32_t)ctx->uid;
+		fairq_enter(data->sched, who, size);
+	}
+}
 
-	if(isenc(fpath)){
+static void bb_sched_leave(void)
+{
+	struct BB_DATA *data = XMP_DATA;
 
-		fp = fopen(fpath, "r");
-		if (fp == NULL)
-			return -errno;
-		/*create temp file */
-		temp = tmpfile();
-		if (temp == NULL)
-			return -errno;
-		/* decode into the temp */
-		do_crypt(fp, temp, DECRYPT, XMP_DATA->key);
-		fclose(fp);
-		fseek(temp, offset, SEEK_SET);
-		res = fread(buf, 1, size, temp);
-		if (res == -1)
-			res = -errno;
-		fclose(temp);
+	if (data->sched)
+		fairq_leave(data->sched);
+}
+
+/* The fd to read a locked block file's blocks from: its fast tier copy
+ * (released with tier_put(*tc)) or the backing file itself */
+static int bb_tier_get(int fd, const char *path, struct tier_copy **tc)
+{
+	struct stat st;
+	int res;
+
+	*tc = NULL;
+	if (XMP_DATA->tier == NULL || fstat(fd, &st) == -1)
+		return fd;
+	res = tier_get(XMP_DATA->tier, &st, path, tc);
+	return res < 0 ? fd : res;
+}
+
+/* Reads a block file. Only the blocks covering the range are decrypted;
+ * blocks not written back yet come from a copy taken when the read
+ * starts, and writes still staged from memory (pinned first, so none
+ * slips through). Neither waits for writers. */
+static int bb_read_blocks(int fd, const char *path, char *buf, size_t size,
+			  off_t offset)
+{
+	struct encblk_hdr hdr;
+	struct wb_file f;
+	struct stg_file *sf = NULL;
+	struct tier_copy *tc;
+	uint64_t end;
+	int res;
+	int rfd;
+
+	if (XMP_DATA->stage)
+		sf = staging_pin(XMP_DATA->stage, fd, &end);
+	res = writeback_read_lock(XMP_DATA->wb, fd, offset, size, &f);
+	if (res == 0) {
+		/* a hot file's blocks come from its fast tier copy */
+		rfd = bb_tier_get(fd, path, &tc);
+		res = writeback_hdr(&f, rfd, &hdr);
+		if (res == 0)
+			res = encblk_read(rfd, writeback_overlay(&f),
+					  &XMP_DATA->blkkeys, &hdr,
+					  buf, size, offset);
+		if (tc)
+			tier_put(XMP_DATA->tier, tc);
+		writeback_unlock(XMP_DATA->wb, &f);
 	}
-	else{
-		int fd;
+	if (sf) {
+		if (res >= 0)
+			res = staging_overlay(XMP_DATA->stage, sf, buf,
+					      size, offset, res);
+		staging_unpin(XMP_DATA->stage, sf);
+	}
+	return res;
+}
 
-		fd = open(fpath, O_RDONLY);
-		if (fd == -1)
-			return -errno;
+static int bb_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	struct encblk_hdr hdr;
+	struct wb_file f;
+	int res;
+	int fd;
+
+	(void) fi;
+
+	fd = bb_openat(path, O_RDONLY, 0);
+	if (fd == -ENOENT && XMP_DATA->pk)
+		return pack_read(XMP_DATA->pk, path, buf, size, offset);
+	if (fd < 0)
+		return fd;
 
+	switch(isenc(fd, path)){
+	case ENC_BLOCKS:
+		res = bb_read_blocks(fd, path, buf, size, offset);
+		close(fd);
+		break;
+
+	case ENC_DEDUP:
+		/* blocks come out of the shared store by id */
+		res = -EIO;
+		if (XMP_DATA->dd &&
+		    (res = writeback_read_lock(XMP_DATA->wb, fd, offset, size, &f)) == 0) {
+			res = writeback_hdr(&f, fd, &hdr);
+			if (res == 0)
+				res = dedup_read(XMP_DATA->dd, fd, writeback_overlay(&f),
+						 &hdr, buf, size, offset);
+			writeback_unlock(XMP_DATA->wb, &f);
+		}
+		close(fd);
+		break;
+
+	case ENC_STRIPED:
+		/* from every device at once */
+		res = -EIO;
+		if (XMP_DATA->stripe &&
+		    (res = writeback_read_lock(XMP_DATA->wb, fd, offset, size, &f)) == 0) {
+			res = writeback_hdr(&f, fd, &hdr);
+			if (res == 0)
+				res = stripe_read(XMP_DATA->stripe, fd, writeback_overlay(&f),
+						  &hdr, buf, size, offset);
+			writeback_unlock(XMP_DATA->wb, &f);
+		}
+		close(fd);
+		break;
+
+	case ENC_LEGACY:
+		/* the first write converts the file in place: not while it
+		   is read, and once it has it is read as a block file */
+		res = writeback_lock(XMP_DATA->wb, fd, 0, &f);
+		if (res < 0) {
+			close(fd);
+			return res;
+		}
+		if (isenc(fd, path) == ENC_BLOCKS) {
+			writeback_unlock(XMP_DATA->wb, &f);
+			res = bb_read_blocks(fd, path, buf, size, offset);
+			close(fd);
+			break;
+		}
+		/* decrypted straight into buf, up to the end of the range */
+		res = bb_legacy_pread(fd, buf, size, offset);
+		writeback_unlock(XMP_DATA->wb, &f);
+		close(fd);
+		break;
+
+	default:
 		res = pread(fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
@@ -513,100 +1724,308 @@ static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
 	return res;
 }
 
-static int xmp_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
 {
-	FILE *fp, *temp;
 	int res;
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-
-	(void) fi;
 
-	if(isenc(fpath)){
+	bb_sched_enter(size);
+	res = bb_read(path, buf, size, offset, fi);
+	bb_sched_leave();
+	return res;
+}
 
-		fp = fopen(fpath, "r");
-		if (fp == NULL)
-			return -errno;
-		/* create a temp file */
-		temp = tmpfile();
-		if (temp == NULL)
-			return -errno;
-		/* encrypt the file into the temp file */
-		do_crypt(fp, temp, DECRYPT, XMP_DATA->key);
-		fclose(fp);
+/* Re-encrypts just the blocks a write touches; they are journaled, and
+ * written in place once the journal is synced. Also the staging workers'
+ * apply callback, so it takes data instead of using XMP_DATA. */
+/* Encrypts the blocks a write to a block format file (st NULL) or a
+ * striped one touches, over the pending blocks in ov */
+static int bb_build_write(struct BB_DATA *data, struct stripe *st, int fd,
+			  const struct encblk_overlay *ov, struct encblk_hdr *hdr,
+			  const char *buf, size_t size, off_t offset,
+			  struct encblk_run *run)
+{
+	if (st)
+		return stripe_build_write(st, fd, ov, hdr, buf, size, offset, run);
+	return encblk_build_write(fd, ov, &data->blkkeys, hdr, buf, size,
+				  offset, run);
+}
 
-		/*seek to the position we need to write at then write */
-		fseek(temp, offset, SEEK_SET);
-		res = fwrite(buf, 1, size, temp);
-		if (res == -1)
-			res = -errno;
-		/* open file, encrypt */
-		fp = fopen(fpath, "w");
-		fseek(temp, 0, SEEK_SET);
-		do_crypt(temp, fp, ENCRYPT, XMP_DATA->key);
+/* Locks the file open on fd for writing (f) with a write built: its new
+ * header and block images. They are built from a snapshot first, so the
+ * file's readers don't wait for the edge reads and the encryption, and
+ * built again under the lock only if another update got in meanwhile. */
+static int bb_lock_write(struct BB_DATA *data, struct stripe *st, int fd,
+			 const char *buf, size_t size, off_t offset,
+			 struct wb_file *f, struct encblk_hdr *hdr,
+			 struct encblk_run *run)
+{
+	unsigned long stamp;
+	int res;
 
-		fclose(temp);
-		fclose(fp);
+	res = writeback_read_lock(data->wb, fd, offset, size, f);
+	if (res < 0)
+		return res;
+	res = writeback_hdr(f, fd, hdr);
+	if (res == 0)
+		res = bb_build_write(data, st, fd, writeback_overlay(f), hdr,
+				     buf, size, offset, run);
+	stamp = writeback_stamp(f);
+	writeback_unlock(data->wb, f);
+	if (res < 0)
+		return res;
+
+	res = writeback_lock(data->wb, fd, 1, f);
+	if (res < 0) {
+		free(run->data);
+		return res;
 	}
+	if (writeback_stamp(f) == stamp)
+		return 0;
+	free(run->data);
+	res = writeback_hdr(f, fd, hdr);
+	if (res == 0)
+		res = bb_build_write(data, st, fd, writeback_overlay(f), hdr,
+				     buf, size, offset, run);
+	if (res < 0)
+		writeback_unlock(data->wb, f);
+	return res;
+}
 
-	/*otherwise fusexmp*/
-	else{
-		int fd;
+static int bb_write_blocks(void *arg, int fd, const char *path,
+			   const char *buf, size_t size, off_t offset)
+{
+	struct BB_DATA *data = arg;
+	struct encblk_hdr hdr;
+	struct encblk_run run;
+	struct wb_file f;
+	int res;
 
-		fd = open(fpath, O_WRONLY);
-		if (fd == -1)
-			return -errno;
+	res = bb_lock_write(data, NULL, fd, buf, size, offset, &f, &hdr, &run);
+	if (res < 0)
+		return res;
+	bb_tier_changed(data, fd);
+	res = writeback_update(data->wb, &f, fd, path, &hdr, &run, NULL, NULL, 0);
+	free(run.data);
+	writeback_unlock(data->wb, &f);
+	return res;
+}
+
+static int bb_write(const char *path, const char *buf, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	struct BB_DATA *data = XMP_DATA;
+	struct encblk_hdr hdr;
+	struct encblk_run run;
+	struct wb_file f;
+	char *plain, *tmp;
+	size_t len;
+	int res;
+	int fd;
+
+	(void) fi;
+
+	fd = bb_openat(path, O_RDWR, 0);
+	if (fd == -ENOENT && data->pk) {
+		res = pack_write(data->pk, path, buf, size, offset);
+		if (res != -EFBIG)
+			return res == 0 ? (int)size : res;
+		/* outgrown: moved out, and written like any other file */
+		res = bb_unpack(path);
+		if (res < 0 && res != -ENOENT)
+			return res;
+		fd = bb_openat(path, O_RDWR, 0);
+	}
+	/* write-only plain files still need to be writable */
+	if (fd == -EACCES)
+		fd = bb_openat(path, O_WRONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	switch(isenc(fd, path)){
+	case ENC_BLOCKS:
+		/* staging mode leaves the encryption to the workers */
+		if (data->stage)
+			res = staging_write(data->stage, fd, path, buf, size, offset);
+		else
+			res = bb_write_blocks(data, fd, path, buf, size, offset);
+		if (res == 0)
+			res = size;
+		break;
+
+	case ENC_DEDUP:
+		/* blocks the store already has are only referenced */
+		if (data->dd == NULL) {
+			res = -EIO;
+			break;
+		}
+		res = writeback_lock(data->wb, fd, 1, &f);
+		if (res < 0)
+			break;
+		writeback_exclude(data->wb, &f);
+		res = dedup_write(data->dd, data->wb, &f, fd, path, buf, size, offset);
+		writeback_unlock(data->wb, &f);
+		if (res == 0)
+			res = size;
+		break;
+
+	case ENC_STRIPED:
+		if (data->stripe == NULL) {
+			res = -EIO;
+			break;
+		}
+		res = bb_lock_write(data, data->stripe, fd, buf, size, offset,
+				    &f, &hdr, &run);
+		if (res < 0)
+			break;
+		res = stripe_commit_write(data->stripe, data->wb, &f, fd, path,
+					  &hdr, &run);
+		free(run.data);
+		writeback_unlock(data->wb, &f);
+		if (res == 0)
+			res = size;
+		break;
+
+	case ENC_LEGACY:
+		/* decrypt, patch, and store again in the block format
+		   (replaces truncating and re-encrypting in place) */
+		res = writeback_lock(XMP_DATA->wb, fd, 1, &f);
+		if (res < 0)
+			break;
+		res = bb_legacy_load(fd, &plain, &len);
+		if (res == 0 && offset + size > len) {
+			tmp = realloc(plain, offset + size);
+			if (tmp == NULL)
+				res = -ENOMEM;
+			else {
+				if ((size_t)offset > len)
+					memset(tmp + len, 0, offset - len);
+				plain = tmp;
+				len = offset + size;
+			}
+		}
+		if (res == 0) {
+			memcpy(plain + offset, buf, size);
+			res = bb_legacy_store(fd, path, &f, plain, len);
+		}
+		free(plain);
+		writeback_unlock(XMP_DATA->wb, &f);
+		if (res == 0)
+			res = size;
+		break;
 
+	/*otherwise fusexmp*/
+	default:
 		res = pwrite(fd, buf, size, offset);
 		if (res == -1)
 			res = -errno;
-
-		close(fd);
 	}
 
+	close(fd);
+	return res;
+}
+
+static int xmp_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	bb_sched_enter(size);
+	res = bb_write(path, buf, size, offset, fi);
+	bb_sched_leave();
 	return res;
 }
 
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+	int fd;
 
-	res = statvfs(fpath, stbuf);
+	fd = bb_openat(path, O_PATH, 0);
+	if (fd < 0)
+		return fd;
+	res = fstatvfs(fd, stbuf);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	close(fd);
 
-	return 0;
+	return res;
+}
+
+/* create() with -o pack: new files start out packed, unless there is a
+ * backing entry of that name already. 1 to create a backing file. */
+static int bb_pack_create(const char *path, mode_t mode)
+{
+	struct bb_at at;
+	struct stat st;
+	int res;
+
+	res = bb_at_get(path, &at);
+	if (res < 0)
+		return res;
+	res = fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW);
+	bb_at_put(&at);
+	if (res == 0)
+		return 1;
+	res = pack_create(XMP_DATA->pk, path, mode, geteuid(), getegid());
+	/* create() truncates, like the O_TRUNC below */
+	if (res == -EEXIST)
+		res = pack_truncate(XMP_DATA->pk, path, 0);
+	return res;
 }
 
 static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi) 
 {
-    (void) fi;
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	FILE *fp;
-    int res;
-    int attr;
-
-    res = creat(fpath, mode);
-    if(res == -1)
-	return -errno;
-	
-	fp = fdopen(res, "w");
-	close(res);
+	struct encblk_hdr hdr;
+	unsigned char hbuf[ENCBLK_HDRLEN];
+	const char *format = FLAG_BLOCKS;
+	int res;
+	int attr;
+
+	if (XMP_DATA->pack && XMP_DATA->pk) {
+		res = bb_pack_create(path, mode);
+		if (res != 1)
+			return res;
+	}
+	res = bb_openat(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+	if(res < 0)
+		return res;
+	bb_dirlist_changed(path, 0);
 	
-	do_crypt(fp, fp, ENCRYPT, XMP_DATA->key);
+	/*set flag first: an empty file flagged as block format reads
+	  as empty, so a crash before the header is written is harmless.
+	  A dedup map has the same header*/
+	if(XMP_DATA->dedup && XMP_DATA->dd)
+		format = FLAG_DEDUP;
+	else if(XMP_DATA->stripe_dirs && XMP_DATA->stripe){
+		format = FLAG_STRIPED;
+		attr = stripe_init_file(XMP_DATA->stripe, res);
+		if(attr < 0){
+			close(res);
+			return attr;
+		}
+	}
+	attr = fsetxattr(res, FLAG, format, strlen(format), 0);
+	if(attr == -1){
+		attr = -errno;
+		close(res);
+		return attr;
+	}
 
-	fclose(fp);
-    
-	/*set flag*/
-	attr = setxattr(fpath, FLAG, "true", 4, 0);
-	if(attr == -1)
-		return -errno;
+	/*new files start out in the block format: just a header*/
+	encblk_hdr_init(&hdr, XMP_DATA->cipher);
+	encblk_hdr_encode(&hdr, hbuf);
+	if(pwrite(res, hbuf, ENCBLK_HDRLEN, 0) != ENCBLK_HDRLEN){
+		attr = -EIO;
+		close(res);
+		return attr;
+	}
 
-    return 0;
+	fi->direct_io = bb_direct_io(res, path);
+	bb_keep_open(res, fi);
+	close(res);
+
+	return 0;
 }
 
 
@@ -621,70 +2040,199 @@ static int xmp_release(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
+/*End Stubs!!*/
+
+/* Journaled updates are durable once the journal is synced, so a
+ * datasync on such a file is one journal fdatasync (a group commit:
+ * concurrent callers share it), and a full fsync adds the file's own for
+ * its metadata. Other files are just synced themselves. */
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
+	int fd;
 
-	(void) path;
-	(void) isdatasync;
 	(void) fi;
-	return 0;
-}
 
-/*End Stubs!!*/
+	fd = bb_openat(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0);
+	/* write-only files still need to be synced */
+	if (fd == -EACCES)
+		fd = bb_openat(path, O_WRONLY | O_NOFOLLOW | O_NONBLOCK, 0);
+	if (fd == -ENOENT && bb_packed(path, NULL))
+		return pack_sync(XMP_DATA->pk, path);
+	if (fd < 0)
+		return fd;
+	res = isenc(fd, path);
+	if (res == ENC_BLOCKS || res == ENC_DEDUP || res == ENC_STRIPED) {
+		/* staged writes first have to get into the journal */
+		res = 0;
+		if (XMP_DATA->stage)
+			res = staging_drain_fd(XMP_DATA->stage, fd);
+		if (res == 0)
+			res = writeback_fsync(XMP_DATA->wb, fd, isdatasync);
+	} else {
+		/* not journaled: the file's own sync covers it */
+		res = isdatasync ? fdatasync(fd) : fsync(fd);
+		if (res == -1)
+			res = -errno;
+	}
+	close(fd);
+
+	return res;
+}
 
-/*ATTR functions - left untouched except adding 
- * char fpath[PATH_MAX];
- * bb_fullpath(fpath, path);
- * and changing l___attr(path....)
- * to l___attr(fpath...) because fpath is the full path and
- * not the relative one that we feed into our program!*/
+/*ATTR functions - left untouched except resolving the
+ * path with bb_at_get() and calling l___attr() on its
+ * /proc/self/fd form (bb_procpath()) instead of on a full
+ * path. Nothing is opened, so symlinks, device nodes and
+ * files we may not read work like they did before*/
 #ifdef HAVE_SETXATTR
+static int bb_xattr_at(const char *path, struct bb_at *at, char fpath[PATH_MAX])
+{
+	int res;
+
+	res = bb_at_get(path, at);
+	if (res < 0)
+		return res;
+	res = bb_procpath(fpath, at);
+	if (res < 0)
+		bb_at_put(at);
+	return res;
+}
+
 static int xmp_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
 	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	int res = lsetxattr(fpath, name, value, size, flags);
+	struct bb_at at;
+	int res;
+
+	res = bb_xattr_at(path, &at, fpath);
+	if (res < 0)
+		return res;
+	res = lsetxattr(fpath, name, value, size, flags);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	/* records have no xattrs: the file moves out to get one */
+	if (res == -ENOENT && XMP_DATA->pk) {
+		res = bb_unpack(path);
+		if (res == 0 && lsetxattr(fpath, name, value, size, flags) == -1)
+			res = -errno;
+	}
+	bb_at_put(&at);
+	return res;
 }
 
 static int xmp_getxattr(const char *path, const char *name, char *value,
 			size_t size)
 {
 	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	int res = lgetxattr(fpath, name, value, size);
+	struct bb_at at;
+	int res;
+
+	res = bb_xattr_at(path, &at, fpath);
+	if (res < 0)
+		return res;
+	res = lgetxattr(fpath, name, value, size);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == -ENOENT && bb_packed(path, NULL))
+		return -ENOATTR;
 	return res;
 }
 
 static int xmp_listxattr(const char *path, char *list, size_t size)
 {
 	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	int res = llistxattr(fpath, list, size);
+	struct bb_at at;
+	int res;
+
+	res = bb_xattr_at(path, &at, fpath);
+	if (res < 0)
+		return res;
+	res = llistxattr(fpath, list, size);
 	if (res == -1)
-		return -errno;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == -ENOENT && bb_packed(path, NULL))
+		return 0;
 	return res;
 }
 
 static int xmp_removexattr(const char *path, const char *name)
 {
 	char fpath[PATH_MAX];
-	bb_fullpath(fpath, path);
-	int res = lremovexattr(fpath, name);
+	struct bb_at at;
+	int res;
+
+	res = bb_xattr_at(path, &at, fpath);
+	if (res < 0)
+		return res;
+	res = lremovexattr(fpath, name);
 	if (res == -1)
-		return -errno;
-	return 0;
+		res = -errno;
+	bb_at_put(&at);
+	if (res == -ENOENT && bb_packed(path, NULL))
+		return -ENOATTR;
+	return res;
 }
 #endif /* HAVE_SETXATTR */
 
+/* Runs after fuse_main has daemonized, so this is where background
+ * threads have to be started */
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	struct BB_DATA *data = XMP_DATA;
+
+	(void) conn;
+	if (bblog_start() < 0)
+		bblog(BBLOG_WARN, "log: no drain thread, logging synchronously");
+	if (data->dirlist && dirlist_cache_start(data->dirlist) < 0) {
+		bblog(BBLOG_WARN, "dirlist_cache: no watcher thread, disabled");
+		dirlist_cache_free(data->dirlist);
+		data->dirlist = NULL;
+	}
+	if (writeback_start(data->wb, data->commit_ms) < 0)
+		bblog(BBLOG_WARN, "writeback: no flusher thread, flushing on fsync only");
+	if (data->stage && staging_start(data->stage, data->stage_workers) < 0) {
+		bblog(BBLOG_WARN, "staging: no worker threads, disabled");
+		staging_free(data->stage);
+		data->stage = NULL;
+	}
+	if (data->pk && pack_start(data->pk) < 0)
+		bblog(BBLOG_WARN, "pack: no compaction thread, containers only grow");
+	if (data->stripe && stripe_start(data->stripe) < 0)
+		bblog(BBLOG_WARN, "stripe: no device threads, devices served in turn");
+	if (data->tier && tier_start(data->tier) < 0)
+		bblog(BBLOG_WARN, "tier: no migrator thread, nothing is copied");
+	return data;
+}
+
+static void xmp_destroy(void *private_data)
+{
+	struct BB_DATA *data = private_data;
+
+	/* staged writes go to the journal, then the journal is only
+	   emptied if everything made it back in place */
+	staging_free(data->stage);
+	tier_close(data->tier);
+	writeback_quiesce(data->wb);
+	writeback_resume(data->wb);
+	writeback_free(data->wb);
+	dedup_close(data->dd);
+	pack_close(data->pk);
+	stripe_close(data->stripe);
+	journal_close(data->journal);
+	dirlist_cache_free(data->dirlist);
+	dirfd_cache_free(data->dircache);
+	close(data->rootfd);
+	optrace_close(data->trace);
+	fairq_free(data->sched);
+	keepcache_free(data->kc);
+	bblog_stop();
+}
+
 static struct fuse_operations xmp_oper = {
 	.getattr	= xmp_getattr,
 	.access		= xmp_access,
@@ -708,6 +2256,8 @@ static struct fuse_operations xmp_oper = {
 	.create         = xmp_create,
 	.release	= xmp_release,
 	.fsync		= xmp_fsync,
+	.init		= xmp_init,
+	.destroy	= xmp_destroy,
 #ifdef HAVE_SETXATTR
 	.setxattr	= xmp_setxattr,
 	.getxattr	= xmp_getxattr,
@@ -716,24 +2266,339 @@ static struct fuse_operations xmp_oper = {
 #endif
 };
 
+/* -o trace: the operations above, each recorded once it returns */
+#define BB_TRACE(op, path, path2, off, size, call)			\
+	do {								\
+		uint64_t start_ = optrace_now();			\
+		int res_ = (call);					\
+		optrace_record(XMP_DATA->trace, (op), (path), (path2),	\
+			       (off), (size), start_, res_);		\
+		return res_;						\
+	} while (0)
+
+static int bb_t_getattr(const char *path, struct stat *stbuf)
+{
+	BB_TRACE(OPT_GETATTR, path, NULL, 0, 0, xmp_getattr(path, stbuf));
+}
+
+static int bb_t_access(const char *path, int mask)
+{
+	BB_TRACE(OPT_ACCESS, path, NULL, 0, mask, xmp_access(path, mask));
+}
+
+static int bb_t_readlink(const char *path, char *buf, size_t size)
+{
+	BB_TRACE(OPT_READLINK, path, NULL, 0, size, xmp_readlink(path, buf, size));
+}
+
+static int bb_t_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			off_t offset, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_READDIR, path, NULL, offset, 0,
+		 xmp_readdir(path, buf, filler, offset, fi));
+}
+
+static int bb_t_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	BB_TRACE(OPT_MKNOD, path, NULL, rdev, mode, xmp_mknod(path, mode, rdev));
+}
+
+static int bb_t_mkdir(const char *path, mode_t mode)
+{
+	BB_TRACE(OPT_MKDIR, path, NULL, 0, mode, xmp_mkdir(path, mode));
+}
+
+/* the link's contents are recorded as the second path */
+static int bb_t_symlink(const char *from, const char *to)
+{
+	BB_TRACE(OPT_SYMLINK, to, from, 0, 0, xmp_symlink(from, to));
+}
+
+static int bb_t_unlink(const char *path)
+{
+	BB_TRACE(OPT_UNLINK, path, NULL, 0, 0, xmp_unlink(path));
+}
+
+static int bb_t_rmdir(const char *path)
+{
+	BB_TRACE(OPT_RMDIR, path, NULL, 0, 0, xmp_rmdir(path));
+}
+
+static int bb_t_rename(const char *from, const char *to)
+{
+	BB_TRACE(OPT_RENAME, from, to, 0, 0, xmp_rename(from, to));
+}
+
+static int bb_t_link(const char *from, const char *to)
+{
+	BB_TRACE(OPT_LINK, from, to, 0, 0, xmp_link(from, to));
+}
+
+static int bb_t_chmod(const char *path, mode_t mode)
+{
+	BB_TRACE(OPT_CHMOD, path, NULL, 0, mode, xmp_chmod(path, mode));
+}
+
+static int bb_t_chown(const char *path, uid_t uid, gid_t gid)
+{
+	BB_TRACE(OPT_CHOWN, path, NULL, uid, gid, xmp_chown(path, uid, gid));
+}
+
+static int bb_t_truncate(const char *path, off_t size)
+{
+	BB_TRACE(OPT_TRUNCATE, path, NULL, size, 0, xmp_truncate(path, size));
+}
+
+static int bb_t_utimens(const char *path, const struct timespec ts[2])
+{
+	BB_TRACE(OPT_UTIMENS, path, NULL, 0, 0, xmp_utimens(path, ts));
+}
+
+static int bb_t_open(const char *path, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_OPEN, path, NULL, 0, fi->flags, xmp_open(path, fi));
+}
+
+static int bb_t_read(const char *path, char *buf, size_t size, off_t offset,
+		     struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_READ, path, NULL, offset, size,
+		 xmp_read(path, buf, size, offset, fi));
+}
+
+static int bb_t_write(const char *path, const char *buf, size_t size,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_WRITE, path, NULL, offset, size,
+		 xmp_write(path, buf, size, offset, fi));
+}
+
+static int bb_t_statfs(const char *path, struct statvfs *stbuf)
+{
+	BB_TRACE(OPT_STATFS, path, NULL, 0, 0, xmp_statfs(path, stbuf));
+}
+
+static int bb_t_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_CREATE, path, NULL, 0, mode, xmp_create(path, mode, fi));
+}
+
+static int bb_t_release(const char *path, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_RELEASE, path, NULL, 0, 0, xmp_release(path, fi));
+}
+
+static int bb_t_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+	BB_TRACE(OPT_FSYNC, path, NULL, 0, isdatasync,
+		 xmp_fsync(path, isdatasync, fi));
+}
+
+#ifdef HAVE_SETXATTR
+static int bb_t_setxattr(const char *path, const char *name, const char *value,
+			 size_t size, int flags)
+{
+	BB_TRACE(OPT_SETXATTR, path, NULL, flags, size,
+		 xmp_setxattr(path, name, value, size, flags));
+}
+
+static int bb_t_getxattr(const char *path, const char *name, char *value,
+			 size_t size)
+{
+	BB_TRACE(OPT_GETXATTR, path, NULL, 0, size,
+		 xmp_getxattr(path, name, value, size));
+}
+
+static int bb_t_listxattr(const char *path, char *list, size_t size)
+{
+	BB_TRACE(OPT_LISTXATTR, path, NULL, 0, size, xmp_listxattr(path, list, size));
+}
+
+static int bb_t_removexattr(const char *path, const char *name)
+{
+	BB_TRACE(OPT_REMOVEXATTR, path, NULL, 0, 0, xmp_removexattr(path, name));
+}
+#endif
+
+static void bb_trace_ops(struct fuse_operations *op)
+{
+	op->getattr = bb_t_getattr;
+	op->access = bb_t_access;
+	op->readlink = bb_t_readlink;
+	op->readdir = bb_t_readdir;
+	op->mknod = bb_t_mknod;
+	op->mkdir = bb_t_mkdir;
+	op->symlink = bb_t_symlink;
+	op->unlink = bb_t_unlink;
+	op->rmdir = bb_t_rmdir;
+	op->rename = bb_t_rename;
+	op->link = bb_t_link;
+	op->chmod = bb_t_chmod;
+	op->chown = bb_t_chown;
+	op->truncate = bb_t_truncate;
+	op->utimens = bb_t_utimens;
+	op->open = bb_t_open;
+	op->read = bb_t_read;
+	op->write = bb_t_write;
+	op->statfs = bb_t_statfs;
+	op->create = bb_t_create;
+	op->release = bb_t_release;
+	op->fsync = bb_t_fsync;
+#ifdef HAVE_SETXATTR
+	op->setxattr = bb_t_setxattr;
+	op->getxattr = bb_t_getxattr;
+	op->listxattr = bb_t_listxattr;
+	op->removexattr = bb_t_removexattr;
+#endif
+}
+
 
 /*Quits if you don't have enough args from "Writing a FUSE Filesystem: a Tutorial"*/
 void bb_usage() 
 {
 	// Prints usage line if arguments not properly supplied
-	printf("./fusec <key phrase> <rootdir> <mountpoint>\n");
+	printf("./fusec [options] <key phrase> <rootdir> <mountpoint>\n");
+	printf("    -o dirfd_cache=N    cache up to N parent directory fds (default 0: off)\n");
+	printf("    -o dirlist_cache=N  cache up to N directory listings (default 0, off)\n");
+	printf("    -o journal_mb=N     checkpoint the journal every N MB (default 64)\n");
+	printf("    -o dirty_mb=N       write back once N MB of updates are pending (default 32)\n");
+	printf("    -o commit_ms=N      commit pending updates every N ms (default 1000)\n");
+	printf("    -o cipher=NAME      cipher for new files: aes-256-cbc (default), aes-128-ctr,\n");
+	printf("                        chacha20, or auto to benchmark and take the fastest\n");
+	printf("    -o ciphers=A:B:...  ciphers auto may choose from (default: all)\n");
+	printf("    -o stage_workers=N  encrypt writes in the background on N threads (default 0: off)\n");
+	printf("    -o stage_mb=N       most MB of writes waiting for those threads (default 64)\n");
+	printf("    -o direct_io_mb=N   open files of N MB and up with direct_io (default 0: off)\n");
+	printf("    -o direct_io_paths=GLOB:GLOB:...  open matching files with direct_io\n");
+	printf("    -o dedup            store new files' blocks once each, in a shared store\n");
+	printf("    -o pack             keep new small files in per-directory containers\n");
+	printf("    -o pack_max=N       largest file kept in a container, bytes (default 4096)\n");
+	printf("    -o trace=FILE       record every operation in FILE (see fusec-replay)\n");
+	printf("    -o sched_slots=N    serve N reads/writes at once, fairly between callers\n");
+	printf("                        (default 0: off)\n");
+	printf("    -o sched_by=uid|pid what a caller is for sched_slots (default uid)\n");
+	printf("    -o sched_weights=ID=W:ID=W:...  caller shares (default 1 each)\n");
+	printf("    -o keep_cache=N     keep cached data of up to N files across opens\n");
+	printf("                        (default 0: off)\n");
+	printf("    -o stripe_dirs=DIR:DIR:...  stripe new files over the root and DIRs\n");
+	printf("    -o stripe_kb=N      stripe unit of a new layout, KB (default 64)\n");
+	printf("    -o tier_dir=DIR     keep copies of the most read files in DIR\n");
+	printf("    -o tier_mb=N        most MB of copies in tier_dir (default 1024)\n");
+	printf("    -o tier_hot=N       heat a file needs to be copied (default 16)\n");
+	printf("    -o workers=N        serve requests on at most N threads of fusec's own\n");
+	printf("                        (default 0: libfuse's loop)\n");
+	printf("    -o meta_workers=N   and metadata on at most N others (default 0: shared)\n");
+	printf("    -o worker_cpus=LIST pin the workers to CPUs LIST, e.g. 0-3:6\n");
+	printf("    -o meta_cpus=LIST   pin the metadata workers to LIST (default worker_cpus)\n");
+	printf("    -o worker_idle_ms=N a worker idle N ms exits, 0: never (default 1000)\n");
+	printf("    -o log_level=N      0 errors, 1 warnings (default), 2 info, 3 debug;\n");
+	printf("                        SIGUSR1 raises it, SIGUSR2 lowers it\n");
 	abort();
 }
 
+#define BB_OPT(t, p, v) { t, offsetof(struct BB_DATA, p), v }
+
+static struct fuse_opt bb_opts[] = {
+	BB_OPT("dirfd_cache=%u", dircache_slots, 0),
+	BB_OPT("dirlist_cache=%u", dirlist_slots, 0),
+	BB_OPT("journal_mb=%u", journal_mb, 0),
+	BB_OPT("dirty_mb=%u", dirty_mb, 0),
+	BB_OPT("commit_ms=%u", commit_ms, 0),
+	BB_OPT("cipher=%s", cipher_name, 0),
+	BB_OPT("ciphers=%s", cipher_allow, 0),
+	BB_OPT("stage_workers=%u", stage_workers, 0),
+	BB_OPT("stage_mb=%u", stage_mb, 0),
+	BB_OPT("direct_io_mb=%u", direct_io_mb, 0),
+	BB_OPT("direct_io_paths=%s", direct_io_paths, 0),
+	BB_OPT("dedup", dedup, 1),
+	BB_OPT("pack", pack, 1),
+	BB_OPT("pack_max=%u", pack_max, 0),
+	BB_OPT("trace=%s", trace_file, 0),
+	BB_OPT("sched_slots=%u", sched_slots, 0),
+	BB_OPT("sched_by=%s", sched_by, 0),
+	BB_OPT("sched_weights=%s", sched_weights, 0),
+	BB_OPT("keep_cache=%u", keep_slots, 0),
+	BB_OPT("stripe_dirs=%s", stripe_dirs, 0),
+	BB_OPT("stripe_kb=%u", stripe_kb, 0),
+	BB_OPT("tier_dir=%s", tier_dir, 0),
+	BB_OPT("tier_mb=%u", tier_mb, 0),
+	BB_OPT("tier_hot=%u", tier_hot, 0),
+	BB_OPT("workers=%u", workers, 0),
+	BB_OPT("meta_workers=%u", meta_workers, 0),
+	BB_OPT("worker_cpus=%s", worker_cpus, 0),
+	BB_OPT("meta_cpus=%s", meta_cpus, 0),
+	BB_OPT("worker_idle_ms=%u", worker_idle_ms, 0),
+	BB_OPT("log_level=%u", log_level, 0),
+	FUSE_OPT_END
+};
+
+/* is cipher in the colon separated list (NULL: all)? */
+static int bb_cipher_allowed(const char *list, uint32_t cipher)
+{
+	const char *name = encblk_cipher_name(cipher);
+	size_t len = strlen(name);
+	const char *p;
+
+	if (list == NULL)
+		return 1;
+	for (p = list; (p = strstr(p, name)) != NULL; p += len)
+		if ((p == list || p[-1] == ':') && (p[len] == ':' || p[len] == '\0'))
+			return 1;
+	return 0;
+}
+
+/* Sets data->cipher from -o cipher= and -o ciphers=; auto times each
+ * allowed cipher on a few MB of blocks and takes the fastest, since
+ * which one wins depends on the CPU (AES-NI or not). */
+static int bb_pick_cipher(struct BB_DATA *data)
+{
+	double best = 0, mbs;
+	uint32_t i;
+	int id;
+
+	if (data->cipher_name == NULL) {
+		data->cipher = ENCBLK_AES256CBC;
+		return 0;
+	}
+	if (strcmp(data->cipher_name, "auto")) {
+		id = encblk_cipher_id(data->cipher_name);
+		if (id < 0 || !encblk_cipher_ok(id)) {
+			fprintf(stderr, "cipher %s not available\n", data->cipher_name);
+			return -1;
+		}
+		data->cipher = id;
+		return 0;
+	}
+	for (i = 0; i < ENCBLK_NCIPHERS; i++) {
+		if (!encblk_cipher_ok(i) || !bb_cipher_allowed(data->cipher_allow, i))
+			continue;
+		mbs = encblk_bench(&data->blkkeys, i, BB_BENCH_BYTES);
+		fprintf(stderr, "cipher: %s %.0f MB/s\n", encblk_cipher_name(i), mbs);
+		if (mbs > best) {
+			best = mbs;
+			data->cipher = i;
+		}
+	}
+	if (best <= 0) {
+		fprintf(stderr, "cipher: none of %s available\n",
+			data->cipher_allow ? data->cipher_allow : "all");
+		return -1;
+	}
+	fprintf(stderr, "cipher: using %s\n", encblk_cipher_name(data->cipher));
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	struct fuseloop *loop = NULL;
+	int res;
 
 	if(argc < 4)
 	{
 		bb_usage();
 	}
 
-	struct BB_DATA* xmp_data = malloc(sizeof(struct BB_DATA));
+	struct BB_DATA* xmp_data = calloc(1, sizeof(struct BB_DATA));
 	if (xmp_data == NULL) {
 		perror("ohnoD:");
 		abort();
@@ -745,7 +2610,177 @@ int main(int argc, char *argv[])
     argv[argc-2] = NULL;
     argv[argc-1] = NULL;
     argc -= 2;
+
+	xmp_data->journal_mb = 64;
+	xmp_data->dirty_mb = 32;
+	xmp_data->commit_ms = 1000;
+	xmp_data->stage_mb = 64;
+	xmp_data->pack_max = 4096;
+	xmp_data->stripe_kb = 64;
+	xmp_data->tier_mb = 1024;
+	xmp_data->tier_hot = 16;
+	xmp_data->worker_idle_ms = 1000;
+	xmp_data->log_level = BBLOG_WARN;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, xmp_data, bb_opts, NULL) == -1)
+		bb_usage();
+	if (xmp_data->log_level > BBLOG_DEBUG)
+		xmp_data->log_level = BBLOG_DEBUG;
+	bblog_level = xmp_data->log_level;
+
+	/* open the backing root once; every operation is relative to it */
+	if (xmp_data->rootdir == NULL) {
+		perror("rootdir");
+		abort();
+	}
+	xmp_data->rootfd = open(xmp_data->rootdir, O_RDONLY | O_DIRECTORY);
+	if (xmp_data->rootfd == -1) {
+		perror("rootdir");
+		abort();
+	}
+	if (xmp_data->dircache_slots) {
+		xmp_data->dircache = dirfd_cache_new(xmp_data->rootfd,
+						     xmp_data->dircache_slots);
+		if (xmp_data->dircache == NULL) {
+			perror("dirfd_cache");
+			abort();
+		}
+	}
+	if (encblk_derive_keys(xmp_data->key, &xmp_data->blkkeys) < 0) {
+		fprintf(stderr, "bad key phrase\n");
+		abort();
+	}
+	if (bb_pick_cipher(xmp_data) < 0)
+		bb_usage();
+	/* finish any block updates a crash interrupted before serving anything */
+	xmp_data->journal = journal_open(xmp_data->rootfd, JOURNAL_NAME,
+					 (size_t)xmp_data->journal_mb << 20);
+	if (xmp_data->journal == NULL) {
+		perror("journal");
+		abort();
+	}
+	/* before the replay, which may have updates for every device */
+	xmp_data->stripe = stripe_open(xmp_data->rootfd, xmp_data->journal,
+				       &xmp_data->blkkeys, xmp_data->stripe_dirs,
+				       xmp_data->stripe_kb);
+	if (xmp_data->stripe == NULL && errno == ENODEV) {
+		fprintf(stderr, "stripe_dirs don't match the layout in %s\n",
+			xmp_data->rootdir);
+		abort();
+	}
+	if (xmp_data->stripe == NULL && errno != ENOENT) {
+		perror("stripe");
+		abort();
+	}
+	res = journal_replay(xmp_data->journal);
+	if (res < 0) {
+		fprintf(stderr, "journal replay failed: %s\n", strerror(-res));
+		abort();
+	}
+	if (res > 0)
+		bblog(BBLOG_INFO, "journal: replayed %d updates", res);
+	/* after the replay: a rebuild reads the maps as they ended up */
+	xmp_data->dd = dedup_open(xmp_data->rootfd, xmp_data->journal,
+				  &xmp_data->blkkeys, FLAG, FLAG_DEDUP,
+				  xmp_data->dedup);
+	if (xmp_data->dd == NULL && errno != ENOENT) {
+		perror("dedup");
+		abort();
+	}
+	xmp_data->pk = pack_open(xmp_data->rootfd, &xmp_data->blkkeys,
+				 xmp_data->pack_max, xmp_data->pack);
+	if (xmp_data->pk == NULL && errno == EKEYREJECTED) {
+		fprintf(stderr, "pack: the key phrase does not match the packed files\n");
+		abort();
+	}
+	if (xmp_data->pk == NULL && errno != ENOENT) {
+		perror("pack");
+		abort();
+	}
+	xmp_data->wb = writeback_new(xmp_data->journal,
+				     (size_t)xmp_data->dirty_mb << 20);
+	if (xmp_data->wb == NULL) {
+		perror("writeback");
+		abort();
+	}
+	if (xmp_data->tier_dir) {
+		/* the migrator is started in xmp_init() */
+		xmp_data->tier = tier_open(xmp_data->rootfd, xmp_data->wb,
+					   xmp_data->tier_dir, xmp_data->tier_mb,
+					   xmp_data->tier_hot);
+		if (xmp_data->tier == NULL) {
+			perror("tier_dir");
+			abort();
+		}
+	}
+
+	if (xmp_data->stage_workers) {
+		/* the workers are started in xmp_init() */
+		xmp_data->stage = staging_new((size_t)xmp_data->stage_mb << 20,
+					      bb_write_blocks, xmp_data);
+		if (xmp_data->stage == NULL)
+			perror("staging: disabled");
+	}
+	if (xmp_data->dirlist_slots) {
+		/* the watcher thread itself is started in xmp_init() */
+		xmp_data->dirlist = dirlist_cache_new(xmp_data->dirlist_slots);
+		if (xmp_data->dirlist == NULL)
+			perror("dirlist_cache: disabled");
+	}
+
+	if (xmp_data->sched_by && strcmp(xmp_data->sched_by, "uid")) {
+		if (strcmp(xmp_data->sched_by, "pid"))
+			bb_usage();
+		xmp_data->sched_pid = 1;
+	}
+	if (xmp_data->sched_slots) {
+		xmp_data->sched = fairq_new(xmp_data->sched_slots,
+					    xmp_data->sched_weights);
+		if (xmp_data->sched == NULL && errno == EINVAL)
+			bb_usage();
+		if (xmp_data->sched == NULL) {
+			perror("sched_slots");
+			abort();
+		}
+	}
+
+	if (xmp_data->keep_slots) {
+		xmp_data->kc = keepcache_new(xmp_data->keep_slots);
+		if (xmp_data->kc == NULL)
+			perror("keep_cache: disabled");
+	}
+
+	if (xmp_data->trace_file) {
+		/* opened here: fuse_main changes to / when it daemonizes */
+		xmp_data->trace = optrace_open(xmp_data->trace_file);
+		if (xmp_data->trace == NULL) {
+			perror("trace");
+			abort();
+		}
+		bb_trace_ops(&xmp_oper);
+	}
+
+	if (xmp_data->workers) {
+		loop = fuseloop_new(xmp_data->workers, xmp_data->meta_workers,
+				    xmp_data->worker_cpus, xmp_data->meta_cpus,
+				    xmp_data->worker_idle_ms);
+		if (loop == NULL && errno == EINVAL)
+			bb_usage();
+		if (loop == NULL) {
+			perror("workers");
+			abort();
+		}
+	} else if (xmp_data->meta_workers || xmp_data->worker_cpus ||
+		   xmp_data->meta_cpus) {
+		fprintf(stderr, "meta_workers, worker_cpus and meta_cpus need workers=N\n");
+		bb_usage();
+	}
+
 	/*from fusexmp*/
     umask(0);
-	return fuse_main(argc, argv, &xmp_oper, xmp_data);
+	if (loop == NULL)
+		return fuse_main(args.argc, args.argv, &xmp_oper, xmp_data);
+	res = fuseloop_main(loop, args.argc, args.argv, &xmp_oper, xmp_data);
+	fuseloop_free(loop);
+	return res;
 }
@@ -0,0 +1,423 @@
+/* fuseloop.c
+ * fusec's own FUSE session loop: bounded, pinned worker pools
+ *
+ * See fuseloop.h for details
+ *
+ * Requests are read whole into buffers (kept on a free list) with
+ * fuse_chan_recv() and served with fuse_session_process(), which work on
+ * libfuse 2.8 and 2.9 alike and never splice, so a request can be served
+ * on another thread than the one that read it. Workers are detached and
+ * counted; stopping waits for the count to drop to zero.
+ *
+ */
+
+#ifdef linux
+/* For cpu_set_t and pthread_attr_setaffinity_np() */
+#define _GNU_SOURCE
+#endif
+
+#define FUSE_USE_VERSION 28
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "bblog.h"
+#include "fuseloop.h"
+
+#if FUSE_MAJOR_VERSION >= 3
+
+struct fuseloop* fuseloop_new(unsigned int workers, unsigned int meta_workers,
+			      const char* cpus, const char* meta_cpus,
+			      unsigned int idle_ms){
+    (void)workers;
+    (void)meta_workers;
+    (void)cpus;
+    (void)meta_cpus;
+    (void)idle_ms;
+    errno = ENOSYS;
+    return NULL;
+}
+
+int fuseloop_main(struct fuseloop* l, int argc, char* argv[],
+		  const struct fuse_operations* op, void* user_data){
+    (void)l;
+    (void)argc;
+    (void)argv;
+    (void)op;
+    (void)user_data;
+    return 1;
+}
+
+void fuseloop_free(struct fuseloop* l){
+    (void)l;
+}
+
+#else
+
+/* The start of every request, from the kernel's FUSE protocol */
+struct fl_in_header {
+    uint32_t len;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint32_t padding;
+};
+
+/* opcodes of the data operations */
+#define FL_READ 15
+#define FL_WRITE 16
+#define FL_FSYNC 20
+#define FL_FLUSH 25
+#define FL_FALLOCATE 43
+#define FL_LSEEK 46
+
+enum { FL_DATA, FL_META };
+
+struct fl_req {
+    struct fl_req* next;
+    struct fuse_chan* ch;
+    size_t len;
+    char buf[];
+};
+
+struct fl_pool {
+    struct fuseloop* l;
+    unsigned int max;
+    int pinned;
+    cpu_set_t cpus;
+    pthread_cond_t work;	/* a request was queued, or stop */
+    struct fl_req* head;
+    struct fl_req** tail;
+    unsigned int queued;
+    unsigned int nthreads;
+    unsigned int nidle;		/* waiting for work */
+};
+
+struct fuseloop {
+    pthread_mutex_t lock;
+    pthread_cond_t done;	/* a worker exited */
+    struct fl_pool pool[2];
+    unsigned int npools;
+    unsigned int idle_ms;
+    struct fuse_session* se;
+    size_t bufsize;
+    struct fl_req* free;
+    unsigned int nfree;
+    int stop;
+};
+
+/* "0-3:6" into set, limited to the CPUs we may run on */
+static int parse_cpus(const char* s, cpu_set_t* set){
+    cpu_set_t allowed;
+    unsigned long a, b;
+    char* end;
+
+    CPU_ZERO(set);
+    for(;;){
+	if(!isdigit((unsigned char)*s))
+	    return -1;
+	a = b = strtoul(s, &end, 10);
+	if(*end == '-'){
+	    if(!isdigit((unsigned char)end[1]))
+		return -1;
+	    b = strtoul(end + 1, &end, 10);
+	}
+	if(b < a || b >= CPU_SETSIZE)
+	    return -1;
+	for(; a <= b; a++)
+	    CPU_SET(a, set);
+	if(*end == '\0')
+	    break;
+	if(*end != ':')
+	    return -1;
+	s = end + 1;
+    }
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	CPU_AND(set, set, &allowed);
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+struct fuseloop* fuseloop_new(unsigned int workers, unsigned int meta_workers,
+			      const char* cpus, const char* meta_cpus,
+			      unsigned int idle_ms){
+    struct fuseloop* l;
+    unsigned int i;
+
+    if(!workers){
+	errno = EINVAL;
+	return NULL;
+    }
+    l = calloc(1, sizeof(*l));
+    if(!l)
+	return NULL;
+    l->npools = meta_workers ? 2 : 1;
+    l->pool[FL_DATA].max = workers;
+    l->pool[FL_META].max = meta_workers;
+    if(!meta_cpus)
+	meta_cpus = cpus;
+    if((cpus && parse_cpus(cpus, &l->pool[FL_DATA].cpus) < 0) ||
+       (meta_cpus && parse_cpus(meta_cpus, &l->pool[FL_META].cpus) < 0)){
+	free(l);
+	errno = EINVAL;
+	return NULL;
+    }
+    l->pool[FL_DATA].pinned = cpus != NULL;
+    l->pool[FL_META].pinned = meta_cpus != NULL;
+    l->idle_ms = idle_ms;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->done, NULL);
+    for(i = 0; i < 2; i++){
+	l->pool[i].l = l;
+	l->pool[i].tail = &l->pool[i].head;
+	pthread_cond_init(&l->pool[i].work, NULL);
+    }
+    return l;
+}
+
+/* called with l->lock held */
+static struct fl_req* get_req(struct fuseloop* l){
+    struct fl_req* r = l->free;
+
+    if(!r)
+	return malloc(sizeof(*r) + l->bufsize);
+    l->free = r->next;
+    l->nfree--;
+    return r;
+}
+
+/* called with l->lock held; keeps about one buffer per worker */
+static void put_req(struct fuseloop* l, struct fl_req* r){
+    if(l->nfree >= l->pool[FL_DATA].max + l->pool[FL_META].max){
+	free(r);
+	return;
+    }
+    r->next = l->free;
+    l->free = r;
+    l->nfree++;
+}
+
+/* called with l->lock held */
+static struct fl_req* dequeue(struct fl_pool* p){
+    struct fl_req* r = p->head;
+
+    p->head = r->next;
+    if(!p->head)
+	p->tail = &p->head;
+    p->queued--;
+    return r;
+}
+
+/* called with l->lock held; drops it while the request is served */
+static void serve(struct fuseloop* l, struct fl_req* r){
+    pthread_mutex_unlock(&l->lock);
+    fuse_session_process(l->se, r->buf, r->len, r->ch);
+    pthread_mutex_lock(&l->lock);
+    put_req(l, r);
+}
+
+static void* worker(void* arg){
+    struct fl_pool* p = arg;
+    struct fuseloop* l = p->l;
+    struct timespec until;
+    int res;
+
+    pthread_mutex_lock(&l->lock);
+    for(;;){
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += l->idle_ms / 1000;
+	until.tv_nsec += (long)(l->idle_ms % 1000) * 1000000;
+	if(until.tv_nsec >= 1000000000){
+	    until.tv_sec++;
+	    until.tv_nsec -= 1000000000;
+	}
+	res = 0;
+	p->nidle++;
+	while(!p->head && !l->stop && res != ETIMEDOUT){
+	    /* the pool's last worker stays anyway, and with no idle time
+	       every one does: no timeout to wake them for nothing */
+	    if(p->nthreads == 1 || !l->idle_ms)
+		res = pthread_cond_wait(&p->work, &l->lock);
+	    else
+		res = pthread_cond_timedwait(&p->work, &l->lock, &until);
+	}
+	p->nidle--;
+	if(p->head)
+	    serve(l, dequeue(p));
+	else if(l->stop || p->nthreads > 1)
+	    break;
+    }
+    p->nthreads--;
+    pthread_cond_broadcast(&l->done);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+/* called with l->lock held */
+static int spawn(struct fl_pool* p){
+    pthread_attr_t attr;
+    sigset_t all, old;
+    pthread_t t;
+    int res;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(p->pinned)
+	pthread_attr_setaffinity_np(&attr, sizeof(p->cpus), &p->cpus);
+    /* signals are left to the reading thread, as with libfuse's loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    res = pthread_create(&t, &attr, worker, p);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if(res)
+	return -res;
+    p->nthreads++;
+    return 0;
+}
+
+static int data_op(uint32_t opcode){
+    switch(opcode){
+    case FL_READ:
+    case FL_WRITE:
+    case FL_FSYNC:
+    case FL_FLUSH:
+    case FL_FALLOCATE:
+    case FL_LSEEK:
+	return 1;
+    }
+    return 0;
+}
+
+/* called with l->lock held */
+static void dispatch(struct fuseloop* l, struct fl_req* r){
+    const struct fl_in_header* in = (const struct fl_in_header*)r->buf;
+    struct fl_pool* p = &l->pool[FL_DATA];
+    int res;
+
+    if(l->npools > 1 && !data_op(in->opcode))
+	p = &l->pool[FL_META];
+    r->next = NULL;
+    *p->tail = r;
+    p->tail = &r->next;
+    p->queued++;
+    if(p->nidle < p->queued && p->nthreads < p->max){
+	res = spawn(p);
+	if(res < 0)
+	    bblog(BBLOG_WARN, "fuseloop: no new worker: %s", strerror(-res));
+    }
+    pthread_cond_signal(&p->work);
+    /* without any worker, whoever reads has to serve */
+    while(!p->nthreads && p->head)
+	serve(l, dequeue(p));
+}
+
+/* The reading side of the loop, on the calling thread; -1 on error */
+static int loop(struct fuseloop* l, struct fuse_session* se){
+    struct fuse_chan* ch0 = fuse_session_next_chan(se, NULL);
+    struct fuse_chan* ch;
+    struct fl_req* r;
+    int err = 0;
+    int res;
+
+    l->se = se;
+    l->bufsize = fuse_chan_bufsize(ch0);
+    pthread_mutex_lock(&l->lock);
+    while(!fuse_session_exited(se)){
+	r = get_req(l);
+	if(!r){
+	    bblog(BBLOG_ERR, "fuseloop: no memory for a request");
+	    err = -1;
+	    break;
+	}
+	pthread_mutex_unlock(&l->lock);
+	ch = ch0;
+	res = fuse_chan_recv(&ch, r->buf, l->bufsize);
+	pthread_mutex_lock(&l->lock);
+	if(res <= 0){
+	    put_req(l, r);
+	    if(res == -EINTR)
+		continue;
+	    if(res < 0)
+		err = -1;
+	    break;
+	}
+	r->ch = ch;
+	r->len = res;
+	dispatch(l, r);
+    }
+    fuse_session_exit(se);
+    /* whatever was read is still served */
+    l->stop = 1;
+    pthread_cond_broadcast(&l->pool[FL_DATA].work);
+    pthread_cond_broadcast(&l->pool[FL_META].work);
+    while(l->pool[FL_DATA].nthreads || l->pool[FL_META].nthreads)
+	pthread_cond_wait(&l->done, &l->lock);
+    l->stop = 0;
+    pthread_mutex_unlock(&l->lock);
+    return err;
+}
+
+int fuseloop_main(struct fuseloop* l, int argc, char* argv[],
+		  const struct fuse_operations* op, void* user_data){
+    struct fuse* f;
+    char* mountpoint;
+    cpu_set_t cpus;
+    int mt, res;
+
+    f = fuse_setup(argc, argv, op, sizeof(*op), &mountpoint, &mt, user_data);
+    if(!f)
+	return 1;
+    if(!mt)
+	res = fuse_loop(f);
+    else{
+	if(l->pool[FL_DATA].pinned && (l->npools == 1 || l->pool[FL_META].pinned)){
+	    cpus = l->pool[FL_DATA].cpus;
+	    if(l->npools > 1)
+		CPU_OR(&cpus, &cpus, &l->pool[FL_META].cpus);
+	    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#if FUSE_VERSION >= 29
+	/* what fuse_loop_mt() does for -o remember */
+	res = fuse_start_cleanup_thread(f) ? -1 : 0;
+	if(res == 0){
+	    res = loop(l, fuse_get_session(f));
+	    fuse_stop_cleanup_thread(f);
+	}
+#else
+	res = loop(l, fuse_get_session(f));
+#endif
+    }
+    fuse_teardown(f, mountpoint);
+    return res == -1 ? 1 : 0;
+}
+
+void fuseloop_free(struct fuseloop* l){
+    struct fl_req* r;
+    unsigned int i;
+
+    if(!l)
+	return;
+    while((r = l->free)){
+	l->free = r->next;
+	free(r);
+    }
+    for(i = 0; i < 2; i++)
+	pthread_cond_destroy(&l->pool[i].work);
+    pthread_cond_destroy(&l->done);
+    pthread_mutex_destroy(&l->lock);
+    free(l);
+}
+
+#endif
@@ -0,0 +1,63 @@
+/* fuseloop.h
+ * fusec's own FUSE session loop: bounded, pinned worker pools
+ *
+ * fuse_main() serves requests with libfuse's multithreaded loop, which
+ * starts a thread whenever none is free to read the next request and
+ * keeps up to ten idle ones, on whatever CPUs the scheduler likes. On a
+ * host shared with latency sensitive services that is hard to live with.
+ *
+ * This loop reads requests on the calling thread and hands each to one
+ * of two pools: data (read, write, fsync, flush, fallocate, lseek) and
+ * metadata (everything else), or to a single shared pool. A pool starts
+ * a worker when a request is queued and none of its workers is free, up
+ * to its maximum; further requests wait in the pool's queue. A worker
+ * idle for the idle time exits, except the pool's last, which waits for
+ * work without waking up. Each pool's workers can be pinned to a set of
+ * CPUs, and the reading thread to the union of both. Threads that fusec
+ * starts from its init handler inherit the CPUs of the pool that served
+ * FUSE_INIT.
+ *
+ * Only built against libfuse 2: libfuse 3 has no fuse_setup().
+ *
+ */
+
+#ifndef FUSELOOP_H
+#define FUSELOOP_H
+
+struct fuse_operations;
+struct fuseloop;
+
+/* struct fuseloop* fuseloop_new(unsigned int workers, unsigned int meta_workers,
+ *                               const char* cpus, const char* meta_cpus,
+ *                               unsigned int idle_ms)
+ * Purpose: Set up the pools
+ * Args: unsigned int workers      : Most data workers (at least 1)
+ *       unsigned int meta_workers : Most metadata workers, or 0 to serve
+ *                                   metadata from the data pool
+ *       const char* cpus          : CPUs to pin the data pool to, "0-3,6",
+ *                                   or NULL for any
+ *       const char* meta_cpus     : Same for the metadata pool (NULL: cpus)
+ *       unsigned int idle_ms      : How long a worker stays idle before it
+ *                                   exits, 0 for never
+ * Return: Loop on success, NULL on error (errno set; EINVAL for a bad CPU
+ *         list or no workers, ENOSYS with libfuse 3)
+ */
+extern struct fuseloop* fuseloop_new(unsigned int workers, unsigned int meta_workers,
+				     const char* cpus, const char* meta_cpus,
+				     unsigned int idle_ms);
+
+/* int fuseloop_main(struct fuseloop* l, int argc, char* argv[],
+ *                   const struct fuse_operations* op, void* user_data)
+ * Purpose: fuse_main() on this loop: mount, serve until unmounted, tear
+ *          down. -s still serves on the calling thread alone.
+ * Return: 0 on success, 1 on error (as fuse_main())
+ */
+extern int fuseloop_main(struct fuseloop* l, int argc, char* argv[],
+			 const struct fuse_operations* op, void* user_data);
+
+/* void fuseloop_free(struct fuseloop* l)
+ * Purpose: Free a loop that isn't running
+ */
+extern void fuseloop_free(struct fuseloop* l);
+
+#endif
@@ -12,17 +12,21 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: Open files keep the underlying file open between open()/create()
+        and release(); its descriptor is stored in fi->fh. read(), write(),
+        fgetattr(), ftruncate(), flush() and fsync() work on that descriptor
+        instead of opening the file again by path for every call.
+
+        Reads and writes go through read_buf() and write_buf(): they hand
+        libfuse the open descriptor rather than a copy of the data, so on
+        kernels that allow it data is spliced between the file and
+        /dev/fuse without passing through this process. Mount with
+        "-o nozerocopy" to copy every byte through read() and write()
+        instead, e.g. to measure what splicing saves.
 
 */
 
-#define FUSE_USE_VERSION 28
+#define FUSE_USE_VERSION 29
 #define HAVE_SETXATTR
 
 #ifdef HAVE_CONFIG_H
@@ -30,12 +34,14 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite() and openat() & co */
+#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -46,11 +52,36 @@
 #include <sys/xattr.h>
 #endif
 
+/* The mirrored tree, opened once in main(). Everything that has an *at()
+   variant is resolved relative to it. */
+static int rootfd = -1;
+
+/* -o options of our own; libfuse gets the rest */
+struct xmp_config {
+	int copy;	/* no read_buf/write_buf: data through our buffers */
+};
+
+static struct xmp_config xmp_conf;
+
+static struct fuse_opt xmp_opts[] = {
+	{ "zerocopy", offsetof(struct xmp_config, copy), 0 },
+	{ "nozerocopy", offsetof(struct xmp_config, copy), 1 },
+	FUSE_OPT_END
+};
+
+/* FUSE hands us absolute paths; strip the leading '/' for *at() calls */
+static const char *xmp_rel(const char *path)
+{
+	while (*path == '/')
+		path++;
+	return *path ? path : ".";
+}
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 
-	res = lstat(path, stbuf);
+	res = fstatat(rootfd, xmp_rel(path), stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -61,7 +92,7 @@ static int xmp_access(const char *path, int mask)
 {
 	int res;
 
-	res = access(path, mask);
+	res = faccessat(rootfd, xmp_rel(path), mask, 0);
 	if (res == -1)
 		return -errno;
 
@@ -72,7 +103,7 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
 
-	res = readlink(path, buf, size - 1);
+	res = readlinkat(rootfd, xmp_rel(path), buf, size - 1);
 	if (res == -1)
 		return -errno;
 
@@ -86,13 +117,19 @@ static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
 	DIR *dp;
 	struct dirent *de;
+	int fd;
 
 	(void) offset;
 	(void) fi;
 
-	dp = opendir(path);
-	if (dp == NULL)
+	fd = openat(rootfd, xmp_rel(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -errno;
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
 		return -errno;
+	}
 
 	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
@@ -114,13 +151,13 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
-		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = openat(rootfd, xmp_rel(path), O_CREAT | O_EXCL | O_WRONLY, mode);
 		if (res >= 0)
 			res = close(res);
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
+		res = mkfifoat(rootfd, xmp_rel(path), mode);
 	else
-		res = mknod(path, mode, rdev);
+		res = mknodat(rootfd, xmp_rel(path), mode, rdev);
 	if (res == -1)
 		return -errno;
 
@@ -131,7 +168,7 @@ static int xmp_mkdir(const char *path, mode_t mode)
 {
 	int res;
 
-	res = mkdir(path, mode);
+	res = mkdirat(rootfd, xmp_rel(path), mode);
 	if (res == -1)
 		return -errno;
 
@@ -142,7 +179,7 @@ static int xmp_unlink(const char *path)
 {
 	int res;
 
-	res = unlink(path);
+	res = unlinkat(rootfd, xmp_rel(path), 0);
 	if (res == -1)
 		return -errno;
 
@@ -153,7 +190,7 @@ static int xmp_rmdir(const char *path)
 {
 	int res;
 
-	res = rmdir(path);
+	res = unlinkat(rootfd, xmp_rel(path), AT_REMOVEDIR);
 	if (res == -1)
 		return -errno;
 
@@ -164,7 +201,7 @@ static int xmp_symlink(const char *from, const char *to)
 {
 	int res;
 
-	res = symlink(from, to);
+	res = symlinkat(from, rootfd, xmp_rel(to));
 	if (res == -1)
 		return -errno;
 
@@ -175,7 +212,7 @@ static int xmp_rename(const char *from, const char *to)
 {
 	int res;
 
-	res = rename(from, to);
+	res = renameat(rootfd, xmp_rel(from), rootfd, xmp_rel(to));
 	if (res == -1)
 		return -errno;
 
@@ -186,7 +223,7 @@ static int xmp_link(const char *from, const char *to)
 {
 	int res;
 
-	res = link(from, to);
+	res = linkat(rootfd, xmp_rel(from), rootfd, xmp_rel(to), 0);
 	if (res == -1)
 		return -errno;
 
@@ -197,7 +234,7 @@ static int xmp_chmod(const char *path, mode_t mode)
 {
 	int res;
 
-	res = chmod(path, mode);
+	res = fchmodat(rootfd, xmp_rel(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
@@ -208,7 +245,7 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 {
 	int res;
 
-	res = lchown(path, uid, gid);
+	res = fchownat(rootfd, xmp_rel(path), uid, gid, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
@@ -226,73 +263,135 @@ static int xmp_truncate(const char *path, off_t size)
 	return 0;
 }
 
-static int xmp_utimens(const char *path, const struct timespec ts[2])
+static int xmp_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
 {
 	int res;
-	struct timeval tv[2];
 
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	(void) path;
 
-	res = utimes(path, tv);
+	res = ftruncate(fi->fh, size);
 	if (res == -1)
 		return -errno;
 
 	return 0;
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
 	int res;
 
-	res = open(path, fi->flags);
+	res = utimensat(rootfd, xmp_rel(path), ts, 0);
 	if (res == -1)
 		return -errno;
 
-	close(res);
 	return 0;
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
 	int fd;
-	int res;
 
-	(void) fi;
-	fd = open(path, O_RDONLY);
+	fd = openat(rootfd, xmp_rel(path), fi->flags);
 	if (fd == -1)
 		return -errno;
 
-	res = pread(fd, buf, size, offset);
+	fi->fh = fd;
+	return 0;
+}
+
+static int xmp_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+
+	res = fstat(fi->fh, stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+	res = pread(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	close(fd);
 	return res;
 }
 
 static int xmp_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
 
-	(void) fi;
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
-
-	res = pwrite(fd, buf, size, offset);
+	(void) path;
+	res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	close(fd);
 	return res;
 }
 
+/* Hand back the open file and offset instead of the data; libfuse reads
+   (or splices) it straight into the reply */
+static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	(void) path;
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+
+	return 0;
+}
+
+/* buf may still be in the pipe the request was spliced into; let
+   libfuse splice it on into the open file */
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	(void) path;
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+/* Ask the kernel to splice requests and replies to and from /dev/fuse
+   where it can; without this libfuse 2 only does so when mounted with
+   -o splice_read,splice_write,splice_move */
+static void *xmp_init(struct fuse_conn_info *conn)
+{
+	if (!xmp_conf.copy)
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+					       FUSE_CAP_SPLICE_WRITE |
+					       FUSE_CAP_SPLICE_MOVE);
+	return NULL;
+}
+
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
@@ -304,40 +403,56 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 	return 0;
 }
 
-static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+static int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int fd;
 
-    (void) fi;
+	fd = openat(rootfd, xmp_rel(path), fi->flags | O_CREAT, mode);
+	if (fd == -1)
+		return -errno;
 
-    int res;
-    res = creat(path, mode);
-    if(res == -1)
-	return -errno;
+	fi->fh = fd;
+	return 0;
+}
 
-    close(res);
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
+{
+	int res;
 
-    return 0;
-}
+	(void) path;
+	/* This is called from every close on an open file, so call the
+	   close on the underlying filesystem.	But since flush may be
+	   called multiple times for an open file, this must not really
+	   close the file.  This is important if used on a network
+	   filesystem like NFS which flush the data/metadata on close() */
+	res = close(dup(fi->fh));
+	if (res == -1)
+		return -errno;
 
+	return 0;
+}
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-
 	(void) path;
-	(void) fi;
+	close(fi->fh);
+
 	return 0;
 }
 
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
 
 	(void) path;
-	(void) isdatasync;
-	(void) fi;
+	if (isdatasync)
+		res = fdatasync(fi->fh);
+	else
+		res = fsync(fi->fh);
+	if (res == -1)
+		return -errno;
+
 	return 0;
 }
 
@@ -379,6 +494,7 @@ static int xmp_removexattr(const char *path, const char *name)
 
 static struct fuse_operations xmp_oper = {
 	.getattr	= xmp_getattr,
+	.fgetattr	= xmp_fgetattr,
 	.access		= xmp_access,
 	.readlink	= xmp_readlink,
 	.readdir	= xmp_readdir,
@@ -392,12 +508,17 @@ static struct fuse_operations xmp_oper = {
 	.chmod		= xmp_chmod,
 	.chown		= xmp_chown,
 	.truncate	= xmp_truncate,
+	.ftruncate	= xmp_ftruncate,
 	.utimens	= xmp_utimens,
 	.open		= xmp_open,
 	.read		= xmp_read,
 	.write		= xmp_write,
+	.read_buf	= xmp_read_buf,
+	.write_buf	= xmp_write_buf,
+	.init		= xmp_init,
 	.statfs		= xmp_statfs,
-	.create         = xmp_create,
+	.create		= xmp_create,
+	.flush		= xmp_flush,
 	.release	= xmp_release,
 	.fsync		= xmp_fsync,
 #ifdef HAVE_SETXATTR
@@ -410,6 +531,25 @@ static struct fuse_operations xmp_oper = {
 
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	if (fuse_opt_parse(&args, &xmp_conf, xmp_opts, NULL) == -1)
+		return 1;
+	if (xmp_conf.copy) {
+		/* libfuse falls back to read() and write() */
+		xmp_oper.read_buf = NULL;
+		xmp_oper.write_buf = NULL;
+	}
+
+	rootfd = open("/", O_RDONLY | O_DIRECTORY);
+	if (rootfd == -1) {
+		perror("open /");
+		fuse_opt_free_args(&args);
+		return 1;
+	}
 	umask(0);
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+	res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
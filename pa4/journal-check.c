@@ -0,0 +1,414 @@
+/* journal-check.c
+ * Crash recovery check for fusec's write-ahead journal
+ *
+ * Each round gives a few files in a scratch backing root random contents,
+ * logs random transactions against them (runs of bytes, now and then a
+ * new file length) and keeps in memory what every file should hold. It
+ * then crashes, replays the journal from a fresh handle and compares the
+ * files. The crash is journal_close() with no checkpoint: appends go
+ * straight to the journal file, so the handle holds nothing a crash
+ * would lose. Every round runs each case:
+ *
+ *   unapplied  nothing applied before the crash: replay applies it all
+ *   partial    some transactions applied, the next one only in part
+ *   torn       the journal cut inside its last record: replay applies
+ *              the others and stops there
+ *   corrupt    a byte of the last record flipped: the same
+ *
+ * Mismatches are reported on stderr with the seed that reproduces them,
+ * and the exit status is 1 if there were any.
+ *
+ */
+
+#ifdef linux
+/* For mkdtemp() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define USAGE "[-r rounds] [-n transactions] [-s seed] [dir]"
+#define CHECK_JOURNAL ".fusec-journal"
+#define CHECK_FILES 4
+/* largest file offset a transaction writes at, and its longest run */
+#define CHECK_MAXOFF (64 * 1024)
+#define CHECK_MAXRUN 4096
+#define CHECK_MAXEXT 4
+#define CHECK_BUFLEN (CHECK_MAXOFF + CHECK_MAXRUN)
+
+enum { CASE_UNAPPLIED, CASE_PARTIAL, CASE_TORN, CASE_CORRUPT, NCASES };
+
+static const char* case_names[] = { "unapplied", "partial", "torn", "corrupt" };
+
+struct check_file {
+    char name[16];
+    uint64_t ino;
+    unsigned char* want;	/* what replay should leave */
+    size_t len;
+};
+
+struct check_txn {
+    struct journal_txn t;
+    struct journal_ext ext[CHECK_MAXEXT];
+    unsigned char* data;
+    unsigned int file;
+};
+
+static uint64_t rnd_state;
+
+/* xorshift64*: the same seed gives the same round */
+static uint64_t rnd(void){
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return rnd_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void rnd_fill(unsigned char* p, size_t len){
+    size_t i;
+
+    for(i = 0; i < len; i++)
+	p[i] = rnd();
+}
+
+static int write_file(int rootfd, struct check_file* f){
+    struct stat st;
+    ssize_t res;
+    int fd;
+
+    fd = openat(rootfd, f->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+	return -errno;
+    res = write(fd, f->want, f->len);
+    if(res != (ssize_t)f->len || fstat(fd, &st) == -1){
+	close(fd);
+	return res < 0 ? -errno : -EIO;
+    }
+    f->ino = st.st_ino;
+    close(fd);
+    return 0;
+}
+
+/* What journal_apply() does to the file, done to the model */
+static void model_apply(struct check_file* f, const struct journal_txn* t){
+    const struct journal_ext* e;
+    unsigned int i;
+
+    for(i = 0; i < t->next; i++){
+	e = &t->ext[i];
+	if(e->off > f->len)
+	    memset(f->want + f->len, 0, e->off - f->len);
+	memcpy(f->want + e->off, e->data, e->len);
+	if(e->off + e->len > f->len)
+	    f->len = e->off + e->len;
+    }
+    if(t->disklen >= 0){
+	if((size_t)t->disklen > f->len)
+	    memset(f->want + f->len, 0, t->disklen - f->len);
+	f->len = t->disklen;
+    }
+}
+
+static int make_txn(struct check_txn* x, struct check_file* files){
+    struct check_file* f;
+    unsigned int i;
+    size_t total = 0;
+    unsigned char* p;
+
+    x->file = rnd() % CHECK_FILES;
+    f = &files[x->file];
+    memset(&x->t, 0, sizeof(x->t));
+    x->t.path = f->name;
+    x->t.ino = f->ino;
+    x->t.disklen = rnd() % 4 ? -1 : (int64_t)(rnd() % CHECK_BUFLEN);
+    x->t.next = 1 + rnd() % CHECK_MAXEXT;
+    for(i = 0; i < x->t.next; i++){
+	x->ext[i].off = rnd() % CHECK_MAXOFF;
+	x->ext[i].len = 1 + rnd() % CHECK_MAXRUN;
+	total += x->ext[i].len;
+    }
+    x->data = malloc(total);
+    if(!x->data)
+	return -ENOMEM;
+    rnd_fill(x->data, total);
+    for(i = 0, p = x->data; i < x->t.next; p += x->ext[i++].len)
+	x->ext[i].data = p;
+    x->t.ext = x->ext;
+    return 0;
+}
+
+/* Apply transaction x to its file, only the first of its runs if part */
+static int apply_txn(int rootfd, const struct check_txn* x, const struct check_file* files,
+		     int part){
+    struct journal_txn t = x->t;
+    int fd, res;
+
+    if(part){
+	t.next = 1;
+	t.disklen = -1;
+    }
+    fd = openat(rootfd, files[x->file].name, O_WRONLY | O_CLOEXEC);
+    if(fd == -1)
+	return -errno;
+    res = journal_apply(fd, &t);
+    close(fd);
+    return res;
+}
+
+/* Files that differ from the model, each reported on stderr */
+static int compare(int rootfd, const struct check_file* files, const char* what){
+    unsigned char* buf;
+    struct stat st;
+    ssize_t got;
+    size_t i, k;
+    int fd, bad = 0;
+
+    buf = malloc(CHECK_BUFLEN);
+    if(!buf)
+	return -ENOMEM;
+    for(i = 0; i < CHECK_FILES; i++){
+	fd = openat(rootfd, files[i].name, O_RDONLY | O_CLOEXEC);
+	if(fd == -1 || fstat(fd, &st) == -1){
+	    fprintf(stderr, "%s: %s: %s\n", what, files[i].name, strerror(errno));
+	    bad++;
+	}
+	else if((size_t)st.st_size != files[i].len){
+	    fprintf(stderr, "%s: %s: %lld bytes, want %zu\n", what, files[i].name,
+		    (long long)st.st_size, files[i].len);
+	    bad++;
+	}
+	else{
+	    got = pread(fd, buf, files[i].len, 0);
+	    for(k = 0; got == (ssize_t)files[i].len && k < files[i].len; k++)
+		if(buf[k] != files[i].want[k])
+		    break;
+	    if(k < files[i].len){
+		fprintf(stderr, "%s: %s: differs at byte %zu\n", what, files[i].name, k);
+		bad++;
+	    }
+	}
+	if(fd != -1)
+	    close(fd);
+    }
+    free(buf);
+    return bad;
+}
+
+/* Cut the journal inside the record starting at from, or flip a bit in
+   it */
+static int damage(int rootfd, off_t from, int c){
+    struct stat st;
+    unsigned char byte;
+    off_t at;
+    int fd, res = 0;
+
+    fd = openat(rootfd, CHECK_JOURNAL, O_RDWR | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1 || st.st_size <= from + 1){
+	res = fd == -1 ? -errno : -EIO;
+	goto out;
+    }
+    if(c == CASE_TORN){
+	at = from + 1 + rnd() % (st.st_size - from - 1);
+	if(ftruncate(fd, at) == -1)
+	    res = -errno;
+    }
+    else{
+	at = from + rnd() % (st.st_size - from);
+	if(pread(fd, &byte, 1, at) != 1)
+	    res = -EIO;
+	byte ^= 1 << rnd() % 8;
+	if(res == 0 && pwrite(fd, &byte, 1, at) != 1)
+	    res = -EIO;
+    }
+ out:
+    if(fd != -1)
+	close(fd);
+    return res;
+}
+
+/* One round of case c; returns how many files were wrong after replay */
+static int run_case(int rootfd, struct check_file* files, struct check_txn* txn,
+		    unsigned int n, int c, uint64_t seed){
+    struct journal* j;
+    struct stat st;
+    off_t last = 0;
+    uint64_t seq = 0;
+    unsigned int i, applied, want;
+    char what[64];
+    int res;
+
+    for(i = 0; i < CHECK_FILES; i++){
+	files[i].len = rnd() % CHECK_BUFLEN;
+	rnd_fill(files[i].want, files[i].len);
+	res = write_file(rootfd, &files[i]);
+	if(res < 0)
+	    return res;
+    }
+    if(unlinkat(rootfd, CHECK_JOURNAL, 0) == -1 && errno != ENOENT)
+	return -errno;
+
+    j = journal_open(rootfd, CHECK_JOURNAL, SIZE_MAX);
+    if(!j)
+	return -errno;
+    for(i = 0; i < n; i++){
+	res = make_txn(&txn[i], files);
+	if(res < 0)
+	    goto out;
+	if(i == n - 1){
+	    if(fstatat(rootfd, CHECK_JOURNAL, &st, 0) == -1){
+		res = -errno;
+		goto out;
+	    }
+	    last = st.st_size;
+	}
+	res = journal_append(j, &txn[i].t, &seq);
+	if(res < 0)
+	    goto out;
+    }
+    res = journal_sync(j, seq, 0);
+    if(res < 0)
+	goto out;
+
+    if(c == CASE_PARTIAL){
+	applied = rnd() % n;
+	for(i = 0; i <= applied && res == 0; i++)
+	    res = apply_txn(rootfd, &txn[i], files, i == applied);
+	if(res < 0)
+	    goto out;
+    }
+    /* crash */
+    journal_close(j);
+    j = NULL;
+
+    if(c == CASE_TORN || c == CASE_CORRUPT){
+	res = damage(rootfd, last, c);
+	if(res < 0)
+	    goto out;
+    }
+
+    want = c == CASE_TORN || c == CASE_CORRUPT ? n - 1 : n;
+    for(i = 0; i < want; i++)
+	model_apply(&files[txn[i].file], &txn[i].t);
+
+    j = journal_open(rootfd, CHECK_JOURNAL, SIZE_MAX);
+    if(!j){
+	res = -errno;
+	goto out;
+    }
+    snprintf(what, sizeof(what), "seed %llu %s", (unsigned long long)seed, case_names[c]);
+    res = journal_replay(j);
+    if(res >= 0 && (unsigned int)res != want){
+	fprintf(stderr, "%s: replayed %d transactions, want %u\n", what, res, want);
+	res = 1;
+    }
+    else if(res >= 0)
+	res = 0;
+    if(res >= 0)
+	res += compare(rootfd, files, what);
+
+ out:
+    journal_close(j);
+    for(i = 0; i < n; i++){
+	free(txn[i].data);
+	txn[i].data = NULL;
+    }
+    return res;
+}
+
+int main(int argc, char* argv[]){
+    struct check_file files[CHECK_FILES];
+    struct check_txn* txn;
+    unsigned int rounds = 16, n = 32, r, i;
+    uint64_t seed = time(NULL), s;
+    char tmp[] = "/tmp/journal-check.XXXXXX";
+    const char* dir = NULL;
+    int rootfd, opt, c, res;
+    int bad = 0, failed = 0;
+
+    while((opt = getopt(argc, argv, "r:n:s:")) != -1){
+	switch(opt){
+	case 'r':
+	    rounds = atoi(optarg);
+	    break;
+	case 'n':
+	    n = atoi(optarg);
+	    break;
+	case 's':
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	default:
+	    n = 0;
+	}
+    }
+    if(optind < argc)
+	dir = argv[optind++];
+    if(n == 0 || optind != argc){
+	fprintf(stderr, "Usage: %s %s\n", argv[0], USAGE);
+	fprintf(stderr, "  -r N  rounds of every case (default 16)\n");
+	fprintf(stderr, "  -n N  transactions logged per round (default 32)\n");
+	fprintf(stderr, "  -s N  seed of the first round (default the time)\n");
+	fprintf(stderr, "  dir   scratch directory (default a new one in /tmp, removed after)\n");
+	exit(EXIT_FAILURE);
+    }
+    if(!dir && !(dir = mkdtemp(tmp))){
+	perror("mkdtemp");
+	exit(EXIT_FAILURE);
+    }
+    rootfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(rootfd == -1){
+	perror(dir);
+	exit(EXIT_FAILURE);
+    }
+    txn = calloc(n, sizeof(*txn));
+    if(!txn){
+	fprintf(stderr, "out of memory\n");
+	exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < CHECK_FILES; i++){
+	snprintf(files[i].name, sizeof(files[i].name), "file%u", i);
+	files[i].want = malloc(CHECK_BUFLEN);
+	if(!files[i].want){
+	    fprintf(stderr, "out of memory\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    for(r = 0; r < rounds && !failed; r++){
+	for(c = 0; c < NCASES && !failed; c++){
+	    /* -s with a round's seed reruns it exactly */
+	    s = seed + r;
+	    rnd_state = s * NCASES + c + 1;
+	    res = run_case(rootfd, files, txn, n, c, s);
+	    if(res < 0){
+		fprintf(stderr, "seed %llu %s: %s\n", (unsigned long long)s, case_names[c],
+			strerror(-res));
+		failed = 1;
+	    }
+	    else
+		bad += res;
+	}
+    }
+    printf("%u rounds of %u transactions from seed %llu: %d files wrong after replay\n",
+	   r, n, (unsigned long long)seed, bad);
+
+    for(i = 0; i < CHECK_FILES; i++){
+	unlinkat(rootfd, files[i].name, 0);
+	free(files[i].want);
+    }
+    unlinkat(rootfd, CHECK_JOURNAL, 0);
+    close(rootfd);
+    if(dir == tmp)
+	rmdir(tmp);
+    free(txn);
+    return bad || failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,810 @@
+/* journal.c
+ * Write-ahead journal for crash consistent in-place updates in fusec
+ *
+ * See journal.h for details
+ *
+ * Record layout (integers in host byte order, the journal never moves
+ * between machines):
+ *   0  u32 magic
+ *   4  u32 crc32 of everything from byte 8 to the end of the record
+ *   8  u64 sequence number
+ *  16  u64 total record length
+ *  24  u32 path length       28  u32 number of extents
+ *  32  u32 xattr name length 36  u32 xattr value length
+ *  40  i64 new file length (-1: unchanged)
+ *  48  u64 inode number (0: the path alone names the target)
+ *  56  path, xattr name, xattr value, extent table (u64 off, u64 len)...
+ *      extent data...
+ *
+ * A record with an empty path is not applied. With an inode number it is
+ * from journal_forget(): replay skips the earlier records of that number
+ * (new file length -1), or from journal_unforget(): the record whose
+ * sequence number is in the length field is void.
+ *
+ * Replay first reads every record, for these and for the inode numbers it
+ * may have to look for. Only if a path no longer names the file logged
+ * under it is the backing root walked, once, to find the others.
+ *
+ */
+
+#ifdef linux
+/* For pwritev() and syncfs() */
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x324e4a46	/* "FJN2" */
+#define JOURNAL_HDRLEN 56
+#define JOURNAL_BUCKETS 256
+
+struct journal_ino {
+    uint64_t ino;
+    struct journal_ino* next;
+};
+
+struct journal {
+    int rootfd;
+    int fd;
+    size_t limit;
+    uint64_t tail;
+    /* last record appended / last record known durable */
+    uint64_t seq;
+    uint64_t synced;
+    /* syncfs tickets handed out / covered by a finished syncfs */
+    unsigned long fs_want;
+    unsigned long fs_done;
+    /* a group commit leader is in fdatasync/syncfs */
+    int syncing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* other filesystems to sync at checkpoints */
+    int fsfd[JOURNAL_MAXFS];
+    unsigned int nfs;
+    /* inode numbers with records since the last checkpoint */
+    struct journal_ino* live[JOURNAL_BUCKETS];
+};
+
+/* What replay learns from a first pass over the records */
+struct journal_gone {
+    uint64_t ino;
+    uint64_t seq;		/* its records before this are skipped */
+};
+
+struct journal_find {
+    uint64_t ino;
+    char* path;			/* where the walk found it, or NULL */
+};
+
+struct journal_scan {
+    struct journal_gone* gone;
+    size_t ngone;
+    struct journal_find* want;
+    size_t nwant;
+    int walked;
+    dev_t dev;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+    uint32_t c;
+    int i, k;
+
+    for(i = 0; i < 256; i++){
+	c = i;
+	for(k = 0; k < 8; k++)
+	    c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+	crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void* buf, size_t len){
+    const unsigned char* p = buf;
+
+    crc = ~crc;
+    while(len--)
+	crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put32(unsigned char* p, uint32_t v){ memcpy(p, &v, 4); }
+static void put64(unsigned char* p, uint64_t v){ memcpy(p, &v, 8); }
+static uint32_t get32(const unsigned char* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t get64(const unsigned char* p){ uint64_t v; memcpy(&v, p, 8); return v; }
+
+static int pwrite_all(int fd, const void* buf, size_t len, off_t off){
+    const char* p = buf;
+    ssize_t res;
+
+    while(len){
+	res = pwrite(fd, p, len, off);
+	if(res < 0){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	p += res;
+	off += res;
+	len -= res;
+    }
+    return 0;
+}
+
+static int pread_all(int fd, void* buf, size_t len, off_t off){
+    char* p = buf;
+    ssize_t res;
+
+    while(len){
+	res = pread(fd, p, len, off);
+	if(res < 0){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if(res == 0)
+	    return -EIO;
+	p += res;
+	off += res;
+	len -= res;
+    }
+    return 0;
+}
+
+/* Link pointing to ino's entry in the live set (to NULL if it has none).
+   Caller holds the lock. */
+static struct journal_ino** find_live(struct journal* j, uint64_t ino){
+    struct journal_ino** pp = &j->live[ino % JOURNAL_BUCKETS];
+
+    while(*pp && (*pp)->ino != ino)
+	pp = &(*pp)->next;
+    return pp;
+}
+
+/* Add node for its ino unless there is one; caller holds the lock */
+static void add_live(struct journal* j, struct journal_ino* node){
+    struct journal_ino** pp = find_live(j, node->ino);
+
+    if(*pp){
+	free(node);
+	return;
+    }
+    node->next = NULL;
+    *pp = node;
+}
+
+static void clear_live(struct journal* j){
+    struct journal_ino* node;
+    unsigned int i;
+
+    for(i = 0; i < JOURNAL_BUCKETS; i++)
+	while((node = j->live[i])){
+	    j->live[i] = node->next;
+	    free(node);
+	}
+}
+
+extern struct journal* journal_open(int rootfd, const char* name, size_t limit){
+    struct journal* j;
+    off_t len;
+
+    pthread_once(&crc_once, crc_init);
+    j = calloc(1, sizeof(*j));
+    if(!j)
+	return NULL;
+    j->fd = openat(rootfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(j->fd == -1){
+	free(j);
+	return NULL;
+    }
+    len = lseek(j->fd, 0, SEEK_END);
+    j->tail = len > 0 ? len : 0;
+    j->rootfd = rootfd;
+    j->limit = limit;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    return j;
+}
+
+extern int journal_apply(int fd, const struct journal_txn* t){
+    unsigned int i;
+    int res;
+
+    for(i = 0; i < t->next; i++){
+	res = pwrite_all(fd, t->ext[i].data, t->ext[i].len, t->ext[i].off);
+	if(res < 0)
+	    return res;
+    }
+    if(t->disklen >= 0 && ftruncate(fd, t->disklen) == -1)
+	return -errno;
+    if(t->xattr_name &&
+       fsetxattr(fd, t->xattr_name, t->xattr_value, strlen(t->xattr_value), 0) == -1)
+	return -errno;
+    return 0;
+}
+
+/* Sync everything applied so far and empty the journal. Caller holds the
+   lock. */
+static int checkpoint_locked(struct journal* j){
+    unsigned int i;
+
+    if(j->tail == 0)
+	return 0;
+    if(syncfs(j->rootfd) == -1)
+	return -errno;
+    for(i = 0; i < j->nfs; i++)
+	if(syncfs(j->fsfd[i]) == -1)
+	    return -errno;
+    if(ftruncate(j->fd, 0) == -1 || fdatasync(j->fd) == -1)
+	return -errno;
+    j->tail = 0;
+    j->synced = j->seq;
+    clear_live(j);
+    return 0;
+}
+
+extern int journal_append(struct journal* j, const struct journal_txn* t, uint64_t* seq){
+    struct iovec iov[1 + 8];
+    struct journal_ino* node = NULL;
+    unsigned char* meta;
+    size_t pathlen = strlen(t->path);
+    size_t xnlen = t->xattr_name ? strlen(t->xattr_name) : 0;
+    size_t xvlen = t->xattr_name ? strlen(t->xattr_value) : 0;
+    size_t metalen = JOURNAL_HDRLEN + pathlen + xnlen + xvlen + 16 * t->next;
+    uint64_t total = metalen;
+    unsigned char* p;
+    unsigned int i, niov;
+    uint32_t crc;
+    off_t off;
+    ssize_t res;
+
+    if(t->next > 8)
+	return -EINVAL;
+    meta = malloc(metalen);
+    if(t->ino && *t->path){
+	node = malloc(sizeof(*node));
+	if(node)
+	    node->ino = t->ino;
+    }
+    if(!meta || (t->ino && *t->path && !node)){
+	free(meta);
+	free(node);
+	return -ENOMEM;
+    }
+
+    p = meta + JOURNAL_HDRLEN;
+    memcpy(p, t->path, pathlen);
+    p += pathlen;
+    memcpy(p, t->xattr_name, xnlen);
+    p += xnlen;
+    memcpy(p, t->xattr_value, xvlen);
+    p += xvlen;
+    iov[0].iov_base = meta;
+    iov[0].iov_len = metalen;
+    niov = 1;
+    for(i = 0; i < t->next; i++){
+	put64(p, t->ext[i].off);
+	put64(p + 8, t->ext[i].len);
+	p += 16;
+	total += t->ext[i].len;
+	if(t->ext[i].len){
+	    iov[niov].iov_base = (void*)t->ext[i].data;
+	    iov[niov].iov_len = t->ext[i].len;
+	    niov++;
+	}
+    }
+
+    pthread_mutex_lock(&j->lock);
+    put32(meta, JOURNAL_MAGIC);
+    put64(meta + 8, j->seq + 1);
+    put64(meta + 16, total);
+    put32(meta + 24, pathlen);
+    put32(meta + 28, t->next);
+    put32(meta + 32, xnlen);
+    put32(meta + 36, xvlen);
+    put64(meta + 40, (uint64_t)t->disklen);
+    put64(meta + 48, t->ino);
+    crc = crc32_update(0, meta + 8, metalen - 8);
+    for(i = 1; i < niov; i++)
+	crc = crc32_update(crc, iov[i].iov_base, iov[i].iov_len);
+    put32(meta + 4, crc);
+
+    off = j->tail;
+    res = pwritev(j->fd, iov, niov, off);
+    if(res < 0){
+	res = -errno;
+	goto out;
+    }
+    if((uint64_t)res < total){
+	/* short write: finish piece by piece */
+	size_t done = res;
+	off_t poff = off;
+	for(i = 0; i < niov; i++){
+	    if(done < iov[i].iov_len){
+		res = pwrite_all(j->fd, (char*)iov[i].iov_base + done,
+				 iov[i].iov_len - done, poff + done);
+		if(res < 0)
+		    goto out;
+		done = 0;
+	    }
+	    else
+		done -= iov[i].iov_len;
+	    poff += iov[i].iov_len;
+	}
+    }
+    j->tail += total;
+    *seq = ++j->seq;
+    if(node)
+	add_live(j, node);
+    node = NULL;
+    res = 0;
+
+ out:
+    pthread_mutex_unlock(&j->lock);
+    free(meta);
+    free(node);
+    return res;
+}
+
+extern int journal_sync(struct journal* j, uint64_t seq, int fs){
+    unsigned long ticket = 0;
+    unsigned long fs_target;
+    uint64_t target;
+    int dofs, res = 0;
+
+    pthread_mutex_lock(&j->lock);
+    if(fs)
+	ticket = ++j->fs_want;
+    for(;;){
+	if(j->synced >= seq && j->fs_done >= ticket)
+	    break;
+	/* someone else is flushing; what they cover we do not have to */
+	if(j->syncing){
+	    pthread_cond_wait(&j->cond, &j->lock);
+	    continue;
+	}
+	/* become the leader for everything appended or requested so far */
+	j->syncing = 1;
+	target = j->seq;
+	fs_target = j->fs_want;
+	dofs = j->fs_done < fs_target;
+	pthread_mutex_unlock(&j->lock);
+
+	/* syncfs covers the journal too, it lives on the same filesystem */
+	if(dofs)
+	    res = syncfs(j->rootfd);
+	else
+	    res = fdatasync(j->fd);
+	if(res == -1)
+	    res = -errno;
+
+	pthread_mutex_lock(&j->lock);
+	j->syncing = 0;
+	if(res == 0){
+	    if(target > j->synced)
+		j->synced = target;
+	    if(dofs)
+		j->fs_done = fs_target;
+	}
+	pthread_cond_broadcast(&j->cond);
+	if(res < 0)
+	    break;
+    }
+    pthread_mutex_unlock(&j->lock);
+    return res;
+}
+
+extern uint64_t journal_last_seq(struct journal* j){
+    uint64_t seq;
+
+    pthread_mutex_lock(&j->lock);
+    seq = j->seq;
+    pthread_mutex_unlock(&j->lock);
+    return seq;
+}
+
+extern uint64_t journal_synced_seq(struct journal* j){
+    uint64_t seq;
+
+    pthread_mutex_lock(&j->lock);
+    seq = j->synced;
+    pthread_mutex_unlock(&j->lock);
+    return seq;
+}
+
+extern int journal_full(struct journal* j){
+    int full;
+
+    pthread_mutex_lock(&j->lock);
+    full = j->tail > j->limit;
+    pthread_mutex_unlock(&j->lock);
+    return full;
+}
+
+extern int journal_checkpoint(struct journal* j){
+    int res;
+
+    pthread_mutex_lock(&j->lock);
+    while(j->syncing)
+	pthread_cond_wait(&j->cond, &j->lock);
+    res = checkpoint_locked(j);
+    pthread_mutex_unlock(&j->lock);
+    return res;
+}
+
+/* Log and sync a record naming no file (see the top of this file) */
+static int mark(struct journal* j, uint64_t ino, int64_t disklen, uint64_t* seq){
+    struct journal_txn t;
+    int res;
+
+    t.path = "";
+    t.ino = ino;
+    t.disklen = disklen;
+    t.xattr_name = NULL;
+    t.xattr_value = NULL;
+    t.ext = NULL;
+    t.next = 0;
+    res = journal_append(j, &t, seq);
+    if(res == 0)
+	res = journal_sync(j, *seq, 0);
+    return res;
+}
+
+extern int journal_forget(struct journal* j, uint64_t ino, uint64_t* seq){
+    struct journal_ino **pp, *node;
+    uint64_t undo;
+    int res;
+
+    *seq = 0;
+    pthread_mutex_lock(&j->lock);
+    node = *find_live(j, ino);
+    pthread_mutex_unlock(&j->lock);
+    /* nothing of it to skip */
+    if(!node)
+	return 0;
+    res = mark(j, ino, -1, seq);
+    if(res < 0){
+	/* it may still reach the disk */
+	if(*seq)
+	    mark(j, ino, (int64_t)*seq, &undo);
+	*seq = 0;
+	return res;
+    }
+    pthread_mutex_lock(&j->lock);
+    pp = find_live(j, ino);
+    node = *pp;
+    if(node){
+	*pp = node->next;
+	free(node);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return 0;
+}
+
+extern int journal_unforget(struct journal* j, uint64_t ino, uint64_t seq){
+    struct journal_ino* node;
+    uint64_t s;
+    int res;
+
+    if(!seq)
+	return 0;
+    node = malloc(sizeof(*node));
+    if(!node)
+	return -ENOMEM;
+    node->ino = ino;
+    res = mark(j, ino, (int64_t)seq, &s);
+    pthread_mutex_lock(&j->lock);
+    add_live(j, node);
+    pthread_mutex_unlock(&j->lock);
+    return res;
+}
+
+static int cmp_find(const void* a, const void* b){
+    uint64_t x = ((const struct journal_find*)a)->ino;
+    uint64_t y = ((const struct journal_find*)b)->ino;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Walk the directory open on fd (rel names it, with a trailing '/' unless
+   it is the root) for the files sc is looking for; fd is closed */
+static void walk(struct journal_scan* sc, int fd, char* rel, size_t len, size_t* left){
+    struct journal_find key, *f;
+    struct dirent* de;
+    struct stat st;
+    DIR* dp;
+    size_t n;
+    int sub;
+
+    dp = fdopendir(fd);
+    if(!dp){
+	close(fd);
+	return;
+    }
+    while(*left && (de = readdir(dp))){
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	n = strlen(de->d_name);
+	if(len + n + 2 > PATH_MAX ||
+	   fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	   st.st_dev != sc->dev)
+	    continue;
+	memcpy(rel + len, de->d_name, n + 1);
+	if(S_ISREG(st.st_mode)){
+	    key.ino = st.st_ino;
+	    f = bsearch(&key, sc->want, sc->nwant, sizeof(*f), cmp_find);
+	    if(f && !f->path && (f->path = strdup(rel)))
+		(*left)--;
+	}
+	else if(S_ISDIR(st.st_mode)){
+	    sub = openat(dirfd(dp), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	    if(sub == -1)
+		continue;
+	    rel[len + n] = '/';
+	    rel[len + n + 1] = '\0';
+	    walk(sc, sub, rel, len + n + 1, left);
+	}
+    }
+    closedir(dp);
+}
+
+/* Open the target of a record for replay: by path, or if that is not the
+   file with inode number ino (any more), wherever a walk finds it */
+static int open_target(struct journal* j, struct journal_scan* sc, const char* path,
+		       uint64_t ino){
+    char rel[PATH_MAX];
+    struct journal_find key, *f;
+    struct stat st;
+    size_t left;
+    int fd;
+
+    fd = openat(j->rootfd, path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(!ino || path[0] == '/')
+	return fd;
+    if(fd != -1){
+	if(fstat(fd, &st) == 0 && st.st_ino == ino)
+	    return fd;
+	close(fd);
+    }
+    if(!sc->walked){
+	sc->walked = 1;
+	fd = dup(j->rootfd);
+	left = sc->nwant;
+	rel[0] = '\0';
+	if(fd != -1)
+	    walk(sc, fd, rel, 0, &left);
+    }
+    key.ino = ino;
+    f = bsearch(&key, sc->want, sc->nwant, sizeof(*f), cmp_find);
+    if(!f || !f->path){
+	errno = ENOENT;
+	return -1;
+    }
+    return openat(j->rootfd, f->path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* First pass: note what replay skips and what it may look for */
+static int note_one(struct journal_scan* sc, const unsigned char* rec, uint64_t seq){
+    uint32_t pathlen = get32(rec + 24);
+    int64_t disklen = (int64_t)get64(rec + 40);
+    uint64_t ino = get64(rec + 48);
+    void* p;
+    size_t i;
+
+    if(!ino)
+	return 0;
+    if(pathlen){
+	if(rec[JOURNAL_HDRLEN] == '/')
+	    return 0;
+	p = realloc(sc->want, (sc->nwant + 1) * sizeof(*sc->want));
+	if(!p)
+	    return -ENOMEM;
+	sc->want = p;
+	sc->want[sc->nwant].ino = ino;
+	sc->want[sc->nwant].path = NULL;
+	sc->nwant++;
+    }
+    else if(disklen < 0){
+	p = realloc(sc->gone, (sc->ngone + 1) * sizeof(*sc->gone));
+	if(!p)
+	    return -ENOMEM;
+	sc->gone = p;
+	sc->gone[sc->ngone].ino = ino;
+	sc->gone[sc->ngone].seq = seq;
+	sc->ngone++;
+    }
+    else
+	for(i = 0; i < sc->ngone; i++)
+	    if(sc->gone[i].ino == ino && sc->gone[i].seq == (uint64_t)disklen)
+		sc->gone[i] = sc->gone[--sc->ngone];
+    return 0;
+}
+
+static int skipped(const struct journal_scan* sc, uint64_t ino, uint64_t seq){
+    size_t i;
+
+    for(i = 0; i < sc->ngone; i++)
+	if(sc->gone[i].ino == ino && sc->gone[i].seq > seq)
+	    return 1;
+    return 0;
+}
+
+/* Parse and apply one record read into rec */
+static int replay_one(struct journal* j, struct journal_scan* sc,
+		      const unsigned char* rec, uint64_t total){
+    struct journal_ext ext[8];
+    struct journal_txn t;
+    char* path;
+    char* xname = NULL;
+    char* xval = NULL;
+    uint32_t pathlen = get32(rec + 24);
+    uint32_t xnlen = get32(rec + 32);
+    uint32_t xvlen = get32(rec + 36);
+    const unsigned char* p;
+    const unsigned char* data;
+    unsigned int i;
+    int fd, res;
+
+    t.next = get32(rec + 28);
+    t.disklen = (int64_t)get64(rec + 40);
+    t.ino = get64(rec + 48);
+    if(t.next > 8 ||
+       JOURNAL_HDRLEN + (uint64_t)pathlen + xnlen + xvlen + 16 * t.next > total)
+	return -EIO;
+
+    p = rec + JOURNAL_HDRLEN;
+    path = strndup((const char*)p, pathlen);
+    p += pathlen;
+    if(xnlen){
+	xname = strndup((const char*)p, xnlen);
+	xval = strndup((const char*)p + xnlen, xvlen);
+    }
+    p += xnlen + xvlen;
+    data = p + 16 * t.next;
+    for(i = 0; i < t.next; i++){
+	ext[i].off = get64(p);
+	ext[i].len = get64(p + 8);
+	ext[i].data = data;
+	data += ext[i].len;
+	p += 16;
+    }
+    t.path = path;
+    t.xattr_name = xname;
+    t.xattr_value = xval;
+    t.ext = ext;
+
+    res = 0;
+    if(!path || (xnlen && (!xname || !xval)))
+	res = -ENOMEM;
+    else if(data > rec + total)
+	res = -EIO;
+    else if(!pathlen || (t.ino && skipped(sc, t.ino, get64(rec + 8))))
+	res = 0;
+    else{
+	fd = open_target(j, sc, path, t.ino);
+	/* gone since: nothing left to make consistent */
+	if(fd == -1)
+	    res = (errno == ENOENT) ? 0 : -errno;
+	else{
+	    res = journal_apply(fd, &t);
+	    close(fd);
+	}
+    }
+    free(path);
+    free(xname);
+    free(xval);
+    return res;
+}
+
+extern int journal_add_fs(struct journal* j, int fd){
+    if(j->nfs >= JOURNAL_MAXFS)
+	return -ENOSPC;
+    j->fsfd[j->nfs++] = fd;
+    return 0;
+}
+
+/* Read the record at off into a new buffer (*rec); its length, 0 at the
+   end of the valid records (a torn tail), -errno on error */
+static int64_t read_rec(struct journal* j, uint64_t off, uint64_t want_seq,
+			unsigned char** rec){
+    unsigned char hdr[JOURNAL_HDRLEN];
+    uint64_t total;
+
+    if(off + JOURNAL_HDRLEN > j->tail || pread_all(j->fd, hdr, JOURNAL_HDRLEN, off) < 0)
+	return 0;
+    total = get64(hdr + 16);
+    if(get32(hdr) != JOURNAL_MAGIC || total < JOURNAL_HDRLEN || off + total > j->tail)
+	return 0;
+    if(want_seq && get64(hdr + 8) != want_seq)
+	return 0;
+    *rec = malloc(total);
+    if(!*rec)
+	return -ENOMEM;
+    if(pread_all(j->fd, *rec, total, off) < 0 ||
+       crc32_update(0, *rec + 8, total - 8) != get32(*rec + 4)){
+	free(*rec);
+	return 0;
+    }
+    return total;
+}
+
+extern int journal_replay(struct journal* j){
+    struct journal_scan sc;
+    unsigned char* rec;
+    uint64_t off, end;
+    uint64_t seq = 0;
+    int64_t total;
+    struct stat st;
+    size_t i, n;
+    int count = 0;
+    int res = 0;
+
+    memset(&sc, 0, sizeof(sc));
+    if(fstat(j->rootfd, &st) == -1)
+	return -errno;
+    sc.dev = st.st_dev;
+
+    /* up to the torn tail, if any */
+    for(off = 0; (total = read_rec(j, off, count ? seq + 1 : 0, &rec)) > 0; off += total){
+	seq = get64(rec + 8);
+	res = get32(rec + 24) > total - JOURNAL_HDRLEN ? -EIO : note_one(&sc, rec, seq);
+	free(rec);
+	if(res < 0)
+	    goto out;
+	count++;
+    }
+    res = total;
+    if(res < 0)
+	goto out;
+    end = off;
+    qsort(sc.want, sc.nwant, sizeof(*sc.want), cmp_find);
+    for(i = n = 0; i < sc.nwant; i++)
+	if(!n || sc.want[n - 1].ino != sc.want[i].ino)
+	    sc.want[n++] = sc.want[i];
+    sc.nwant = n;
+
+    for(off = 0; off < end; off += total){
+	total = read_rec(j, off, 0, &rec);
+	if(total <= 0){
+	    res = total ? total : -EIO;
+	    goto out;
+	}
+	res = replay_one(j, &sc, rec, total);
+	free(rec);
+	if(res < 0)
+	    goto out;
+    }
+
+    j->seq = seq;
+    res = checkpoint_locked(j);
+    if(res == 0)
+	res = count;
+ out:
+    for(i = 0; i < sc.nwant; i++)
+	free(sc.want[i].path);
+    free(sc.want);
+    free(sc.gone);
+    return res;
+}
+
+extern void journal_close(struct journal* j){
+    if(!j)
+	return;
+    close(j->fd);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
@@ -0,0 +1,162 @@
+/* journal.h
+ * Write-ahead journal for crash consistent in-place updates in fusec
+ *
+ * Every in-place update of an encrypted file is first logged as one
+ * transaction: the target path, the block images to write and optionally
+ * a new file length and an xattr to set. Only once the transaction is
+ * durable in the journal is it applied to the file itself. After a crash
+ * journal_replay() re-applies every complete transaction, so each update
+ * is seen either entirely or not at all.
+ *
+ * Transactions are checksummed; a torn record at the tail of the journal
+ * is where replay stops. When the journal grows past its limit it is
+ * checkpointed: the backing filesystem is synced and the journal emptied.
+ *
+ * Paths are relative to the backing root, or absolute for files on other
+ * filesystems (see journal_add_fs()). A file in the backing root is also
+ * logged with its inode number, and replay looks for it by that number if
+ * the path names another file by then (or none): a rename doesn't need a
+ * checkpoint. Removing the last name of a file does need journal_forget(),
+ * so that its records aren't replayed into a file that gets its number.
+ *
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* most filesystems journal_add_fs() takes */
+#define JOURNAL_MAXFS 16
+
+struct journal;
+
+/* A run of bytes to write into the target file */
+struct journal_ext {
+    uint64_t off;
+    size_t len;
+    const void* data;
+};
+
+struct journal_txn {
+    const char* path;		/* target, relative to the backing root; "" for
+				   a file with no name left, not replayed */
+    uint64_t ino;		/* inode number of a target in the backing
+				   root, or 0 to go by the path alone */
+    int64_t disklen;		/* new file length, -1 to leave it alone */
+    const char* xattr_name;	/* xattr to set after the data, or NULL */
+    const char* xattr_value;
+    const struct journal_ext* ext;
+    unsigned int next;
+};
+
+/* struct journal* journal_open(int rootfd, const char* name, size_t limit)
+ * Purpose: Open (creating if needed) the journal file
+ * Args: int rootfd       : Backing root directory fd
+ *       const char* name : Journal file name inside the root
+ *       size_t limit     : Journal size that triggers a checkpoint
+ * Return: Journal on success, NULL on error (errno set)
+ */
+extern struct journal* journal_open(int rootfd, const char* name, size_t limit);
+
+/* int journal_add_fs(struct journal* j, int fd)
+ * Purpose: Have checkpoints also sync the filesystem fd is on, for
+ *          targets outside the backing root (named by absolute path).
+ *          Call before journal_replay().
+ * Args: struct journal* j : Journal
+ *       int fd            : Any fd on that filesystem; kept open by the caller
+ * Return: 0 on success, -ENOSPC if there are JOURNAL_MAXFS already
+ */
+extern int journal_add_fs(struct journal* j, int fd);
+
+/* int journal_replay(struct journal* j)
+ * Purpose: Apply all complete transactions left from a crash, then empty
+ *          the journal. Call once at mount, before serving requests.
+ * Args: struct journal* j : Journal
+ * Return: Number of transactions replayed, -errno on error
+ */
+extern int journal_replay(struct journal* j);
+
+/* int journal_append(struct journal* j, const struct journal_txn* t, uint64_t* seq)
+ * Purpose: Append a transaction to the journal, without waiting for it to
+ *          reach the disk. It must not be applied in place before
+ *          journal_sync() has covered it.
+ * Args: struct journal* j          : Journal
+ *       const struct journal_txn* t : Transaction
+ *       uint64_t* seq              : Output sequence number of the record
+ * Return: 0 on success, -errno on error (nothing to undo)
+ */
+extern int journal_append(struct journal* j, const struct journal_txn* t, uint64_t* seq);
+
+/* int journal_sync(struct journal* j, uint64_t seq, int fs)
+ * Purpose: Group commit: wait until every record up to seq is durable, and
+ *          with fs also until a syncfs of the backing filesystem that started
+ *          after this call has finished. Concurrent callers share one
+ *          fdatasync/syncfs that covers all of them.
+ * Args: struct journal* j : Journal
+ *       uint64_t seq      : Last record that must be durable (0: none)
+ *       int fs            : Also sync the backing filesystem
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_sync(struct journal* j, uint64_t seq, int fs);
+
+/* uint64_t journal_last_seq(struct journal* j)
+ * Purpose: Sequence number of the last record appended
+ */
+extern uint64_t journal_last_seq(struct journal* j);
+
+/* uint64_t journal_synced_seq(struct journal* j)
+ * Purpose: Sequence number of the last record known to be durable
+ */
+extern uint64_t journal_synced_seq(struct journal* j);
+
+/* int journal_full(struct journal* j)
+ * Purpose: Has the journal grown past its limit (time to checkpoint)?
+ */
+extern int journal_full(struct journal* j);
+
+/* int journal_apply(int fd, const struct journal_txn* t)
+ * Purpose: Apply a transaction to the open target file
+ * Args: int fd                     : Target file, open for writing
+ *       const struct journal_txn* t : Transaction
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_apply(int fd, const struct journal_txn* t);
+
+/* int journal_forget(struct journal* j, uint64_t ino, uint64_t* seq)
+ * Purpose: Before the last name of the file with inode number ino is
+ *          removed: log that replay must skip its records so far. If it
+ *          has none since the last checkpoint nothing is logged; otherwise
+ *          the record is synced before this returns. The caller keeps the
+ *          file from being updated meanwhile.
+ * Args: struct journal* j : Journal
+ *       uint64_t ino      : The file's inode number
+ *       uint64_t* seq     : Output record for journal_unforget(), 0 if none
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_forget(struct journal* j, uint64_t ino, uint64_t* seq);
+
+/* int journal_unforget(struct journal* j, uint64_t ino, uint64_t seq)
+ * Purpose: The name was not removed after all: have replay apply the
+ *          records journal_forget() made it skip (synced like it)
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_unforget(struct journal* j, uint64_t ino, uint64_t seq);
+
+/* int journal_checkpoint(struct journal* j)
+ * Purpose: Sync the backing filesystem and empty the journal. The caller
+ *          makes sure every appended transaction has been applied and
+ *          that no new ones are appended meanwhile.
+ * Args: struct journal* j : Journal
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_checkpoint(struct journal* j);
+
+/* void journal_close(struct journal* j)
+ * Purpose: Close the journal. It is not checkpointed; anything left in it
+ *          is replayed at the next mount.
+ */
+extern void journal_close(struct journal* j);
+
+#endif
@@ -0,0 +1,99 @@
+/* keepcache.c
+ * When fusec can let the kernel keep a file's cached plaintext
+ *
+ * See keepcache.h for details
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "keepcache.h"
+
+struct keepcache_ent {
+    dev_t dev;
+    ino_t ino;			/* 0: free */
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint64_t gen;
+};
+
+struct keepcache {
+    pthread_mutex_t lock;
+    unsigned int slots;
+    struct keepcache_ent* ent;
+};
+
+struct keepcache* keepcache_new(unsigned int slots){
+    struct keepcache* kc;
+
+    if(!slots){
+	errno = EINVAL;
+	return NULL;
+    }
+    kc = calloc(1, sizeof(*kc));
+    if(!kc)
+	return NULL;
+    kc->ent = calloc(slots, sizeof(*kc->ent));
+    if(!kc->ent){
+	free(kc);
+	return NULL;
+    }
+    kc->slots = slots;
+    pthread_mutex_init(&kc->lock, NULL);
+    return kc;
+}
+
+static struct keepcache_ent* slot(struct keepcache* kc, const struct stat* st){
+    uint64_t h = ((uint64_t)st->st_dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)st->st_ino;
+
+    h *= 0xff51afd7ed558ccdULL;
+    return &kc->ent[(h >> 32) % kc->slots];
+}
+
+static int same_file(const struct keepcache_ent* e, const struct stat* st){
+    return e->ino && e->ino == st->st_ino && e->dev == st->st_dev;
+}
+
+static int unchanged(const struct keepcache_ent* e, const struct stat* st, uint64_t gen){
+    return e->gen == gen && e->size == st->st_size &&
+	e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	e->ctime.tv_sec == st->st_ctim.tv_sec &&
+	e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void remember(struct keepcache_ent* e, const struct stat* st, uint64_t gen){
+    e->gen = gen;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->ctime = st->st_ctim;
+}
+
+int keepcache_open(struct keepcache* kc, const struct stat* st, uint64_t gen){
+    struct keepcache_ent* e;
+    int keep = 0;
+
+    pthread_mutex_lock(&kc->lock);
+    e = slot(kc, st);
+    if(same_file(e, st))
+	keep = unchanged(e, st, gen);
+    else{
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+    }
+    remember(e, st, gen);
+    pthread_mutex_unlock(&kc->lock);
+    return keep;
+}
+
+void keepcache_free(struct keepcache* kc){
+    if(!kc)
+	return;
+    pthread_mutex_destroy(&kc->lock);
+    free(kc->ent);
+    free(kc);
+}
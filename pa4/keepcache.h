@@ -0,0 +1,51 @@
+/* keepcache.h
+ * When fusec can let the kernel keep a file's cached plaintext
+ *
+ * Unless a file is opened with keep_cache, the kernel drops its page
+ * cache on every open, so a hot file is decrypted again each time it is
+ * opened even if nothing changed. This remembers, per backing inode, the
+ * size, mtime and ctime it had when it was last opened, and the version of
+ * its writes still pending in write-back (writeback_gen()), which leave
+ * the backing file as it was; if they are all the same at the next open,
+ * whatever the kernel cached is still right.
+ *
+ * Any change counts, fusec's own writes included, so the first open
+ * after a write drops the cache once more. The FUSE 2 high-level API has
+ * no way to drop the kernel's cache of a file that is already open, so
+ * nothing short of an unchanged backing file is trusted.
+ *
+ * Entries are kept in a fixed number of slots indexed by inode; a
+ * collision just forgets the older one.
+ *
+ */
+
+#ifndef KEEPCACHE_H
+#define KEEPCACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct keepcache;
+
+/* struct keepcache* keepcache_new(unsigned int slots)
+ * Purpose: Create a table for up to slots files
+ * Return: New table on success, NULL on error (errno set)
+ */
+extern struct keepcache* keepcache_new(unsigned int slots);
+
+/* int keepcache_open(struct keepcache* kc, const struct stat* st, uint64_t gen)
+ * Purpose: Note that the backing file st is being opened
+ * Args: struct keepcache* kc   : Table
+ *       const struct stat* st  : The backing file's current stat
+ *       uint64_t gen           : Version of its pending writes (0: none)
+ * Return: 1 if st and gen are unchanged since the file was last opened,
+ *         so the kernel's cached data for it is still valid, 0 if not
+ */
+extern int keepcache_open(struct keepcache* kc, const struct stat* st, uint64_t gen);
+
+/* void keepcache_free(struct keepcache* kc)
+ * Purpose: Free the table
+ */
+extern void keepcache_free(struct keepcache* kc);
+
+#endif
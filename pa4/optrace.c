@@ -0,0 +1,239 @@
+/* optrace.c
+ * Operation traces for fusec
+ *
+ * See optrace.h for the file format
+ *
+ * Records are built in a buffer under one mutex and written out when it
+ * fills up; a record is a few dozen bytes, so serving an operation costs
+ * a short critical section rather than a write(2). Path ids come from a
+ * hash table under the same mutex.
+ *
+ */
+
+#ifdef linux
+/* For syscall() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "bblog.h"
+#include "optrace.h"
+
+#define OPTRACE_BUF (1 << 20)
+#define OPTRACE_BUCKETS 4096
+
+struct opt_path {
+    uint32_t id;
+    struct opt_path* next;
+    char name[];
+};
+
+struct optrace {
+    pthread_mutex_t lock;
+    int fd;
+    int failed;
+    unsigned char* buf;
+    size_t len;
+    uint32_t nextid;
+    struct opt_path* paths[OPTRACE_BUCKETS];
+};
+
+static const char* const op_names[OPT_NOPS] = {
+    "?", "getattr", "access", "readlink", "readdir", "mknod",
+    "mkdir", "symlink", "unlink", "rmdir", "rename", "link",
+    "chmod", "chown", "truncate", "utimens", "open", "read",
+    "write", "statfs", "create", "release", "fsync",
+    "setxattr", "getxattr", "listxattr", "removexattr",
+};
+
+static uint64_t epoch;
+
+static void put32(unsigned char* p, uint32_t v){ memcpy(p, &v, 4); }
+static void put64(unsigned char* p, uint64_t v){ memcpy(p, &v, 8); }
+static uint32_t get32(const unsigned char* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t get64(const unsigned char* p){ uint64_t v; memcpy(&v, p, 8); return v; }
+
+extern const char* optrace_op_name(unsigned int op){
+    if(op == 0 || op >= OPT_NOPS)
+	return "?";
+    return op_names[op];
+}
+
+extern void optrace_decode(const unsigned char buf[OPTRACE_RECLEN], struct optrace_rec* r){
+    r->op = buf[1];
+    r->tid = get32(buf + 4);
+    r->path = get32(buf + 8);
+    r->path2 = get32(buf + 12);
+    r->off = get64(buf + 16);
+    r->size = get32(buf + 24);
+    r->res = (int32_t)get32(buf + 28);
+    r->start = get64(buf + 32);
+    r->dur = get64(buf + 40);
+}
+
+static uint64_t clock_ns(clockid_t clk){
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+extern uint64_t optrace_now(void){
+    return clock_ns(CLOCK_MONOTONIC) - epoch;
+}
+
+/* Called with lock held */
+static void flush_locked(struct optrace* t){
+    size_t done = 0;
+    ssize_t n;
+
+    while(!t->failed && done < t->len){
+	n = write(t->fd, t->buf + done, t->len - done);
+	if(n < 0 && errno == EINTR)
+	    continue;
+	if(n <= 0){
+	    bblog(BBLOG_ERR, "trace: write failed, trace stopped");
+	    t->failed = 1;
+	    break;
+	}
+	done += n;
+    }
+    t->len = 0;
+}
+
+/* Called with lock held; room for len more bytes */
+static void reserve_locked(struct optrace* t, size_t len){
+    if(t->len + len > OPTRACE_BUF)
+	flush_locked(t);
+}
+
+/* Called with lock held; 0 for a path that can't be recorded */
+static uint32_t path_id(struct optrace* t, const char* path){
+    struct opt_path* p;
+    size_t len, h = 5381;
+    const char* s;
+    unsigned char* r;
+
+    if(!path)
+	return OPTRACE_NOPATH;
+    for(s = path; *s; s++)
+	h = h * 33 + (unsigned char)*s;
+    len = s - path;
+    h %= OPTRACE_BUCKETS;
+    for(p = t->paths[h]; p; p = p->next)
+	if(!strcmp(p->name, path))
+	    return p->id;
+    if(len > OPTRACE_BUF - OPTRACE_PATHLEN)
+	return OPTRACE_NOPATH;
+    p = malloc(sizeof(*p) + len + 1);
+    if(!p)
+	return OPTRACE_NOPATH;
+    p->id = t->nextid++;
+    memcpy(p->name, path, len + 1);
+    p->next = t->paths[h];
+    t->paths[h] = p;
+
+    reserve_locked(t, OPTRACE_PATHLEN + len);
+    r = t->buf + t->len;
+    memset(r, 0, OPTRACE_PATHLEN);
+    r[0] = OPTRACE_PATH;
+    put32(r + 4, p->id);
+    put32(r + 8, len);
+    memcpy(r + OPTRACE_PATHLEN, path, len);
+    t->len += OPTRACE_PATHLEN + len;
+    return p->id;
+}
+
+extern struct optrace* optrace_open(const char* file){
+    unsigned char hdr[OPTRACE_HDRLEN];
+    struct optrace* t;
+    int err;
+
+    t = calloc(1, sizeof(*t));
+    if(!t)
+	return NULL;
+    t->buf = malloc(OPTRACE_BUF);
+    if(!t->buf){
+	free(t);
+	errno = ENOMEM;
+	return NULL;
+    }
+    t->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(t->fd == -1){
+	err = errno;
+	free(t->buf);
+	free(t);
+	errno = err;
+	return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->nextid = OPTRACE_NOPATH + 1;
+    epoch = clock_ns(CLOCK_MONOTONIC);
+    memcpy(hdr, OPTRACE_MAGIC, 8);
+    put64(hdr + 8, clock_ns(CLOCK_REALTIME));
+    memcpy(t->buf, hdr, OPTRACE_HDRLEN);
+    t->len = OPTRACE_HDRLEN;
+    return t;
+}
+
+extern void optrace_record(struct optrace* t, unsigned int op, const char* path,
+			   const char* path2, uint64_t off, uint64_t size,
+			   uint64_t start, int res){
+    static __thread uint32_t tid;
+    uint64_t end = optrace_now();
+    unsigned char* r;
+    uint32_t p1, p2;
+
+    if(!tid)
+	tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&t->lock);
+    if(t->failed){
+	pthread_mutex_unlock(&t->lock);
+	return;
+    }
+    p1 = path_id(t, path);
+    p2 = path_id(t, path2);
+    reserve_locked(t, OPTRACE_RECLEN);
+    r = t->buf + t->len;
+    r[0] = OPTRACE_OP;
+    r[1] = op;
+    r[2] = r[3] = 0;
+    put32(r + 4, tid);
+    put32(r + 8, p1);
+    put32(r + 12, p2);
+    put64(r + 16, off);
+    put32(r + 24, size > UINT32_MAX ? UINT32_MAX : size);
+    put32(r + 28, (uint32_t)res);
+    put64(r + 32, start);
+    put64(r + 40, end - start);
+    t->len += OPTRACE_RECLEN;
+    pthread_mutex_unlock(&t->lock);
+}
+
+extern void optrace_close(struct optrace* t){
+    struct opt_path *p, *next;
+    int i;
+
+    if(!t)
+	return;
+    pthread_mutex_lock(&t->lock);
+    flush_locked(t);
+    pthread_mutex_unlock(&t->lock);
+    close(t->fd);
+    for(i = 0; i < OPTRACE_BUCKETS; i++)
+	for(p = t->paths[i]; p; p = next){
+	    next = p->next;
+	    free(p);
+	}
+    pthread_mutex_destroy(&t->lock);
+    free(t->buf);
+    free(t);
+}
@@ -0,0 +1,107 @@
+/* optrace.h
+ * Operation traces for fusec, and their on-disk format
+ *
+ * With -o trace=FILE fusec records every operation it serves: which
+ * operation, on which path, offset, size, result, calling thread, and
+ * when it started and how long it took. Paths are written once, the
+ * first time they are seen, and referred to by a number after that, so
+ * a record is OPTRACE_RECLEN bytes. No file data is recorded.
+ *
+ * fusec-replay reads a trace and issues the same operations against a
+ * mount (see fusec-replay.c).
+ *
+ * File layout (host byte order, like the journal):
+ *   header    "FCTRACE1", u64 CLOCK_REALTIME ns at the start of the trace
+ *   records   one of
+ *     path:   u8 OPTRACE_PATH, 3 unused, u32 id, u32 length, path bytes
+ *     op:     u8 OPTRACE_OP, u8 operation, 2 unused, u32 thread,
+ *             u32 path id, u32 second path id (rename, link, symlink),
+ *             u64 offset, u32 size, i32 result,
+ *             u64 start ns (since the trace started), u64 duration ns
+ *
+ */
+
+#ifndef OPTRACE_H
+#define OPTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OPTRACE_MAGIC "FCTRACE1"
+#define OPTRACE_HDRLEN 16
+#define OPTRACE_RECLEN 48
+#define OPTRACE_PATHLEN 12
+
+/* record types */
+#define OPTRACE_PATH 1
+#define OPTRACE_OP 2
+
+/* path id of "no path" */
+#define OPTRACE_NOPATH 0
+
+/* operations */
+enum {
+    OPT_GETATTR = 1, OPT_ACCESS, OPT_READLINK, OPT_READDIR, OPT_MKNOD,
+    OPT_MKDIR, OPT_SYMLINK, OPT_UNLINK, OPT_RMDIR, OPT_RENAME, OPT_LINK,
+    OPT_CHMOD, OPT_CHOWN, OPT_TRUNCATE, OPT_UTIMENS, OPT_OPEN, OPT_READ,
+    OPT_WRITE, OPT_STATFS, OPT_CREATE, OPT_RELEASE, OPT_FSYNC,
+    OPT_SETXATTR, OPT_GETXATTR, OPT_LISTXATTR, OPT_REMOVEXATTR,
+    OPT_NOPS
+};
+
+struct optrace_rec {
+    uint8_t op;
+    uint32_t tid;
+    uint32_t path;
+    uint32_t path2;
+    uint64_t off;
+    uint32_t size;
+    int32_t res;
+    uint64_t start;
+    uint64_t dur;
+};
+
+struct optrace;
+
+/* const char* optrace_op_name(unsigned int op)
+ * Purpose: Name of an operation ("?" if unknown)
+ */
+extern const char* optrace_op_name(unsigned int op);
+
+/* void optrace_decode(const unsigned char buf[OPTRACE_RECLEN], struct optrace_rec* r)
+ * Purpose: Decode an op record (buf[0] is OPTRACE_OP)
+ */
+extern void optrace_decode(const unsigned char buf[OPTRACE_RECLEN], struct optrace_rec* r);
+
+/* struct optrace* optrace_open(const char* file)
+ * Purpose: Start a trace, replacing file
+ * Return: Trace on success, NULL on error (errno set)
+ */
+extern struct optrace* optrace_open(const char* file);
+
+/* uint64_t optrace_now(void)
+ * Purpose: Current time on the trace clock, for optrace_record()
+ */
+extern uint64_t optrace_now(void);
+
+/* void optrace_record(struct optrace* t, unsigned int op, const char* path,
+ *                     const char* path2, uint64_t off, uint64_t size,
+ *                     uint64_t start, int res)
+ * Purpose: Record a finished operation
+ * Args: struct optrace* t          : Trace
+ *       unsigned int op            : OPT_*
+ *       const char* path, path2    : Paths (path2 may be NULL)
+ *       uint64_t off, uint64_t size : Offset and size, where there are any
+ *       uint64_t start             : optrace_now() when the operation started
+ *       int res                    : What the operation returned
+ */
+extern void optrace_record(struct optrace* t, unsigned int op, const char* path,
+			   const char* path2, uint64_t off, uint64_t size,
+			   uint64_t start, int res);
+
+/* void optrace_close(struct optrace* t)
+ * Purpose: Write out what is buffered and close the trace
+ */
+extern void optrace_close(struct optrace* t);
+
+#endif
@@ -0,0 +1,1362 @@
+/* pack.c
+ * Small files packed into per-directory containers for fusec
+ *
+ * See pack.h for the container layout
+ *
+ * Each directory in use has an index of its live records (name,
+ * attributes, where the record is) under its own mutex; contents stay in
+ * the container and are read and decrypted on demand. The directories
+ * are in a table keyed by inode under the pack mutex; the least recently
+ * used one is dropped once there are more than PACK_DIRS.
+ *
+ * Lock order: a directory, then the pack mutex; two directories (a
+ * rename) in address order. Nothing here calls into writeback, so
+ * callers must not hold a writeback lock either (pack_unpack()'s make
+ * callback is called with the directory locked and may take them).
+ *
+ */
+
+#ifdef linux
+/* For pread(), fdatasync() and the *at() calls */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "bblog.h"
+#include "pack.h"
+
+#define PACK_NAME ".fusec-pack"
+#define PACK_TMP ".fusec-pack.tmp"
+#define PACK_KEYFILE ".fusec-pack-key"
+#define PACK_HDRLEN 16
+#define PACK_IVLEN 16
+#define PACK_MACLEN 32
+#define PACK_RECHDR (8 + PACK_IVLEN)
+#define PACK_BODYHDR 64
+#define PACK_RECMIN (PACK_RECHDR + PACK_BODYHDR + 1 + PACK_MACLEN)
+#define PACK_RECMAX (PACK_RECHDR + PACK_BODYHDR + 2 * NAME_MAX + PACK_FILE_MAX + PACK_MACLEN)
+/* record types */
+#define PK_FILE 1
+#define PK_GONE 2
+/* directory indexes kept in memory */
+#define PACK_DIRS 256
+/* the compactor looks this often for containers that are at least half
+   dead bytes, and at least PACK_COMPACT_MIN of them */
+#define PACK_COMPACT_MS 2000
+#define PACK_COMPACT_MIN (64 << 10)
+/* containers are read this much at a time when loaded */
+#define PACK_READBUF (1 << 20)
+
+static const char PACK_MAGIC[8] = { 'F', 'C', 'P', 'A', 'C', 'K', '0', '1' };
+static const char PACK_KEYMAGIC[8] = { 'F', 'C', 'P', 'A', 'C', 'K', 'K', '1' };
+
+struct pk_rec {
+    struct pk_rec* next;
+    struct pack_attr a;
+    uint64_t off;		/* where the record is in the container */
+    uint32_t len;
+    char name[];
+};
+
+struct pk_dir {
+    struct pk_dir* next;	/* in the table */
+    dev_t dev;
+    ino_t ino;
+    unsigned int refs;
+    int gone;			/* out of the table (being removed) */
+    uint64_t used;
+    pthread_mutex_t lock;
+    int dirfd;
+    int fd;			/* container, -1 while there is none */
+    uint64_t end;		/* container size */
+    uint64_t live;		/* bytes of live records */
+    struct pk_rec** tab;
+    size_t nbuckets;
+    size_t nrec;
+};
+
+struct pack {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pk_dir* dirs[PACK_DIRS];
+    size_t ndirs;
+    uint64_t clock;
+    int rootfd;
+    size_t max;
+    unsigned char kenc[32];
+    unsigned char kmac[32];
+    pthread_t thread;
+    int running;
+    int stop;
+};
+
+/* a decoded record */
+struct pk_body {
+    int type;
+    struct pack_attr a;
+    char name[NAME_MAX + 1];
+    char old[NAME_MAX + 1];
+    const char* data;
+};
+
+static void put16(unsigned char* p, uint16_t v){ memcpy(p, &v, 2); }
+static void put32(unsigned char* p, uint32_t v){ memcpy(p, &v, 4); }
+static void put64(unsigned char* p, uint64_t v){ memcpy(p, &v, 8); }
+static uint16_t get16(const unsigned char* p){ uint16_t v; memcpy(&v, p, 2); return v; }
+static uint32_t get32(const unsigned char* p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t get64(const unsigned char* p){ uint64_t v; memcpy(&v, p, 8); return v; }
+
+static void now(struct timespec* ts){
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/* Splits a mount path into its directory (relative to the root, "." for
+ * the root itself) and last component */
+static int split(const char* path, char dir[PATH_MAX], const char** name){
+    const char* slash;
+    size_t len;
+
+    while(*path == '/')
+	path++;
+    slash = strrchr(path, '/');
+    if(!slash){
+	strcpy(dir, ".");
+	*name = path;
+    }
+    else{
+	len = slash - path;
+	if(len >= PATH_MAX)
+	    return -ENAMETOOLONG;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	*name = slash + 1;
+    }
+    if(!**name)
+	return -ENOENT;
+    if(strlen(*name) > NAME_MAX)
+	return -ENAMETOOLONG;
+    return 0;
+}
+
+/* records */
+
+/* Builds a record of type for name (replacing old, if set) in *out */
+static int seal(const struct pack* pk, int type, const char* name, const char* old,
+		const struct pack_attr* a, const char* data,
+		unsigned char** out, uint32_t* outlen){
+    size_t nl = strlen(name), ol = old ? strlen(old) : 0;
+    size_t dl = type == PK_FILE ? a->size : 0;
+    size_t bodylen = PACK_BODYHDR + nl + ol + dl;
+    size_t len = PACK_RECHDR + bodylen + PACK_MACLEN;
+    unsigned char *r, *body;
+    unsigned int maclen = PACK_MACLEN;
+    EVP_CIPHER_CTX* ctx;
+    int outl, res = -EIO;
+
+    r = malloc(len);
+    body = malloc(bodylen);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!r || !body || !ctx){
+	res = -ENOMEM;
+	goto out;
+    }
+    memset(body, 0, PACK_BODYHDR);
+    put16(body, nl);
+    put16(body + 2, ol);
+    put32(body + 4, a->mode);
+    put32(body + 8, a->uid);
+    put32(body + 12, a->gid);
+    put64(body + 16, dl);
+    put64(body + 24, a->atime.tv_sec);
+    put64(body + 32, a->mtime.tv_sec);
+    put64(body + 40, a->ctime.tv_sec);
+    put32(body + 48, a->atime.tv_nsec);
+    put32(body + 52, a->mtime.tv_nsec);
+    put32(body + 56, a->ctime.tv_nsec);
+    memcpy(body + PACK_BODYHDR, name, nl);
+    if(ol)
+	memcpy(body + PACK_BODYHDR + nl, old, ol);
+    if(dl)
+	memcpy(body + PACK_BODYHDR + nl + ol, data, dl);
+
+    memset(r, 0, 8);
+    put32(r, len);
+    r[4] = type;
+    if(RAND_bytes(r + 8, PACK_IVLEN) != 1)
+	goto out;
+    if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, pk->kenc, r + 8) ||
+       !EVP_EncryptUpdate(ctx, r + PACK_RECHDR, &outl, body, bodylen) ||
+       (size_t)outl != bodylen)
+	goto out;
+    if(!HMAC(EVP_sha256(), pk->kmac, sizeof(pk->kmac), r, len - PACK_MACLEN,
+	     r + len - PACK_MACLEN, &maclen))
+	goto out;
+    *out = r;
+    *outlen = len;
+    r = NULL;
+    res = 0;
+
+ out:
+    EVP_CIPHER_CTX_free(ctx);
+    free(body);
+    free(r);
+    return res;
+}
+
+/* Checks and decrypts record r; b->data points into *plain (to be freed) */
+static int unseal(const struct pack* pk, const unsigned char* r, uint32_t len,
+		  struct pk_body* b, unsigned char** plain){
+    unsigned char mac[PACK_MACLEN];
+    unsigned int maclen = PACK_MACLEN;
+    size_t bodylen = len - PACK_RECHDR - PACK_MACLEN;
+    size_t nl, ol;
+    EVP_CIPHER_CTX* ctx;
+    unsigned char* body;
+    int outl;
+
+    if(!HMAC(EVP_sha256(), pk->kmac, sizeof(pk->kmac), r, len - PACK_MACLEN, mac, &maclen))
+	return -EIO;
+    if(CRYPTO_memcmp(mac, r + len - PACK_MACLEN, PACK_MACLEN))
+	return -EIO;
+    body = malloc(bodylen);
+    ctx = EVP_CIPHER_CTX_new();
+    if(!body || !ctx){
+	EVP_CIPHER_CTX_free(ctx);
+	free(body);
+	return -ENOMEM;
+    }
+    if(!EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, pk->kenc, r + 8) ||
+       !EVP_DecryptUpdate(ctx, body, &outl, r + PACK_RECHDR, bodylen) ||
+       (size_t)outl != bodylen){
+	EVP_CIPHER_CTX_free(ctx);
+	free(body);
+	return -EIO;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    b->type = r[4];
+    nl = get16(body);
+    ol = get16(body + 2);
+    b->a.mode = get32(body + 4);
+    b->a.uid = get32(body + 8);
+    b->a.gid = get32(body + 12);
+    b->a.size = get64(body + 16);
+    b->a.atime.tv_sec = get64(body + 24);
+    b->a.mtime.tv_sec = get64(body + 32);
+    b->a.ctime.tv_sec = get64(body + 40);
+    b->a.atime.tv_nsec = get32(body + 48);
+    b->a.mtime.tv_nsec = get32(body + 52);
+    b->a.ctime.tv_nsec = get32(body + 56);
+    if((b->type != PK_FILE && b->type != PK_GONE) || nl == 0 || nl > NAME_MAX ||
+       ol > NAME_MAX || b->a.size > PACK_FILE_MAX ||
+       PACK_BODYHDR + nl + ol + b->a.size != bodylen){
+	free(body);
+	return -EIO;
+    }
+    memcpy(b->name, body + PACK_BODYHDR, nl);
+    b->name[nl] = '\0';
+    memcpy(b->old, body + PACK_BODYHDR + nl, ol);
+    b->old[ol] = '\0';
+    b->data = (const char*)body + PACK_BODYHDR + nl + ol;
+    *plain = body;
+    return 0;
+}
+
+/* index */
+
+static size_t name_hash(const char* s){
+    size_t h = 5381;
+
+    while(*s)
+	h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static struct pk_rec* rec_find(struct pk_dir* d, const char* name){
+    struct pk_rec* e;
+
+    for(e = d->tab[name_hash(name) & (d->nbuckets - 1)]; e; e = e->next)
+	if(!strcmp(e->name, name))
+	    return e;
+    return NULL;
+}
+
+static void rec_drop(struct pk_dir* d, const char* name){
+    struct pk_rec **pp, *e;
+
+    for(pp = &d->tab[name_hash(name) & (d->nbuckets - 1)]; (e = *pp); pp = &e->next)
+	if(!strcmp(e->name, name)){
+	    *pp = e->next;
+	    d->live -= e->len;
+	    d->nrec--;
+	    free(e);
+	    return;
+	}
+}
+
+static int rec_set(struct pk_dir* d, const char* name, const struct pack_attr* a,
+		   uint64_t off, uint32_t len){
+    struct pk_rec **tab, *e, *next;
+    size_t i, h;
+
+    e = rec_find(d, name);
+    if(e){
+	d->live += (uint64_t)len - e->len;
+	e->a = *a;
+	e->off = off;
+	e->len = len;
+	return 0;
+    }
+    e = malloc(sizeof(*e) + strlen(name) + 1);
+    if(!e)
+	return -ENOMEM;
+    strcpy(e->name, name);
+    e->a = *a;
+    e->off = off;
+    e->len = len;
+    if(d->nrec >= 2 * d->nbuckets){
+	tab = calloc(2 * d->nbuckets, sizeof(*tab));
+	/* without memory the chains just get longer */
+	if(tab){
+	    for(i = 0; i < d->nbuckets; i++)
+		for(next = d->tab[i]; next; ){
+		    struct pk_rec* n = next;
+		    next = n->next;
+		    h = name_hash(n->name) & (2 * d->nbuckets - 1);
+		    n->next = tab[h];
+		    tab[h] = n;
+		}
+	    free(d->tab);
+	    d->tab = tab;
+	    d->nbuckets *= 2;
+	}
+    }
+    h = name_hash(name) & (d->nbuckets - 1);
+    e->next = d->tab[h];
+    d->tab[h] = e;
+    d->nrec++;
+    d->live += len;
+    return 0;
+}
+
+/* containers */
+
+/* Called with d locked: appends record r, at *off */
+static int append(struct pk_dir* d, const unsigned char* r, uint32_t len, uint64_t* off){
+    unsigned char hdr[PACK_HDRLEN];
+    struct stat st;
+    ssize_t n;
+    int res;
+
+    if(d->gone)
+	return -ENOENT;
+    if(d->fd == -1){
+	d->fd = openat(d->dirfd, PACK_NAME, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if(d->fd == -1)
+	    return -errno;
+	if(fstat(d->fd, &st) == -1){
+	    res = -errno;
+	    close(d->fd);
+	    d->fd = -1;
+	    return res;
+	}
+	d->end = st.st_size;
+	if(d->end < PACK_HDRLEN){
+	    memset(hdr, 0, sizeof(hdr));
+	    memcpy(hdr, PACK_MAGIC, sizeof(PACK_MAGIC));
+	    if(pwrite(d->fd, hdr, PACK_HDRLEN, 0) != PACK_HDRLEN){
+		res = errno ? -errno : -EIO;
+		close(d->fd);
+		d->fd = -1;
+		return res;
+	    }
+	    d->end = PACK_HDRLEN;
+	}
+    }
+    n = pwrite(d->fd, r, len, d->end);
+    if(n != (ssize_t)len){
+	res = n < 0 ? -errno : -ENOSPC;
+	/* a partial record must not stay in front of the next one */
+	if(ftruncate(d->fd, d->end) == -1)
+	    bblog(BBLOG_ERR, "pack: could not cut off a failed append: %s", strerror(errno));
+	return res;
+    }
+    *off = d->end;
+    d->end += len;
+    return 0;
+}
+
+/* Called with d locked: reads and decrypts the record of e */
+static int rec_load(const struct pack* pk, struct pk_dir* d, const struct pk_rec* e,
+		    struct pk_body* b, unsigned char** plain){
+    unsigned char* r;
+    ssize_t n;
+    int res;
+
+    r = malloc(e->len);
+    if(!r)
+	return -ENOMEM;
+    n = pread(d->fd, r, e->len, e->off);
+    if(n != (ssize_t)e->len)
+	res = n < 0 ? -errno : -EIO;
+    else
+	res = unseal(pk, r, e->len, b, plain);
+    if(res == -EIO)
+	bblog(BBLOG_ERR, "pack: bad record for %s", e->name);
+    free(r);
+    return res;
+}
+
+/* Called with d locked: writes name's new record and indexes it */
+static int put_file(struct pack* pk, struct pk_dir* d, const char* name, const char* old,
+		    const struct pack_attr* a, const char* data){
+    unsigned char* r;
+    uint32_t len;
+    uint64_t off;
+    int res;
+
+    res = seal(pk, PK_FILE, name, old, a, data, &r, &len);
+    if(res < 0)
+	return res;
+    res = append(d, r, len, &off);
+    free(r);
+    if(res < 0)
+	return res;
+    if(old)
+	rec_drop(d, old);
+    return rec_set(d, name, a, off, len);
+}
+
+/* Called with d locked: writes a tombstone for name and drops it */
+static int put_gone(struct pack* pk, struct pk_dir* d, const char* name){
+    struct pack_attr a;
+    unsigned char* r;
+    uint32_t len;
+    uint64_t off;
+    int res;
+
+    memset(&a, 0, sizeof(a));
+    res = seal(pk, PK_GONE, name, NULL, &a, NULL, &r, &len);
+    if(res < 0)
+	return res;
+    res = append(d, r, len, &off);
+    free(r);
+    if(res == 0)
+	rec_drop(d, name);
+    return res;
+}
+
+/* Reads the container of a directory being loaded into its index. A
+ * record that runs past the end was torn by a crash and is cut off. */
+static int scan(struct pack* pk, struct pk_dir* d){
+    unsigned char hdr[PACK_HDRLEN];
+    unsigned char *buf, *tmp, *plain;
+    size_t cap = PACK_READBUF, buflen = 0;
+    uint64_t bufoff = 0, off, size;
+    struct pk_body b;
+    struct stat st;
+    struct pk_rec *e, *next;
+    uint32_t len;
+    size_t i, shadowed = 0;
+    ssize_t n;
+    int res = 0;
+
+    if(fstat(d->fd, &st) == -1)
+	return -errno;
+    size = st.st_size;
+    if(size < PACK_HDRLEN){
+	/* torn while being created */
+	d->end = 0;
+	return ftruncate(d->fd, 0) == -1 ? -errno : 0;
+    }
+    if(pread(d->fd, hdr, PACK_HDRLEN, 0) != PACK_HDRLEN)
+	return -EIO;
+    if(memcmp(hdr, PACK_MAGIC, sizeof(PACK_MAGIC)))
+	return -EINVAL;
+    buf = malloc(cap);
+    if(!buf)
+	return -ENOMEM;
+
+    for(off = PACK_HDRLEN; off < size; off += len){
+	/* the record, or at least its length, in buf */
+	len = PACK_RECMIN;
+	for(i = 0; i < 2; i++){
+	    if(off + len > size)
+		break;
+	    if(off + len > bufoff + buflen){
+		if(len > cap){
+		    tmp = realloc(buf, len);
+		    if(!tmp){
+			res = -ENOMEM;
+			goto out;
+		    }
+		    buf = tmp;
+		    cap = len;
+		}
+		n = pread(d->fd, buf, size - off < cap ? size - off : cap, off);
+		if(n < (ssize_t)len){
+		    res = n < 0 ? -errno : -EIO;
+		    goto out;
+		}
+		bufoff = off;
+		buflen = n;
+	    }
+	    if(i == 0){
+		len = get32(buf + (off - bufoff));
+		if(len < PACK_RECMIN || len > PACK_RECMAX)
+		    break;
+	    }
+	}
+	if(i < 2){
+	    bblog(BBLOG_WARN, "pack: cutting off a torn record at %llu",
+		  (unsigned long long)off);
+	    if(ftruncate(d->fd, off) == -1){
+		res = -errno;
+		goto out;
+	    }
+	    size = off;
+	    break;
+	}
+	res = unseal(pk, buf + (off - bufoff), len, &b, &plain);
+	if(res == -ENOMEM)
+	    goto out;
+	if(res < 0){
+	    bblog(BBLOG_ERR, "pack: bad record at %llu, skipped", (unsigned long long)off);
+	    res = 0;
+	    continue;
+	}
+	if(b.type == PK_FILE){
+	    if(b.old[0])
+		rec_drop(d, b.old);
+	    res = rec_set(d, b.name, &b.a, off, len);
+	}
+	else
+	    rec_drop(d, b.name);
+	free(plain);
+	if(res < 0)
+	    goto out;
+    }
+    d->end = size;
+
+    /* a crash while a file was moved out can leave both copies; the
+       backing one is newer */
+    for(i = 0; i < d->nbuckets; i++)
+	for(e = d->tab[i]; e; e = next){
+	    next = e->next;
+	    if(fstatat(d->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+		rec_drop(d, e->name);
+		shadowed++;
+	    }
+	}
+    if(shadowed)
+	bblog(BBLOG_INFO, "pack: dropped %zu records of files moved out", shadowed);
+
+ out:
+    free(buf);
+    return res;
+}
+
+static void free_dir(struct pk_dir* d){
+    struct pk_rec *e, *next;
+    size_t i;
+
+    for(i = 0; i < d->nbuckets; i++)
+	for(e = d->tab[i]; e; e = next){
+	    next = e->next;
+	    free(e);
+	}
+    if(d->fd != -1)
+	close(d->fd);
+    close(d->dirfd);
+    pthread_mutex_destroy(&d->lock);
+    free(d->tab);
+    free(d);
+}
+
+static struct pk_dir* load_dir(struct pack* pk, const char* dir, int* err){
+    struct pk_dir* d;
+    struct stat st;
+    int res;
+
+    d = calloc(1, sizeof(*d));
+    if(!d){
+	*err = -ENOMEM;
+	return NULL;
+    }
+    d->nbuckets = 64;
+    d->tab = calloc(d->nbuckets, sizeof(*d->tab));
+    d->fd = -1;
+    d->dirfd = openat(pk->rootfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(!d->tab || d->dirfd == -1 || fstat(d->dirfd, &st) == -1){
+	*err = d->tab ? -errno : -ENOMEM;
+	if(d->dirfd != -1)
+	    close(d->dirfd);
+	free(d->tab);
+	free(d);
+	return NULL;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    /* left over from an interrupted compaction */
+    unlinkat(d->dirfd, PACK_TMP, 0);
+    d->fd = openat(d->dirfd, PACK_NAME, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if(d->fd == -1 && errno != ENOENT){
+	*err = -errno;
+	free_dir(d);
+	return NULL;
+    }
+    if(d->fd != -1){
+	res = scan(pk, d);
+	if(res < 0){
+	    bblog(BBLOG_ERR, "pack: can't load %s/%s: %s", dir, PACK_NAME, strerror(-res));
+	    *err = res;
+	    free_dir(d);
+	    return NULL;
+	}
+    }
+    return d;
+}
+
+static size_t dir_hash(dev_t dev, ino_t ino){
+    return ((size_t)ino ^ (size_t)dev * 31) % PACK_DIRS;
+}
+
+/* Called with the pack mutex held */
+static void unlink_dir(struct pack* pk, struct pk_dir* d){
+    struct pk_dir** pp;
+
+    for(pp = &pk->dirs[dir_hash(d->dev, d->ino)]; *pp; pp = &(*pp)->next)
+	if(*pp == d){
+	    *pp = d->next;
+	    pk->ndirs--;
+	    return;
+	}
+}
+
+/* Called with the pack mutex held: the least recently used unreferenced
+ * directory, out of the table, once there are too many */
+static struct pk_dir* evict(struct pack* pk){
+    struct pk_dir *d, *lru = NULL;
+    size_t i;
+
+    if(pk->ndirs <= PACK_DIRS)
+	return NULL;
+    for(i = 0; i < PACK_DIRS; i++)
+	for(d = pk->dirs[i]; d; d = d->next)
+	    if(!d->refs && (!lru || d->used < lru->used))
+		lru = d;
+    if(lru)
+	unlink_dir(pk, lru);
+    return lru;
+}
+
+/* The directory of mount path path (referenced), and path's last component */
+static int get_dir(struct pack* pk, const char* path, struct pk_dir** out, const char** name){
+    char dir[PATH_MAX];
+    struct pk_dir *d, *nd, *old;
+    struct stat st;
+    int res;
+
+    res = split(path, dir, name);
+    if(res < 0)
+	return res;
+    if(fstatat(pk->rootfd, dir, &st, 0) == -1)
+	return -errno;
+    if(!S_ISDIR(st.st_mode))
+	return -ENOTDIR;
+
+    pthread_mutex_lock(&pk->lock);
+    for(d = pk->dirs[dir_hash(st.st_dev, st.st_ino)]; d; d = d->next)
+	if(d->dev == st.st_dev && d->ino == st.st_ino)
+	    break;
+    if(d){
+	d->refs++;
+	d->used = ++pk->clock;
+	pthread_mutex_unlock(&pk->lock);
+	*out = d;
+	return 0;
+    }
+    pthread_mutex_unlock(&pk->lock);
+
+    /* loaded without the lock; whoever gets done first wins */
+    nd = load_dir(pk, dir, &res);
+    if(!nd)
+	return res;
+    pthread_mutex_lock(&pk->lock);
+    for(d = pk->dirs[dir_hash(nd->dev, nd->ino)]; d; d = d->next)
+	if(d->dev == nd->dev && d->ino == nd->ino)
+	    break;
+    old = NULL;
+    if(!d){
+	d = nd;
+	nd = NULL;
+	d->next = pk->dirs[dir_hash(d->dev, d->ino)];
+	pk->dirs[dir_hash(d->dev, d->ino)] = d;
+	pk->ndirs++;
+	old = evict(pk);
+    }
+    d->refs++;
+    d->used = ++pk->clock;
+    pthread_mutex_unlock(&pk->lock);
+    if(nd)
+	free_dir(nd);
+    if(old)
+	free_dir(old);
+    *out = d;
+    return 0;
+}
+
+static void put_dir(struct pack* pk, struct pk_dir* d){
+    int dead;
+
+    pthread_mutex_lock(&pk->lock);
+    dead = --d->refs == 0 && d->gone;
+    pthread_mutex_unlock(&pk->lock);
+    if(dead)
+	free_dir(d);
+}
+
+/* Called with d locked: rewrites the container with only its live
+ * records, or removes it if there are none */
+static int compact(struct pack* pk, struct pk_dir* d){
+    unsigned char hdr[PACK_HDRLEN];
+    struct pk_rec **recs = NULL, *e;
+    uint64_t *offs = NULL, off;
+    unsigned char* buf = NULL;
+    size_t i, j, n = 0;
+    int fd, res = 0;
+
+    (void) pk;
+    if(d->fd == -1 || d->gone)
+	return 0;
+    if(d->nrec == 0){
+	if(unlinkat(d->dirfd, PACK_NAME, 0) == -1)
+	    return -errno;
+	close(d->fd);
+	d->fd = -1;
+	d->end = 0;
+	return 0;
+    }
+
+    /* records keep their order: a rename record must stay in front of
+       a later file of the name it removed */
+    recs = malloc(d->nrec * sizeof(*recs));
+    offs = malloc(d->nrec * sizeof(*offs));
+    buf = malloc(PACK_RECMAX);
+    if(!recs || !offs || !buf){
+	res = -ENOMEM;
+	goto out;
+    }
+    for(i = 0; i < d->nbuckets; i++)
+	for(e = d->tab[i]; e; e = e->next){
+	    for(j = n; j > 0 && recs[j - 1]->off > e->off; j--)
+		recs[j] = recs[j - 1];
+	    recs[j] = e;
+	    n++;
+	}
+
+    fd = openat(d->dirfd, PACK_TMP, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(fd == -1){
+	res = -errno;
+	goto out;
+    }
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, PACK_MAGIC, sizeof(PACK_MAGIC));
+    off = PACK_HDRLEN;
+    if(pwrite(fd, hdr, PACK_HDRLEN, 0) != PACK_HDRLEN)
+	res = -EIO;
+    for(i = 0; res == 0 && i < n; i++){
+	if(pread(d->fd, buf, recs[i]->len, recs[i]->off) != (ssize_t)recs[i]->len ||
+	   pwrite(fd, buf, recs[i]->len, off) != (ssize_t)recs[i]->len)
+	    res = errno ? -errno : -EIO;
+	offs[i] = off;
+	off += recs[i]->len;
+    }
+    if(res == 0 && fdatasync(fd) == -1)
+	res = -errno;
+    if(res == 0 && renameat(d->dirfd, PACK_TMP, d->dirfd, PACK_NAME) == -1)
+	res = -errno;
+    if(res < 0){
+	close(fd);
+	unlinkat(d->dirfd, PACK_TMP, 0);
+	goto out;
+    }
+    fsync(d->dirfd);
+    for(i = 0; i < n; i++)
+	recs[i]->off = offs[i];
+    close(d->fd);
+    d->fd = fd;
+    d->end = off;
+
+ out:
+    free(buf);
+    free(offs);
+    free(recs);
+    return res;
+}
+
+static int wants_compaction(const struct pk_dir* d){
+    uint64_t dead;
+
+    if(d->fd == -1)
+	return 0;
+    if(d->nrec == 0)
+	return 1;
+    dead = d->end - PACK_HDRLEN - d->live;
+    return dead >= PACK_COMPACT_MIN && dead >= d->live;
+}
+
+static void* compactor(void* arg){
+    struct pack* pk = arg;
+    struct pk_dir* todo[16];
+    struct pk_dir* d;
+    struct timespec ts;
+    size_t i, n;
+    int res;
+
+    pthread_mutex_lock(&pk->lock);
+    while(!pk->stop){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += PACK_COMPACT_MS / 1000;
+	ts.tv_nsec += (long)(PACK_COMPACT_MS % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&pk->cond, &pk->lock, &ts);
+	if(pk->stop)
+	    break;
+	/* the counters are only read here: a stale look just means
+	   the next round */
+	n = 0;
+	for(i = 0; i < PACK_DIRS && n < sizeof(todo) / sizeof(*todo); i++)
+	    for(d = pk->dirs[i]; d && n < sizeof(todo) / sizeof(*todo); d = d->next)
+		if(wants_compaction(d)){
+		    d->refs++;
+		    todo[n++] = d;
+		}
+	pthread_mutex_unlock(&pk->lock);
+	for(i = 0; i < n; i++){
+	    pthread_mutex_lock(&todo[i]->lock);
+	    res = wants_compaction(todo[i]) ? compact(pk, todo[i]) : 0;
+	    pthread_mutex_unlock(&todo[i]->lock);
+	    if(res < 0)
+		bblog(BBLOG_WARN, "pack: compaction failed: %s", strerror(-res));
+	    put_dir(pk, todo[i]);
+	}
+	pthread_mutex_lock(&pk->lock);
+    }
+    pthread_mutex_unlock(&pk->lock);
+    return NULL;
+}
+
+/* API */
+
+extern struct pack* pack_open(int rootfd, const struct encblk_keys* keys, size_t max, int create){
+    unsigned char check[8 + 32], want[8 + 32];
+    unsigned int len;
+    struct pack* pk;
+    ssize_t n;
+    int fd, res;
+
+    pk = calloc(1, sizeof(*pk));
+    if(!pk)
+	return NULL;
+    pk->rootfd = rootfd;
+    pk->max = max < PACK_FILE_MAX ? max : PACK_FILE_MAX;
+    len = sizeof(pk->kenc);
+    if(!HMAC(EVP_sha256(), keys->k[ENCBLK_AES256CBC], ENCBLK_KEYLEN,
+	     (const unsigned char*)"fusec pack enc", 14, pk->kenc, &len)){
+	res = -EIO;
+	goto fail;
+    }
+    len = sizeof(pk->kmac);
+    if(!HMAC(EVP_sha256(), keys->k[ENCBLK_AES256CBC], ENCBLK_KEYLEN,
+	     (const unsigned char*)"fusec pack mac", 14, pk->kmac, &len)){
+	res = -EIO;
+	goto fail;
+    }
+    memcpy(want, PACK_KEYMAGIC, 8);
+    len = 32;
+    if(!HMAC(EVP_sha256(), pk->kmac, sizeof(pk->kmac),
+	     (const unsigned char*)"fusec pack check", 16, want + 8, &len)){
+	res = -EIO;
+	goto fail;
+    }
+
+    fd = openat(rootfd, PACK_KEYFILE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1 && errno == ENOENT && create){
+	fd = openat(rootfd, PACK_KEYFILE, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		    0600);
+	if(fd == -1){
+	    res = -errno;
+	    goto fail;
+	}
+	n = write(fd, want, sizeof(want));
+	if(n != sizeof(want) || fsync(fd) == -1){
+	    res = n < 0 ? -errno : -EIO;
+	    close(fd);
+	    unlinkat(rootfd, PACK_KEYFILE, 0);
+	    goto fail;
+	}
+	close(fd);
+	fsync(rootfd);
+    }
+    else if(fd == -1){
+	res = -errno;
+	goto fail;
+    }
+    else{
+	n = read(fd, check, sizeof(check));
+	close(fd);
+	if(n != sizeof(check) || memcmp(check, want, 8)){
+	    res = -EINVAL;
+	    goto fail;
+	}
+	if(CRYPTO_memcmp(check + 8, want + 8, 32)){
+	    res = -EKEYREJECTED;
+	    goto fail;
+	}
+    }
+    pthread_mutex_init(&pk->lock, NULL);
+    pthread_cond_init(&pk->cond, NULL);
+    return pk;
+
+ fail:
+    free(pk);
+    errno = -res;
+    return NULL;
+}
+
+extern int pack_start(struct pack* pk){
+    int res;
+
+    res = pthread_create(&pk->thread, NULL, compactor, pk);
+    if(res)
+	return -res;
+    pk->running = 1;
+    return 0;
+}
+
+extern int pack_getattr(struct pack* pk, const char* path, struct pack_attr* a){
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(e && a)
+	*a = e->a;
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return e ? 0 : -ENOENT;
+}
+
+extern int pack_list(struct pack* pk, const char* path,
+		     int (*fn)(void* arg, const char* name, const struct pack_attr* a),
+		     void* arg){
+    char dir[PATH_MAX];
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    size_t i;
+    int res;
+
+    /* the directory itself, as the parent of an entry in it */
+    res = snprintf(dir, sizeof(dir), "%s/.", path);
+    if(res < 0 || (size_t)res >= sizeof(dir))
+	return -ENAMETOOLONG;
+    res = get_dir(pk, dir, &d, &name);
+    if(res < 0)
+	return res;
+    pthread_mutex_lock(&d->lock);
+    for(i = 0; i < d->nbuckets; i++)
+	for(e = d->tab[i]; e; e = e->next)
+	    if(fn(arg, e->name, &e->a))
+		goto done;
+ done:
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return 0;
+}
+
+extern int pack_create(struct pack* pk, const char* path, mode_t mode, uid_t uid, gid_t gid){
+    struct pack_attr a;
+    struct pk_dir* d;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res;
+    memset(&a, 0, sizeof(a));
+    a.mode = S_IFREG | (mode & 07777);
+    a.uid = uid;
+    a.gid = gid;
+    now(&a.mtime);
+    a.atime = a.ctime = a.mtime;
+    pthread_mutex_lock(&d->lock);
+    if(rec_find(d, name))
+	res = -EEXIST;
+    else
+	res = put_file(pk, d, name, NULL, &a, NULL);
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern ssize_t pack_read(struct pack* pk, const char* path, char* buf, size_t size, off_t offset){
+    unsigned char* plain;
+    struct pk_body b;
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    ssize_t res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(!e)
+	res = -ENOENT;
+    else if((uint64_t)offset >= e->a.size)
+	res = 0;
+    else{
+	res = rec_load(pk, d, e, &b, &plain);
+	if(res == 0){
+	    if(size > b.a.size - offset)
+		size = b.a.size - offset;
+	    memcpy(buf, b.data + offset, size);
+	    free(plain);
+	    res = size;
+	}
+    }
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+/* Called with d locked: name's contents become the first size bytes of
+ * what it had, with buf written at offset */
+static int rewrite(struct pack* pk, struct pk_dir* d, struct pk_rec* e,
+		   const char* buf, size_t len, off_t offset, uint64_t size){
+    struct pack_attr a = e->a;
+    unsigned char* plain = NULL;
+    struct pk_body b;
+    char* data;
+    size_t keep;
+    int res;
+
+    if(size > pk->max)
+	return -EFBIG;
+    data = calloc(1, size ? size : 1);
+    if(!data)
+	return -ENOMEM;
+    keep = a.size < size ? a.size : size;
+    if(keep){
+	res = rec_load(pk, d, e, &b, &plain);
+	if(res < 0){
+	    free(data);
+	    return res;
+	}
+	memcpy(data, b.data, keep);
+	free(plain);
+    }
+    if(len)
+	memcpy(data + offset, buf, len);
+    a.size = size;
+    now(&a.mtime);
+    a.ctime = a.mtime;
+    res = put_file(pk, d, e->name, NULL, &a, data);
+    free(data);
+    return res;
+}
+
+extern int pack_write(struct pack* pk, const char* path, const char* buf, size_t size, off_t offset){
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    uint64_t end;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(!e)
+	res = -ENOENT;
+    else if((uint64_t)offset > pk->max || size > pk->max - offset)
+	res = -EFBIG;
+    else{
+	end = offset + size;
+	res = rewrite(pk, d, e, buf, size, offset, end > e->a.size ? end : e->a.size);
+    }
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_truncate(struct pack* pk, const char* path, uint64_t size){
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(!e)
+	res = -ENOENT;
+    else
+	res = rewrite(pk, d, e, NULL, 0, 0, size);
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_setattr(struct pack* pk, const char* path, int what, const struct pack_attr* a){
+    unsigned char* plain = NULL;
+    struct pack_attr na;
+    struct pk_body b;
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(!e)
+	res = -ENOENT;
+    else
+	res = rec_load(pk, d, e, &b, &plain);
+    if(res == 0){
+	na = e->a;
+	if(what & PACK_SET_MODE)
+	    na.mode = (na.mode & S_IFMT) | (a->mode & 07777);
+	if(what & PACK_SET_UID)
+	    na.uid = a->uid;
+	if(what & PACK_SET_GID)
+	    na.gid = a->gid;
+	if(what & PACK_SET_ATIME)
+	    na.atime = a->atime;
+	if(what & PACK_SET_MTIME)
+	    na.mtime = a->mtime;
+	now(&na.ctime);
+	res = put_file(pk, d, e->name, NULL, &na, b.data);
+	free(plain);
+    }
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_remove(struct pack* pk, const char* path){
+    struct pk_dir* d;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    if(!rec_find(d, name))
+	res = -ENOENT;
+    else
+	res = put_gone(pk, d, name);
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_rename(struct pack* pk, const char* from, const char* to){
+    unsigned char* plain = NULL;
+    struct pk_dir *df, *dt;
+    struct pk_body b;
+    struct pk_rec* e;
+    const char *nf, *nt;
+    int res;
+
+    res = get_dir(pk, from, &df, &nf);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    res = get_dir(pk, to, &dt, &nt);
+    if(res < 0){
+	put_dir(pk, df);
+	return res;
+    }
+    if(df == dt)
+	pthread_mutex_lock(&df->lock);
+    else if(df < dt){
+	pthread_mutex_lock(&df->lock);
+	pthread_mutex_lock(&dt->lock);
+    }
+    else{
+	pthread_mutex_lock(&dt->lock);
+	pthread_mutex_lock(&df->lock);
+    }
+
+    e = rec_find(df, nf);
+    if(!e)
+	res = -ENOENT;
+    else if(df == dt && !strcmp(nf, nt))
+	res = 0;
+    else
+	res = rec_load(pk, df, e, &b, &plain);
+    if(res == 0 && plain){
+	now(&b.a.ctime);
+	if(df == dt)
+	    /* one record: the old name goes with it */
+	    res = put_file(pk, dt, nt, nf, &b.a, b.data);
+	else{
+	    /* the new copy has to be safe before the old one goes, or a
+	       crash could lose the file */
+	    res = put_file(pk, dt, nt, NULL, &b.a, b.data);
+	    if(res == 0 && fdatasync(dt->fd) == -1)
+		res = -errno;
+	    if(res == 0)
+		res = put_gone(pk, df, nf);
+	}
+	free(plain);
+    }
+
+    pthread_mutex_unlock(&df->lock);
+    if(df != dt)
+	pthread_mutex_unlock(&dt->lock);
+    put_dir(pk, dt);
+    put_dir(pk, df);
+    return res;
+}
+
+extern int pack_unpack(struct pack* pk, const char* path,
+		       int (*make)(void* arg, const char* path, const char* data,
+				   const struct pack_attr* a),
+		       void* arg){
+    unsigned char* plain = NULL;
+    struct pk_body b;
+    struct pk_dir* d;
+    struct pk_rec* e;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res == -ENOTDIR ? -ENOENT : res;
+    pthread_mutex_lock(&d->lock);
+    e = rec_find(d, name);
+    if(!e)
+	res = -ENOENT;
+    else
+	res = rec_load(pk, d, e, &b, &plain);
+    if(res == 0){
+	res = make(arg, path, b.data, &b.a);
+	if(res == 0)
+	    res = put_gone(pk, d, name);
+	free(plain);
+    }
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_sync(struct pack* pk, const char* path){
+    struct pk_dir* d;
+    const char* name;
+    int res;
+
+    res = get_dir(pk, path, &d, &name);
+    if(res < 0)
+	return res;
+    pthread_mutex_lock(&d->lock);
+    if(d->fd != -1 && fdatasync(d->fd) == -1)
+	res = -errno;
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern int pack_rmdir(struct pack* pk, const char* path){
+    char dir[PATH_MAX];
+    struct pk_dir* d;
+    const char* name;
+    int res;
+
+    res = snprintf(dir, sizeof(dir), "%s/.", path);
+    if(res < 0 || (size_t)res >= sizeof(dir))
+	return -ENAMETOOLONG;
+    res = get_dir(pk, dir, &d, &name);
+    if(res < 0)
+	return res;
+    pthread_mutex_lock(&d->lock);
+    if(d->nrec)
+	res = -ENOTEMPTY;
+    else if(d->fd != -1 && unlinkat(d->dirfd, PACK_NAME, 0) == -1)
+	res = -errno;
+    if(res == 0){
+	if(d->fd != -1)
+	    close(d->fd);
+	d->fd = -1;
+	d->end = 0;
+	/* whoever still has it can't append any more; if the rmdir
+	   fails after all, the directory is simply loaded again */
+	pthread_mutex_lock(&pk->lock);
+	unlink_dir(pk, d);
+	d->gone = 1;
+	pthread_mutex_unlock(&pk->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    put_dir(pk, d);
+    return res;
+}
+
+extern void pack_close(struct pack* pk){
+    struct pk_dir* d;
+    size_t i;
+    int res;
+
+    if(!pk)
+	return;
+    if(pk->running){
+	pthread_mutex_lock(&pk->lock);
+	pk->stop = 1;
+	pthread_cond_signal(&pk->cond);
+	pthread_mutex_unlock(&pk->lock);
+	pthread_join(pk->thread, NULL);
+    }
+    for(i = 0; i < PACK_DIRS; i++)
+	while((d = pk->dirs[i])){
+	    pk->dirs[i] = d->next;
+	    /* one last chance to drop dead records */
+	    if(wants_compaction(d) && (res = compact(pk, d)) < 0)
+		bblog(BBLOG_WARN, "pack: compaction failed: %s", strerror(-res));
+	    free_dir(d);
+	}
+    pthread_mutex_destroy(&pk->lock);
+    pthread_cond_destroy(&pk->cond);
+    free(pk);
+}
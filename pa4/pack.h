@@ -0,0 +1,197 @@
+/* pack.h
+ * Small files packed into per-directory containers for fusec
+ *
+ * A backing file per small file costs an inode, an xattr, a header and a
+ * whole block of ciphertext, and every operation on it a few system
+ * calls. Packed files have none of that: each directory has one
+ * container, .fusec-pack, holding its packed files as encrypted records
+ * (name, attributes, contents). Nothing else in the backing directory
+ * stands for them; fusec lists and serves them next to the directory's
+ * real entries. A name is either packed or a backing entry, never both.
+ *
+ * The container is a log. Every change appends a record that replaces
+ * the file's previous one (or a tombstone, for removals); an index of
+ * the live records is built in memory when the directory is first used.
+ * A background thread rewrites containers once most of their bytes are
+ * dead, and removes empty ones.
+ *
+ * Container layout (host byte order):
+ *   header   PACK_HDRLEN bytes, "FCPACK01" then unused
+ *   records  u32 record length, u8 type (file or tombstone), 3 unused,
+ *            PACK_IVLEN byte IV, the body encrypted with AES-256-CTR,
+ *            HMAC-SHA256 of everything before it
+ *   body     u16 name length, u16 length of a name the record removes
+ *            (same-directory renames), u32 mode, u32 uid, u32 gid,
+ *            u64 size, i64 atime, mtime and ctime seconds, u32 their
+ *            nanoseconds, 4 unused, the names, the contents
+ *
+ * A crash can leave a torn record at the end of a container; it is cut
+ * off at the next load. Appends are not synced until pack_sync(), like
+ * writes to a plain file. Records are self-contained, so compaction
+ * copies them without decrypting.
+ *
+ * The root of the backing store holds .fusec-pack-key, which tells
+ * whether packs exist at all (so a mount without any costs nothing) and
+ * catches a wrong key phrase before a container is misread as torn.
+ *
+ * Indexes are kept for the most recently used directories, by inode, so
+ * directories can be renamed (even behind the mount's back); a directory
+ * has to be removed through pack_rmdir(). Changes to a container made
+ * behind the mount's back are not noticed.
+ *
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "encblk.h"
+
+/* largest file pack_open() will keep packed */
+#define PACK_FILE_MAX (1 << 20)
+
+/* pack_setattr() fields */
+#define PACK_SET_MODE 1
+#define PACK_SET_UID 2
+#define PACK_SET_GID 4
+#define PACK_SET_ATIME 8
+#define PACK_SET_MTIME 16
+
+struct pack_attr {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+struct pack;
+
+/* struct pack* pack_open(int rootfd, const struct encblk_keys* keys, size_t max, int create)
+ * Purpose: Open the packed files of a backing store
+ * Args: int rootfd                    : Backing root directory fd
+ *       const struct encblk_keys* keys : Mount keys the pack keys are derived from
+ *       size_t max                    : Files larger than this are not kept
+ *                                       packed (at most PACK_FILE_MAX)
+ *       int create                    : Set the store up if it has no packs yet
+ * Return: Packs on success, NULL on error (errno set; ENOENT if there are
+ *         no packs and create is 0, EKEYREJECTED for the wrong keys)
+ */
+extern struct pack* pack_open(int rootfd, const struct encblk_keys* keys, size_t max, int create);
+
+/* int pack_start(struct pack* pk)
+ * Purpose: Start the compaction thread. Without it containers are never
+ *          compacted.
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_start(struct pack* pk);
+
+/* int pack_getattr(struct pack* pk, const char* path, struct pack_attr* a)
+ * Purpose: Look up a packed file
+ * Args: struct pack* pk      : Packs
+ *       const char* path     : Mount path ("/dir/name")
+ *       struct pack_attr* a  : Output attributes (may be NULL)
+ * Return: 0 if path is a packed file, -ENOENT if it is not, -errno on error
+ */
+extern int pack_getattr(struct pack* pk, const char* path, struct pack_attr* a);
+
+/* int pack_list(struct pack* pk, const char* path,
+ *               int (*fn)(void* arg, const char* name, const struct pack_attr* a),
+ *               void* arg)
+ * Purpose: Call fn for each packed file in directory path, until it
+ *          returns non-zero. fn must not call back into the packs.
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_list(struct pack* pk, const char* path,
+		     int (*fn)(void* arg, const char* name, const struct pack_attr* a),
+		     void* arg);
+
+/* int pack_create(struct pack* pk, const char* path, mode_t mode, uid_t uid, gid_t gid)
+ * Purpose: Create an empty packed file. The caller makes sure there is no
+ *          backing entry of that name.
+ * Return: 0 on success, -EEXIST if it is packed already, -errno on error
+ */
+extern int pack_create(struct pack* pk, const char* path, mode_t mode, uid_t uid, gid_t gid);
+
+/* ssize_t pack_read(struct pack* pk, const char* path, char* buf, size_t size, off_t offset)
+ * Purpose: Read from a packed file
+ * Return: Bytes read (short at EOF), -ENOENT if it is not packed, -errno on error
+ */
+extern ssize_t pack_read(struct pack* pk, const char* path, char* buf, size_t size, off_t offset);
+
+/* int pack_write(struct pack* pk, const char* path, const char* buf, size_t size, off_t offset)
+ * Purpose: Write to a packed file
+ * Return: 0 on success, -EFBIG if the file would outgrow the packs (see
+ *         pack_unpack()), -ENOENT if it is not packed, -errno on error
+ */
+extern int pack_write(struct pack* pk, const char* path, const char* buf, size_t size, off_t offset);
+
+/* int pack_truncate(struct pack* pk, const char* path, uint64_t size)
+ * Purpose: Truncate a packed file
+ * Return: As pack_write()
+ */
+extern int pack_truncate(struct pack* pk, const char* path, uint64_t size);
+
+/* int pack_setattr(struct pack* pk, const char* path, int what, const struct pack_attr* a)
+ * Purpose: Change the attributes of a packed file selected by what
+ *          (PACK_SET_*) to those in a; the ctime is always updated
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on error
+ */
+extern int pack_setattr(struct pack* pk, const char* path, int what, const struct pack_attr* a);
+
+/* int pack_remove(struct pack* pk, const char* path)
+ * Purpose: Remove a packed file
+ * Return: 0 on success, -ENOENT if it is not packed, -errno on error
+ */
+extern int pack_remove(struct pack* pk, const char* path);
+
+/* int pack_rename(struct pack* pk, const char* from, const char* to)
+ * Purpose: Rename a packed file, replacing a packed file at to. The
+ *          caller makes sure there is no backing entry at to.
+ * Return: 0 on success, -ENOENT if from is not packed, -errno on error
+ */
+extern int pack_rename(struct pack* pk, const char* from, const char* to);
+
+/* int pack_unpack(struct pack* pk, const char* path,
+ *                 int (*make)(void* arg, const char* path, const char* data,
+ *                             const struct pack_attr* a),
+ *                 void* arg)
+ * Purpose: Move a packed file out of its container. make creates the
+ *          backing file from the contents and attributes; the record is
+ *          only removed once it succeeded. If the file had contents, make
+ *          has to sync them first, or a crash could lose data that was
+ *          synced while packed. The directory stays locked meanwhile.
+ * Return: 0 on success, -ENOENT if it is not packed, make's error, or
+ *         -errno on error
+ */
+extern int pack_unpack(struct pack* pk, const char* path,
+		       int (*make)(void* arg, const char* path, const char* data,
+				   const struct pack_attr* a),
+		       void* arg);
+
+/* int pack_sync(struct pack* pk, const char* path)
+ * Purpose: Make the packed file at path durable
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_sync(struct pack* pk, const char* path);
+
+/* int pack_rmdir(struct pack* pk, const char* path)
+ * Purpose: Get directory path ready to be removed: removes its (empty)
+ *          container, and new packed files can't be created in it
+ *          through what is known about it so far
+ * Return: 0 on success, -ENOTEMPTY if it has packed files, -errno on error
+ */
+extern int pack_rmdir(struct pack* pk, const char* path);
+
+/* void pack_close(struct pack* pk)
+ * Purpose: Stop compaction and free the packs
+ */
+extern void pack_close(struct pack* pk);
+
+#endif
@@ -0,0 +1,464 @@
+/* staging.c
+ * Background encryption of staged writes for fusec
+ *
+ * See staging.h for details
+ *
+ * Each file with staged data has a FIFO of writes. At most one worker
+ * works on a file at a time, always from the front, so overlapping writes
+ * land in the order they were made; adjacent writes are handed to the
+ * apply callback together. A write stays in the FIFO (marked done) until
+ * no reader has the file pinned, so a read never misses data that is
+ * halfway between staging and the file.
+ *
+ */
+
+#ifdef linux
+/* For strdup() and dup() */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bblog.h"
+#include "staging.h"
+
+/* most bytes handed to apply at once */
+#define STG_MAX_RUN (1 << 20)
+
+enum { STG_QUEUED, STG_APPLYING, STG_DONE };
+
+struct stg_ext {
+    off_t off;
+    size_t len;
+    int state;
+    struct stg_ext* next;
+    char* data;
+};
+
+struct stg_file {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    char* path;
+    struct stg_ext* head;
+    struct stg_ext* tail;
+    int busy;			/* a worker is applying from it */
+    unsigned int pins;		/* readers */
+    int err;			/* first background failure, not reported yet */
+    struct stg_file* next;
+};
+
+struct staging {
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* something was staged, or stop */
+    pthread_cond_t space;	/* staged bytes went down */
+    pthread_cond_t drained;	/* a file's writes were retired */
+    struct stg_file* files;
+    size_t bytes;
+    size_t limit;
+    staging_apply_fn apply;
+    void* arg;
+    pthread_t* threads;
+    unsigned int nthreads;
+    int stop;
+};
+
+static struct stg_file* find_file(struct staging* stg, dev_t dev, ino_t ino){
+    struct stg_file* f;
+
+    for(f = stg->files; f; f = f->next)
+	if(f->dev == dev && f->ino == ino)
+	    return f;
+    return NULL;
+}
+
+static void unlink_file(struct staging* stg, struct stg_file* f){
+    struct stg_file** pp = &stg->files;
+
+    while(*pp != f)
+	pp = &(*pp)->next;
+    *pp = f->next;
+}
+
+/* Free applied writes (unless a reader still needs them), and the file
+   itself once it has nothing left to do. Lock held. */
+static void retire(struct staging* stg, struct stg_file* f){
+    struct stg_ext* e;
+
+    if(f->pins)
+	return;
+    while((e = f->head) && e->state == STG_DONE){
+	f->head = e->next;
+	stg->bytes -= e->len;
+	free(e->data);
+	free(e);
+    }
+    if(!f->head)
+	f->tail = NULL;
+    pthread_cond_broadcast(&stg->space);
+    pthread_cond_broadcast(&stg->drained);
+    if(!f->head && !f->busy && !f->err){
+	unlink_file(stg, f);
+	close(f->fd);
+	free(f->path);
+	free(f);
+    }
+}
+
+/* A file with queued writes no worker is busy with, or NULL. Lock held. */
+static struct stg_file* pick(struct staging* stg){
+    struct stg_file* f;
+    struct stg_ext* e;
+
+    for(f = stg->files; f; f = f->next){
+	if(f->busy)
+	    continue;
+	for(e = f->head; e; e = e->next)
+	    if(e->state == STG_QUEUED)
+		return f;
+    }
+    return NULL;
+}
+
+static void* worker(void* arg){
+    struct staging* stg = arg;
+    struct stg_file *f, **pp;
+    struct stg_ext *first, *e, *end;
+    size_t total, n, i;
+    char* buf;
+    int res;
+
+    pthread_mutex_lock(&stg->lock);
+    for(;;){
+	f = pick(stg);
+	if(!f){
+	    if(stg->stop)
+		break;
+	    pthread_cond_wait(&stg->work, &stg->lock);
+	    continue;
+	}
+	f->busy = 1;
+	for(first = f->head; first->state != STG_QUEUED; first = first->next)
+	    ;
+	/* take the run of adjacent writes starting there */
+	total = first->len;
+	n = 1;
+	first->state = STG_APPLYING;
+	for(end = first->next; end && end->state == STG_QUEUED &&
+		end->off == first->off + (off_t)total &&
+		total + end->len <= STG_MAX_RUN; end = end->next){
+	    end->state = STG_APPLYING;
+	    total += end->len;
+	    n++;
+	}
+	/* go to the back of the line so one busy file does not starve others */
+	unlink_file(stg, f);
+	for(pp = &stg->files; *pp; pp = &(*pp)->next)
+	    ;
+	*pp = f;
+	f->next = NULL;
+	pthread_mutex_unlock(&stg->lock);
+
+	/* applying writes no one else touches, and staging_write() only
+	   appends after them, so the run can be read without the lock */
+	buf = first->data;
+	res = 0;
+	if(n > 1){
+	    buf = malloc(total);
+	    if(buf){
+		total = 0;
+		for(e = first, i = 0; i < n; e = e->next, i++){
+		    memcpy(buf + total, e->data, e->len);
+		    total += e->len;
+		}
+	    }
+	    else
+		res = -ENOMEM;
+	}
+	if(res == 0)
+	    res = stg->apply(stg->arg, f->fd, f->path, buf, total, first->off);
+	if(buf != first->data)
+	    free(buf);
+
+	pthread_mutex_lock(&stg->lock);
+	for(e = first, i = 0; i < n; e = e->next, i++)
+	    e->state = STG_DONE;
+	if(res < 0 && !f->err){
+	    bblog(BBLOG_WARN, "staging: write to %s failed: %s", f->path, strerror(-res));
+	    f->err = res;
+	}
+	f->busy = 0;
+	retire(stg, f);
+	pthread_cond_broadcast(&stg->work);
+    }
+    pthread_mutex_unlock(&stg->lock);
+    return NULL;
+}
+
+extern struct staging* staging_new(size_t limit, staging_apply_fn apply, void* arg){
+    struct staging* stg;
+
+    stg = calloc(1, sizeof(*stg));
+    if(!stg)
+	return NULL;
+    stg->limit = limit;
+    stg->apply = apply;
+    stg->arg = arg;
+    pthread_mutex_init(&stg->lock, NULL);
+    pthread_cond_init(&stg->work, NULL);
+    pthread_cond_init(&stg->space, NULL);
+    pthread_cond_init(&stg->drained, NULL);
+    return stg;
+}
+
+extern int staging_start(struct staging* stg, unsigned int nworkers){
+    unsigned int i;
+    int res;
+
+    stg->threads = calloc(nworkers, sizeof(pthread_t));
+    if(!stg->threads)
+	return -ENOMEM;
+    for(i = 0; i < nworkers; i++){
+	res = pthread_create(&stg->threads[i], NULL, worker, stg);
+	if(res)
+	    break;
+	stg->nthreads++;
+    }
+    return stg->nthreads ? 0 : -res;
+}
+
+extern int staging_write(struct staging* stg, int fd, const char* path,
+			 const char* buf, size_t size, off_t offset){
+    struct stg_file* f;
+    struct stg_ext* e;
+    struct stat st;
+    int res;
+
+    if(fstat(fd, &st) == -1)
+	return -errno;
+    /* copy outside the lock */
+    e = malloc(sizeof(*e));
+    if(!e)
+	return -ENOMEM;
+    e->data = malloc(size ? size : 1);
+    if(!e->data){
+	free(e);
+	return -ENOMEM;
+    }
+    memcpy(e->data, buf, size);
+    e->off = offset;
+    e->len = size;
+    e->state = STG_QUEUED;
+    e->next = NULL;
+
+    pthread_mutex_lock(&stg->lock);
+    /* full: wait for the workers (a single write larger than the cap is
+       let through on its own) */
+    while(stg->bytes && stg->bytes + size > stg->limit)
+	pthread_cond_wait(&stg->space, &stg->lock);
+
+    f = find_file(stg, st.st_dev, st.st_ino);
+    if(f && f->err){
+	res = f->err;
+	f->err = 0;
+	retire(stg, f);
+	goto fail;
+    }
+    if(!f){
+	f = calloc(1, sizeof(*f));
+	if(!f){
+	    res = -ENOMEM;
+	    goto fail;
+	}
+	f->fd = dup(fd);
+	f->path = strdup(path);
+	if(f->fd == -1 || !f->path){
+	    res = f->fd == -1 ? -errno : -ENOMEM;
+	    if(f->fd != -1)
+		close(f->fd);
+	    free(f->path);
+	    free(f);
+	    goto fail;
+	}
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->next = stg->files;
+	stg->files = f;
+    }
+    if(f->tail)
+	f->tail->next = e;
+    else
+	f->head = e;
+    f->tail = e;
+    stg->bytes += size;
+    pthread_cond_signal(&stg->work);
+    pthread_mutex_unlock(&stg->lock);
+    return 0;
+
+ fail:
+    pthread_mutex_unlock(&stg->lock);
+    free(e->data);
+    free(e);
+    return res;
+}
+
+extern struct stg_file* staging_pin(struct staging* stg, int fd, uint64_t* end){
+    struct stg_file* f;
+    struct stg_ext* e;
+    struct stat st;
+
+    *end = 0;
+    if(fstat(fd, &st) == -1)
+	return NULL;
+    pthread_mutex_lock(&stg->lock);
+    f = find_file(stg, st.st_dev, st.st_ino);
+    if(f && !f->head)
+	f = NULL;
+    if(f){
+	f->pins++;
+	for(e = f->head; e; e = e->next)
+	    if((uint64_t)e->off + e->len > *end)
+		*end = e->off + e->len;
+    }
+    pthread_mutex_unlock(&stg->lock);
+    return f;
+}
+
+extern size_t staging_overlay(struct staging* stg, struct stg_file* f,
+			      char* buf, size_t size, off_t offset, size_t len){
+    struct stg_ext* e;
+    off_t from, to;
+    size_t newlen = len;
+
+    pthread_mutex_lock(&stg->lock);
+    /* staged writes past what the file has extend it; the gap is a hole */
+    for(e = f->head; e; e = e->next){
+	to = e->off + e->len;
+	if(to > offset + (off_t)size)
+	    to = offset + size;
+	if(e->len && to > offset && (size_t)(to - offset) > newlen)
+	    newlen = to - offset;
+    }
+    if(newlen > len)
+	memset(buf + len, 0, newlen - len);
+    /* oldest first, so later writes win */
+    for(e = f->head; e; e = e->next){
+	from = e->off > offset ? e->off : offset;
+	to = e->off + e->len;
+	if(to > offset + (off_t)size)
+	    to = offset + size;
+	if(from < to)
+	    memcpy(buf + (from - offset), e->data + (from - e->off), to - from);
+    }
+    pthread_mutex_unlock(&stg->lock);
+    return newlen;
+}
+
+extern void staging_unpin(struct staging* stg, struct stg_file* f){
+    pthread_mutex_lock(&stg->lock);
+    f->pins--;
+    retire(stg, f);
+    pthread_mutex_unlock(&stg->lock);
+}
+
+extern int staging_drain_fd(struct staging* stg, int fd){
+    struct stg_file* f;
+    struct stat st;
+    int res = 0;
+
+    if(fstat(fd, &st) == -1)
+	return -errno;
+    pthread_mutex_lock(&stg->lock);
+    while((f = find_file(stg, st.st_dev, st.st_ino))){
+	if(!f->head && !f->busy){
+	    res = f->err;
+	    f->err = 0;
+	    retire(stg, f);
+	    break;
+	}
+	pthread_cond_wait(&stg->drained, &stg->lock);
+    }
+    pthread_mutex_unlock(&stg->lock);
+    return res;
+}
+
+static int path_match(const char* fpath, const char* path, int subtree){
+    size_t len = strlen(path);
+
+    if(!strcmp(fpath, path))
+	return 1;
+    if(!subtree)
+	return 0;
+    /* "/" holds everything */
+    if(len && path[len - 1] == '/')
+	return !strncmp(fpath, path, len);
+    return !strncmp(fpath, path, len) && fpath[len] == '/';
+}
+
+extern int staging_drain_path(struct staging* stg, const char* path, int subtree){
+    struct stg_file *f, *next;
+    int res = 0;
+
+    pthread_mutex_lock(&stg->lock);
+ again:
+    for(f = stg->files; f; f = f->next)
+	if((f->head || f->busy) && path_match(f->path, path, subtree)){
+	    pthread_cond_wait(&stg->drained, &stg->lock);
+	    goto again;
+	}
+    /* collect (and forget) failures for those paths */
+    for(f = stg->files; f; f = next){
+	next = f->next;
+	if(path_match(f->path, path, subtree)){
+	    if(f->err && !res)
+		res = f->err;
+	    f->err = 0;
+	    retire(stg, f);
+	}
+    }
+    pthread_mutex_unlock(&stg->lock);
+    return res;
+}
+
+extern void staging_free(struct staging* stg){
+    struct stg_file *f;
+    struct stg_ext* e;
+    unsigned int i;
+
+    if(!stg)
+	return;
+    pthread_mutex_lock(&stg->lock);
+    /* without workers nothing staged can ever be applied */
+    if(stg->nthreads){
+	while(pick(stg) || stg->bytes)
+	    pthread_cond_wait(&stg->drained, &stg->lock);
+    }
+    stg->stop = 1;
+    pthread_cond_broadcast(&stg->work);
+    pthread_mutex_unlock(&stg->lock);
+    for(i = 0; i < stg->nthreads; i++)
+	pthread_join(stg->threads[i], NULL);
+
+    while((f = stg->files)){
+	stg->files = f->next;
+	while((e = f->head)){
+	    f->head = e->next;
+	    free(e->data);
+	    free(e);
+	}
+	close(f->fd);
+	free(f->path);
+	free(f);
+    }
+    free(stg->threads);
+    pthread_cond_destroy(&stg->work);
+    pthread_cond_destroy(&stg->space);
+    pthread_cond_destroy(&stg->drained);
+    pthread_mutex_destroy(&stg->lock);
+    free(stg);
+}
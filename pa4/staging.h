@@ -0,0 +1,108 @@
+/* staging.h
+ * Background encryption of staged writes for fusec
+ *
+ * In staging mode a write to an encrypted file only copies its data into
+ * memory and returns; a pool of worker threads later hands each staged
+ * write, in order, to an apply callback that encrypts it into the file.
+ * Reads overlay whatever is still staged on top of the file's contents,
+ * so staged data is visible right away. The total staged bytes are
+ * capped: writers wait for the workers once the cap is reached.
+ *
+ * Staged data is not in the journal yet, so like the kernel page cache it
+ * is lost in a crash until fsync (staging_drain_fd() then a journal sync)
+ * has been called on the file.
+ *
+ * Staged writes remember the path they came in through; anything that
+ * changes what a path names (rename, unlink) must drain it first.
+ *
+ */
+
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct staging;
+struct stg_file;
+
+/* Encrypts one staged write into the file; returns 0 or -errno */
+typedef int (*staging_apply_fn)(void* arg, int fd, const char* path,
+				const char* buf, size_t size, off_t offset);
+
+/* struct staging* staging_new(size_t limit, staging_apply_fn apply, void* arg)
+ * Purpose: Create an (idle) staging area
+ * Args: size_t limit           : Staged bytes at which writers wait
+ *       staging_apply_fn apply : Called by the workers for each staged write
+ *       void* arg              : Passed to apply
+ * Return: New staging area, NULL on error (errno set)
+ */
+extern struct staging* staging_new(size_t limit, staging_apply_fn apply, void* arg);
+
+/* int staging_start(struct staging* stg, unsigned int nworkers)
+ * Purpose: Start the worker threads
+ * Return: 0 on success, -errno on error
+ */
+extern int staging_start(struct staging* stg, unsigned int nworkers);
+
+/* int staging_write(struct staging* stg, int fd, const char* path,
+ *                   const char* buf, size_t size, off_t offset)
+ * Purpose: Stage a write to the file open on fd (waits while the staging
+ *          area is full)
+ * Args: struct staging* stg : Staging area
+ *       int fd              : Backing file, open for reading and writing
+ *       const char* path    : Mount path of the file
+ *       const char* buf, size_t size, off_t offset : The write
+ * Return: 0 on success, -errno on error (including an earlier write to the
+ *         file that failed in the background)
+ */
+extern int staging_write(struct staging* stg, int fd, const char* path,
+			 const char* buf, size_t size, off_t offset);
+
+/* struct stg_file* staging_pin(struct staging* stg, int fd, uint64_t* end)
+ * Purpose: Keep the staged writes of the file open on fd from being
+ *          retired while it is read. Must be paired with staging_unpin().
+ * Args: struct staging* stg : Staging area
+ *       int fd              : Backing file
+ *       uint64_t* end       : Output end of the last staged byte
+ * Return: Pinned file, NULL if nothing is staged for it
+ */
+extern struct stg_file* staging_pin(struct staging* stg, int fd, uint64_t* end);
+
+/* size_t staging_overlay(struct staging* stg, struct stg_file* f,
+ *                        char* buf, size_t size, off_t offset, size_t len)
+ * Purpose: Copy staged data over a read of the file's own contents
+ * Args: struct stg_file* f      : Pinned file
+ *       char* buf, size_t size  : Read buffer
+ *       off_t offset            : Read offset
+ *       size_t len              : Bytes the file itself provided
+ * Return: Bytes now valid in buf (staged data may extend the file)
+ */
+extern size_t staging_overlay(struct staging* stg, struct stg_file* f,
+			      char* buf, size_t size, off_t offset, size_t len);
+
+/* void staging_unpin(struct staging* stg, struct stg_file* f)
+ * Purpose: Release a file pinned by staging_pin()
+ */
+extern void staging_unpin(struct staging* stg, struct stg_file* f);
+
+/* int staging_drain_fd(struct staging* stg, int fd)
+ * Purpose: Wait until everything staged for the file open on fd is applied
+ * Return: 0, or -errno of a staged write that failed in the background
+ */
+extern int staging_drain_fd(struct staging* stg, int fd);
+
+/* int staging_drain_path(struct staging* stg, const char* path, int subtree)
+ * Purpose: Wait until nothing staged came in through path (or, with
+ *          subtree, through anything below it either)
+ * Return: 0, or -errno of a staged write that failed in the background
+ */
+extern int staging_drain_path(struct staging* stg, const char* path, int subtree);
+
+/* void staging_free(struct staging* stg)
+ * Purpose: Apply everything still staged, stop the workers, free the area
+ */
+extern void staging_free(struct staging* stg);
+
+#endif
@@ -0,0 +1,909 @@
+/* stripe.c
+ * Block format files striped across several backing directories for fusec
+ *
+ * See stripe.h for details
+ *
+ * Within any run of a file's blocks, the ones on one device are
+ * contiguous on that device (its units follow each other there), so a
+ * request is one pread or one journal extent per device: block images
+ * are gathered into a buffer per device before they go out, and
+ * scattered back into file order as they come in. Device 0 is done by
+ * the calling thread while the device threads do the others.
+ *
+ * Pending updates are kept by the write-back state like those of any
+ * block file, by file block; apply() writes them back, sorted, which
+ * turns them into runs per device again.
+ *
+ */
+
+#ifdef linux
+/* For syncfs() (through the journal) and O_CLOEXEC */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <openssl/rand.h>
+
+#include "stripe.h"
+#include "bblog.h"
+
+#define STRIPE_MANIFEST ".fusec-stripe"
+#define STRIPE_TAGFILE ".fusec-stripe-tag"
+#define STRIPE_OBJDIR ".fusec-stripe.d"
+#define STRIPE_MAGIC "FCSTRIP1"
+#define STRIPE_MAGICLEN 8
+#define STRIPE_TAGLEN 16
+/* object names: STRIPE_IDLEN random bytes in hex */
+#define STRIPE_IDLEN 16
+#define STRIPE_HEXLEN (2 * STRIPE_IDLEN)
+#define STRIPE_MANLEN(n) (STRIPE_MAGICLEN + 8 + ((n) - 1) * STRIPE_TAGLEN)
+
+#define STRIPE_READ 0
+#define STRIPE_APPLY 1
+
+struct stripe_batch {
+    unsigned int pending;
+};
+
+struct stripe_task {
+    int op;
+    int fd;			/* -1: no object yet, reads as holes */
+    unsigned char* buf;
+    size_t len;
+    off_t off;
+    const struct journal_txn* txn;
+    int res;
+    struct stripe_batch* batch;
+    struct stripe_task* next;
+};
+
+struct stripe_dev {
+    int objfd;			/* <dir>/.fusec-stripe.d */
+    char* objpath;		/* its absolute path, for the journal */
+    struct stripe_task* head;
+    struct stripe_task* tail;
+    pthread_cond_t work;
+    pthread_t thread;
+    int running;
+};
+
+struct stripe {
+    int rootfd;
+    struct journal* j;
+    const struct encblk_keys* keys;
+    struct wb_format format;	/* for writeback_commit() */
+    uint64_t unit;		/* blocks per unit */
+    unsigned int ndev;		/* backing root included */
+    struct stripe_dev dev[STRIPE_MAXDEV];	/* [0] unused */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int stop;
+};
+
+/* A device thread and its stripe */
+struct stripe_arg {
+    struct stripe* st;
+    unsigned int d;
+};
+
+/* Where a request's blocks are on each device */
+struct stripe_span {
+    uint64_t lo;		/* first local block */
+    size_t n;			/* blocks */
+    unsigned char* buf;		/* their images, in local order */
+    int fd;
+};
+
+static void put32(unsigned char* p, uint32_t v){
+    memcpy(p, &v, 4);
+}
+
+static uint32_t get32(const unsigned char* p){
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void locate(const struct stripe* st, uint64_t b, unsigned int* d, uint64_t* local){
+    uint64_t u = b / st->unit;
+
+    *d = u % st->ndev;
+    *local = (u / st->ndev) * st->unit + b % st->unit;
+}
+
+static off_t dev_off(unsigned int d, uint64_t local){
+    return (d ? 0 : ENCBLK_HDRLEN) + (off_t)local * ENCBLK_DISK;
+}
+
+/* How many of a file's first nblk blocks device d holds */
+static uint64_t dev_blocks(const struct stripe* st, uint64_t nblk, unsigned int d){
+    uint64_t full = nblk / st->unit;
+    uint64_t n = (full / st->ndev) * st->unit;
+
+    if(d < full % st->ndev)
+	n += st->unit;
+    else if(d == full % st->ndev)
+	n += nblk % st->unit;
+    return n;
+}
+
+static uint64_t nblocks(uint64_t size){
+    return (size + ENCBLK_SIZE - 1) / ENCBLK_SIZE;
+}
+
+/* Which parts of blocks first.. (n of them) each device holds */
+static void spans(const struct stripe* st, uint64_t first, size_t n, struct stripe_span* sp){
+    uint64_t local;
+    unsigned int d;
+    size_t i;
+
+    memset(sp, 0, st->ndev * sizeof(*sp));
+    for(i = 0; i < n; i++){
+	locate(st, first + i, &d, &local);
+	if(!sp[d].n)
+	    sp[d].lo = local;
+	sp[d].n++;
+    }
+}
+
+static int get_id(int fd, char hex[STRIPE_HEXLEN + 1]){
+    ssize_t len = fgetxattr(fd, STRIPE_XATTR, hex, STRIPE_HEXLEN);
+
+    if(len == -1)
+	return errno == ENODATA ? -EIO : -errno;
+    if(len != STRIPE_HEXLEN)
+	return -EIO;
+    hex[STRIPE_HEXLEN] = '\0';
+    return 0;
+}
+
+/* Open a file's object on device d, for writing too with rw; -1 (not an
+ * error) if there is none and create is 0. A new object's name is synced
+ * before anything is journaled for it, or replay could find it missing. */
+static int open_obj(struct stripe* st, unsigned int d, const char* hex, int rw, int create){
+    int fd;
+
+    if(create){
+	fd = openat(st->dev[d].objfd, hex, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(fd >= 0){
+	    if(fsync(st->dev[d].objfd) == -1){
+		close(fd);
+		return -errno;
+	    }
+	    return fd;
+	}
+	if(errno != EEXIST)
+	    return -errno;
+    }
+    fd = openat(st->dev[d].objfd, hex, (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if(fd == -1)
+	return errno == ENOENT && !create ? -1 : -errno;
+    return fd;
+}
+
+static int pread_full(int fd, unsigned char* buf, size_t len, off_t off){
+    ssize_t n;
+    size_t done = 0;
+
+    while(fd >= 0 && done < len){
+	n = pread(fd, buf + done, len - done, off + done);
+	if(n == -1 && errno == EINTR)
+	    continue;
+	if(n == -1)
+	    return -errno;
+	if(n == 0)
+	    break;
+	done += n;
+    }
+    memset(buf + done, 0, len - done);
+    return 0;
+}
+
+static void run_task(struct stripe_task* t){
+    if(t->op == STRIPE_READ)
+	t->res = pread_full(t->fd, t->buf, t->len, t->off);
+    else
+	t->res = journal_apply(t->fd, t->txn);
+}
+
+static void* dev_thread(void* arg){
+    struct stripe_arg* a = arg;
+    struct stripe* st = a->st;
+    struct stripe_dev* dev = &st->dev[a->d];
+    struct stripe_task* t;
+
+    free(a);
+    pthread_mutex_lock(&st->lock);
+    for(;;){
+	while(!dev->head && !st->stop)
+	    pthread_cond_wait(&dev->work, &st->lock);
+	if(!dev->head)
+	    break;
+	t = dev->head;
+	dev->head = t->next;
+	if(!dev->head)
+	    dev->tail = NULL;
+	pthread_mutex_unlock(&st->lock);
+
+	run_task(t);
+
+	pthread_mutex_lock(&st->lock);
+	if(!--t->batch->pending)
+	    pthread_cond_broadcast(&st->done);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/* Run task[d] for every device d that has one (op >= 0), in parallel
+ * where there are device threads; the first error wins */
+static int run_tasks(struct stripe* st, struct stripe_task* task){
+    struct stripe_batch batch = { 0 };
+    unsigned int d;
+    int res = 0;
+
+    pthread_mutex_lock(&st->lock);
+    for(d = 1; d < st->ndev; d++){
+	if(task[d].op < 0 || !st->dev[d].running)
+	    continue;
+	task[d].batch = &batch;
+	task[d].next = NULL;
+	if(st->dev[d].tail)
+	    st->dev[d].tail->next = &task[d];
+	else
+	    st->dev[d].head = &task[d];
+	st->dev[d].tail = &task[d];
+	batch.pending++;
+	pthread_cond_signal(&st->dev[d].work);
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    for(d = 0; d < st->ndev; d++)
+	if(task[d].op >= 0 && (d == 0 || !st->dev[d].running))
+	    run_task(&task[d]);
+
+    pthread_mutex_lock(&st->lock);
+    while(batch.pending)
+	pthread_cond_wait(&st->done, &st->lock);
+    pthread_mutex_unlock(&st->lock);
+
+    for(d = 0; d < st->ndev; d++)
+	if(task[d].op >= 0 && task[d].res < 0 && res == 0)
+	    res = task[d].res;
+    return res;
+}
+
+static void free_spans(const struct stripe* st, struct stripe_span* sp){
+    unsigned int d;
+
+    for(d = 0; d < st->ndev; d++){
+	free(sp[d].buf);
+	if(d && sp[d].fd >= 0)
+	    close(sp[d].fd);
+	sp[d].fd = -1;
+    }
+}
+
+/* Read the images of n blocks from first on into disk, in file order */
+static int read_images(struct stripe* st, int fd, const char* hex, uint64_t first, size_t n,
+		       unsigned char* disk){
+    struct stripe_span sp[STRIPE_MAXDEV];
+    struct stripe_task task[STRIPE_MAXDEV];
+    uint64_t local;
+    unsigned int d;
+    size_t i;
+    int res = 0;
+
+    spans(st, first, n, sp);
+    for(d = 0; d < st->ndev; d++){
+	task[d].op = -1;
+	sp[d].fd = -1;
+    }
+    for(d = 0; d < st->ndev; d++){
+	if(!sp[d].n)
+	    continue;
+	sp[d].buf = malloc(sp[d].n * ENCBLK_DISK);
+	if(!sp[d].buf){
+	    res = -ENOMEM;
+	    goto out;
+	}
+	sp[d].fd = d ? open_obj(st, d, hex, 0, 0) : fd;
+	if(sp[d].fd < -1){
+	    res = sp[d].fd;
+	    goto out;
+	}
+	task[d].op = STRIPE_READ;
+	task[d].fd = sp[d].fd;
+	task[d].buf = sp[d].buf;
+	task[d].len = sp[d].n * ENCBLK_DISK;
+	task[d].off = dev_off(d, sp[d].lo);
+    }
+    res = run_tasks(st, task);
+    if(res < 0)
+	goto out;
+    for(i = 0; i < n; i++){
+	locate(st, first + i, &d, &local);
+	memcpy(disk + i * ENCBLK_DISK, sp[d].buf + (local - sp[d].lo) * ENCBLK_DISK,
+	       ENCBLK_DISK);
+    }
+
+ out:
+    free_spans(st, sp);
+    return res;
+}
+
+/* encblk overlay serving the blocks a partial write or truncate keeps:
+ * pending ones first, then the devices */
+struct stripe_edge {
+    struct stripe* st;
+    int fd;
+    const char* hex;
+    const struct encblk_overlay* ov;
+};
+
+static int edge_lookup(void* arg, uint64_t idx, unsigned char* disk){
+    struct stripe_edge* e = arg;
+
+    if(e->ov && e->ov->lookup(e->ov->arg, idx, disk))
+	return 1;
+    if(read_images(e->st, e->fd, e->hex, idx, 1, disk) < 0)
+	memset(disk, 0, ENCBLK_DISK);
+    return 1;
+}
+
+/* Log an update and keep it pending: new header hdr, the n block images
+ * from first on, and with trunc every device cut to its share of
+ * hdr->size */
+static int commit(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+		  const char* path, const char* hex, const struct encblk_hdr* hdr,
+		  uint64_t first, size_t n, const unsigned char* disk, int trunc){
+    struct stripe_span sp[STRIPE_MAXDEV];
+    struct journal_txn txn[STRIPE_MAXDEV];
+    struct journal_ext ext[STRIPE_MAXDEV][2];
+    char objpath[STRIPE_MAXDEV][PATH_MAX];
+    unsigned char hbuf[ENCBLK_HDRLEN];
+    uint64_t local, newblk = nblocks(hdr->size), seq;
+    struct stat fst;
+    unsigned int d, ntxn = 0;
+    size_t i;
+    int ofd, res = 0;
+
+    /* a file whose names are gone is not replayed (writeback_forget()) */
+    if(fstat(fd, &fst) == -1)
+	return -errno;
+    spans(st, first, n, sp);
+    for(d = 0; d < st->ndev; d++)
+	sp[d].fd = -1;
+    for(d = 0; d < st->ndev; d++){
+	if(!sp[d].n)
+	    continue;
+	sp[d].buf = malloc(sp[d].n * ENCBLK_DISK);
+	if(!sp[d].buf){
+	    res = -ENOMEM;
+	    goto out;
+	}
+    }
+    for(i = 0; i < n; i++){
+	locate(st, first + i, &d, &local);
+	memcpy(sp[d].buf + (local - sp[d].lo) * ENCBLK_DISK, disk + i * ENCBLK_DISK,
+	       ENCBLK_DISK);
+    }
+    encblk_hdr_encode(hdr, hbuf);
+
+    /* the other devices first: replay never finds a header whose size
+       covers blocks that were not logged */
+    for(d = st->ndev; d-- > 0; ){
+	if(!sp[d].n && !trunc && d)
+	    continue;
+	if(d){
+	    ofd = open_obj(st, d, hex, 1, sp[d].n > 0);
+	    if(ofd < -1){
+		res = ofd;
+		goto out;
+	    }
+	    /* nothing there to cut */
+	    if(ofd == -1)
+		continue;
+	    close(ofd);
+	    snprintf(objpath[d], sizeof(objpath[d]), "%s/%s", st->dev[d].objpath, hex);
+	    txn[ntxn].path = objpath[d];
+	    txn[ntxn].ino = 0;
+	}
+	else{
+	    while(*path == '/')
+		path++;
+	    txn[ntxn].path = fst.st_nlink ? path : "";
+	    txn[ntxn].ino = fst.st_nlink ? fst.st_ino : 0;
+	}
+	txn[ntxn].next = 0;
+	if(sp[d].n){
+	    ext[d][0].off = dev_off(d, sp[d].lo);
+	    ext[d][0].len = sp[d].n * ENCBLK_DISK;
+	    ext[d][0].data = sp[d].buf;
+	    txn[ntxn].next++;
+	}
+	if(d == 0){
+	    ext[d][txn[ntxn].next].off = 0;
+	    ext[d][txn[ntxn].next].len = ENCBLK_HDRLEN;
+	    ext[d][txn[ntxn].next].data = hbuf;
+	    txn[ntxn].next++;
+	}
+	txn[ntxn].ext = ext[d];
+	txn[ntxn].disklen = trunc ? dev_off(d, dev_blocks(st, newblk, d)) : -1;
+	txn[ntxn].xattr_name = NULL;
+	txn[ntxn].xattr_value = NULL;
+	ntxn++;
+    }
+    res = writeback_commit(wb, f, fd, &st->format, txn, ntxn, hdr, first, n, disk, &seq);
+
+ out:
+    free_spans(st, sp);
+    return res;
+}
+
+/* wb_format apply: write a file's pending state back to the devices, the
+ * same end state as applying its records one by one. Blocks of a device
+ * whose object is gone (stripe_forget()) are dropped. */
+static int apply(void* arg, int fd, const struct encblk_hdr* hdr, uint64_t cut,
+		 const struct wb_unit* blk, size_t n){
+    struct stripe* st = arg;
+    struct stripe_task task[STRIPE_MAXDEV];
+    struct journal_txn txn[STRIPE_MAXDEV];
+    struct journal_ext *ext, *x[STRIPE_MAXDEV], *e;
+    char hex[STRIPE_HEXLEN + 1];
+    unsigned char hbuf[ENCBLK_HDRLEN];
+    unsigned char* buf;
+    size_t cnt[STRIPE_MAXDEV] = { 0 }, base[STRIPE_MAXDEV], done[STRIPE_MAXDEV] = { 0 };
+    uint64_t local, newblk = nblocks(hdr->size);
+    off_t cutlen;
+    struct stat ost;
+    unsigned int d;
+    size_t i, k;
+    int res;
+
+    res = get_id(fd, hex);
+    if(res < 0)
+	return res;
+    for(d = 0; d < st->ndev; d++){
+	task[d].op = -1;
+	task[d].fd = -1;
+    }
+    for(i = 0; i < n; i++){
+	locate(st, blk[i].idx, &d, &local);
+	cnt[d]++;
+    }
+    buf = malloc(n * ENCBLK_DISK + 1);
+    ext = malloc((n + 1) * sizeof(*ext));
+    if(!buf || !ext){
+	res = -ENOMEM;
+	goto out;
+    }
+    /* device 0's extents leave room for the header after them */
+    for(d = 0, k = 0; d < st->ndev; d++){
+	base[d] = k;
+	k += cnt[d];
+	x[d] = ext + base[d] + (d > 0);
+	txn[d].path = "";
+	txn[d].ino = 0;
+	txn[d].ext = x[d];
+	txn[d].next = 0;
+	txn[d].disklen = cut != WB_NOCUT ? dev_off(d, dev_blocks(st, newblk, d)) : -1;
+	txn[d].xattr_name = NULL;
+	txn[d].xattr_value = NULL;
+    }
+    /* each device's blocks in local order, merged into runs */
+    for(i = 0; i < n; i++){
+	locate(st, blk[i].idx, &d, &local);
+	k = base[d] + done[d]++;
+	memcpy(buf + k * ENCBLK_DISK, blk[i].img, ENCBLK_DISK);
+	e = txn[d].next ? &x[d][txn[d].next - 1] : NULL;
+	if(e && (off_t)(e->off + e->len) == dev_off(d, local))
+	    e->len += ENCBLK_DISK;
+	else{
+	    e = &x[d][txn[d].next++];
+	    e->off = dev_off(d, local);
+	    e->len = ENCBLK_DISK;
+	    e->data = buf + k * ENCBLK_DISK;
+	}
+    }
+    encblk_hdr_encode(hdr, hbuf);
+    e = &x[0][txn[0].next++];
+    e->off = 0;
+    e->len = ENCBLK_HDRLEN;
+    e->data = hbuf;
+
+    for(d = 0; d < st->ndev; d++){
+	if(!txn[d].next && cut == WB_NOCUT)
+	    continue;
+	task[d].fd = d ? open_obj(st, d, hex, 1, 0) : fd;
+	if(task[d].fd < -1){
+	    res = task[d].fd;
+	    goto out;
+	}
+	if(task[d].fd == -1)
+	    continue;
+	/* blocks past a truncation that were not written again are holes */
+	if(cut != WB_NOCUT){
+	    cutlen = dev_off(d, dev_blocks(st, cut, d));
+	    if(fstat(task[d].fd, &ost) == -1){
+		res = -errno;
+		goto out;
+	    }
+	    if(ost.st_size > cutlen && ftruncate(task[d].fd, cutlen) == -1){
+		res = -errno;
+		goto out;
+	    }
+	}
+	task[d].op = STRIPE_APPLY;
+	task[d].txn = &txn[d];
+    }
+    res = run_tasks(st, task);
+
+ out:
+    for(d = 1; d < st->ndev; d++)
+	if(task[d].fd >= 0)
+	    close(task[d].fd);
+    free(ext);
+    free(buf);
+    return res;
+}
+
+ssize_t stripe_read(struct stripe* st, int fd, const struct encblk_overlay* ov,
+		    const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset){
+    char hex[STRIPE_HEXLEN + 1];
+    unsigned char* disk;
+    uint64_t first, last, i;
+    ssize_t res;
+
+    if(offset < 0)
+	return -EINVAL;
+    if((uint64_t)offset >= hdr->size || size == 0)
+	return 0;
+    if(size > hdr->size - offset)
+	size = hdr->size - offset;
+    res = get_id(fd, hex);
+    if(res < 0)
+	return res;
+
+    first = offset / ENCBLK_SIZE;
+    last = (offset + size - 1) / ENCBLK_SIZE;
+    disk = malloc((last - first + 1) * ENCBLK_DISK);
+    if(!disk)
+	return -ENOMEM;
+    res = read_images(st, fd, hex, first, last - first + 1, disk);
+    /* pending images replace what the devices have */
+    for(i = first; res == 0 && ov && i <= last; i++)
+	ov->lookup(ov->arg, i, disk + (i - first) * ENCBLK_DISK);
+    if(res == 0)
+	res = encblk_decrypt(st->keys, hdr, disk, buf, size, offset);
+    free(disk);
+    return res;
+}
+
+int stripe_build_write(struct stripe* st, int fd, const struct encblk_overlay* ov,
+		       struct encblk_hdr* hdr, const char* buf, size_t size, off_t offset,
+		       struct encblk_run* run){
+    char hex[STRIPE_HEXLEN + 1];
+    struct stripe_edge e = { st, fd, hex, ov };
+    struct encblk_overlay eov = { edge_lookup, &e };
+    int res;
+
+    run->len = 0;
+    run->data = NULL;
+    res = get_id(fd, hex);
+    if(res < 0)
+	return res;
+    return encblk_build_write(fd, &eov, st->keys, hdr, buf, size, offset, run);
+}
+
+int stripe_commit_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+			const char* path, const struct encblk_hdr* hdr,
+			const struct encblk_run* run){
+    char hex[STRIPE_HEXLEN + 1];
+    int res;
+
+    if(!run->len)
+	return 0;
+    res = get_id(fd, hex);
+    if(res < 0)
+	return res;
+    return commit(st, wb, f, fd, path, hex, hdr, (run->off - ENCBLK_HDRLEN) / ENCBLK_DISK,
+		  run->len / ENCBLK_DISK, run->data, 0);
+}
+
+int stripe_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+		 const char* path, const char* buf, size_t size, off_t offset){
+    struct encblk_hdr hdr;
+    struct encblk_run run;
+    int res;
+
+    res = writeback_hdr(f, fd, &hdr);
+    if(res == 0)
+	res = stripe_build_write(st, fd, writeback_overlay(f), &hdr, buf, size, offset, &run);
+    if(res < 0)
+	return res;
+    res = stripe_commit_write(st, wb, f, fd, path, &hdr, &run);
+    free(run.data);
+    return res;
+}
+
+int stripe_truncate(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+		    const char* path, uint64_t size){
+    char hex[STRIPE_HEXLEN + 1];
+    struct stripe_edge e = { st, fd, hex, writeback_overlay(f) };
+    struct encblk_overlay ov = { edge_lookup, &e };
+    struct encblk_hdr hdr;
+    struct encblk_run run;
+    int res;
+
+    res = writeback_hdr(f, fd, &hdr);
+    if(res == 0)
+	res = get_id(fd, hex);
+    if(res == 0)
+	res = encblk_build_truncate(fd, &ov, st->keys, &hdr, size, &run);
+    if(res < 0)
+	return res;
+    res = commit(st, wb, f, fd, path, hex, &hdr,
+		 run.len ? (run.off - ENCBLK_HDRLEN) / ENCBLK_DISK : 0,
+		 run.len / ENCBLK_DISK, run.data, 1);
+    free(run.data);
+    return res;
+}
+
+int stripe_init_file(struct stripe* st, int fd){
+    unsigned char id[STRIPE_IDLEN];
+    char hex[STRIPE_HEXLEN + 1];
+    int i;
+
+    (void) st;
+    if(RAND_bytes(id, sizeof(id)) != 1)
+	return -EIO;
+    for(i = 0; i < STRIPE_IDLEN; i++)
+	sprintf(hex + 2 * i, "%02x", id[i]);
+    if(fsetxattr(fd, STRIPE_XATTR, hex, STRIPE_HEXLEN, 0) == -1)
+	return -errno;
+    return 0;
+}
+
+void stripe_forget(struct stripe* st, int fd){
+    char hex[STRIPE_HEXLEN + 1];
+    unsigned int d;
+
+    if(get_id(fd, hex) < 0)
+	return;
+    for(d = 1; d < st->ndev; d++)
+	if(unlinkat(st->dev[d].objfd, hex, 0) == -1 && errno != ENOENT)
+	    bblog(BBLOG_WARN, "stripe: removing %s/%s: %s",
+		  st->dev[d].objpath, hex, strerror(errno));
+}
+
+static int write_file(int dirfd, const char* name, const unsigned char* buf, size_t len){
+    int fd, res = 0;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd == -1)
+	return -errno;
+    if(write(fd, buf, len) != (ssize_t)len)
+	res = -EIO;
+    if(res == 0 && fsync(fd) == -1)
+	res = -errno;
+    close(fd);
+    if(res < 0)
+	unlinkat(dirfd, name, 0);
+    else if(fsync(dirfd) == -1)
+	res = -errno;
+    return res;
+}
+
+static int read_file(int dirfd, const char* name, unsigned char* buf, size_t len){
+    ssize_t n;
+    int fd;
+
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+	return -errno;
+    n = pread(fd, buf, len, 0);
+    close(fd);
+    if(n == -1)
+	return -errno;
+    return n == (ssize_t)len ? 0 : -EIO;
+}
+
+/* Open the extra devices named in dirs; a new layout gets tags */
+static int open_devs(struct stripe* st, const char* dirs, unsigned char* man, int create){
+    char path[PATH_MAX], abspath[PATH_MAX];
+    unsigned char tag[STRIPE_TAGLEN];
+    const char *p, *end;
+    unsigned int d = 1;
+    size_t len;
+    int dirfd, res;
+
+    for(p = dirs; *p; p = *end ? end + 1 : end, d++){
+	end = strchr(p, ':');
+	if(!end)
+	    end = p + strlen(p);
+	len = end - p;
+	if(!len || len >= sizeof(path) || d >= STRIPE_MAXDEV)
+	    return -EINVAL;
+	if(!create && d >= st->ndev)
+	    return -ENODEV;
+	memcpy(path, p, len);
+	path[len] = '\0';
+	if(!realpath(path, abspath))
+	    return -errno;
+	dirfd = open(abspath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirfd == -1)
+	    return -errno;
+	if(create){
+	    if(RAND_bytes(tag, sizeof(tag)) != 1)
+		res = -EIO;
+	    else
+		res = write_file(dirfd, STRIPE_TAGFILE, tag, sizeof(tag));
+	    if(res == 0 && mkdirat(dirfd, STRIPE_OBJDIR, 0700) == -1 && errno != EEXIST)
+		res = -errno;
+	    if(res == 0 && fsync(dirfd) == -1)
+		res = -errno;
+	    memcpy(man + STRIPE_MAGICLEN + 8 + (d - 1) * STRIPE_TAGLEN, tag, sizeof(tag));
+	}
+	else{
+	    res = read_file(dirfd, STRIPE_TAGFILE, tag, sizeof(tag));
+	    if(res == -ENOENT ||
+	       (res == 0 && memcmp(tag, man + STRIPE_MAGICLEN + 8 + (d - 1) * STRIPE_TAGLEN,
+				   STRIPE_TAGLEN)))
+		res = -ENODEV;
+	}
+	if(res == 0){
+	    st->dev[d].objfd = openat(dirfd, STRIPE_OBJDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	    if(st->dev[d].objfd == -1)
+		res = -errno;
+	}
+	close(dirfd);
+	if(res < 0)
+	    return res;
+	if(snprintf(path, sizeof(path), "%s/%s", abspath, STRIPE_OBJDIR) >= (int)sizeof(path))
+	    return -ENAMETOOLONG;
+	st->dev[d].objpath = strdup(path);
+	if(!st->dev[d].objpath)
+	    return -ENOMEM;
+	pthread_cond_init(&st->dev[d].work, NULL);
+	res = journal_add_fs(st->j, st->dev[d].objfd);
+	if(res < 0)
+	    return res;
+	if(create)
+	    st->ndev = d + 1;
+    }
+    if(d != st->ndev)
+	return -ENODEV;
+    return 0;
+}
+
+struct stripe* stripe_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+			   const char* dirs, unsigned int unit_kb){
+    unsigned char man[STRIPE_MANLEN(STRIPE_MAXDEV)];
+    struct stripe* st;
+    unsigned int d;
+    int res, create = 0;
+
+    st = calloc(1, sizeof(*st));
+    if(!st)
+	return NULL;
+    st->rootfd = rootfd;
+    st->j = j;
+    st->keys = keys;
+    st->format.unit = ENCBLK_DISK;
+    st->format.apply = apply;
+    st->format.arg = st;
+    for(d = 0; d < STRIPE_MAXDEV; d++)
+	st->dev[d].objfd = -1;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->done, NULL);
+
+    res = read_file(rootfd, STRIPE_MANIFEST, man, STRIPE_MANLEN(1));
+    if(res == -ENOENT && dirs){
+	if(!unit_kb || unit_kb % (ENCBLK_SIZE / 1024)){
+	    res = -EINVAL;
+	    goto fail;
+	}
+	create = 1;
+	st->unit = unit_kb / (ENCBLK_SIZE / 1024);
+	st->ndev = 1;
+	memcpy(man, STRIPE_MAGIC, STRIPE_MAGICLEN);
+	res = 0;
+    }
+    else if(res == 0){
+	st->unit = get32(man + STRIPE_MAGICLEN);
+	st->ndev = get32(man + STRIPE_MAGICLEN + 4);
+	if(memcmp(man, STRIPE_MAGIC, STRIPE_MAGICLEN) || !st->unit ||
+	   st->ndev < 2 || st->ndev > STRIPE_MAXDEV)
+	    res = -EIO;
+	else
+	    res = read_file(rootfd, STRIPE_MANIFEST, man, STRIPE_MANLEN(st->ndev));
+	if(res == 0 && !dirs)
+	    res = -ENODEV;
+	if(res == 0 && unit_kb && unit_kb != st->unit * (ENCBLK_SIZE / 1024))
+	    bblog(BBLOG_WARN, "stripe: keeping the layout's %llu KB units",
+		  (unsigned long long)st->unit * (ENCBLK_SIZE / 1024));
+    }
+    if(res < 0)
+	goto fail;
+
+    res = open_devs(st, dirs, man, create);
+    if(res < 0)
+	goto fail;
+    if(create){
+	if(st->ndev < 2){
+	    res = -EINVAL;
+	    goto fail;
+	}
+	put32(man + STRIPE_MAGICLEN, st->unit);
+	put32(man + STRIPE_MAGICLEN + 4, st->ndev);
+	res = write_file(rootfd, STRIPE_MANIFEST, man, STRIPE_MANLEN(st->ndev));
+	if(res < 0)
+	    goto fail;
+	bblog(BBLOG_INFO, "stripe: new layout, %u devices, %llu KB units", st->ndev,
+	      (unsigned long long)st->unit * (ENCBLK_SIZE / 1024));
+    }
+    return st;
+
+ fail:
+    stripe_close(st);
+    errno = -res;
+    return NULL;
+}
+
+int stripe_start(struct stripe* st){
+    struct stripe_arg* a;
+    unsigned int d;
+    int res;
+
+    for(d = 1; d < st->ndev; d++){
+	a = malloc(sizeof(*a));
+	if(!a)
+	    return -ENOMEM;
+	a->st = st;
+	a->d = d;
+	res = pthread_create(&st->dev[d].thread, NULL, dev_thread, a);
+	if(res){
+	    free(a);
+	    return -res;
+	}
+	st->dev[d].running = 1;
+    }
+    return 0;
+}
+
+void stripe_close(struct stripe* st){
+    unsigned int d;
+
+    if(!st)
+	return;
+    pthread_mutex_lock(&st->lock);
+    st->stop = 1;
+    for(d = 1; d < STRIPE_MAXDEV; d++)
+	if(st->dev[d].running)
+	    pthread_cond_signal(&st->dev[d].work);
+    pthread_mutex_unlock(&st->lock);
+    for(d = 1; d < STRIPE_MAXDEV; d++){
+	if(st->dev[d].running)
+	    pthread_join(st->dev[d].thread, NULL);
+	if(st->dev[d].objpath)
+	    pthread_cond_destroy(&st->dev[d].work);
+	if(st->dev[d].objfd >= 0)
+	    close(st->dev[d].objfd);
+	free(st->dev[d].objpath);
+    }
+    pthread_cond_destroy(&st->done);
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
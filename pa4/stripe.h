@@ -0,0 +1,171 @@
+/* stripe.h
+ * Block format files striped across several backing directories for fusec
+ *
+ * A mount with one backing root can't be faster than that root's disk.
+ * Striped files spread their blocks over the root and up to
+ * STRIPE_MAXDEV - 1 extra directories, ideally each on a disk of its
+ * own, in units of a fixed number of blocks: unit u of a file lives on
+ * device u % N (device 0 being the backing root), and each device holds
+ * its units of a file back to back. The blocks a request touches on
+ * different devices are read and written in parallel, one thread per
+ * extra device.
+ *
+ * On device 0 a striped file is an ordinary backing file with the usual
+ * encblk header followed by device 0's blocks, so names, attributes and
+ * xattrs work as for any other file. Its blocks on the other devices are
+ * in <dir>/.fusec-stripe.d/<id>, where id is a random name recorded in
+ * the file's STRIPE_XATTR; an object is only created once the file has
+ * a block on that device.
+ *
+ * The layout is fixed when striping is set up, in the root's
+ * .fusec-stripe manifest: "FCSTRIP1", the unit size, the number of
+ * devices and a random tag per extra device, which is also kept in the
+ * device's .fusec-stripe-tag. Later mounts have to name the same
+ * directories in the same order; the tags catch a mix-up.
+ *
+ * Updates go through the journal (objects are named by absolute path, so
+ * the directories must stay where they are) and are kept pending by the
+ * write-back state like block file updates, then written to every device
+ * at once. Checkpoints sync every device.
+ *
+ */
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encblk.h"
+#include "journal.h"
+#include "writeback.h"
+
+/* xattr holding a striped file's object name */
+#define STRIPE_XATTR "user.pa4-encfs.stripe"
+/* most devices, the backing root included */
+#define STRIPE_MAXDEV 16
+
+struct stripe;
+
+/* struct stripe* stripe_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+ *                            const char* dirs, unsigned int unit_kb)
+ * Purpose: Open (or set up) the stripe devices. Call before
+ *          journal_replay(), whose checkpoint has to sync them too.
+ * Args: int rootfd                    : Backing root directory fd (device 0)
+ *       struct journal* j             : Journal updates are logged in
+ *       const struct encblk_keys* keys : Block keys
+ *       const char* dirs              : The other devices, "DIR:DIR:...",
+ *                                       or NULL
+ *       unsigned int unit_kb          : Stripe unit for a new layout, KB (a
+ *                                       multiple of 4); an existing layout
+ *                                       keeps its own
+ * Return: Stripes on success, NULL on error (errno set; ENOENT if the root
+ *         has no layout and dirs is NULL, ENODEV if dirs doesn't match the
+ *         layout)
+ */
+extern struct stripe* stripe_open(int rootfd, struct journal* j, const struct encblk_keys* keys,
+				  const char* dirs, unsigned int unit_kb);
+
+/* int stripe_start(struct stripe* st)
+ * Purpose: Start the device threads. Without them every device is
+ *          served by the calling thread, one after the other.
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_start(struct stripe* st);
+
+/* int stripe_init_file(struct stripe* st, int fd)
+ * Purpose: Give a new, empty file its object name (before it is flagged
+ *          as striped)
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_init_file(struct stripe* st, int fd);
+
+/* ssize_t stripe_read(struct stripe* st, int fd, const struct encblk_overlay* ov,
+ *                     const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset)
+ * Purpose: Read a plaintext range of a striped file. The caller holds it
+ *          locked with writeback_read_lock() for the range.
+ * Args: struct stripe* st              : Stripes
+ *       int fd                        : The file on device 0
+ *       const struct encblk_overlay* ov : Its pending blocks
+ *                                       (writeback_overlay()), or NULL
+ *       const struct encblk_hdr* hdr  : Its header (writeback_hdr())
+ *       char* buf, size_t size        : Output buffer
+ *       off_t offset                  : Plaintext offset
+ * Return: Number of bytes read (short at EOF), -errno on error
+ */
+extern ssize_t stripe_read(struct stripe* st, int fd, const struct encblk_overlay* ov,
+			   const struct encblk_hdr* hdr, char* buf, size_t size, off_t offset);
+
+/* int stripe_build_write(struct stripe* st, int fd, const struct encblk_overlay* ov,
+ *                        struct encblk_hdr* hdr, const char* buf, size_t size,
+ *                        off_t offset, struct encblk_run* run)
+ * Purpose: Encrypt the blocks a write to a striped file touches, without
+ *          logging them (encblk_build_write() for striped files)
+ * Args: struct stripe* st              : Stripes
+ *       int fd                        : The file on device 0
+ *       const struct encblk_overlay* ov : Its pending blocks
+ *                                       (writeback_overlay()), or NULL
+ *       struct encblk_hdr* hdr        : Its header (writeback_hdr()); size
+ *                                       is updated for the write
+ *       const char* buf, size_t size, off_t offset : The write
+ *       struct encblk_run* run        : Output run of block images in file
+ *                                       order (free run->data)
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_build_write(struct stripe* st, int fd, const struct encblk_overlay* ov,
+			      struct encblk_hdr* hdr, const char* buf, size_t size, off_t offset,
+			      struct encblk_run* run);
+
+/* int stripe_commit_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+ *                         const char* path, const struct encblk_hdr* hdr,
+ *                         const struct encblk_run* run)
+ * Purpose: Log a write built by stripe_build_write() over the file's
+ *          current state and keep it pending (writeback_commit())
+ * Args: struct wb_file* f      : The file, locked for writing with writeback_lock()
+ *       const struct encblk_hdr* hdr, const struct encblk_run* run : The
+ *                                built write
+ *       (others as for stripe_write())
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_commit_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+			       const char* path, const struct encblk_hdr* hdr,
+			       const struct encblk_run* run);
+
+/* int stripe_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+ *                  const char* path, const char* buf, size_t size, off_t offset)
+ * Purpose: Write to a striped file; the update is logged and kept pending
+ *          (writeback_commit())
+ * Args: struct stripe* st     : Stripes
+ *       struct writeback* wb  : Write-back state
+ *       struct wb_file* f     : The file, locked for writing with writeback_lock()
+ *       int fd                : The file on device 0, open for reading and writing
+ *       const char* path      : Its path relative to the backing root
+ *       const char* buf, size_t size, off_t offset : The write
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_write(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+			const char* path, const char* buf, size_t size, off_t offset);
+
+/* int stripe_truncate(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+ *                     const char* path, uint64_t size)
+ * Purpose: Truncate a striped file (locked as for stripe_write())
+ * Return: 0 on success, -errno on error
+ */
+extern int stripe_truncate(struct stripe* st, struct writeback* wb, struct wb_file* f, int fd,
+			   const char* path, uint64_t size);
+
+/* void stripe_forget(struct stripe* st, int fd)
+ * Purpose: Remove the objects of a striped file whose last link is being
+ *          removed. The caller holds it locked for writing (writeback_lock()).
+ */
+extern void stripe_forget(struct stripe* st, int fd);
+
+/* void stripe_close(struct stripe* st)
+ * Purpose: Stop the device threads and free the stripes. Call once the
+ *          write-back state, which writes pending updates back through
+ *          them, is freed.
+ */
+extern void stripe_close(struct stripe* st);
+
+#endif
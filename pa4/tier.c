@@ -0,0 +1,443 @@
+/* tier.c
+ * Copies of hot files on a fast device for fusec
+ *
+ * See tier.h for details
+ *
+ * The slots are under the tier mutex. A copy is reference counted: its
+ * slot holds one reference and every read in progress another, so
+ * dropping a copy never waits for readers; the last one closes it.
+ * Copies are made by the migrator alone, without the mutex.
+ *
+ */
+
+#ifdef linux
+/* For O_TMPFILE, pread() and the *at() calls */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bblog.h"
+#include "tier.h"
+
+#define TIER_SLOTS 4096
+#define TIER_ROUND_MS 1000
+/* most copies made per round */
+#define TIER_BATCH 8
+#define TIER_HEAT_MAX 1000000
+#define TIER_COPYBUF (256 * 1024)
+
+struct tier_copy {
+    int fd;
+    unsigned int refs;
+};
+
+struct tier_ent {
+    dev_t dev;
+    ino_t ino;			/* 0: free */
+    char* path;			/* last read as, relative to the root */
+    unsigned int heat;
+    uint64_t gen;		/* new on every tier_changed() */
+    struct tier_copy* copy;
+    /* the backing file as copied */
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+struct tier_cand {
+    dev_t dev;
+    ino_t ino;
+    char* path;
+    unsigned int heat;
+    uint64_t gen;
+};
+
+struct tier {
+    int rootfd;
+    int fastfd;
+    struct writeback* wb;
+    uint64_t budget;		/* bytes */
+    uint64_t used;
+    unsigned int hot;
+    uint64_t gen;		/* last generation handed out */
+    unsigned long tmpseq;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    struct tier_ent* ent;
+};
+
+static struct tier_ent* slot(struct tier* t, dev_t dev, ino_t ino){
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+    h *= 0xff51afd7ed558ccdULL;
+    return &t->ent[(h >> 32) % TIER_SLOTS];
+}
+
+static int same_file(const struct tier_ent* e, dev_t dev, ino_t ino){
+    return e->ino && e->ino == ino && e->dev == dev;
+}
+
+static int unchanged(const struct tier_ent* e, const struct stat* st){
+    return e->size == st->st_size &&
+	e->mtime.tv_sec == st->st_mtim.tv_sec &&
+	e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	e->ctime.tv_sec == st->st_ctim.tv_sec &&
+	e->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static void copy_put(struct tier_copy* c){
+    if(--c->refs)
+	return;
+    close(c->fd);
+    free(c);
+}
+
+/* Caller holds the mutex */
+static void drop(struct tier* t, struct tier_ent* e){
+    if(!e->copy)
+	return;
+    copy_put(e->copy);
+    e->copy = NULL;
+    t->used -= e->size;
+}
+
+static void forget(struct tier* t, struct tier_ent* e){
+    drop(t, e);
+    free(e->path);
+    memset(e, 0, sizeof(*e));
+}
+
+struct tier* tier_open(int rootfd, struct writeback* wb, const char* dir,
+		       unsigned int mb, unsigned int hot){
+    struct tier* t;
+
+    if(!dir || !mb || !hot){
+	errno = EINVAL;
+	return NULL;
+    }
+    t = calloc(1, sizeof(*t));
+    if(!t)
+	return NULL;
+    t->ent = calloc(TIER_SLOTS, sizeof(*t->ent));
+    if(!t->ent){
+	free(t);
+	return NULL;
+    }
+    t->fastfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(t->fastfd == -1){
+	free(t->ent);
+	free(t);
+	return NULL;
+    }
+    t->rootfd = rootfd;
+    t->wb = wb;
+    t->budget = (uint64_t)mb << 20;
+    t->hot = hot;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    return t;
+}
+
+int tier_get(struct tier* t, const struct stat* st, const char* path,
+	     struct tier_copy** c){
+    struct tier_ent* e;
+    char* p;
+    int fd = -1;
+
+    *c = NULL;
+    while(*path == '/')
+	path++;
+    pthread_mutex_lock(&t->lock);
+    e = slot(t, st->st_dev, st->st_ino);
+    if(!same_file(e, st->st_dev, st->st_ino)){
+	/* a copy still in use keeps its slot */
+	if(e->ino && e->copy && e->heat){
+	    pthread_mutex_unlock(&t->lock);
+	    return -1;
+	}
+	forget(t, e);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->gen = ++t->gen;
+    }
+    if(e->heat < TIER_HEAT_MAX)
+	e->heat++;
+    if(!e->path || strcmp(e->path, path)){
+	p = strdup(path);
+	if(p){
+	    free(e->path);
+	    e->path = p;
+	}
+    }
+    if(e->copy && !unchanged(e, st)){
+	bblog(BBLOG_DEBUG, "tier: %s changed behind the mount's back", path);
+	drop(t, e);
+    }
+    if(e->copy){
+	e->copy->refs++;
+	*c = e->copy;
+	fd = e->copy->fd;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return fd;
+}
+
+void tier_put(struct tier* t, struct tier_copy* c){
+    pthread_mutex_lock(&t->lock);
+    copy_put(c);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void tier_changed(struct tier* t, const struct stat* st){
+    struct tier_ent* e;
+
+    pthread_mutex_lock(&t->lock);
+    e = slot(t, st->st_dev, st->st_ino);
+    if(same_file(e, st->st_dev, st->st_ino)){
+	e->gen = ++t->gen;
+	drop(t, e);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* An unnamed file on the fast tier */
+static int make_tmp(struct tier* t){
+    char name[64];
+    int fd;
+
+#ifdef O_TMPFILE
+    fd = openat(t->fastfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+	return fd;
+#endif
+    snprintf(name, sizeof(name), ".fusec-tier-%ld-%lu", (long)getpid(), t->tmpseq++);
+    fd = openat(t->fastfd, name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if(fd >= 0)
+	unlinkat(t->fastfd, name, 0);
+    return fd;
+}
+
+static int copy_data(int in, int out, off_t size){
+    char* buf;
+    ssize_t n;
+    off_t off = 0;
+    int res = 0;
+
+    buf = malloc(TIER_COPYBUF);
+    if(!buf)
+	return -ENOMEM;
+    while(off < size){
+	n = pread(in, buf, TIER_COPYBUF, off);
+	if(n == -1 && errno == EINTR)
+	    continue;
+	if(n <= 0){
+	    res = n ? -errno : -EIO;
+	    break;
+	}
+	if(pwrite(out, buf, n, off) != n){
+	    res = -EIO;
+	    break;
+	}
+	off += n;
+    }
+    free(buf);
+    return res;
+}
+
+/* Make room for size bytes, dropping copies colder than heat. Caller
+   holds the mutex. */
+static int make_room(struct tier* t, uint64_t size, unsigned int heat){
+    struct tier_ent* cold;
+    unsigned int i;
+
+    while(t->used + size > t->budget){
+	cold = NULL;
+	for(i = 0; i < TIER_SLOTS; i++)
+	    if(t->ent[i].copy && t->ent[i].heat < heat &&
+	       (!cold || t->ent[i].heat < cold->heat))
+		cold = &t->ent[i];
+	if(!cold)
+	    return 0;
+	drop(t, cold);
+    }
+    return 1;
+}
+
+/* Copy a candidate to the fast tier */
+static void promote(struct tier* t, const struct tier_cand* cand){
+    struct tier_copy* c;
+    struct tier_ent* e;
+    struct wb_file f;
+    struct stat st, st2;
+    int fd, out, res, pending;
+
+    fd = openat(t->rootfd, cand->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1)
+	return;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+       st.st_dev != cand->dev || st.st_ino != cand->ino ||
+       (uint64_t)st.st_size > t->budget){
+	close(fd);
+	return;
+    }
+    /* the backing file has to be what readers see; pending updates
+       are written back soon, then it's the next round's turn */
+    if(writeback_lock(t->wb, fd, 0, &f) < 0){
+	close(fd);
+	return;
+    }
+    pending = writeback_overlay(&f) != NULL;
+    writeback_unlock(t->wb, &f);
+    if(pending){
+	close(fd);
+	return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    res = make_room(t, st.st_size, cand->heat);
+    if(res)
+	t->used += st.st_size;
+    pthread_mutex_unlock(&t->lock);
+    if(!res){
+	close(fd);
+	return;
+    }
+
+    out = make_tmp(t);
+    res = out == -1 ? -errno : copy_data(fd, out, st.st_size);
+    if(res == 0 && fstat(fd, &st2) == -1)
+	res = -errno;
+    close(fd);
+    c = res == 0 ? malloc(sizeof(*c)) : NULL;
+
+    pthread_mutex_lock(&t->lock);
+    e = slot(t, cand->dev, cand->ino);
+    if(c && same_file(e, cand->dev, cand->ino) && e->gen == cand->gen && !e->copy &&
+       st2.st_size == st.st_size &&
+       st2.st_mtim.tv_sec == st.st_mtim.tv_sec && st2.st_mtim.tv_nsec == st.st_mtim.tv_nsec &&
+       st2.st_ctim.tv_sec == st.st_ctim.tv_sec && st2.st_ctim.tv_nsec == st.st_ctim.tv_nsec){
+	c->fd = out;
+	c->refs = 1;
+	e->copy = c;
+	e->size = st.st_size;
+	e->mtime = st.st_mtim;
+	e->ctime = st.st_ctim;
+	c = NULL;
+	out = -1;
+	bblog(BBLOG_DEBUG, "tier: copied %s (%lld bytes)", cand->path,
+	      (long long)st.st_size);
+    }
+    else
+	t->used -= st.st_size;
+    pthread_mutex_unlock(&t->lock);
+    if(res < 0)
+	bblog(BBLOG_WARN, "tier: copying %s: %s", cand->path, strerror(-res));
+    free(c);
+    if(out != -1)
+	close(out);
+}
+
+static void* migrator(void* arg){
+    struct tier* t = arg;
+    struct tier_cand cand[TIER_BATCH];
+    struct tier_ent* e;
+    struct timespec ts;
+    unsigned int i, j, n;
+
+    pthread_mutex_lock(&t->lock);
+    while(!t->stop){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += TIER_ROUND_MS / 1000;
+	ts.tv_nsec += (long)(TIER_ROUND_MS % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+	if(t->stop)
+	    break;
+	/* the hottest files without a copy, then everything cools down;
+	   a copy nobody reads any more is dropped */
+	n = 0;
+	for(i = 0; i < TIER_SLOTS; i++){
+	    e = &t->ent[i];
+	    if(!e->ino)
+		continue;
+	    if(!e->copy && e->path && e->heat >= t->hot){
+		/* a full batch gives up a colder one */
+		j = n;
+		if(n == TIER_BATCH)
+		    for(j = 0; j < n && cand[j].heat >= e->heat; j++)
+			;
+		if(j < n)
+		    free(cand[j].path);
+		else if(j < TIER_BATCH)
+		    n++;
+		if(j < TIER_BATCH){
+		    cand[j].dev = e->dev;
+		    cand[j].ino = e->ino;
+		    cand[j].path = strdup(e->path);
+		    cand[j].heat = e->heat;
+		    cand[j].gen = e->gen;
+		}
+	    }
+	    e->heat /= 2;
+	    if(e->copy && !e->heat)
+		drop(t, e);
+	    else if(!e->copy && !e->heat)
+		forget(t, e);
+	}
+	pthread_mutex_unlock(&t->lock);
+	for(i = 0; i < n; i++){
+	    if(cand[i].path)
+		promote(t, &cand[i]);
+	    free(cand[i].path);
+	}
+	pthread_mutex_lock(&t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int tier_start(struct tier* t){
+    int res;
+
+    res = pthread_create(&t->thread, NULL, migrator, t);
+    if(res)
+	return -res;
+    t->running = 1;
+    return 0;
+}
+
+void tier_close(struct tier* t){
+    unsigned int i;
+
+    if(!t)
+	return;
+    if(t->running){
+	pthread_mutex_lock(&t->lock);
+	t->stop = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+    }
+    for(i = 0; i < TIER_SLOTS; i++)
+	forget(t, &t->ent[i]);
+    close(t->fastfd);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t->ent);
+    free(t);
+}
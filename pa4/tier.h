@@ -0,0 +1,87 @@
+/* tier.h
+ * Copies of hot files on a fast device for fusec
+ *
+ * The backing root is the capacity tier: it always holds every file, and
+ * it is what the journal protects. A second directory on a fast device
+ * (tmpfs, NVMe) holds copies of the block format files that are read the
+ * most, byte for byte, which their reads are then served from. Nothing
+ * there has to be written back or recovered: a copy is dropped instead of
+ * updated, and is unlinked as soon as it is made, so its space goes back
+ * to the fast device when it is dropped, at unmount or at a crash.
+ *
+ * Every read adds to its file's heat, which a background migrator halves
+ * once a round. A file whose heat reaches the threshold is copied to the
+ * fast tier, making room by dropping colder copies if the tier is full;
+ * a copy whose file is no longer read goes cold and is dropped.
+ *
+ * A copy is only made of a file without pending block updates, and
+ * dropped by tier_changed() before the next one is logged, so with the
+ * pending blocks overlaid it always reads as the backing file would. A
+ * change made behind the mount's back is caught by the file's size,
+ * mtime and ctime.
+ *
+ * Files are tracked in a fixed number of slots indexed by inode; a
+ * collision forgets the colder one.
+ *
+ */
+
+#ifndef TIER_H
+#define TIER_H
+
+#include <sys/stat.h>
+
+#include "writeback.h"
+
+struct tier;
+struct tier_copy;
+
+/* struct tier* tier_open(int rootfd, struct writeback* wb, const char* dir,
+ *                        unsigned int mb, unsigned int hot)
+ * Purpose: Set up a fast tier in dir
+ * Args: int rootfd          : Backing root directory fd
+ *       struct writeback* wb : Write-back state of the mount
+ *       const char* dir      : Fast tier directory
+ *       unsigned int mb      : Most MB of copies kept there
+ *       unsigned int hot     : Heat at which a file is copied
+ * Return: New tier on success, NULL on error (errno set)
+ */
+extern struct tier* tier_open(int rootfd, struct writeback* wb, const char* dir,
+			      unsigned int mb, unsigned int hot);
+
+/* int tier_start(struct tier* t)
+ * Purpose: Start the migrator thread. Without it nothing is copied.
+ * Return: 0 on success, -errno on error
+ */
+extern int tier_start(struct tier* t);
+
+/* int tier_get(struct tier* t, const struct stat* st, const char* path,
+ *              struct tier_copy** c)
+ * Purpose: Note a read of the backing file st, and find its copy. Call
+ *          with the file locked by writeback_lock().
+ * Args: struct tier* t        : Tier
+ *       const struct stat* st : The backing file's current stat
+ *       const char* path      : Its path relative to the backing root
+ *       struct tier_copy** c  : Set to the copy to release with tier_put()
+ * Return: An fd to read the file's blocks from instead, or -1 if it has
+ *         no copy
+ */
+extern int tier_get(struct tier* t, const struct stat* st, const char* path,
+		    struct tier_copy** c);
+
+/* void tier_put(struct tier* t, struct tier_copy* c)
+ * Purpose: Release a copy returned by tier_get()
+ */
+extern void tier_put(struct tier* t, struct tier_copy* c);
+
+/* void tier_changed(struct tier* t, const struct stat* st)
+ * Purpose: Drop the copy of the backing file st, whose blocks are about to
+ *          change
+ */
+extern void tier_changed(struct tier* t, const struct stat* st);
+
+/* void tier_close(struct tier* t)
+ * Purpose: Stop the migrator and drop every copy
+ */
+extern void tier_close(struct tier* t);
+
+#endif
@@ -0,0 +1,916 @@
+/* writeback.c
+ * Deferred write-back of journaled block updates for fusec
+ *
+ * See writeback.h for details
+ *
+ * Pending state of a file (struct wb_dirty) is the newest image of every
+ * block written since the last write-back (unit bytes each: a whole
+ * encrypted block, or a dedup map entry), its newest header, and the
+ * lowest block count it was truncated to meanwhile (blocks from there on
+ * that were not written again read as holes). Writing it back truncates to
+ * that point, writes the images and header, then sets the final length;
+ * the same end state replaying its journal records one by one would give.
+ * A format with an apply hook (striped files) gets the same state handed
+ * over, its blocks sorted, and does all of that itself.
+ *
+ * A write-back runs without the stripe lock once the stripe is drained
+ * (draining set, previous epoch's readers gone): updates wait for it to
+ * end, so nothing changes the pending state it is writing, and readers
+ * arriving meanwhile find that state and take their blocks from it.
+ *
+ */
+
+#ifdef linux
+/* For pwrite() and PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP */
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "bblog.h"
+#include "writeback.h"
+
+#define WB_LOCKS 64
+#define WB_BUCKETS 64
+
+struct wb_blk {
+    uint64_t idx;
+    struct wb_blk* next;
+    unsigned char img[];	/* unit bytes */
+};
+
+struct wb_dirty {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    struct wb_format fmt;
+    struct encblk_hdr hdr;
+    uint64_t seq;		/* journal record of the newest update */
+    uint64_t cut;		/* lowest block count truncated to, or WB_NOCUT */
+    char* xattr_name;
+    char* xattr_value;
+    int written;		/* written back, to be freed */
+    size_t nblk;
+    struct wb_blk* blk[WB_BUCKETS];
+    struct wb_dirty* next;
+};
+
+struct writeback {
+    struct journal* j;
+    size_t limit;
+    /* updates hold it shared, a checkpoint exclusively */
+    pthread_rwlock_t gate;
+    pthread_mutex_t locks[WB_LOCKS];
+    struct wb_dirty* dirty[WB_LOCKS];
+    /* readers of each stripe, by epoch parity; a write-back waits on
+       drained for the previous epoch's, and updates for it to end */
+    unsigned int readers[WB_LOCKS][2];
+    unsigned int epoch[WB_LOCKS];
+    /* updates installed on each stripe (writeback_stamp()) */
+    unsigned long updates[WB_LOCKS];
+    int draining[WB_LOCKS];
+    struct wb_file* excluding[WB_LOCKS];	/* its readers wait too */
+    pthread_cond_t drained[WB_LOCKS];
+    /* bytes of pending block images */
+    pthread_mutex_t acct;
+    size_t bytes;
+    /* flusher thread */
+    pthread_mutex_t tlock;
+    pthread_cond_t tcond;
+    pthread_t thread;
+    unsigned int interval_ms;
+    int running;
+    int stop;
+    /* bumped when a file lost its last name: a writer that looked at its
+       file before takes another look */
+    unsigned long unlinks;
+};
+
+static unsigned int stripe(dev_t dev, ino_t ino){
+    return (unsigned int)(((unsigned long)dev ^ (unsigned long)ino) % WB_LOCKS);
+}
+
+static void account(struct writeback* wb, long delta){
+    pthread_mutex_lock(&wb->acct);
+    wb->bytes += delta;
+    pthread_mutex_unlock(&wb->acct);
+}
+
+static struct wb_blk* find_blk(struct wb_dirty* d, uint64_t idx){
+    struct wb_blk* b;
+
+    for(b = d->blk[idx % WB_BUCKETS]; b; b = b->next)
+	if(b->idx == idx)
+	    return b;
+    return NULL;
+}
+
+static struct wb_dirty* find_dirty(struct writeback* wb, dev_t dev, ino_t ino){
+    struct wb_dirty* d;
+
+    for(d = wb->dirty[stripe(dev, ino)]; d; d = d->next)
+	if(d->dev == dev && d->ino == ino)
+	    return d;
+    return NULL;
+}
+
+/* encblk_overlay lookup over a file's pending state */
+static int overlay_lookup(void* arg, uint64_t idx, unsigned char* disk){
+    struct wb_dirty* d = arg;
+    struct wb_blk* b;
+
+    if(!d)
+	return 0;
+    b = find_blk(d, idx);
+    if(b){
+	memcpy(disk, b->img, d->fmt.unit);
+	return 1;
+    }
+    if(idx >= d->cut){
+	memset(disk, 0, d->fmt.unit);
+	return 1;
+    }
+    return 0;
+}
+
+/* A reader's copy of the pending state of its range */
+struct wb_snap {
+    struct encblk_hdr hdr;
+    size_t unit;
+    uint64_t cut;
+    uint64_t first;
+    size_t n;
+    unsigned char** img;	/* n, NULL if not pending */
+};
+
+static int snap_lookup(void* arg, uint64_t idx, unsigned char* disk){
+    struct wb_snap* s = arg;
+
+    if(idx >= s->first && idx - s->first < s->n && s->img[idx - s->first]){
+	memcpy(disk, s->img[idx - s->first], s->unit);
+	return 1;
+    }
+    if(idx >= s->cut){
+	memset(disk, 0, s->unit);
+	return 1;
+    }
+    return 0;
+}
+
+static struct wb_snap* take_snap(struct wb_dirty* d, uint64_t first, size_t n){
+    struct wb_snap* s;
+    unsigned char* p;
+    size_t i, k = 0;
+
+    for(i = 0; i < n; i++)
+	if(find_blk(d, first + i))
+	    k++;
+    s = malloc(sizeof(*s) + n * sizeof(*s->img) + k * d->fmt.unit);
+    if(!s)
+	return NULL;
+    s->hdr = d->hdr;
+    s->unit = d->fmt.unit;
+    s->cut = d->cut;
+    s->first = first;
+    s->n = n;
+    s->img = (unsigned char**)(s + 1);
+    p = (unsigned char*)(s->img + n);
+    for(i = 0; i < n; i++){
+	struct wb_blk* b = find_blk(d, first + i);
+
+	s->img[i] = NULL;
+	if(b){
+	    memcpy(p, b->img, d->fmt.unit);
+	    s->img[i] = p;
+	    p += d->fmt.unit;
+	}
+    }
+    return s;
+}
+
+/* Wait until the readers of stripe i from before now are done, and keep
+   updates out until drain_end(). Caller holds the stripe lock, which is
+   let go while waiting. */
+static void drain_begin(struct writeback* wb, unsigned int i){
+    unsigned int old;
+
+    while(wb->draining[i])
+	pthread_cond_wait(&wb->drained[i], &wb->locks[i]);
+    wb->draining[i] = 1;
+    old = wb->epoch[i]++ & 1;
+    while(wb->readers[i][old])
+	pthread_cond_wait(&wb->drained[i], &wb->locks[i]);
+}
+
+static void drain_end(struct writeback* wb, unsigned int i){
+    wb->draining[i] = 0;
+    pthread_cond_broadcast(&wb->drained[i]);
+}
+
+/* Forget blocks at or past nblocks (truncated away) */
+static void drop_blocks(struct writeback* wb, struct wb_dirty* d, uint64_t nblocks){
+    struct wb_blk **pp, *b;
+    unsigned int i;
+
+    for(i = 0; i < WB_BUCKETS && d->nblk; i++){
+	pp = &d->blk[i];
+	while((b = *pp)){
+	    if(b->idx >= nblocks){
+		*pp = b->next;
+		free(b);
+		d->nblk--;
+		account(wb, -(long)d->fmt.unit);
+	    }
+	    else
+		pp = &b->next;
+	}
+    }
+}
+
+static void free_dirty(struct writeback* wb, struct wb_dirty* d){
+    drop_blocks(wb, d, 0);
+    free(d->xattr_name);
+    free(d->xattr_value);
+    close(d->fd);
+    free(d);
+}
+
+static void unlink_dirty(struct writeback* wb, struct wb_dirty* d){
+    struct wb_dirty** pp = &wb->dirty[stripe(d->dev, d->ino)];
+
+    while(*pp != d)
+	pp = &(*pp)->next;
+    *pp = d->next;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, off_t off){
+    ssize_t res;
+
+    while(len){
+	res = pwrite(fd, buf, len, off);
+	if(res < 0){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	buf = (const char*)buf + res;
+	len -= res;
+	off += res;
+    }
+    return 0;
+}
+
+/* On-disk length of a file with nblocks blocks */
+static off_t disklen(const struct wb_dirty* d, uint64_t nblocks){
+    return ENCBLK_HDRLEN + (off_t)nblocks * d->fmt.unit;
+}
+
+static int unit_cmp(const void* a, const void* b){
+    const struct wb_unit *x = a, *y = b;
+
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* Hand a file's pending state to its format's apply hook */
+static int apply_hook(struct wb_dirty* d){
+    struct wb_unit* u;
+    struct wb_blk* b;
+    unsigned int i;
+    size_t n = 0;
+    int res;
+
+    u = malloc(d->nblk * sizeof(*u) + 1);
+    if(!u)
+	return -ENOMEM;
+    for(i = 0; i < WB_BUCKETS; i++)
+	for(b = d->blk[i]; b; b = b->next){
+	    u[n].idx = b->idx;
+	    u[n].img = b->img;
+	    n++;
+	}
+    qsort(u, n, sizeof(*u), unit_cmp);
+    res = d->fmt.apply(d->fmt.arg, d->fd, &d->hdr, d->cut, u, n);
+    free(u);
+    return res;
+}
+
+/* Write a file's blocks and header back in place */
+static int apply_blocks(struct wb_dirty* d){
+    unsigned char hbuf[ENCBLK_HDRLEN];
+    struct wb_blk* b;
+    struct stat st;
+    off_t cutlen;
+    unsigned int i;
+    int res;
+
+    if(d->cut != WB_NOCUT){
+	cutlen = disklen(d, d->cut);
+	if(fstat(d->fd, &st) == -1)
+	    return -errno;
+	if(st.st_size > cutlen && ftruncate(d->fd, cutlen) == -1)
+	    return -errno;
+    }
+    for(i = 0; i < WB_BUCKETS; i++)
+	for(b = d->blk[i]; b; b = b->next){
+	    res = pwrite_all(d->fd, b->img, d->fmt.unit, disklen(d, b->idx));
+	    if(res < 0)
+		return res;
+	}
+    encblk_hdr_encode(&d->hdr, hbuf);
+    res = pwrite_all(d->fd, hbuf, ENCBLK_HDRLEN, 0);
+    if(res < 0)
+	return res;
+    if(ftruncate(d->fd, disklen(d, (d->hdr.size + ENCBLK_SIZE - 1) / ENCBLK_SIZE)) == -1)
+	return -errno;
+    return 0;
+}
+
+/* Write a file's pending state back. Its journal records must be durable
+   already. */
+static int apply_dirty(struct wb_dirty* d){
+    int res;
+
+    res = d->fmt.apply ? apply_hook(d) : apply_blocks(d);
+    if(res < 0)
+	return res;
+    if(d->xattr_name &&
+       fsetxattr(d->fd, d->xattr_name, d->xattr_value, strlen(d->xattr_value), 0) == -1)
+	return -errno;
+    return 0;
+}
+
+extern struct writeback* writeback_new(struct journal* j, size_t limit){
+    struct writeback* wb;
+    pthread_rwlockattr_t attr;
+    unsigned int i;
+
+    wb = calloc(1, sizeof(*wb));
+    if(!wb)
+	return NULL;
+    wb->j = j;
+    wb->limit = limit;
+    /* a checkpoint must not wait forever behind a stream of writers */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&wb->gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    for(i = 0; i < WB_LOCKS; i++){
+	pthread_mutex_init(&wb->locks[i], NULL);
+	pthread_cond_init(&wb->drained[i], NULL);
+    }
+    pthread_mutex_init(&wb->acct, NULL);
+    pthread_mutex_init(&wb->tlock, NULL);
+    pthread_cond_init(&wb->tcond, NULL);
+    return wb;
+}
+
+static void* flusher(void* arg){
+    struct writeback* wb = arg;
+    struct timespec ts;
+    int res;
+
+    pthread_mutex_lock(&wb->tlock);
+    while(!wb->stop){
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += wb->interval_ms / 1000;
+	ts.tv_nsec += (long)(wb->interval_ms % 1000) * 1000000;
+	if(ts.tv_nsec >= 1000000000){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&wb->tcond, &wb->tlock, &ts);
+	if(wb->stop)
+	    break;
+	pthread_mutex_unlock(&wb->tlock);
+	res = writeback_flush(wb);
+	if(res < 0)
+	    bblog(BBLOG_ERR, "writeback: flush failed: %s", strerror(-res));
+	if(journal_full(wb->j)){
+	    res = writeback_quiesce(wb);
+	    if(res < 0)
+		bblog(BBLOG_ERR, "writeback: checkpoint failed: %s", strerror(-res));
+	    writeback_resume(wb);
+	}
+	pthread_mutex_lock(&wb->tlock);
+    }
+    pthread_mutex_unlock(&wb->tlock);
+    return NULL;
+}
+
+extern int writeback_start(struct writeback* wb, unsigned int interval_ms){
+    int res;
+
+    wb->interval_ms = interval_ms ? interval_ms : 1;
+    res = pthread_create(&wb->thread, NULL, flusher, wb);
+    if(res)
+	return -res;
+    wb->running = 1;
+    return 0;
+}
+
+extern int writeback_lock(struct writeback* wb, int fd, int forwrite, struct wb_file* f){
+    unsigned long unlinks = __atomic_load_n(&wb->unlinks, __ATOMIC_ACQUIRE);
+    struct stat st;
+    unsigned int i;
+
+    if(fstat(fd, &st) == -1)
+	return -errno;
+    f->gated = 0;
+    f->gone = 0;
+    f->forgetting = 0;
+    if(forwrite){
+	if(journal_full(wb->j)){
+	    writeback_quiesce(wb);
+	    writeback_resume(wb);
+	}
+	pthread_rwlock_rdlock(&wb->gate);
+	f->gated = 1;
+    }
+    i = stripe(st.st_dev, st.st_ino);
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->snap = NULL;
+    f->reader = 0;
+    f->excl = 0;
+    f->lock = &wb->locks[i];
+    pthread_mutex_lock(f->lock);
+    if(forwrite){
+	while(wb->draining[i])
+	    pthread_cond_wait(&wb->drained[i], f->lock);
+	/* names are removed under this lock */
+	if(__atomic_load_n(&wb->unlinks, __ATOMIC_ACQUIRE) != unlinks && fstat(fd, &st) == -1)
+	    st.st_nlink = 0;
+	f->gone = st.st_nlink == 0;
+    }
+    else{
+	while(wb->excluding[i] && wb->excluding[i]->dev == st.st_dev &&
+	      wb->excluding[i]->ino == st.st_ino)
+	    pthread_cond_wait(&wb->drained[i], f->lock);
+	f->reader = 1 + (wb->epoch[i] & 1);
+	wb->readers[i][f->reader - 1]++;
+    }
+    /* after the waits, which let go of the lock */
+    f->stamp = wb->updates[i];
+    f->dirty = find_dirty(wb, st.st_dev, st.st_ino);
+    f->ov.lookup = overlay_lookup;
+    f->ov.arg = f->dirty;
+    if(!forwrite && !f->dirty){
+	pthread_mutex_unlock(f->lock);
+	f->lock = NULL;
+    }
+    return 0;
+}
+
+extern int writeback_read_lock(struct writeback* wb, int fd, off_t offset, size_t size,
+			       struct wb_file* f){
+    uint64_t first;
+    int res;
+
+    res = writeback_lock(wb, fd, 0, f);
+    if(res < 0 || !f->dirty)
+	return res;
+    /* an empty range still needs the header */
+    first = offset > 0 ? (uint64_t)offset / ENCBLK_SIZE : 0;
+    f->snap = take_snap(f->dirty, first,
+			size ? ((uint64_t)offset + size - 1) / ENCBLK_SIZE - first + 1 : 0);
+    if(!f->snap){
+	writeback_unlock(wb, f);
+	return -ENOMEM;
+    }
+    f->ov.lookup = snap_lookup;
+    f->ov.arg = f->snap;
+    f->dirty = NULL;
+    pthread_mutex_unlock(f->lock);
+    f->lock = NULL;
+    return 0;
+}
+
+extern void writeback_exclude(struct writeback* wb, struct wb_file* f){
+    unsigned int i = stripe(f->dev, f->ino);
+
+    wb->excluding[i] = f;
+    drain_begin(wb, i);
+    f->excl = 1;
+}
+
+extern void writeback_unlock(struct writeback* wb, struct wb_file* f){
+    unsigned int i = stripe(f->dev, f->ino);
+    size_t bytes;
+
+    if(f->excl){
+	wb->excluding[i] = NULL;
+	drain_end(wb, i);
+	f->excl = 0;
+    }
+    if(f->forgetting){
+	__atomic_add_fetch(&wb->unlinks, 1, __ATOMIC_RELEASE);
+	f->forgetting = 0;
+    }
+    if(f->reader){
+	if(!f->lock)
+	    pthread_mutex_lock(&wb->locks[i]);
+	if(!--wb->readers[i][f->reader - 1] && wb->draining[i])
+	    pthread_cond_broadcast(&wb->drained[i]);
+	if(!f->lock)
+	    pthread_mutex_unlock(&wb->locks[i]);
+	f->reader = 0;
+    }
+    free(f->snap);
+    f->snap = NULL;
+    if(f->lock)
+	pthread_mutex_unlock(f->lock);
+    if(f->gated)
+	pthread_rwlock_unlock(&wb->gate);
+    f->lock = NULL;
+    f->gated = 0;
+
+    pthread_mutex_lock(&wb->acct);
+    bytes = wb->bytes;
+    pthread_mutex_unlock(&wb->acct);
+    if(bytes > wb->limit)
+	writeback_flush(wb);
+}
+
+extern unsigned long writeback_stamp(struct wb_file* f){
+    return f->stamp;
+}
+
+extern int writeback_hdr(struct wb_file* f, int fd, struct encblk_hdr* hdr){
+    if(f->snap){
+	*hdr = f->snap->hdr;
+	return 0;
+    }
+    if(f->dirty){
+	*hdr = f->dirty->hdr;
+	return 0;
+    }
+    return encblk_read_hdr(fd, hdr);
+}
+
+extern const struct encblk_overlay* writeback_overlay(struct wb_file* f){
+    return f->dirty || f->snap ? &f->ov : NULL;
+}
+
+extern uint64_t writeback_gen(struct wb_file* f){
+    return f->dirty ? f->dirty->seq : 0;
+}
+
+/* Give up on what prepare() got */
+static void unprepare(struct wb_dirty* d, int fresh, struct wb_blk** slot, size_t n){
+    size_t i;
+
+    if(slot){
+	for(i = 0; i < n; i++)
+	    if(slot[i] && slot[i]->idx == WB_NOCUT)
+		free(slot[i]);
+	free(slot);
+    }
+    if(fresh){
+	close(d->fd);
+	free(d);
+    }
+}
+
+/* Get what an update of n blocks from first on needs before it is logged,
+ * so that nothing can fail once it is: the file's pending state (new if
+ * *fresh) and a place for each block in *slotp. Nothing to give up on
+ * if it fails. */
+static int prepare(struct wb_file* f, int fd, const struct wb_format* fmt,
+		   uint64_t first, size_t n,
+		   struct wb_dirty** dp, struct wb_blk*** slotp, int* fresh){
+    struct wb_dirty* d = f->dirty;
+    struct wb_blk** slot = NULL;
+    size_t i;
+    int res;
+
+    *fresh = 0;
+    if(d && (d->fmt.unit != fmt->unit || d->fmt.apply != fmt->apply))
+	return -EINVAL;
+    if(!d){
+	d = calloc(1, sizeof(*d));
+	if(!d)
+	    return -ENOMEM;
+	d->fd = dup(fd);
+	if(d->fd == -1){
+	    res = -errno;
+	    free(d);
+	    return res;
+	}
+	d->dev = f->dev;
+	d->ino = f->ino;
+	d->fmt = *fmt;
+	d->cut = WB_NOCUT;
+	*fresh = 1;
+    }
+    if(n){
+	slot = calloc(n, sizeof(*slot));
+	if(!slot)
+	    goto nomem;
+	for(i = 0; i < n; i++){
+	    slot[i] = find_blk(d, first + i);
+	    if(!slot[i]){
+		slot[i] = malloc(sizeof(struct wb_blk) + fmt->unit);
+		if(!slot[i])
+		    goto nomem;
+		slot[i]->idx = WB_NOCUT;
+	    }
+	}
+    }
+    *dp = d;
+    *slotp = slot;
+    return 0;
+
+ nomem:
+    unprepare(d, *fresh, slot, n);
+    return -ENOMEM;
+}
+
+/* The update logged in record seq is pending now: header hdr, and the
+   n block images in data (from first on) in the places prepare() got */
+static void install(struct writeback* wb, struct wb_file* f, struct wb_dirty* d, int fresh,
+		    const struct encblk_hdr* hdr, uint64_t seq, uint64_t first, size_t n,
+		    struct wb_blk** slot, const unsigned char* data){
+    uint64_t nblocks;
+    size_t i;
+
+    if(fresh){
+	d->next = wb->dirty[stripe(d->dev, d->ino)];
+	wb->dirty[stripe(d->dev, d->ino)] = d;
+	f->dirty = d;
+	f->ov.arg = d;
+    }
+    wb->updates[stripe(d->dev, d->ino)]++;
+    d->hdr = *hdr;
+    d->seq = seq;
+    nblocks = (hdr->size + ENCBLK_SIZE - 1) / ENCBLK_SIZE;
+    if(nblocks < d->cut){
+	drop_blocks(wb, d, nblocks);
+	d->cut = nblocks;
+    }
+    for(i = 0; i < n; i++){
+	if(slot[i]->idx == WB_NOCUT){
+	    slot[i]->idx = first + i;
+	    slot[i]->next = d->blk[slot[i]->idx % WB_BUCKETS];
+	    d->blk[slot[i]->idx % WB_BUCKETS] = slot[i];
+	    d->nblk++;
+	    account(wb, d->fmt.unit);
+	}
+	memcpy(slot[i]->img, data + i * d->fmt.unit, d->fmt.unit);
+    }
+    free(slot);
+}
+
+/* Block files: whole encrypted blocks in place */
+static const struct wb_format blk_format = { ENCBLK_DISK, NULL, NULL };
+
+extern int writeback_update(struct writeback* wb, struct wb_file* f, int fd, const char* path,
+			    const struct encblk_hdr* hdr, const struct encblk_run* run,
+			    const char* xattr_name, const char* xattr_value, int sync){
+    unsigned char hbuf[ENCBLK_HDRLEN];
+    struct journal_ext ext[2];
+    struct journal_txn t;
+    struct wb_dirty* d;
+    struct wb_blk** slot;
+    char *xn = NULL, *xv = NULL;
+    uint64_t first = 0, seq;
+    size_t n = run->len / ENCBLK_DISK;
+    int fresh;
+    int res;
+
+    /* everything that can fail comes before the journal record */
+    if(n)
+	first = (run->off - ENCBLK_HDRLEN) / ENCBLK_DISK;
+    res = prepare(f, fd, &blk_format, first, n, &d, &slot, &fresh);
+    if(res < 0)
+	return res;
+    if(xattr_name){
+	xn = strdup(xattr_name);
+	xv = strdup(xattr_value);
+	if(!xn || !xv){
+	    res = -ENOMEM;
+	    goto fail;
+	}
+    }
+
+    encblk_hdr_encode(hdr, hbuf);
+    t.next = 0;
+    if(run->len){
+	ext[t.next].off = run->off;
+	ext[t.next].len = run->len;
+	ext[t.next].data = run->data;
+	t.next++;
+    }
+    ext[t.next].off = 0;
+    ext[t.next].len = ENCBLK_HDRLEN;
+    ext[t.next].data = hbuf;
+    t.next++;
+    t.ext = ext;
+    while(*path == '/')
+	path++;
+    t.path = f->gone ? "" : path;
+    t.ino = f->gone ? 0 : f->ino;
+    t.disklen = encblk_disklen(hdr->size);
+    t.xattr_name = xattr_name;
+    t.xattr_value = xattr_value;
+    res = journal_append(wb->j, &t, &seq);
+    if(res < 0)
+	goto fail;
+
+    /* the update is logged; now it is pending */
+    install(wb, f, d, fresh, hdr, seq, first, n, slot, run->data);
+    if(xn){
+	free(d->xattr_name);
+	free(d->xattr_value);
+	d->xattr_name = xn;
+	d->xattr_value = xv;
+    }
+
+    if(!sync)
+	return 0;
+    res = journal_sync(wb->j, seq, 0);
+    if(res == 0){
+	drain_begin(wb, stripe(d->dev, d->ino));
+	res = apply_dirty(d);
+	drain_end(wb, stripe(d->dev, d->ino));
+    }
+    if(res == 0){
+	unlink_dirty(wb, d);
+	free_dirty(wb, d);
+	f->dirty = NULL;
+	f->ov.arg = NULL;
+    }
+    return res;
+
+ fail:
+    unprepare(d, fresh, slot, n);
+    free(xn);
+    free(xv);
+    return res;
+}
+
+extern int writeback_commit(struct writeback* wb, struct wb_file* f, int fd,
+			    const struct wb_format* fmt, const struct journal_txn* txn,
+			    unsigned int ntxn, const struct encblk_hdr* hdr,
+			    uint64_t first, size_t n, const unsigned char* data,
+			    uint64_t* seq){
+    struct wb_dirty* d;
+    struct wb_blk** slot;
+    unsigned int i;
+    int fresh;
+    int res;
+
+    res = prepare(f, fd, fmt, first, n, &d, &slot, &fresh);
+    if(res < 0)
+	return res;
+    for(i = 0; i < ntxn; i++){
+	res = journal_append(wb->j, &txn[i], seq);
+	if(res < 0){
+	    unprepare(d, fresh, slot, n);
+	    return res;
+	}
+    }
+    install(wb, f, d, fresh, hdr, *seq, first, n, slot, data);
+    return 0;
+}
+
+extern int writeback_forget(struct writeback* wb, struct wb_file* f, int fd){
+    struct stat st;
+    int res;
+
+    if(fstat(fd, &st) == -1)
+	return -errno;
+    if(!S_ISREG(st.st_mode) || st.st_nlink != 1)
+	return 0;
+    res = journal_forget(wb->j, st.st_ino, &f->forgot);
+    if(res == 0)
+	f->forgetting = 1;
+    return res;
+}
+
+extern void writeback_unforget(struct writeback* wb, struct wb_file* f){
+    int res;
+
+    if(!f->forgetting)
+	return;
+    res = journal_unforget(wb->j, f->ino, f->forgot);
+    if(res < 0)
+	bblog(BBLOG_ERR, "writeback: journal: %s", strerror(-res));
+    f->forgetting = 0;
+}
+
+extern int writeback_fsync(struct writeback* wb, int fd, int datasync){
+    struct wb_dirty* d;
+    struct stat st;
+    pthread_mutex_t* lock;
+    uint64_t seq = 0;
+    int res;
+
+    if(fstat(fd, &st) == -1)
+	return -errno;
+    lock = &wb->locks[stripe(st.st_dev, st.st_ino)];
+    pthread_mutex_lock(lock);
+    d = find_dirty(wb, st.st_dev, st.st_ino);
+    if(d)
+	seq = d->seq;
+    pthread_mutex_unlock(lock);
+
+    /* pending data is safe once the journal is; no need to write it back */
+    res = journal_sync(wb->j, seq, 0);
+    /* the rest of the metadata (times, mode) is the file's own */
+    if(res == 0 && !datasync && fsync(fd) == -1)
+	res = -errno;
+    return res;
+}
+
+extern int writeback_flush(struct writeback* wb){
+    struct wb_dirty *d, *next;
+    uint64_t target;
+    unsigned int i;
+    int res, err = 0;
+
+    target = journal_last_seq(wb->j);
+    res = journal_sync(wb->j, target, 0);
+    if(res < 0)
+	return res;
+    for(i = 0; i < WB_LOCKS; i++){
+	pthread_mutex_lock(&wb->locks[i]);
+	if(!wb->dirty[i]){
+	    pthread_mutex_unlock(&wb->locks[i]);
+	    continue;
+	}
+	drain_begin(wb, i);
+	pthread_mutex_unlock(&wb->locks[i]);
+	for(d = wb->dirty[i]; d; d = d->next){
+	    /* updated after the sync started: next time */
+	    if(d->seq > target)
+		continue;
+	    res = apply_dirty(d);
+	    if(res < 0)
+		err = res;
+	    else
+		d->written = 1;
+	}
+	pthread_mutex_lock(&wb->locks[i]);
+	for(d = wb->dirty[i]; d; d = next){
+	    next = d->next;
+	    if(d->written){
+		unlink_dirty(wb, d);
+		free_dirty(wb, d);
+	    }
+	}
+	drain_end(wb, i);
+	pthread_mutex_unlock(&wb->locks[i]);
+    }
+    return err;
+}
+
+extern int writeback_quiesce(struct writeback* wb){
+    int res;
+
+    pthread_rwlock_wrlock(&wb->gate);
+    res = writeback_flush(wb);
+    if(res == 0)
+	res = journal_checkpoint(wb->j);
+    return res;
+}
+
+extern void writeback_resume(struct writeback* wb){
+    pthread_rwlock_unlock(&wb->gate);
+}
+
+extern void writeback_free(struct writeback* wb){
+    struct wb_dirty* d;
+    unsigned int i;
+
+    if(!wb)
+	return;
+    if(wb->running){
+	pthread_mutex_lock(&wb->tlock);
+	wb->stop = 1;
+	pthread_cond_signal(&wb->tcond);
+	pthread_mutex_unlock(&wb->tlock);
+	pthread_join(wb->thread, NULL);
+    }
+    writeback_flush(wb);
+    /* whatever could not be written back is still in the journal */
+    for(i = 0; i < WB_LOCKS; i++)
+	while((d = wb->dirty[i])){
+	    wb->dirty[i] = d->next;
+	    free_dirty(wb, d);
+	}
+    for(i = 0; i < WB_LOCKS; i++){
+	pthread_mutex_destroy(&wb->locks[i]);
+	pthread_cond_destroy(&wb->drained[i]);
+    }
+    pthread_rwlock_destroy(&wb->gate);
+    pthread_mutex_destroy(&wb->acct);
+    pthread_mutex_destroy(&wb->tlock);
+    pthread_cond_destroy(&wb->tcond);
+    free(wb);
+}
@@ -0,0 +1,268 @@
+/* writeback.h
+ * Deferred write-back of journaled block updates for fusec
+ *
+ * A block update is appended to the journal without waiting for the disk,
+ * and its block images are kept here in memory. They are written into the
+ * file itself only after the journal has been synced past them, which
+ * keeps the write-ahead rule without a device flush per write. Until then
+ * readers see them through an encblk_overlay.
+ *
+ * Durability is a group commit: fsync (writeback_fsync()), the periodic
+ * flusher thread and the dirty memory limit all go through journal_sync(),
+ * where a single fdatasync of the journal covers every update appended
+ * before it started, however many callers are waiting for it.
+ *
+ * Files in other formats log their own records and keep their pending
+ * state here the same way (writeback_commit()): a dedup file's blocks are
+ * its map entries, and a striped file's blocks are written back to its
+ * devices by the stripe code.
+ *
+ * Pending state is kept per inode and protected by one of WB_LOCKS striped
+ * locks; updates additionally hold a shared gate that writeback_quiesce()
+ * takes exclusively to checkpoint the journal.
+ *
+ * Reads see one version of a file even while it is written and written
+ * back. writeback_read_lock() copies the pending images of the blocks a
+ * read covers and lets go of the lock, so the read itself runs without
+ * it, and later updates don't touch its copy. Block and striped writes
+ * are built the same way, from such a copy, and take the lock only to
+ * check that no update got in meanwhile (writeback_stamp()) and to log
+ * and install theirs, which is as long as a reader waits for them. Other
+ * updates (truncates, dedup writes, legacy conversions) read and encrypt
+ * under the lock, and reads of every file on its stripe wait for them.
+ * Every reader is counted in an epoch of its lock stripe: writing pending
+ * state back in place waits until the readers of the previous epoch, who
+ * may be reading those blocks from the file, are done. Updates wait for a
+ * write-back in progress; readers never do, except while an update that
+ * can't be overlapped by reads holds them off (writeback_exclude()).
+ *
+ */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "encblk.h"
+#include "journal.h"
+
+struct writeback;
+struct wb_dirty;
+
+struct wb_snap;
+
+/* No truncation pending (the cut given to a wb_format's apply) */
+#define WB_NOCUT UINT64_MAX
+
+/* A pending block, as handed to a wb_format's apply */
+struct wb_unit {
+    uint64_t idx;
+    const unsigned char* img;	/* unit bytes */
+};
+
+/* How a file keeps its blocks, for writeback_commit() */
+struct wb_format {
+    size_t unit;		/* bytes per block, after the encblk header */
+    /* writes pending state back for a format whose blocks are not all in
+       the file itself: header hdr, the n blocks in blk (by idx), with
+       everything from block cut on cut off first. NULL: in place. */
+    int (*apply)(void* arg, int fd, const struct encblk_hdr* hdr, uint64_t cut,
+		 const struct wb_unit* blk, size_t n);
+    void* arg;
+};
+
+/* A locked file; filled in by writeback_lock(), fields are private */
+struct wb_file {
+    pthread_mutex_t* lock;
+    struct wb_dirty* dirty;
+    struct wb_snap* snap;
+    struct encblk_overlay ov;
+    dev_t dev;
+    ino_t ino;
+    int gone;			/* no names left */
+    uint64_t forgot;		/* journal_forget() record */
+    int forgetting;
+    int gated;
+    int reader;
+    int excl;
+    unsigned long stamp;
+};
+
+/* struct writeback* writeback_new(struct journal* j, size_t limit)
+ * Purpose: Create the write-back state for a mount
+ * Args: struct journal* j : Journal updates are logged in
+ *       size_t limit      : Pending bytes that force a flush
+ * Return: New state, NULL on error (errno set)
+ */
+extern struct writeback* writeback_new(struct journal* j, size_t limit);
+
+/* int writeback_start(struct writeback* wb, unsigned int interval_ms)
+ * Purpose: Start the flusher thread, which commits and writes back pending
+ *          updates every interval_ms (bounding how much a crash can lose)
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_start(struct writeback* wb, unsigned int interval_ms);
+
+/* int writeback_lock(struct writeback* wb, int fd, int forwrite, struct wb_file* f)
+ * Purpose: Lock the pending state of the file open on fd
+ * Args: struct writeback* wb : Write-back state
+ *       int fd               : Backing file
+ *       int forwrite         : 1 to update the file; 0 to read it (a file
+ *                              with nothing pending is not kept locked)
+ *       struct wb_file* f    : Output handle for writeback_unlock()
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_lock(struct writeback* wb, int fd, int forwrite, struct wb_file* f);
+
+/* int writeback_read_lock(struct writeback* wb, int fd, off_t offset, size_t size,
+ *                         struct wb_file* f)
+ * Purpose: Lock the file open on fd for reading the plaintext range at
+ *          offset, without keeping it locked: writeback_hdr() and
+ *          writeback_overlay() give a copy of its pending state taken now,
+ *          and its blocks aren't written back until writeback_unlock().
+ *          Only blocks in the range can be looked up in the overlay.
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_read_lock(struct writeback* wb, int fd, off_t offset, size_t size,
+			       struct wb_file* f);
+
+/* void writeback_exclude(struct writeback* wb, struct wb_file* f)
+ * Purpose: For a file locked for writing whose update must not overlap
+ *          reads (a dedup update lets go of blocks a reader may be about
+ *          to fetch), wait for the reads in progress and hold new ones off
+ *          until writeback_unlock()
+ */
+extern void writeback_exclude(struct writeback* wb, struct wb_file* f);
+
+/* void writeback_unlock(struct writeback* wb, struct wb_file* f)
+ * Purpose: Release a file locked by writeback_lock(); flushes if the
+ *          pending bytes went past the limit
+ */
+extern void writeback_unlock(struct writeback* wb, struct wb_file* f);
+
+/* unsigned long writeback_stamp(struct wb_file* f)
+ * Purpose: Count of the updates installed on the file's lock stripe when
+ *          it was locked. If two locks of a file have the same stamp, no
+ *          update of it came in between: an update built from what the
+ *          first one saw can be installed under the second as it is.
+ */
+extern unsigned long writeback_stamp(struct wb_file* f);
+
+/* int writeback_hdr(struct wb_file* f, int fd, struct encblk_hdr* hdr)
+ * Purpose: Current header of a locked file, pending updates included
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_hdr(struct wb_file* f, int fd, struct encblk_hdr* hdr);
+
+/* const struct encblk_overlay* writeback_overlay(struct wb_file* f)
+ * Purpose: Pending block images of a locked file, NULL if there are none
+ */
+extern const struct encblk_overlay* writeback_overlay(struct wb_file* f);
+
+/* uint64_t writeback_gen(struct wb_file* f)
+ * Purpose: Version of a file's pending state, locked by writeback_lock()
+ * Return: 0 if nothing is pending, else a number every update changes
+ *         (the journal record of the newest one)
+ */
+extern uint64_t writeback_gen(struct wb_file* f);
+
+/* int writeback_update(struct writeback* wb, struct wb_file* f, int fd, const char* path,
+ *                      const struct encblk_hdr* hdr, const struct encblk_run* run,
+ *                      const char* xattr_name, const char* xattr_value, int sync)
+ * Purpose: Log a block update (run + new header, optionally an xattr) in the
+ *          journal and keep it pending
+ * Args: struct writeback* wb : Write-back state
+ *       struct wb_file* f    : File, locked for writing
+ *       int fd               : Backing file, open for reading and writing
+ *       const char* path     : Path of the file relative to the backing root
+ *       const struct encblk_hdr* hdr : New header
+ *       const struct encblk_run* run : Block images to write
+ *       const char* xattr_name, xattr_value : xattr to set, or NULL
+ *       int sync             : Commit and write back before returning
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_update(struct writeback* wb, struct wb_file* f, int fd, const char* path,
+			    const struct encblk_hdr* hdr, const struct encblk_run* run,
+			    const char* xattr_name, const char* xattr_value, int sync);
+
+/* int writeback_commit(struct writeback* wb, struct wb_file* f, int fd,
+ *                      const struct wb_format* fmt, const struct journal_txn* txn,
+ *                      unsigned int ntxn, const struct encblk_hdr* hdr,
+ *                      uint64_t first, size_t n, const unsigned char* data,
+ *                      uint64_t* seq)
+ * Purpose: For formats that build their own journal records: log them,
+ *          then keep the file's update pending like writeback_update()
+ *          does. It is written back (by fmt->apply, or in place,
+ *          fmt->unit bytes per block after the header) once the journal
+ *          is durable past the last record.
+ * Args: struct writeback* wb         : Write-back state
+ *       struct wb_file* f            : File, locked for writing
+ *       int fd                       : Backing file, open for reading and writing
+ *       const struct wb_format* fmt  : The file's format
+ *       const struct journal_txn* txn, unsigned int ntxn : Records to log,
+ *                                      in order, at least one
+ *       const struct encblk_hdr* hdr : New header
+ *       uint64_t first, size_t n     : Blocks updated
+ *       const unsigned char* data    : Their new contents, n * fmt->unit bytes
+ *       uint64_t* seq                : Output sequence number of the last record
+ * Return: 0 on success, -errno on error: then the last record was not
+ *         logged and nothing is pending
+ */
+extern int writeback_commit(struct writeback* wb, struct wb_file* f, int fd,
+			    const struct wb_format* fmt, const struct journal_txn* txn,
+			    unsigned int ntxn, const struct encblk_hdr* hdr,
+			    uint64_t first, size_t n, const unsigned char* data,
+			    uint64_t* seq);
+
+/* int writeback_forget(struct writeback* wb, struct wb_file* f, int fd)
+ * Purpose: For a file locked for writing whose name is about to be
+ *          removed: if it is the last one, have the journal skip the
+ *          file's records (journal_forget()). Its later updates, through
+ *          files still open, are logged not to be replayed either.
+ * Args: struct writeback* wb : Write-back state
+ *       struct wb_file* f    : File, locked for writing
+ *       int fd               : The file (O_PATH will do)
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_forget(struct writeback* wb, struct wb_file* f, int fd);
+
+/* void writeback_unforget(struct writeback* wb, struct wb_file* f)
+ * Purpose: Undo writeback_forget() when the name could not be removed
+ */
+extern void writeback_unforget(struct writeback* wb, struct wb_file* f);
+
+/* int writeback_fsync(struct writeback* wb, int fd, int datasync)
+ * Purpose: Make the journaled file open on fd durable. Its pending updates
+ *          only need the journal synced; without datasync the file is
+ *          fsynced too, for the metadata the journal doesn't log.
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_fsync(struct writeback* wb, int fd, int datasync);
+
+/* int writeback_flush(struct writeback* wb)
+ * Purpose: Commit the journal and write back every pending update
+ * Return: 0 on success, -errno on error
+ */
+extern int writeback_flush(struct writeback* wb);
+
+/* int writeback_quiesce(struct writeback* wb)
+ * Purpose: Stop updates, write everything back and checkpoint the journal
+ *          (until writeback_resume())
+ * Return: 0 on success, -errno on error; updates are stopped either way
+ */
+extern int writeback_quiesce(struct writeback* wb);
+
+/* void writeback_resume(struct writeback* wb)
+ * Purpose: Let updates go on after writeback_quiesce()
+ */
+extern void writeback_resume(struct writeback* wb);
+
+/* void writeback_free(struct writeback* wb)
+ * Purpose: Stop the flusher, write everything back and free the state
+ */
+extern void writeback_free(struct writeback* wb);
+
+#endif